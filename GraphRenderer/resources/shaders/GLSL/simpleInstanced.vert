@@ -0,0 +1,24 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+layout(set = 0, binding = 0) uniform SceneUBO{
+    mat4 V, P;
+};
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inNormal;
+// Per instance, uses locations 2 to 5
+layout(location = 2) in mat4 inM;
+
+
+layout(location = 0) out vec3 fragColor;
+
+void main() {
+    gl_Position = P * V * inM * vec4(inPosition, 1.0);
+
+    vec3 wNorm = normalize(vec3(inM * vec4(inNormal, 0)));
+
+    float d = dot(wNorm, vec3(0.408, 0.408, 0.81));
+    float k = 0.5 + 0.6 * (d > 0 ? d : 0.0);
+    fragColor = k * (0.5 + inNormal * 0.5);
+}
\ No newline at end of file
@@ -0,0 +1,35 @@
+#version 450
+#extension GL_ARB_separate_shader_objects : enable
+
+layout(set = 0, binding = 0) uniform SceneUBO{
+    mat4 V, P;
+};
+
+// Position in the bounding box, from unorm16
+layout(location = 0) in vec4 inPosition;
+// Octahedral normal, from snorm16
+layout(location = 1) in vec2 inNormalOct;
+// Per instance, uses locations 2 to 5. Includes the dequantization of the positions
+layout(location = 2) in mat4 inM;
+
+
+layout(location = 0) out vec3 fragColor;
+
+vec3 octDecode(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0) {
+        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0 ? 1.0 : -1.0, n.y >= 0 ? 1.0 : -1.0);
+    }
+    return normalize(n);
+}
+
+void main() {
+    gl_Position = P * V * inM * vec4(inPosition.xyz, 1.0);
+
+    vec3 inNormal = octDecode(inNormalOct);
+    vec3 wNorm = normalize(vec3(inM * vec4(inNormal, 0)));
+
+    float d = dot(wNorm, vec3(0.408, 0.408, 0.81));
+    float k = 0.5 + 0.6 * (d > 0 ? d : 0.0);
+    fragColor = k * (0.5 + inNormal * 0.5);
+}
\ No newline at end of file
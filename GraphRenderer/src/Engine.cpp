@@ -20,6 +20,8 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <stb_image/stb_image.h>
 #include <chrono>
+#include <filesystem>
+#include <fstream>
 
 
 namespace gr
@@ -52,9 +54,15 @@ namespace gr
 
 		pRenderContext->createDevice(true, &mGlobalContext.getWindow().getSurface());
 
+		pRenderContext->getPipelineManager().initialize(*pRenderContext, PIPELINE_CACHE_PATH);
+		if (pRenderContext->getPipelineManager().getStats().loadedCacheBytes == 0) {
+			mGlobalContext.addNewLog("No valid pipeline cache found, pipelines will be compiled from scratch");
+		}
+
 		mSwapChain = SwapChain(*pRenderContext, mGlobalContext.getWindow());
 
 		createSyncObjects();
+		createTimestampQueryPool();
 
 		/*for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
 			mContexts[i] = FrameContext(i, pRenderContext.get());
@@ -66,6 +74,7 @@ namespace gr
 			std::copy_n(std::make_move_iterator(v.begin()), MAX_FRAMES_IN_FLIGHT, mContexts.begin());
 			mCommandFlusherGraphicsBlock = pRenderContext->getCommandFlusher()->createNewBlock(CommandFlusher::Type::eGRAPHICS);
 		}
+		pRenderContext->getTransformBuffer().initialize(*pRenderContext, MAX_FRAMES_IN_FLIGHT);
 
 		createRenderPass();
 		createFrameBufferObjects();
@@ -83,10 +92,7 @@ namespace gr
 		createDescriptorSets();
 		createPipelineLayout();
 		createGraphicsPipeline();
-
-		for (FrameContext& fc : mContexts) {
-			fc.renderSubmitter().setDefaultMaterial(mGraphicsPipeline, mPipLayout, mGlobalContext.rc().getEmptyDescriptorSet());
-		}
+		setSubmitterPipelines();
 
 		mGui.init(&mGlobalContext);
 		mGui.updatePipelineState(&mGlobalContext.rc(), mRenderPass, 1);
@@ -128,16 +134,34 @@ namespace gr
 				assert(res == vk::Result::eSuccess);
 			}
 
+			// Also the objects of the other frames that already finished
+			pRenderContext->getDeferredDestroyer().drain(*pRenderContext,
+				pRenderContext->getDevice().getSemaphoreCounterValue(mFrameAvailableTimelineSemaphore));
+			pRenderContext->getGeometryArena().releaseEmptyBlocks(pRenderContext,
+				mContexts[mCurrentFrame].getNextFrameCount());
+			pRenderContext->getReadback().update(pRenderContext);
+			// No job reads the movable buffers until the frame is recorded
+			pRenderContext->getDefragmenter().update(pRenderContext,
+				mFrameAvailableTimelineSemaphore, mLastSubmittedFrameCount);
+
 			mContexts[mCurrentFrame].updateTime(glfwGetTime());
+			readGpuFrameTime(&mContexts[mCurrentFrame]);
 			mContexts[mCurrentFrame].resetFrameResources();
 
+			updateRequestedPipelines();
+			// No render job reads the meshes yet
+			mGlobalContext.getResidencyManager().update(&mContexts[mCurrentFrame]);
+			mGlobalContext.getMeshStreamer().update(&mContexts[mCurrentFrame]);
+
 			mGui.updatePreFrame(&mContexts[mCurrentFrame]);
 
 			updateScene(&mContexts[mCurrentFrame]);
 
 			draw(mContexts[mCurrentFrame]);
+			mGlobalContext.frameSubmitted();
+
+			finishSceneUpdate(&mContexts[mCurrentFrame]);
 
-			pRenderContext->flushData();
 			mGlobalContext.getDict().flushDataAndFree(&mContexts[mCurrentFrame]);
 		}
 
@@ -176,11 +200,16 @@ namespace gr
 			return;
 		}
 
+		mCapturingFrame = mGui.consumeCaptureRequest() && requestCapture(frameContext);
+
 		frameContext.rc().getCommandFlusher()->pushGraphicsCB(mCommandFlusherGraphicsBlock, createAndRecordGraphicCommandBuffers(mContexts.data() + frameContext.getIdx()));
 		frameContext.rc().getCommandFlusher()->pushWait(vkg::CommandFlusher::Type::eGRAPHICS, mCommandFlusherGraphicsBlock,
 			mImageAvailableSemaphores[frameContext.getIdx()], vk::PipelineStageFlagBits::eColorAttachmentOutput);
-		frameContext.rc().getCommandFlusher()->pushSignal(vkg::CommandFlusher::Type::eGRAPHICS, mCommandFlusherGraphicsBlock,
-			mRenderingFinishedSemaphores[frameContext.getIdx()]);
+		// When capturing, the image is presented after the readback
+		if (!mCapturingFrame) {
+			frameContext.rc().getCommandFlusher()->pushSignal(vkg::CommandFlusher::Type::eGRAPHICS, mCommandFlusherGraphicsBlock,
+				mRenderingFinishedSemaphores[frameContext.getIdx()]);
+		}
 		frameContext.rc().getCommandFlusher()->pushSignal(vkg::CommandFlusher::Type::eGRAPHICS, mCommandFlusherGraphicsBlock,
 			mFrameAvailableTimelineSemaphore, frameContext.getNextFrameCount());
 
@@ -205,12 +234,19 @@ namespace gr
 			vk::Semaphore sem;
 			uint64_t value;
 			mGlobalContext.rc().getTransferer()->updateAndFlushTransfers(
-				&mGlobalContext.rc(), &sem, &value);
+				&mGlobalContext.rc(), &sem, &value, frameContext.frameArena());
 			frameContext.rc().getCommandFlusher()->pushWait(vkg::CommandFlusher::Type::eGRAPHICS, mCommandFlusherGraphicsBlock,
 				sem, vk::PipelineStageFlagBits::eTopOfPipe, value);
 		}
 		
-		frameContext.rc().getCommandFlusher()->flush();
+		frameContext.rc().getCommandFlusher()->flush(nullptr, frameContext.frameArena());
+		mLastSubmittedFrameCount = frameContext.getNextFrameCount();
+
+		// After the frame, so the readbacks see what it wrote
+		frameContext.rc().getReadback().flush(&frameContext.rc(),
+			mFrameAvailableTimelineSemaphore, frameContext.getNextFrameCount(),
+			mCapturingFrame ? mRenderingFinishedSemaphores[frameContext.getIdx()] : vk::Semaphore(),
+			frameContext.frameArena());
 
 		bool swapChainNeedsRecreation = 
 			!frameContext.presentPool().submitPresentationImage(
@@ -224,6 +260,56 @@ namespace gr
 		}
 	}
 
+	bool Engine::requestCapture(FrameContext& frameContext)
+	{
+		if (!mSwapChain.isCaptureSupported()) {
+			mGlobalContext.addNewLog("Error: The swap chain images can not be read back");
+			return false;
+		}
+
+		std::filesystem::create_directories(CAPTURES_PATH);
+		const std::string path = std::string(CAPTURES_PATH) + "/frame_" +
+			std::to_string(frameContext.getNextFrameCount()) + ".ppm";
+
+		const bool requested = frameContext.rc().getReadback().readImage(frameContext.rc(),
+			mSwapChain.getImagesVector()[frameContext.getImageIdx()],
+			mSwapChain.getExtent(), mSwapChain.getFormat(),
+			vk::ImageLayout::eTransferSrcOptimal,	// set by the graphics commands
+			vk::ImageLayout::ePresentSrcKHR,
+			[path](const vkg::BufferReadback::Result& result) { s_writeCapture(path, result); });
+
+		if (requested) {
+			mGlobalContext.addNewLog("Capturing the frame into " + path);
+		}
+		else {
+			mGlobalContext.addNewLog("Error: All the readbacks are busy, capture again later");
+		}
+		return requested;
+	}
+
+	void Engine::s_writeCapture(const std::string& path, const vkg::BufferReadback::Result& result)
+	{
+		// Binary PPM, the swap chain formats are 8 bit RGBA or BGRA
+		std::ofstream stream(path, std::ofstream::trunc | std::ofstream::binary);
+		if (!stream) {
+			return;
+		}
+		stream << "P6\n" << result.extent.width << " " << result.extent.height << "\n255\n";
+
+		const bool bgra = result.format == vk::Format::eB8G8R8A8Unorm ||
+			result.format == vk::Format::eB8G8R8A8Srgb;
+		std::vector<uint8_t> row(3 * static_cast<size_t>(result.extent.width));
+		for (uint32_t y = 0; y < result.extent.height; ++y) {
+			const uint8_t* texel = result.data + 4 * static_cast<size_t>(y) * result.extent.width;
+			for (uint32_t x = 0; x < result.extent.width; ++x, texel += 4) {
+				row[3 * x + 0] = bgra ? texel[2] : texel[0];
+				row[3 * x + 1] = texel[1];
+				row[3 * x + 2] = bgra ? texel[0] : texel[2];
+			}
+			stream.write(reinterpret_cast<const char*>(row.data()), row.size());
+		}
+	}
+
 	void Engine::updateUBO(const FrameContext& frameContext, uint32_t currentImage)
 	{
 		
@@ -243,16 +329,39 @@ namespace gr
 
 	void Engine::updateScene(FrameContext* fc)
 	{
-		if (!fc->gc().getBoundScene()) {
-			return;
+		Scene* scene = nullptr;
+		if (fc->gc().getBoundScene()) {
+			fc->gc().getDict().get(fc, fc->gc().getBoundScene(), &scene);
+		}
+
+		if (scene != nullptr && !scene->overlapsLogicAndRender()) {
+			scene->logicUpdate(fc);
 		}
 
-		Scene* scene;
-		fc->gc().getDict().get(fc->gc().getBoundScene(), &scene);
+		// After the Gui and the logic started their objects, so all the slots
+		// fit in the buffer of the frame before the objects write their matrices
+		fc->rc().getTransformBuffer().beginFrame(fc->rc(), fc->getIdx(),
+			fc->allocateTransientDescriptorSet(fc->rc().getBasicTransformLayout()));
+
+		if (scene == nullptr) {
+			return;
+		}
 
-		scene->logicUpdate(fc);
 		scene->graphicsUpdate(fc);
+		if (scene->overlapsLogicAndRender()) {
+			// The state left by the logic of the previous frame was extracted,
+			// run the next logic update while this frame is recorded
+			scene->dispatchLogicUpdate(fc);
+			mSceneInLogicUpdate = scene;
+		}
+	}
 
+	void Engine::finishSceneUpdate(FrameContext* fc)
+	{
+		if (mSceneInLogicUpdate) {
+			mSceneInLogicUpdate->waitLogicUpdate();
+			mSceneInLogicUpdate = nullptr;
+		}
 	}
 
 	void Engine::createRenderPass()
@@ -336,47 +445,68 @@ namespace gr
 
 		cleanupSwapChainDependantObjs();
 
+		const vk::Format oldFormat = mSwapChain.getFormat();
 		mSwapChain.recreateSwapChain(mGlobalContext.rc(), mGlobalContext.getWindow());
 
-		createRenderPass();
+		// The viewport and scissor are dynamic, so the render pass and the
+		// pipelines are only rebuilt if the surface format changed
+		if (mSwapChain.getFormat() != oldFormat) {
+			destroyRenderPassAndPipelines();
+			createRenderPass();
+			createGraphicsPipeline();
+			setSubmitterPipelines();
+			mGui.updatePipelineState(&mGlobalContext.rc(), mRenderPass, 1);
+		}
 
 		createFrameBufferObjects();
 
 		createUniformBuffers();
 		createDescriptorSets();
-		createGraphicsPipeline();
-		for (FrameContext& fc : mContexts) {
-			fc.renderSubmitter().setDefaultMaterial(mGraphicsPipeline, mPipLayout, mGlobalContext.rc().getEmptyDescriptorSet());
-		}
 	}
 
 	vk::CommandBuffer Engine::createAndRecordGraphicCommandBuffers(FrameContext* frame)
 	{
 		 vkg::ResetCommandPool& cmdPool = frame->graphicsPool();
 
-		 // create render secondary command buffer
-		 vk::CommandBuffer renderBuff, guiBuff;
-		 grjob::Job jobs[2];
-		 jobs[0] = grjob::Job( [&renderBuff, &frame, this]()
-			 {
-				 renderBuff = frame->graphicsPool().newCommandBuffer(vk::CommandBufferLevel::eSecondary);
-
-				 vk::CommandBufferInheritanceInfo inheritanceInfo(
-					 mRenderPass, 0, mPresentFramebuffers[frame->getImageIdx()]);
-
-				 vk::CommandBufferBeginInfo beginInfo(
-					 vk::CommandBufferUsageFlagBits::eOneTimeSubmit |
-					 vk::CommandBufferUsageFlagBits::eRenderPassContinue,
-					 &inheritanceInfo);
-				 renderBuff.begin(beginInfo);
-
-				 frame->renderSubmitter().flushDraws(renderBuff);
-
-				 renderBuff.end();
-			 }
-		 );
-
-		 jobs[1] = grjob::Job([&guiBuff, &frame, this]()
+		 // Sort and batch the draws, and split them in ranges to record in parallel.
+		 // Each job allocates its secondary command buffer from the pool of its own thread.
+		 const uint32_t numRanges = frame->renderSubmitter().prepareDraws(frame->rc(), grjob::getNumThreads());
+
+		 // create render secondary command buffers
+		 std::vector<vk::CommandBuffer> renderBuffs(numRanges);
+		 vk::CommandBuffer guiBuff;
+		 std::vector<grjob::Job> jobs;
+		 jobs.reserve(numRanges + 1);
+		 for (uint32_t i = 0; i < numRanges; ++i) {
+			 jobs.push_back(grjob::Job([&renderBuffs, frame, i, this]()
+				 {
+					 vk::CommandBuffer renderBuff = frame->graphicsPool().newCommandBuffer(vk::CommandBufferLevel::eSecondary);
+
+					 vk::CommandBufferInheritanceInfo inheritanceInfo(
+						 mRenderPass, 0, mPresentFramebuffers[frame->getImageIdx()]);
+
+					 vk::CommandBufferBeginInfo beginInfo(
+						 vk::CommandBufferUsageFlagBits::eOneTimeSubmit |
+						 vk::CommandBufferUsageFlagBits::eRenderPassContinue,
+						 &inheritanceInfo);
+					 renderBuff.begin(beginInfo);
+
+					 const vk::Extent2D extent = mSwapChain.getExtent();
+					 const vk::Viewport viewport(0.0f, 0.0f,
+						 static_cast<float>(extent.width), static_cast<float>(extent.height), 0.0f, 1.0f);
+					 renderBuff.setViewport(0, 1, &viewport);
+					 const vk::Rect2D scissor(vk::Offset2D(0, 0), extent);
+					 renderBuff.setScissor(0, 1, &scissor);
+
+					 frame->renderSubmitter().recordDraws(renderBuff, i);
+
+					 renderBuff.end();
+					 renderBuffs[i] = renderBuff;
+				 }
+			 ));
+		 }
+
+		 jobs.push_back(grjob::Job([&guiBuff, &frame, this]()
 			 {
 				 guiBuff = frame->graphicsPool().newCommandBuffer(vk::CommandBufferLevel::eSecondary);
 
@@ -394,12 +524,12 @@ namespace gr
 
 				 guiBuff.end();
 			 }
-		 );
+		 ));
 
 		 grjob::Counter* c = nullptr;
-		 //grjob::runJobBatch(grjob::Priority::eMid, jobs, 2, &c);
-		 //grjob::waitForCounterAndFree(c, 0);
-		 jobs[0].run(); jobs[1].run();
+		 grjob::runJobBatch(grjob::Priority::eHigh, jobs.data(), static_cast<uint32_t>(jobs.size()), &c);
+		 grjob::waitForCounterAndFree(c, 0);
+		 frame->renderSubmitter().endDraws();
 
 		vk::CommandBuffer buff = cmdPool.newCommandBuffer();
 
@@ -407,6 +537,11 @@ namespace gr
 
 		buff.begin(beginInfo);
 
+		if (mTimestampQueryPool) {
+			buff.resetQueryPool(mTimestampQueryPool, 2 * frame->getIdx(), 2);
+			buff.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, mTimestampQueryPool, 2 * frame->getIdx());
+		}
+
 		// The first clear is ignored because it is the resolve image
 		std::array<vk::ClearValue, 3> clearVal = {};
 		clearVal[1].color.setFloat32({ 0.2f, 0.2f, 0.2f, 1.0f });
@@ -422,7 +557,9 @@ namespace gr
 
 		buff.beginRenderPass(passInfo, vk::SubpassContents::eSecondaryCommandBuffers);
 
-		buff.executeCommands(1, &renderBuff);
+		if (numRanges > 0) {
+			buff.executeCommands(numRanges, renderBuffs.data());
+		}
 		/*
 		if (mGui.isWireframeRenderModeEnabled()) {
 			buff.bindPipeline(vk::PipelineBindPoint::eGraphics, mWireframePipeline);
@@ -459,6 +596,30 @@ namespace gr
 
 		buff.endRenderPass();
 
+		if (mCapturingFrame) {
+			// Read back in a later graphics submission, that leaves it ready to present
+			vk::ImageMemoryBarrier barrier(
+				vk::AccessFlagBits::eColorAttachmentWrite,	// src AccessMask
+				vk::AccessFlags{},							// dst AccessMask
+				vk::ImageLayout::ePresentSrcKHR,			// old layout
+				vk::ImageLayout::eTransferSrcOptimal,		// new layout
+				VK_QUEUE_FAMILY_IGNORED,					// src queue family
+				VK_QUEUE_FAMILY_IGNORED,					// dst queue family
+				mSwapChain.getImagesVector()[frame->getImageIdx()],
+				vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1));
+			buff.pipelineBarrier(
+				vk::PipelineStageFlagBits::eColorAttachmentOutput,	// src stage mask
+				vk::PipelineStageFlagBits::eBottomOfPipe,			// dst stage mask
+				vk::DependencyFlagBits{},
+				0, nullptr, 0, nullptr,		// memory and buffer barriers
+				1, &barrier);
+		}
+
+		if (mTimestampQueryPool) {
+			buff.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, mTimestampQueryPool, 2 * frame->getIdx() + 1);
+			mTimestampsWritten[frame->getIdx()] = true;
+		}
+
 		buff.end();
 
 		return buff;
@@ -467,16 +628,44 @@ namespace gr
 
 	void Engine::createShaderModules()
 	{
+		vkg::RenderContext& rc = mGlobalContext.rc();
+		vkg::ShaderModuleCache& shaders = rc.getShaderModuleCache();
 		{
 			grjob::Job jobs[2];
-			jobs[0] = grjob::Job(&vkg::RenderContext::createShaderModule, &mGlobalContext.rc(), "resources/shaders/SPIR-V/simple.vert.spv", mShaderModules + 0, nullptr);
-			jobs[1] = grjob::Job(&vkg::RenderContext::createShaderModule, &mGlobalContext.rc(), "resources/shaders/SPIR-V/simple.frag.spv", mShaderModules + 1, nullptr);
+			jobs[0] = grjob::Job([this]() {
+				mShaderModules[0] = mGlobalContext.rc().getShaderModuleCache().acquire(mGlobalContext.rc(), "resources/shaders/SPIR-V/simple.vert.spv");
+			});
+			jobs[1] = grjob::Job([this]() {
+				mShaderModules[1] = mGlobalContext.rc().getShaderModuleCache().acquire(mGlobalContext.rc(), "resources/shaders/SPIR-V/simple.frag.spv");
+			});
 			grjob::Counter* c = nullptr;
 
 			grjob::runJobBatch(gr::grjob::Priority::eMid, jobs, 2, &c);
 
 			grjob::waitForCounterAndFree(c, 0);
 		}
+
+		// Without the instanced shader the draws are not batched
+		const char* instancedPath = "resources/shaders/SPIR-V/simpleInstanced.vert.spv";
+		if (std::filesystem::exists(instancedPath)) {
+			mInstancedVertexShader = shaders.acquire(rc, instancedPath);
+		}
+		else {
+			mGlobalContext.addNewLog(std::string("Instanced shader not found, draws will not be batched: ") + instancedPath);
+		}
+
+		// Without the packed shader the meshes keep the full vertex format
+		const char* packedPath = "resources/shaders/SPIR-V/simplePacked.vert.spv";
+		const char* packedInstancedPath = "resources/shaders/SPIR-V/simpleInstancedPacked.vert.spv";
+		if (std::filesystem::exists(packedPath)) {
+			mPackedVertexShader = shaders.acquire(rc, packedPath);
+			if (std::filesystem::exists(packedInstancedPath)) {
+				mPackedInstancedVertexShader = shaders.acquire(rc, packedInstancedPath);
+			}
+		}
+		else {
+			mGlobalContext.addNewLog(std::string("Packed shader not found, meshes will use the full vertex format: ") + packedPath);
+		}
 	}
 
 	void Engine::createDescriptorSetLayout()
@@ -583,6 +772,8 @@ namespace gr
 
 	void Engine::createGraphicsPipeline()
 	{
+		vkg::RenderContext& rc = mGlobalContext.rc();
+		vkg::PipelineManager& pipelines = rc.getPipelineManager();
 		vkg::GraphicsPipelineBuilder builder;
 		
 		// Set Vertex Input descriptions
@@ -598,17 +789,100 @@ namespace gr
 		builder.setCulling(vk::CullModeFlagBits::eBack);
 		builder.setShaderStages(mShaderModules[0], mShaderModules[1]);
 		builder.setPrimitiveTopology(vk::PrimitiveTopology::eTriangleList);
-		builder.setViewportSize(mSwapChain.getExtent());
-		builder.setMultisampleCount(mGlobalContext.rc().getMsaaSampleCount());
+		// Set when recording, so a resize keeps the pipelines
+		builder.addDynamicState(vk::DynamicState::eViewport);
+		builder.addDynamicState(vk::DynamicState::eScissor);
+		builder.setMultisampleCount(rc.getMsaaSampleCount());
 		builder.setColorBlendAttachmentStd();
 		builder.setPipelineLayout(mPipLayout);
 		builder.setDepthState(true, true, vk::CompareOp::eLess);
 
-		mGraphicsPipeline = builder.createPipeline(mGlobalContext.rc().getDevice(), mRenderPass, 0);
+		mGraphicsPipeline = pipelines.getPipeline(rc, builder, mRenderPass, 0);
 
 		builder.setPolygonMode(vk::PolygonMode::eLine);
 
-		mWireframePipeline = builder.createPipeline(mGlobalContext.rc().getDevice(), mRenderPass, 0);
+		mWireframePipeline = pipelines.getPipeline(rc, builder, mRenderPass, 0);
+
+		// The packed meshes choose their format when uploaded, so it is needed now
+		if (mPackedVertexShader) {
+			vkg::VertexInputDescription vid;
+			Mesh::addToVertexInputDescription(0, &vid, true);
+
+			builder.setVertexBindingDescriptions(vid.getBindingDescription());
+			builder.setVertexAttirbuteDescriptions(vid.getAttributeDescriptions());
+			builder.setShaderStages(mPackedVertexShader, mShaderModules[1]);
+			builder.setPolygonMode(vk::PolygonMode::eFill);
+
+			mPackedPipeline = pipelines.getPipeline(rc, builder, mRenderPass, 0);
+		}
+
+		// The instanced pipelines compile in the background.
+		// Until they are ready, the draws are not batched
+		mInstancedPipeline = nullptr;
+		mPackedInstancedPipeline = nullptr;
+
+		if (mInstancedVertexShader) {
+			// Model matrix per instance, in 4 consecutive locations
+			vkg::VertexInputDescription vid;
+			Mesh::addToVertexInputDescription(0, &vid);
+			vkg::VertexInputDescription::Binding& instBinding = vid.addBinding(
+				vkg::RenderSubmitter::INSTANCE_BINDING, sizeof(glm::mat4), vk::VertexInputRate::eInstance);
+			for (uint32_t i = 0; i < 4; ++i) {
+				instBinding.addAttributeFloat(2 + i, 4, i * sizeof(glm::vec4));
+			}
+
+			builder.setVertexBindingDescriptions(vid.getBindingDescription());
+			builder.setVertexAttirbuteDescriptions(vid.getAttributeDescriptions());
+			builder.setShaderStages(mInstancedVertexShader, mShaderModules[1]);
+			builder.setPolygonMode(vk::PolygonMode::eFill);
+
+			mInstancedPipelineRequest = pipelines.requestPipeline(rc, builder, mRenderPass, 0);
+		}
+
+		if (mPackedInstancedVertexShader && mPackedPipeline) {
+			vkg::VertexInputDescription vid;
+			Mesh::addToVertexInputDescription(0, &vid, true);
+			vkg::VertexInputDescription::Binding& instBinding = vid.addBinding(
+				vkg::RenderSubmitter::INSTANCE_BINDING, sizeof(glm::mat4), vk::VertexInputRate::eInstance);
+			for (uint32_t i = 0; i < 4; ++i) {
+				instBinding.addAttributeFloat(2 + i, 4, i * sizeof(glm::vec4));
+			}
+
+			builder.setVertexBindingDescriptions(vid.getBindingDescription());
+			builder.setVertexAttirbuteDescriptions(vid.getAttributeDescriptions());
+			builder.setShaderStages(mPackedInstancedVertexShader, mShaderModules[1]);
+			builder.setPolygonMode(vk::PolygonMode::eFill);
+
+			mPackedInstancedPipelineRequest = pipelines.requestPipeline(rc, builder, mRenderPass, 0);
+		}
+	}
+
+	void Engine::setSubmitterPipelines()
+	{
+		for (FrameContext& fc : mContexts) {
+			fc.renderSubmitter().setDefaultMaterial(mGraphicsPipeline, mPipLayout, mGlobalContext.rc().getEmptyDescriptorSet());
+			fc.renderSubmitter().setInstancedPipeline(mInstancedPipeline);
+			fc.renderSubmitter().setPackedMaterial(mPackedPipeline, mPackedInstancedPipeline, mPipLayout, mGlobalContext.rc().getEmptyDescriptorSet());
+		}
+	}
+
+	void Engine::updateRequestedPipelines()
+	{
+		const vkg::PipelineManager& pipelines = mGlobalContext.rc().getPipelineManager();
+		bool changed = false;
+		if (mInstancedVertexShader && !mInstancedPipeline) {
+			mInstancedPipeline = pipelines.getPipeline(mInstancedPipelineRequest);
+			changed |= static_cast<bool>(mInstancedPipeline);
+		}
+		if (mPackedInstancedVertexShader && mPackedPipeline && !mPackedInstancedPipeline) {
+			mPackedInstancedPipeline = pipelines.getPipeline(mPackedInstancedPipelineRequest);
+			changed |= static_cast<bool>(mPackedInstancedPipeline);
+		}
+
+		// The other frames finished recording, so all the contexts can change
+		if (changed) {
+			setSubmitterPipelines();
+		}
 	}
 
 	void Engine::createSyncObjects()
@@ -624,6 +898,57 @@ namespace gr
 		mFrameAvailableTimelineSemaphore = mGlobalContext.rc().createTimelineSemaphore(2 * mContexts.size() - 1);
 	}
 
+	void Engine::createTimestampQueryPool()
+	{
+		if (!mGlobalContext.rc().getPhysicalProperties().limits.timestampComputeAndGraphics) {
+			mGlobalContext.addNewLog("Timestamps not supported, GPU frame time will not be measured");
+			return;
+		}
+
+		const uint32_t validBits = mGlobalContext.rc().getPhysicalDevice().getQueueFamilyProperties()
+			[mGlobalContext.rc().getGraphicsFamilyIdx()].timestampValidBits;
+		if (validBits == 0) {
+			mGlobalContext.addNewLog("Timestamps not supported in the graphics queue, GPU frame time will not be measured");
+			return;
+		}
+		mTimestampMask = validBits >= 64 ? ~uint64_t(0) : (uint64_t(1) << validBits) - 1;
+
+		vk::QueryPoolCreateInfo createInfo(
+			{},		// flags
+			vk::QueryType::eTimestamp,
+			2 * MAX_FRAMES_IN_FLIGHT // query count
+		);
+
+		mTimestampQueryPool = mGlobalContext.rc().getDevice().createQueryPool(createInfo);
+		mTimestampsWritten.fill(false);
+	}
+
+	void Engine::readGpuFrameTime(FrameContext* fc)
+	{
+		// The frame of this context has finished, so the queries are available
+		if (!mTimestampQueryPool || !mTimestampsWritten[fc->getIdx()]) {
+			return;
+		}
+
+		// Each timestamp followed by its availability
+		std::array<uint64_t, 4> results;
+		vk::Result res = mGlobalContext.rc().getDevice().getQueryPoolResults(
+			mTimestampQueryPool,
+			2 * fc->getIdx(), 2,	// first query and count
+			sizeof(results), results.data(),
+			2 * sizeof(uint64_t),	// stride
+			vk::QueryResultFlagBits::e64 | vk::QueryResultFlagBits::eWithAvailability
+		);
+		mTimestampsWritten[fc->getIdx()] = false;
+
+		if (res == vk::Result::eSuccess && results[1] != 0 && results[3] != 0) {
+			// The masked difference is right even if the counter wrapped around
+			const uint64_t ticks = (results[2] - results[0]) & mTimestampMask;
+			const double_t period = mGlobalContext.rc().getPhysicalProperties().limits.timestampPeriod;
+			fc->setGpuTime(static_cast<double_t>(ticks) * period * 1.0e-9);
+		}
+	}
+
 	void Engine::createFrameBufferObjects()
 	{
 		mColorImage = mGlobalContext.rc().createImage2DColorAttachment(
@@ -702,8 +1027,12 @@ namespace gr
 		}
 		mGlobalContext.rc().destroy(mFrameAvailableTimelineSemaphore);
 
+		if (mTimestampQueryPool) {
+			mGlobalContext.rc().getDevice().destroyQueryPool(mTimestampQueryPool);
+		}
+
 		cleanupSwapChainDependantObjs();
-		
+		destroyRenderPassAndPipelines();
 		
 		mGlobalContext.rc().safeDestroyImage(mTexture);
 
@@ -714,8 +1043,12 @@ namespace gr
 
 		mGlobalContext.rc().getDevice().destroyPipelineLayout(mPipLayout);
 
-		mGlobalContext.rc().destroy(mShaderModules[0]);
-		mGlobalContext.rc().destroy(mShaderModules[1]);
+		vkg::ShaderModuleCache& shaders = mGlobalContext.rc().getShaderModuleCache();
+		shaders.release(mGlobalContext.rc(), mShaderModules[0]);
+		shaders.release(mGlobalContext.rc(), mShaderModules[1]);
+		shaders.release(mGlobalContext.rc(), mInstancedVertexShader);
+		shaders.release(mGlobalContext.rc(), mPackedVertexShader);
+		shaders.release(mGlobalContext.rc(), mPackedInstancedVertexShader);
 	}
 
 	void Engine::cleanupSwapChainDependantObjs()
@@ -735,9 +1068,17 @@ namespace gr
 
 		mGlobalContext.rc().safeDestroyImage(mColorImage);
 		mGlobalContext.rc().safeDestroyImage(mDepthImage);
+	}
 
-		mGlobalContext.rc().destroy(mGraphicsPipeline);
-		mGlobalContext.rc().destroy(mWireframePipeline);
+	void Engine::destroyRenderPassAndPipelines()
+	{
+		// Also waits the pipelines still compiling
+		mGlobalContext.rc().getPipelineManager().destroyPipelines(mGlobalContext.rc(), mRenderPass);
+		mGraphicsPipeline = nullptr;
+		mWireframePipeline = nullptr;
+		mInstancedPipeline = nullptr;
+		mPackedPipeline = nullptr;
+		mPackedInstancedPipeline = nullptr;
 
 		mGlobalContext.rc().destroy(mRenderPass);
 	}
@@ -22,6 +22,8 @@ namespace gr
 
 	protected:
 		static constexpr uint32_t MAX_FRAMES_IN_FLIGHT = 3;
+		static constexpr const char* PIPELINE_CACHE_PATH = "resources/cache/pipelines.bin";
+		static constexpr const char* CAPTURES_PATH = "captures";
 
 		GlobalContext mGlobalContext;
 
@@ -37,15 +39,30 @@ namespace gr
 
 		vk::PipelineLayout mPipLayout;
 		vk::ShaderModule mShaderModules[2];
+		vk::ShaderModule mInstancedVertexShader;
+		vk::ShaderModule mPackedVertexShader, mPackedInstancedVertexShader;
 		vk::Pipeline mGraphicsPipeline, mWireframePipeline;
+		vk::Pipeline mInstancedPipeline;
+		vk::Pipeline mPackedPipeline, mPackedInstancedPipeline;
+		// Compiled in the background, see updateRequestedPipelines
+		vkg::PipelineManager::Handle mInstancedPipelineRequest = 0;
+		vkg::PipelineManager::Handle mPackedInstancedPipelineRequest = 0;
 
 		uint32_t mCurrentFrame = 0;
 		vk::Semaphore mFrameAvailableTimelineSemaphore;
+		// Signaled by the last frame submitted, the skipped frames signal nothing
+		uint64_t mLastSubmittedFrameCount = 0;
 		std::array<vk::Semaphore, MAX_FRAMES_IN_FLIGHT> mImageAvailableSemaphores;
 		std::array<vk::Semaphore, MAX_FRAMES_IN_FLIGHT> mRenderingFinishedSemaphores;
 		std::array<uint64_t, MAX_FRAMES_IN_FLIGHT> mInFlightSemaphoreValues;
 		std::vector<vk::Fence> mImagesInFlightFences;
 
+		// Two timestamps per frame in flight, around the render pass
+		vk::QueryPool mTimestampQueryPool;
+		std::array<bool, MAX_FRAMES_IN_FLIGHT> mTimestampsWritten = {};
+		// Of the timestampValidBits of the graphics queue, the rest are undefined
+		uint64_t mTimestampMask = 0;
+
 		std::vector<vkg::Buffer> mUbos;
 		vkg::Image2D mTexture;
 		vk::Sampler mTexSampler;
@@ -55,11 +72,22 @@ namespace gr
 
 		uint32_t mCommandFlusherGraphicsBlock;
 
+		// Scene with a logic update running while the frame is drawn
+		Scene* mSceneInLogicUpdate = nullptr;
+
+		// The swap chain image of the frame is read back before presenting it
+		bool mCapturingFrame = false;
+
 		void draw(FrameContext& frameContext);
 
+		// Reads back the swap chain image of the frame into a file
+		bool requestCapture(FrameContext& frameContext);
+		static void s_writeCapture(const std::string& path, const vkg::BufferReadback::Result& result);
+
 		void updateUBO(const FrameContext& frameContext, uint32_t currentImage);
 
 		void updateScene(FrameContext* fc);
+		void finishSceneUpdate(FrameContext* fc);
 
 		void createRenderPass();
 		void recreateSwapChain();
@@ -75,9 +103,14 @@ namespace gr
 		void createPipelineLayout();
 
 		void createGraphicsPipeline();
+		void setSubmitterPipelines();
+		void updateRequestedPipelines();
 
 		void createSyncObjects();
 
+		void createTimestampQueryPool();
+		void readGpuFrameTime(FrameContext* fc);
+
 		void createFrameBufferObjects();
 
 		void createUniformBuffers();
@@ -85,6 +118,7 @@ namespace gr
 
 		void cleanup();
 		void cleanupSwapChainDependantObjs();
+		void destroyRenderPassAndPipelines();
 	};
 
 }; // namespace gr
\ No newline at end of file
@@ -31,17 +31,10 @@ void gr::FrameContext::updateTime(double_t newTime)
 	mDeltaTime = mGlobalContext->computeDeltaTime();
 }
 
-void gr::FrameContext::scheduleToDestroy(const vkg::Buffer& buffer)
+void gr::FrameContext::scheduleToDestroy(vk::DescriptorSet set, vk::DescriptorSetLayout layout)
 {
-	if (buffer) {
-		mResourcesToDelete.push_back(std::unique_ptr<DelRes>(new DelResBuffer(buffer)));
-	}
-}
-
-void gr::FrameContext::scheduleToDestroy(const vkg::Image2D& image)
-{
-	if (image) {
-		mResourcesToDelete.push_back(std::unique_ptr<DelRes>(new DelResImage(image)));
+	if (set) {
+		rc().getDeferredDestroyer().pushDescriptorSet(set, layout, getNextFrameCount());
 	}
 }
 
@@ -50,12 +43,8 @@ void gr::FrameContext::resetFrameResources()
 	graphicsPool().reset();
 	presentPool().reset();
 	transferPool().reset();
-
-	for (size_t i = 0; i < mResourcesToDelete.size(); ++i) {
-		(mResourcesToDelete[i])->destroy(mGlobalContext);
-	}
-
-	mResourcesToDelete.clear();
+	mDescriptorAllocator.reset(rc());
+	mFrameArena.reset();
 }
 
 void gr::FrameContext::recreateCommandPools()
@@ -66,7 +55,9 @@ void gr::FrameContext::recreateCommandPools()
 
 void gr::FrameContext::destroy()
 {
+	mRenderSubmitter.destroy(rc());
 	resetFrameResources();
+	mDescriptorAllocator.destroy(rc());
 	destroyCommandPools();
 }
 
@@ -77,23 +68,3 @@ void gr::FrameContext::destroyCommandPools()
 	}
 }
 
-gr::FrameContext::DelResBuffer::DelResBuffer(const vkg::Buffer& buffer)
-{
-	std::memcpy(&mBuffer, &buffer, sizeof(buffer));
-}
-
-void gr::FrameContext::DelResBuffer::destroy(GlobalContext* gc)
-{
-	gc->rc().destroy(reinterpret_cast<vkg::Buffer&>(mBuffer));
-}
-
-gr::FrameContext::DelResImage::DelResImage(const vkg::Image2D& image)
-{
-	std::memcpy(&mBuffer, &image, sizeof(image));
-}
-
-void gr::FrameContext::DelResImage::destroy(GlobalContext* gc)
-{
-	gc->rc().destroy(reinterpret_cast<vkg::Image2D&>(mBuffer));
-}
-
@@ -2,6 +2,8 @@
 #include "GlobalContext.h"
 
 #include "../graphics/RenderSubmitter.h"
+#include "../graphics/resources/TransientDescriptorAllocator.h"
+#include "../utils/FrameArena.h"
 
 namespace gr
 {
@@ -43,6 +45,10 @@ public:
 	float_t timef() const { return static_cast<float_t>(mTime); }
 	float_t dtf() const { return static_cast<float_t>(mDeltaTime); }
 
+	// GPU time of the last frame rendered with this context. 0 if unknown
+	void setGpuTime(double_t gpuTime) { mGpuTime = gpuTime; }
+	double_t gpuTime() const { return mGpuTime; }
+
 	vkg::ResetCommandPool& graphicsPool() { return mPools.graphicsPool; };
 	const vkg::ResetCommandPool& graphicsPool() const { return mPools.graphicsPool; };
 	vkg::ResetCommandPool& presentPool() { return mPools.presentPool; };
@@ -53,11 +59,20 @@ public:
 	vkg::RenderSubmitter& renderSubmitter() { return mRenderSubmitter; }
 	const vkg::RenderSubmitter& renderSubmitter() const { return mRenderSubmitter; }
 
+	// Descriptor sets valid only during this frame
+	vk::DescriptorSet allocateTransientDescriptorSet(vk::DescriptorSetLayout layout) { return mDescriptorAllocator.allocate(rc(), layout); }
+	const vkg::TransientDescriptorAllocator& descriptorAllocator() const { return mDescriptorAllocator; }
+
+	// CPU memory valid only during this frame, for the FrameAllocator of the containers.
+	// Null if the arena is disabled
+	FrameArena* frameArena() { return FrameArena::s_isEnabled() ? &mFrameArena : nullptr; }
+	const FrameArena& getFrameArena() const { return mFrameArena; }
 
-	void scheduleToDestroy(const vkg::Buffer& buffer);
-	void scheduleToDestroy(const vkg::Image2D& image);
+	// Destroyed once the GPU finishes the frames submitted until this one, see DeferredDestroyer
 	template<typename T>
 	void scheduleToDestroy(const T& obj);
+	// The set returns to the free list of its layout
+	void scheduleToDestroy(vk::DescriptorSet set, vk::DescriptorSetLayout layout);
 
 
 	void resetFrameResources();
@@ -72,12 +87,12 @@ private:
 	uint32_t mImageIdx = 0;
 	double_t mTime = 0.0;
 	double_t mDeltaTime = 1/30.0;
+	double_t mGpuTime = 0.0;
 
 	vkg::RenderContext::FrameCommandPools mPools;
 	vkg::RenderSubmitter mRenderSubmitter;
-
-	struct DelRes;
-	std::vector<std::unique_ptr<DelRes>> mResourcesToDelete;
+	vkg::TransientDescriptorAllocator mDescriptorAllocator;
+	FrameArena mFrameArena;
 
 
 	GlobalContext* mGlobalContext;
@@ -87,45 +102,14 @@ private:
 	FrameContext(uint32_t numMax, uint32_t id, GlobalContext* globalContext) :
 		CONCURRENT_FRAMES(numMax), mFrameId(id), mFrameCount(id), mGlobalContext(globalContext) {}
 
-
-	struct DelRes {
-		static constexpr size_t SIZE = 4 * sizeof(void*);
-		typedef std::aligned_storage<SIZE>::type Stack;
-		Stack mBuffer;
-		virtual void destroy(GlobalContext* gc) { assert(false); };
-	};
-
-	struct DelResBuffer : public DelRes {
-		static_assert(sizeof(vkg::Buffer) <= SIZE, "Not enough memory");
-		DelResBuffer(const vkg::Buffer& buffer);
-		virtual void destroy(GlobalContext* gc) override final;
-	};
-
-	struct DelResImage : public DelRes {
-		static_assert(sizeof(vkg::Image2D) <= SIZE, "Not enough memory");
-		DelResImage(const vkg::Image2D& image);
-		virtual void destroy(GlobalContext* gc) override final;
-	};
-
-	template<typename T>
-	struct DelResTemp : public DelRes {
-		static_assert(sizeof(T) <= SIZE, "Not enough memory");
-		DelResTemp(const T& obj) {
-			std::memcpy(&mBuffer, &obj, sizeof(obj));
-		}
-		virtual void destroy(GlobalContext* gc) override final {
-			gc->rc().destroy(reinterpret_cast<T&>(mBuffer));
-		}
-	};
-
 };
 
 template<typename T>
 inline void FrameContext::scheduleToDestroy(const T& obj)
 {
+	// This frame signals the greatest value of the frames in flight
 	if (obj) {
-		mResourcesToDelete.push_back(
-			std::unique_ptr<DelRes>(new DelResTemp<T>(obj)));
+		rc().getDeferredDestroyer().push(obj, getNextFrameCount());
 	}
 }
 
@@ -2,9 +2,11 @@
 
 #include "../utils/serialization.h"
 #include "FrameContext.h"
+#include "../utils/grTools.h"
 
 #include <cereal/cereal.hpp>
 #include <fstream>
+#include <sstream>
 
 constexpr const char* RESOURCES_FILE = "Resources.json";
 
@@ -50,6 +52,8 @@ void gr::GlobalContext::saveProject() const
 
 bool gr::GlobalContext::loadProject(FrameContext* fc, const std::filesystem::path& newPath)
 {
+	const auto start_timer = std::chrono::high_resolution_clock::now();
+
 	std::filesystem::path resourcesPath = newPath;
 	resourcesPath /= RESOURCES_FILE;
 	std::ifstream stream(resourcesPath, std::ofstream::in);
@@ -70,11 +74,56 @@ bool gr::GlobalContext::loadProject(FrameContext* fc, const std::filesystem::pat
 
 	this->setProjectPath(newPath);
 
-	mDict.startAll(fc);
+	const auto deserialize_timer = std::chrono::high_resolution_clock::now();
+	{
+		typedef std::chrono::duration<double_t> Fsec;
+		const Fsec duration = deserialize_timer - start_timer;
+		std::stringstream ss;
+		ss << "Loaded project " << newPath.string() << "\n\tDeserialization took " << duration.count() << " seconds";
+		addNewLog(ss.str());
+	}
+
+	// Only the bound scene and its references are started now
+	mDict.startAll(fc, mBoundScene);
+
+	mProjectLoadStart = start_timer;
+	mWaitingFirstFrame = true;
+	mWaitingStreamed = true;
 
 	return true;
 }
 
+void gr::GlobalContext::frameSubmitted()
+{
+	typedef std::chrono::duration<double_t> Fsec;
+
+	if (mWaitingFirstFrame) {
+		mWaitingFirstFrame = false;
+
+		const Fsec duration = std::chrono::high_resolution_clock::now() - mProjectLoadStart;
+		std::stringstream ss;
+		ss << "First frame of project " << mProjectPath.string() << "\n\tTook " << duration.count() << " seconds since the load started";
+		addNewLog(ss.str());
+	}
+
+	if (!mWaitingStreamed) {
+		return;
+	}
+	const MeshStreamer::Stats stats = mMeshStreamer.getStats();
+	if (stats.numMeshes != 0 || stats.numLoading != 0) {
+		return;
+	}
+	mWaitingStreamed = false;
+
+	const Fsec duration = std::chrono::high_resolution_clock::now() - mProjectLoadStart;
+	std::stringstream ss;
+	ss.precision(4);
+	ss << "Streamed the meshes of project " << mProjectPath.string() << "\n\tTook " << duration.count() << " seconds since the load started";
+	ss << "\n\tResident set " << tools::getResidentSetSize() / (1024.0 * 1024.0) << " MiB, mesh host copies released "
+		<< Mesh::s_getReleasedHostBytes() / (1024.0 * 1024.0) << " MiB";
+	addNewLog(ss.str());
+}
+
 void gr::GlobalContext::addNewLog(const std::string& log) const
 {
 	if (mLogFun) {
@@ -90,5 +139,7 @@ void gr::GlobalContext::setLogCallback(const std::function<void(const std::strin
 void gr::GlobalContext::destroy()
 {
 	mWindow.destroy(mRenderContext.getInstance());
+	// Its levels in flight own ranges of the geometry arena
+	mMeshStreamer.destroy(mRenderContext);
 	mRenderContext.destroy();
 }
@@ -3,9 +3,12 @@
 #include "../graphics/RenderContext.h"
 #include "../graphics/Window.h"
 #include "../meshes/ResourceDictionary.h"
+#include "../meshes/MeshStreamer.h"
+#include "../meshes/ResidencyManager.h"
 
 #include <filesystem>
 #include <functional>
+#include <chrono>
 
 namespace gr
 {
@@ -23,6 +26,10 @@ public:
 	const vkg::Window& getWindow() const { return mWindow; }
 	const ResourceDictionary& getDict() const { return mDict; }
 	ResourceDictionary& getDict() { return mDict; }
+	MeshStreamer& getMeshStreamer() { return mMeshStreamer; }
+	const MeshStreamer& getMeshStreamer() const { return mMeshStreamer; }
+	ResidencyManager& getResidencyManager() { return mResidencyManager; }
+	const ResidencyManager& getResidencyManager() const { return mResidencyManager; }
 
 	double_t getTime() const { return mGlobalTime; }
 	void setTime(double_t newTime);
@@ -38,6 +45,9 @@ public:
 
 	void saveProject() const;
 	bool loadProject(FrameContext *fc, const std::filesystem::path& projectPath);
+	// Called after submitting each frame, logs the time to the first frame of a loaded project,
+	// and the memory of the process once all its meshes are streamed
+	void frameSubmitted();
 
 	void addNewLog(const std::string& log) const;
 	void setLogCallback(const std::function<void(const std::string&)>& callback);
@@ -51,11 +61,17 @@ private:
 	vkg::RenderContext mRenderContext;
 	vkg::Window mWindow;
 	ResourceDictionary mDict;
+	MeshStreamer mMeshStreamer;
+	ResidencyManager mResidencyManager;
 
 	ResId mBoundScene;
 
 	std::filesystem::path mProjectPath = {};
 
+	std::chrono::high_resolution_clock::time_point mProjectLoadStart;
+	bool mWaitingFirstFrame = false;
+	bool mWaitingStreamed = false;
+
 	std::function<void(const std::string&)> mLogFun;
 
 };
@@ -4,6 +4,7 @@
 #include "DebugVk.h"
 
 #include <glm/glm.hpp>
+#include <cstring>
 
 namespace gr
 {
@@ -24,28 +25,25 @@ namespace vkg
 		createLogicalDevice(surfaceToRequestSwapChain);
 		createQueues();
 
-		mMemManager = MemoryManager(mInstance, mPhysicalDevice, mDevice);
+		mMemManager = MemoryManager(mInstance, mPhysicalDevice, mDevice, mMemoryBudgetEnabled);
 
 		mGraphicsBufferTransferer.setUpTransferBlocks(this);
+		mReadback.initialize(*this);
+		mDefragmenter.initialize(*this);
 
 		mDescriptorManager.initialize(*this);
 
 		createBasicVkElements();
 	}
 
-	void RenderContext::flushData()
-	{
-		mGraphicsCommandPool.flushFrees();
-		mTransferCommandPool.flushFrees();
-	}
-
 
 	Image2D RenderContext::createTexture2D(
 		const vk::Extent2D& extent,
 		uint32_t mipLevels,
 		vk::SampleCountFlagBits numSamples,
 		vk::Format format,
-		vk::ImageAspectFlags imageAspect)
+		vk::ImageAspectFlags imageAspect,
+		const MemoryTag& tag)
 	{
 
 		vk::Image image;
@@ -54,7 +52,7 @@ namespace vkg
 		createImage2D(extent, mipLevels, numSamples, format,
 			vk::ImageUsageFlagBits::eTransferDst |
 			vk::ImageUsageFlagBits::eSampled,
-			&image, &alloc);
+			&image, &alloc, tag);
 
 		vk::ImageViewCreateInfo ivCreateInfo(
 			{},						// flags
@@ -86,7 +84,8 @@ namespace vkg
 		const vk::Extent2D& extent,
 		uint32_t mipLevels, 
 		vk::SampleCountFlagBits numSamples,
-		vk::Format format)
+		vk::Format format,
+		const MemoryTag& tag)
 	{
 
 		vk::Image image;
@@ -95,7 +94,7 @@ namespace vkg
 		createImage2D(extent, mipLevels, numSamples, format,
 			vk::ImageUsageFlagBits::eColorAttachment |
 			vk::ImageUsageFlagBits::eTransientAttachment,
-			&image, &alloc);
+			&image, &alloc, tag);
 
 		vk::ImageViewCreateInfo ivCreateInfo(
 			{},						// flags
@@ -126,13 +125,14 @@ namespace vkg
 
 	Image2D RenderContext::create2DDepthAttachment(
 		const vk::Extent2D& extent,
-		vk::SampleCountFlagBits numSamples)
+		vk::SampleCountFlagBits numSamples,
+		const MemoryTag& tag)
 	{
 		vk::Image image;
 		VmaAllocation alloc;
 		createImage2D(extent, 1, numSamples, getDepthFormat(),
 			vk::ImageUsageFlagBits::eDepthStencilAttachment,
-			&image, &alloc);
+			&image, &alloc, tag);
 
 		vk::ImageViewCreateInfo ivCreateInfo(
 			{},						// flags
@@ -199,7 +199,7 @@ namespace vkg
 		return mDevice.createSampler(createInfo);
 	}
 
-	Buffer RenderContext::createIndexBuffer(size_t sizeInBytes) const
+	Buffer RenderContext::createIndexBuffer(size_t sizeInBytes, const MemoryTag& tag) const
 	{
 		vk::BufferCreateInfo createInfo(
 			vk::BufferCreateFlagBits(),	// flags
@@ -217,13 +217,15 @@ namespace vkg
 			vk::MemoryPropertyFlagBits::eDeviceLocal,
 			vk::MemoryPropertyFlagBits::eDeviceLocal,
 			&buffer,
-			&alloc);
+			&alloc,
+			nullptr,
+			tag);
 
 
 		return Buffer(buffer, alloc, sizeInBytes);
 	}
 
-	Buffer RenderContext::createVertexBuffer(size_t sizeInBytes) const
+	Buffer RenderContext::createVertexBuffer(size_t sizeInBytes, const MemoryTag& tag) const
 	{
 		vk::BufferCreateInfo createInfo(
 			vk::BufferCreateFlagBits(),	// flags
@@ -241,13 +243,15 @@ namespace vkg
 			vk::MemoryPropertyFlagBits::eDeviceLocal,
 			vk::MemoryPropertyFlagBits::eDeviceLocal,
 			&buffer,
-			&alloc);
+			&alloc,
+			nullptr,
+			tag);
 
 
 		return Buffer(buffer, alloc, sizeInBytes);
 	}
 
-	Buffer RenderContext::createStagingBuffer(size_t sizeInBytes) const
+	Buffer RenderContext::createStagingBuffer(size_t sizeInBytes, const MemoryTag& tag) const
 	{
 		vk::BufferCreateInfo createInfo(
 			vk::BufferCreateFlagBits(),	// flags
@@ -264,13 +268,15 @@ namespace vkg
 			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
 			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
 			&buffer,
-			&alloc);
+			&alloc,
+			nullptr,
+			tag);
 
 
 		return Buffer(buffer, alloc, sizeInBytes);
 	}
 
-	Buffer RenderContext::createUniformBuffer(size_t sizeInBytes) const
+	Buffer RenderContext::createUniformBuffer(size_t sizeInBytes, const MemoryTag& tag) const
 	{
 		std::array<const uint32_t, 2> sharedR = { getGraphicsFamilyIdx(), getTransferFamilyIdx() };
 		vk::BufferCreateInfo createInfo(
@@ -289,14 +295,16 @@ namespace vkg
 			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
 			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
 			&buffer,
-			&alloc);
+			&alloc,
+			nullptr,
+			tag);
 
 
 		return Buffer(buffer, alloc, sizeInBytes);
 	}
 
 	Buffer RenderContext::createCpuVisibleBuffer(
-		size_t sizeInBytes, vk::BufferUsageFlags usageFlags) const
+		size_t sizeInBytes, vk::BufferUsageFlags usageFlags, const MemoryTag& tag) const
 	{
 		vk::BufferCreateInfo createInfo(
 			vk::BufferCreateFlagBits(),	// flags
@@ -313,7 +321,35 @@ namespace vkg
 			vk::MemoryPropertyFlagBits::eHostVisible,
 			vk::MemoryPropertyFlagBits::eHostVisible,
 			&buffer,
-			&alloc);
+			&alloc,
+			nullptr,
+			tag);
+
+
+		return Buffer(buffer, alloc, sizeInBytes);
+	}
+
+	Buffer RenderContext::createReadbackBuffer(size_t sizeInBytes, const MemoryTag& tag) const
+	{
+		vk::BufferCreateInfo createInfo(
+			vk::BufferCreateFlagBits(),	// flags
+			sizeInBytes,				// size of buffer
+			vk::BufferUsageFlagBits::eTransferDst,
+			vk::SharingMode::eExclusive,
+			0, nullptr					// family sharing
+		);
+
+		vk::Buffer buffer;
+		VmaAllocation alloc;
+
+		// The host reads it, cached memory is much faster for that
+		mMemManager.createBufferAllocation(createInfo,
+			vk::MemoryPropertyFlagBits::eHostVisible,
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCached,
+			&buffer,
+			&alloc,
+			nullptr,
+			tag);
 
 
 		return Buffer(buffer, alloc, sizeInBytes);
@@ -402,6 +438,11 @@ namespace vkg
 		mMemManager.flushAllocations(allocations, num);
 	}
 
+	void RenderContext::invalidateAllocations(const VmaAllocation* allocations, uint32_t num) const
+	{
+		mMemManager.invalidateAllocations(allocations, num);
+	}
+
 
 
 	vk::Semaphore RenderContext::createSemaphore() const
@@ -499,12 +540,22 @@ namespace vkg
 
 	void RenderContext::destroy()
 	{
+		mPipelineManager.destroy(*this);
+		mShaderModuleCache.destroy(*this);
+		mTransformBuffer.destroy(*this);
+
 		destroyBasicVkElements();
 
 		mGraphicsBufferTransferer.destroy(this);
+		mReadback.destroy(this);
+		mDefragmenter.destroy(this);
+		// The device is idle, and it frees to the pools and arena destroyed below
+		mDeferredDestroyer.destroy(*this);
 
 		mDescriptorManager.destroy(*this);
 
+		mGeometryArena.destroy(*this);
+
 		mGraphicsCommandPool.destroy();
 		mTransferCommandPool.destroy();
 
@@ -527,10 +578,8 @@ namespace vkg
 			pp = ResetCommandPool(getPresentFamilyIdx(), {}, getDevice());
 		//}
 
-		if (getGraphicsFamilyIdx() == getTransferFamilyIdx()) {
-			throw std::runtime_error("Graphics family is the same as the transfer family!!");
-		}
-
+		// Software devices like lavapipe have one family for everything,
+		// then both pools use the same queue
 		ResetCommandPool tp(
 			getTransferFamilyIdx(),
 			vk::CommandPoolCreateFlagBits::eTransient,
@@ -635,6 +684,15 @@ namespace vkg
 		if (mPresentQueueRequested) {
 			deviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
 		}
+		// Optional, without it VMA estimates the budget from the heap sizes
+		mMemoryBudgetEnabled = false;
+		for (const vk::ExtensionProperties& ext : mPhysicalDevice.enumerateDeviceExtensionProperties()) {
+			if (std::strcmp(ext.extensionName, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0) {
+				deviceExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+				mMemoryBudgetEnabled = true;
+				break;
+			}
+		}
 
 		vk::DeviceCreateInfo createInfo;
 		createInfo.queueCreateInfoCount = static_cast<uint32_t>(queuesCreateInfos.size());
@@ -805,7 +863,8 @@ namespace vkg
 		vk::Format format,
 		vk::ImageUsageFlags usage,
 		vk::Image* outImage,
-		VmaAllocation* outAlloc) const
+		VmaAllocation* outAlloc,
+		const MemoryTag& tag) const
 	{
 		vk::ImageCreateInfo createInfo(
 			{},							// flags
@@ -826,7 +885,9 @@ namespace vkg
 			vk::MemoryPropertyFlagBits::eDeviceLocal,
 			vk::MemoryPropertyFlagBits::eDeviceLocal,
 			outImage,
-			outAlloc);
+			outAlloc,
+			nullptr,
+			tag);
 	}
 
 	void RenderContext::createBasicVkElements()
@@ -854,6 +915,24 @@ namespace vkg
 		{
 			mBasicCameraDescriptorSetLayout = mBasicDescriptorSetLayout;
 		}
+		// Object transforms, selected with the dynamic offset
+		{
+			std::array< vk::DescriptorSetLayoutBinding, 1> bindings;
+			bindings[0] = vk::DescriptorSetLayoutBinding(
+				0u, // binding
+				vk::DescriptorType::eUniformBufferDynamic,
+				1,		// number of elements in the ubo (array)
+				vk::ShaderStageFlagBits::eVertex | vk::ShaderStageFlagBits::eFragment,
+				nullptr
+			);
+
+			vk::DescriptorSetLayoutCreateInfo createInfo(
+				{}, // flags
+				bindings
+			);
+
+			mTransformDescriptorSetLayout = this->getDevice().createDescriptorSetLayout(createInfo);
+		}
 		// Empty Layout
 		{
 			vk::DescriptorSetLayoutCreateInfo createInfo(
@@ -875,6 +954,7 @@ namespace vkg
 		mDescriptorManager.freeDescriptorSet(mEmptyDescriptorSet, mEmptyDescriptorSetLayout);
 
 		getDevice().destroyDescriptorSetLayout(mBasicDescriptorSetLayout);
+		getDevice().destroyDescriptorSetLayout(mTransformDescriptorSetLayout);
 		getDevice().destroyDescriptorSetLayout(mEmptyDescriptorSetLayout);
 	}
 
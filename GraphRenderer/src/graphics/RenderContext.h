@@ -3,13 +3,20 @@
 #include "AppInstance.h"
 #include "memory/MemoryManager.h"
 #include "memory/BufferTransferer.h"
+#include "memory/BufferReadback.h"
+#include "memory/Defragmenter.h"
 #include "command/ResetCommandPool.h"
 #include "command/FreeCommandPool.h"
+#include "render/PipelineManager.h"
+#include "shaders/ShaderModuleCache.h"
 
 #include "present/SwapChain.h"
 #include "resources/Image2D.h"
 #include "resources/Buffer.h"
+#include "resources/DeferredDestroyer.h"
 #include "resources/DescriptorManager.h"
+#include "resources/GeometryArena.h"
+#include "resources/TransformBuffer.h"
 
 #include "command/CommandFlusher.h"
 
@@ -38,7 +45,6 @@ namespace vkg
 			const vk::SurfaceKHR* surfaceToRequestSwapChain = nullptr
 		);
 
-		void flushData();
 
 
 		const vk::PhysicalDevice &getPhysicalDevice() const { return mPhysicalDevice; }
@@ -48,31 +54,43 @@ namespace vkg
 		explicit operator vk::PhysicalDevice() const { return mPhysicalDevice; }
 		explicit operator vk::Device() const { return mDevice; }
 
+		// The tags set the category and owner of the allocation, see MemoryManager::getStats
 		Image2D createTexture2D(const vk::Extent2D& extent,
 			uint32_t mipLevels,
 			vk::SampleCountFlagBits numSamples,
 			vk::Format format,
-			vk::ImageAspectFlags ImageAspect = vk::ImageAspectFlagBits::eColor);
+			vk::ImageAspectFlags ImageAspect = vk::ImageAspectFlagBits::eColor,
+			const MemoryTag& tag = MemoryTag(MemoryCategory::eTexture));
 
 		Image2D createImage2DColorAttachment(const vk::Extent2D& extent,
 			uint32_t mipLevels,
 			vk::SampleCountFlagBits numSamples,
-			vk::Format format);
+			vk::Format format,
+			const MemoryTag& tag = MemoryTag(MemoryCategory::eAttachment));
 
 		Image2D create2DDepthAttachment(
 			const vk::Extent2D& extent,
-			vk::SampleCountFlagBits numSamples);
+			vk::SampleCountFlagBits numSamples,
+			const MemoryTag& tag = MemoryTag(MemoryCategory::eAttachment));
 
 		static vk::Format getDepthFormat() { return vk::Format::eD32Sfloat; }
 
 
 		vk::Sampler createSampler(vk::SamplerAddressMode addressMode) const;
 
-		Buffer createVertexBuffer(size_t sizeInBytes) const;
-		Buffer createIndexBuffer(size_t sizeInBytes) const;
-		Buffer createStagingBuffer(size_t sizeInBytes) const;
-		Buffer createUniformBuffer(size_t sizeInBytes) const;
-		Buffer createCpuVisibleBuffer(size_t sizeInBytes, vk::BufferUsageFlags usageFlags) const;
+		Buffer createVertexBuffer(size_t sizeInBytes,
+			const MemoryTag& tag = MemoryTag(MemoryCategory::eVertex)) const;
+		Buffer createIndexBuffer(size_t sizeInBytes,
+			const MemoryTag& tag = MemoryTag(MemoryCategory::eIndex)) const;
+		Buffer createStagingBuffer(size_t sizeInBytes,
+			const MemoryTag& tag = MemoryTag(MemoryCategory::eStaging)) const;
+		Buffer createUniformBuffer(size_t sizeInBytes,
+			const MemoryTag& tag = MemoryTag(MemoryCategory::eUniform)) const;
+		Buffer createCpuVisibleBuffer(size_t sizeInBytes, vk::BufferUsageFlags usageFlags,
+			const MemoryTag& tag = MemoryTag(MemoryCategory::eOther)) const;
+		// Destination of copies that the host reads, cached if possible
+		Buffer createReadbackBuffer(size_t sizeInBytes,
+			const MemoryTag& tag = MemoryTag(MemoryCategory::eStaging)) const;
 
 
 		void transferDataToGPU(const Allocatable& allocatable, const void* data, size_t numBytes) const;
@@ -82,6 +100,7 @@ namespace vkg
 		void mapAllocatable(const Allocatable& allocatable, void** ptr) const;
 		void unmapAllocatable(const Allocatable& allocatable) const;
 		void flushAllocations(const VmaAllocation* allocations, uint32_t num);
+		void invalidateAllocations(const VmaAllocation* allocations, uint32_t num) const;
 
 		vk::Semaphore createSemaphore() const;
 		vk::Semaphore createTimelineSemaphore(uint64_t initialValue = 0) const;
@@ -122,11 +141,22 @@ namespace vkg
 			return &mGraphicsBufferTransferer;
 		}
 
+		// Copies from the GPU delivered to a worker some frames later
+		BufferReadback& getReadback() { return mReadback; }
+		const BufferReadback& getReadback() const { return mReadback; }
+
+		// Moves the movable buffers to compact the device memory
+		Defragmenter& getDefragmenter() { return mDefragmenter; }
+		const Defragmenter& getDefragmenter() const { return mDefragmenter; }
+
 		bool isPresentQueueCreated() const { return mPresentQueueRequested; }
 
 		size_t padUniformBuffer(size_t size) const;
 		vk::SampleCountFlagBits getMsaaSampleCount() const { return mMsaaSamples; }
+		const vk::PhysicalDeviceProperties& getPhysicalProperties() const { return mPhysicalProperties; }
 		CommandFlusher* getCommandFlusher() { return &mCommandFlusher; }
+		const MemoryManager& getMemoryManager() const { return mMemManager; }
+		bool isMemoryBudgetEnabled() const { return mMemoryBudgetEnabled; }
 
 		DescriptorManager& getDescriptorManager() { return mDescriptorManager; }
 		const DescriptorManager& getDescriptorManager() const { return mDescriptorManager; }
@@ -141,12 +171,34 @@ namespace vkg
 			getDescriptorManager().freeDescriptorSet(set, layout);
 		}
 
+		// Vertices and indices of the meshes, suballocated from shared buffers
+		GeometryArena& getGeometryArena() { return mGeometryArena; }
+		const GeometryArena& getGeometryArena() const { return mGeometryArena; }
+
+		// Shader modules shared by all the users of the same SPIR-V
+		ShaderModuleCache& getShaderModuleCache() { return mShaderModuleCache; }
+		const ShaderModuleCache& getShaderModuleCache() const { return mShaderModuleCache; }
+
+		// Deduplicated graphics pipelines, with a cache stored between runs
+		PipelineManager& getPipelineManager() { return mPipelineManager; }
+		const PipelineManager& getPipelineManager() const { return mPipelineManager; }
+
+		// Model matrices of the objects, one dynamic uniform buffer per frame in flight
+		TransformBuffer& getTransformBuffer() { return mTransformBuffer; }
+		const TransformBuffer& getTransformBuffer() const { return mTransformBuffer; }
+
+		// Objects destroyed once the GPU is done with them, see FrameContext::scheduleToDestroy
+		DeferredDestroyer& getDeferredDestroyer() { return mDeferredDestroyer; }
+		const DeferredDestroyer& getDeferredDestroyer() const { return mDeferredDestroyer; }
+
 		void safeDestroyBuffer(Buffer& buffer) const;
 		void destroy(const Buffer& buffer) const;
 
 		void safeDestroyImage(Image& image) const;
 		void destroy(const Image& image) const;
 
+		void destroy(const GeometryRange& range) { mGeometryArena.free(range); }
+
 		void destroy(const vk::RenderPass renderPass) const;
 
 		void destroy(const vk::Framebuffer framebuffer) const;
@@ -177,7 +229,8 @@ namespace vkg
 			alignas(16) glm::mat4 P;
 		};
 
-		vk::DescriptorSetLayout getBasicTransformLayout() const { return mBasicDescriptorSetLayout; }
+		// Dynamic uniform buffer, see TransformBuffer
+		vk::DescriptorSetLayout getBasicTransformLayout() const { return mTransformDescriptorSetLayout; }
 		vk::DescriptorSetLayout getBasicCameraTransformLayout() const { return mBasicCameraDescriptorSetLayout; }
 		vk::DescriptorSetLayout getEmptyLayout() const { return mEmptyDescriptorSetLayout; }
 		vk::DescriptorSet getEmptyDescriptorSet() const { return mEmptyDescriptorSet; }
@@ -190,7 +243,14 @@ namespace vkg
 		CommandFlusher mCommandFlusher;
 
 		BufferTransferer mGraphicsBufferTransferer;
+		BufferReadback mReadback;
+		Defragmenter mDefragmenter;
 		DescriptorManager mDescriptorManager;
+		GeometryArena mGeometryArena;
+		TransformBuffer mTransformBuffer;
+		PipelineManager mPipelineManager;
+		ShaderModuleCache mShaderModuleCache;
+		DeferredDestroyer mDeferredDestroyer;
 
 		// Device members
 		vk::Queue mGraphicsQueue;
@@ -205,6 +265,7 @@ namespace vkg
 		uint32_t mGraphicsFamilyIdx, mComputeFamilyIdx, mTransferFamilyIdx, mPresentFamilyIdx;
 		
 		bool mAnisotropySamplerEnabled, mPresentQueueRequested;
+		bool mMemoryBudgetEnabled = false;
 		vk::SampleCountFlagBits mMsaaSamples = vk::SampleCountFlagBits::e1;
 		vk::PhysicalDeviceProperties mPhysicalProperties;
 
@@ -255,11 +316,13 @@ namespace vkg
 			vk::Format format,
 			vk::ImageUsageFlags usage,
 			vk::Image* outImage,
-			VmaAllocation* outAlloc) const;
+			VmaAllocation* outAlloc,
+			const MemoryTag& tag) const;
 
 		// Basic VkElements
 		vk::DescriptorSetLayout mBasicDescriptorSetLayout;
 		vk::DescriptorSetLayout mBasicCameraDescriptorSetLayout;
+		vk::DescriptorSetLayout mTransformDescriptorSetLayout;
 		vk::DescriptorSetLayout mEmptyDescriptorSetLayout;
 		vk::DescriptorSet mEmptyDescriptorSet;
 
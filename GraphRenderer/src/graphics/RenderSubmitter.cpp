@@ -1,10 +1,135 @@
 #include "RenderSubmitter.h"
 
+#include "RenderContext.h"
+#include "../utils/grjob.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+
 namespace gr
 {
 namespace vkg
 {
 
+namespace
+{
+
+uint64_t s_fold16(uint64_t v)
+{
+    v ^= v >> 32;
+    v ^= v >> 16;
+    return v & 0xFFFF;
+}
+
+// Least significant digit radix sort of 8 bits per pass. The histograms and
+// the scatter of each pass run in parallel over chunks of the keys.
+typedef std::pair<uint64_t, uint32_t> SortItem;
+
+constexpr uint32_t RADIX_CHUNK_SIZE = 2048;
+
+struct RadixPass {
+    const SortItem* src;
+    SortItem* dst;
+    uint32_t size;
+    uint32_t shift;
+    // Per chunk, the histogram and then the first output position of each digit
+    std::array<uint32_t, 256>* chunkCounts;
+};
+
+void s_radixHistogram(RadixPass* pass, uint32_t chunk)
+{
+    std::array<uint32_t, 256>& counts = pass->chunkCounts[chunk];
+    counts.fill(0);
+    const uint32_t begin = chunk * RADIX_CHUNK_SIZE;
+    const uint32_t end = std::min(begin + RADIX_CHUNK_SIZE, pass->size);
+    for (uint32_t i = begin; i < end; ++i) {
+        counts[(pass->src[i].first >> pass->shift) & 0xFF] += 1;
+    }
+}
+
+void s_radixScatter(RadixPass* pass, uint32_t chunk)
+{
+    std::array<uint32_t, 256>& offsets = pass->chunkCounts[chunk];
+    const uint32_t begin = chunk * RADIX_CHUNK_SIZE;
+    const uint32_t end = std::min(begin + RADIX_CHUNK_SIZE, pass->size);
+    for (uint32_t i = begin; i < end; ++i) {
+        pass->dst[offsets[(pass->src[i].first >> pass->shift) & 0xFF]++] = pass->src[i];
+    }
+}
+
+void s_runChunks(void(*fun)(RadixPass*, uint32_t), RadixPass* pass, uint32_t numChunks)
+{
+    if (numChunks == 1) {
+        fun(pass, 0);
+        return;
+    }
+
+    std::vector<grjob::Job> jobs;
+    jobs.reserve(numChunks);
+    for (uint32_t c = 0; c < numChunks; ++c) {
+        jobs.push_back(grjob::Job(fun, pass, c));
+    }
+    grjob::Counter* counter = nullptr;
+    grjob::runJobBatch(grjob::Priority::eHigh, jobs.data(), numChunks, &counter);
+    grjob::waitForCounterAndFree(counter, 0);
+}
+
+void s_radixSort(std::vector<SortItem>* items, std::vector<SortItem>* tmp)
+{
+    const uint32_t size = static_cast<uint32_t>(items->size());
+    if (size <= 1) {
+        return;
+    }
+    tmp->resize(size);
+
+    const uint32_t numChunks = (size + RADIX_CHUNK_SIZE - 1) / RADIX_CHUNK_SIZE;
+    std::vector<std::array<uint32_t, 256>> chunkCounts(numChunks);
+
+    bool resultInTmp = false;
+    for (uint32_t shift = 0; shift < 64; shift += 8) {
+        RadixPass pass;
+        pass.src = resultInTmp ? tmp->data() : items->data();
+        pass.dst = resultInTmp ? items->data() : tmp->data();
+        pass.size = size;
+        pass.shift = shift;
+        pass.chunkCounts = chunkCounts.data();
+
+        s_runChunks(&s_radixHistogram, &pass, numChunks);
+
+        // Skip the pass if all the keys have the same digit
+        bool allEqual = false;
+        for (uint32_t d = 0; d < 256 && !allEqual; ++d) {
+            uint32_t total = 0;
+            for (uint32_t c = 0; c < numChunks; ++c) {
+                total += chunkCounts[c][d];
+            }
+            allEqual = total == size;
+        }
+        if (allEqual) {
+            continue;
+        }
+
+        // Stable output positions, by digit and then by chunk
+        uint32_t offset = 0;
+        for (uint32_t d = 0; d < 256; ++d) {
+            for (uint32_t c = 0; c < numChunks; ++c) {
+                const uint32_t count = chunkCounts[c][d];
+                chunkCounts[c][d] = offset;
+                offset += count;
+            }
+        }
+
+        s_runChunks(&s_radixScatter, &pass, numChunks);
+        resultInTmp = !resultInTmp;
+    }
+
+    if (resultInTmp) {
+        items->swap(*tmp);
+    }
+}
+
+} // namespace
 
 
 bool RenderSubmitter::MaterialKey::operator==(const MaterialKey& o) const
@@ -14,6 +139,11 @@ bool RenderSubmitter::MaterialKey::operator==(const MaterialKey& o) const
         this->materialDescriptorSet == o.materialDescriptorSet;
 }
 
+RenderSubmitter::RenderSubmitter() :
+    mBuckets(grjob::getNumThreads())
+{
+}
+
 RenderSubmitter::RenderSubmitter(const RenderSubmitter& o)
 {
     *this = o;
@@ -21,21 +151,39 @@ RenderSubmitter::RenderSubmitter(const RenderSubmitter& o)
 
 RenderSubmitter& RenderSubmitter::operator=(const RenderSubmitter& o)
 {
-    mMaterialRenderList = o.mMaterialRenderList;
+    mMaterials = o.mMaterials;
 
     mDefaultMaterial = o.mDefaultMaterial;
+    mPackedMaterial = o.mPackedMaterial;
 
     mSceneDescriptorSet = o.mSceneDescriptorSet;
 
+    mBuckets = std::vector<Bucket>(grjob::getNumThreads());
+
     return *this;
 }
 
 void RenderSubmitter::pushPredefinedDraw(const DrawData& drawData)
 {
-    assert(mDefaultMaterial.pipeline);
-    mMutex.lock();
-    mMaterialRenderList.at(mDefaultMaterial).renderList.push_back(drawData);
-    mMutex.unlock();
+    assert(!mMaterials.empty());
+    assert(!drawData.packedVertices || supportsPackedVertices());
+    const uint32_t materialIdx = drawData.packedVertices ? mPackedMaterial : mDefaultMaterial;
+    const KeyedDraw keyedDraw{ s_computeSortKey(materialIdx, drawData), drawData };
+
+    // A job does not yield while pushing, so no other job uses the bucket of this thread
+    const uint32_t threadId = grjob::getThreadId();
+    if (threadId < static_cast<uint32_t>(mBuckets.size())) {
+        mBuckets[threadId].draws.push_back(keyedDraw);
+        return;
+    }
+
+    if (!mLockedBucketMutex.try_lock()) {
+        mNumContendedPushes += 1;
+        mLockedBucketMutex.lock();
+    }
+    mLockedBucket.draws.push_back(keyedDraw);
+    mLockedBucketMutex.unlock();
+    mNumLockedPushes += 1;
 }
 
 void RenderSubmitter::setDefaultMaterial(
@@ -43,18 +191,40 @@ void RenderSubmitter::setDefaultMaterial(
     const vk::PipelineLayout pipLayout,
     const vk::DescriptorSet descriptorSet)
 {
-    MaterialKey key{ pipeline, descriptorSet };
-    Material mat{ pipLayout };
+    Material mat{ MaterialKey{ pipeline, descriptorSet }, pipLayout, nullptr };
 
-    if (mMaterialRenderList.count(mDefaultMaterial)) {
-        mMaterialRenderList.erase(mDefaultMaterial);
+    if (mMaterials.empty()) {
+        mDefaultMaterial = 0;
+        mMaterials.push_back(mat);
     }
+    else {
+        mat.instancedPipeline = mMaterials[mDefaultMaterial].instancedPipeline;
+        mMaterials[mDefaultMaterial] = mat;
+    }
+    assert(mMaterials.size() <= MAX_MATERIALS);
+}
 
-    mDefaultMaterial = key;
-
+void RenderSubmitter::setPackedMaterial(
+    const vk::Pipeline pipeline,
+    const vk::Pipeline instancedPipeline,
+    const vk::PipelineLayout pipLayout,
+    const vk::DescriptorSet descriptorSet)
+{
+    Material mat{ MaterialKey{ pipeline, descriptorSet }, pipLayout, instancedPipeline };
 
+    if (mPackedMaterial == MAX_MATERIALS) {
+        mPackedMaterial = static_cast<uint32_t>(mMaterials.size());
+        mMaterials.push_back(mat);
+    }
+    else {
+        mMaterials[mPackedMaterial] = mat;
+    }
+    assert(mMaterials.size() <= MAX_MATERIALS);
+}
 
-    mMaterialRenderList.insert({ key, mat });
+bool RenderSubmitter::supportsPackedVertices() const
+{
+    return mPackedMaterial < mMaterials.size() && mMaterials[mPackedMaterial].key.pipeline;
 }
 
 void RenderSubmitter::setSceneDescriptorSet(const vk::DescriptorSet descriptor)
@@ -62,65 +232,320 @@ void RenderSubmitter::setSceneDescriptorSet(const vk::DescriptorSet descriptor)
     mSceneDescriptorSet = descriptor;
 }
 
-void RenderSubmitter::flushDraws(vk::CommandBuffer cmd)
+void RenderSubmitter::setInstancedPipeline(const vk::Pipeline pipeline)
 {
-    assert(cmd);
+    assert(!mMaterials.empty());
+    mMaterials[mDefaultMaterial].instancedPipeline = pipeline;
+}
 
-    if (!mSceneDescriptorSet) {
-        return;
+uint32_t RenderSubmitter::prepareDraws(const RenderContext& rc, uint32_t maxRanges)
+{
+    assert(maxRanges > 0);
+    mPrepareTime = std::chrono::high_resolution_clock::now();
+
+    mStats = Stats();
+    mStats.numLockedPushes = mNumLockedPushes.exchange(0);
+    mStats.numContendedPushes = mNumContendedPushes.exchange(0);
+
+    mDrawCalls.clear();
+    if (mSceneDescriptorSet) {
+        sortDraws();
+    }
+    else {
+        mSortKeys.clear();
+        mSortedDraws.clear();
     }
 
-    bool firstBindDescriptors = true;
+    const uint32_t numDraws = static_cast<uint32_t>(mSortedDraws.size());
+    mStats.numDrawData = numDraws;
 
-    for (auto& material : mMaterialRenderList) {
+    uint32_t numInstances = 0;
+    uint32_t begin = 0;
+    while (begin < numDraws) {
+        // The draws of each material are consecutive
+        const uint32_t materialIdx = static_cast<uint32_t>(mSortKeys[begin].first >> 56);
+        uint32_t end = begin + 1;
+        while (end < numDraws && static_cast<uint32_t>(mSortKeys[end].first >> 56) == materialIdx) {
+            ++end;
+        }
 
-        if (firstBindDescriptors) {
-            firstBindDescriptors = false;
+        // Instanced batches first, and then the draws that could not be batched
+        mSingleDraws.clear();
+        if (mMaterials[materialIdx].instancedPipeline) {
+            batchInstancedDraws(materialIdx, begin, end, &numInstances);
+        }
+        else {
+            for (uint32_t i = begin; i < end; ++i) {
+                mSingleDraws.push_back(i);
+            }
+        }
+        for (uint32_t i : mSingleDraws) {
+            mDrawCalls.push_back(DrawCall{ materialIdx, i, 0, 0 });
+        }
+
+        begin = end;
+    }
+
+    // Fill the model matrices now, so the ranges only read shared data
+    if (numInstances > 0) {
+        reserveInstances(rc, numInstances);
+        for (const DrawCall& dc : mDrawCalls) {
+            for (uint32_t i = 0; i < dc.numInstances; ++i) {
+                mInstanceBufferPtr[dc.firstInstance + i] = mSortedDraws[dc.firstDraw + i]->modelMatrix;
+            }
+        }
+    }
+
+    const uint32_t numDrawCalls = static_cast<uint32_t>(mDrawCalls.size());
+    const uint32_t numRanges = numDrawCalls == 0 ? 0 :
+        std::max(1u, std::min(maxRanges, numDrawCalls / MIN_DRAW_CALLS_RANGE));
+    mRangeStats.assign(numRanges, Stats());
+    mStats.numCommandBuffers = numRanges;
+
+    return numRanges;
+}
+
+void RenderSubmitter::recordDraws(vk::CommandBuffer cmd, uint32_t rangeIdx)
+{
+    assert(cmd);
+    assert(rangeIdx < mRangeStats.size());
+
+    const uint64_t numDrawCalls = mDrawCalls.size();
+    const uint64_t numRanges = mRangeStats.size();
+    const uint32_t begin = static_cast<uint32_t>(numDrawCalls * rangeIdx / numRanges);
+    const uint32_t end = static_cast<uint32_t>(numDrawCalls * (rangeIdx + 1) / numRanges);
+
+    Stats& stats = mRangeStats[rangeIdx];
+    // Secondary command buffers do not inherit any state
+    BoundState state;
+
+    for (uint32_t i = begin; i < end; ++i) {
+        const DrawCall& dc = mDrawCalls[i];
+        const Material& material = mMaterials[dc.materialIdx];
+        const DrawData& dd = *mSortedDraws[dc.firstDraw];
+
+        if (i == begin) {
             // bind to 0
             cmd.bindDescriptorSets(
                 vk::PipelineBindPoint::eGraphics,   // bind point
-                material.second.pipelineLayout,     // pipeline layout
+                material.pipelineLayout,            // pipeline layout
                 0, 1,                               // set and number of sets
                 &mSceneDescriptorSet,// desc set
                 0, nullptr                          // no dynamic offsets
             );
+            stats.numDescriptorSetBinds += 1;
         }
 
-        cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, material.first.pipeline);
-        if (material.first.materialDescriptorSet) {
-            // bind to 1
-            cmd.bindDescriptorSets(
-                vk::PipelineBindPoint::eGraphics,   // bind point
-                material.second.pipelineLayout,     // pipeline layout
-                1, 1,                               // set and number of sets
-                &material.first.materialDescriptorSet,// desc set
-                0, nullptr                          // no dynamic offsets
+        if (dc.materialIdx != state.materialIdx) {
+            state.materialIdx = dc.materialIdx;
+            if (material.key.materialDescriptorSet) {
+                // bind to 1
+                cmd.bindDescriptorSets(
+                    vk::PipelineBindPoint::eGraphics,   // bind point
+                    material.pipelineLayout,            // pipeline layout
+                    1, 1,                               // set and number of sets
+                    &material.key.materialDescriptorSet,// desc set
+                    0, nullptr                          // no dynamic offsets
                 );
+                stats.numDescriptorSetBinds += 1;
+            }
+        }
+
+        const vk::Pipeline pipeline = dc.numInstances > 0 ? material.instancedPipeline : material.key.pipeline;
+        if (pipeline != state.pipeline) {
+            cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline);
+            state.pipeline = pipeline;
+            stats.numPipelineBinds += 1;
         }
 
-        for (const DrawData& dd : material.second.renderList) {
-            if (dd.objectDescriptorSet) {
+        if (dc.numInstances > 0) {
+            if (!state.instanceBufferBound) {
+                const vk::DeviceSize instanceOffset = 0;
+                cmd.bindVertexBuffers(INSTANCE_BINDING, 1, &mInstanceBuffer.getVkBuffer(), &instanceOffset);
+                state.instanceBufferBound = true;
+                stats.numVertexBufferBinds += 1;
+            }
+
+            s_bindMeshBuffers(cmd, dd, &state, &stats);
+            cmd.drawIndexed(dd.numIndices, dc.numInstances, dd.firstIndex, dd.vertexOffset, dc.firstInstance);
+
+            stats.numInstancedDrawCalls += 1;
+            stats.numInstances += dc.numInstances;
+        }
+        else {
+            if (dd.objectDescriptorSet &&
+                (dd.objectDescriptorSet != state.objectDescriptorSet || dd.objectOffset != state.objectOffset)) {
                 // bind to 2
                 cmd.bindDescriptorSets(
                     vk::PipelineBindPoint::eGraphics,   // bind point
-                    material.second.pipelineLayout,     // pipeline layout
+                    material.pipelineLayout,            // pipeline layout
                     2, 1,                               // set and number of sets
                     &dd.objectDescriptorSet,// desc set
-                    0, nullptr                          // no dynamic offsets
+                    1, &dd.objectOffset                 // dynamic offset of the model matrix
                 );
+                state.objectDescriptorSet = dd.objectDescriptorSet;
+                state.objectOffset = dd.objectOffset;
+                stats.numDescriptorSetBinds += 1;
             }
 
-            // bind to 0
-            cmd.bindVertexBuffers(0, 1, &dd.vertexBuffer, &dd.vertexBufferOffset);
-            cmd.bindIndexBuffer(dd.indexBuffer, 0, vk::IndexType::eUint32);
+            s_bindMeshBuffers(cmd, dd, &state, &stats);
+            cmd.drawIndexed(dd.numIndices, 1, dd.firstIndex, dd.vertexOffset, 0);
+        }
+
+        stats.numDrawCalls += 1;
+    }
+}
+
+void RenderSubmitter::endDraws()
+{
+    for (const Stats& stats : mRangeStats) {
+        mStats.numDrawCalls += stats.numDrawCalls;
+        mStats.numInstancedDrawCalls += stats.numInstancedDrawCalls;
+        mStats.numInstances += stats.numInstances;
+        mStats.numPipelineBinds += stats.numPipelineBinds;
+        mStats.numDescriptorSetBinds += stats.numDescriptorSetBinds;
+        mStats.numVertexBufferBinds += stats.numVertexBufferBinds;
+        mStats.numIndexBufferBinds += stats.numIndexBufferBinds;
+    }
+
+    typedef std::chrono::duration<double_t> Fsec;
+    mStats.recordTime = Fsec(std::chrono::high_resolution_clock::now() - mPrepareTime).count();
+
+    clearDraws();
+}
 
-            cmd.drawIndexed(dd.numIndices, 1, dd.firstIndex, 0, 0);
+void RenderSubmitter::destroy(const RenderContext& rc)
+{
+    if (mInstanceBufferPtr) {
+        rc.unmapAllocatable(mInstanceBuffer);
+        mInstanceBufferPtr = nullptr;
+    }
+    if (mInstanceBuffer) {
+        rc.destroy(mInstanceBuffer);
+        mInstanceBuffer = nullptr;
+    }
+    mInstanceCapacity = 0;
+}
+
+uint64_t RenderSubmitter::s_computeSortKey(uint32_t materialIdx, const DrawData& drawData)
+{
+    const uint64_t buffers = s_fold16(
+        std::hash<vk::Buffer>{}(drawData.vertexBuffer) ^
+        (std::hash<vk::Buffer>{}(drawData.indexBuffer) << 1) ^
+        static_cast<uint64_t>(drawData.indexType));
+    const uint64_t range = s_fold16(
+        (static_cast<uint64_t>(drawData.firstIndex) << 32) ^
+        static_cast<uint64_t>(drawData.numIndices) ^
+        (static_cast<uint64_t>(static_cast<uint32_t>(drawData.vertexOffset)) << 8));
+
+    // Positive floats keep their order when compared as integers
+    const float_t depth = std::max(drawData.depth, 0.0f);
+    uint32_t depthBits;
+    std::memcpy(&depthBits, &depth, sizeof(depthBits));
+
+    return (static_cast<uint64_t>(materialIdx) << 56) | (buffers << 40) | (range << 24) | (depthBits >> 8);
+}
+
+void RenderSubmitter::sortDraws()
+{
+    mSortKeys.clear();
+    mGatheredDraws.clear();
+
+    auto gather = [this](const Bucket& bucket) {
+        for (const KeyedDraw& keyedDraw : bucket.draws) {
+            mSortKeys.push_back({ keyedDraw.key, static_cast<uint32_t>(mGatheredDraws.size()) });
+            mGatheredDraws.push_back(&keyedDraw.draw);
+        }
+    };
+    for (const Bucket& bucket : mBuckets) {
+        gather(bucket);
+    }
+    gather(mLockedBucket);
+
+    s_radixSort(&mSortKeys, &mSortKeysTmp);
+
+    mSortedDraws.resize(mSortKeys.size());
+    for (size_t i = 0; i < mSortKeys.size(); ++i) {
+        mSortedDraws[i] = mGatheredDraws[mSortKeys[i].second];
+    }
+}
+
+void RenderSubmitter::reserveInstances(const RenderContext& rc, uint32_t numInstances)
+{
+    if (numInstances <= mInstanceCapacity) {
+        return;
+    }
+
+    // The last frame that used this submitter has finished, so the buffer is not in use
+    destroy(rc);
+
+    mInstanceCapacity = std::max(numInstances, 256u);
+    mInstanceBuffer = rc.createCpuVisibleBuffer(
+        sizeof(glm::mat4) * mInstanceCapacity,
+        vk::BufferUsageFlagBits::eVertexBuffer,
+        MemoryTag(MemoryCategory::eVertex));
+    rc.mapAllocatable(mInstanceBuffer, reinterpret_cast<void**>(&mInstanceBufferPtr));
+    // Filled and bound by handle each frame
+    rc.getMemoryManager().setMovable(&mInstanceBuffer, reinterpret_cast<void**>(&mInstanceBufferPtr));
+}
+
+void RenderSubmitter::batchInstancedDraws(uint32_t materialIdx, uint32_t begin, uint32_t end, uint32_t* numInstances)
+{
+    // The draws are sorted, thus the ones of the same mesh range are consecutive,
+    // unless the hashes of the key collide.
+    for (uint32_t i = begin, j = begin; i < end; i = j) {
+        const DrawData& dd = *mSortedDraws[i];
+        j = i + 1;
+        while (j < end &&
+            mSortedDraws[j]->vertexBuffer == dd.vertexBuffer &&
+            mSortedDraws[j]->vertexOffset == dd.vertexOffset &&
+            mSortedDraws[j]->indexBuffer == dd.indexBuffer &&
+            mSortedDraws[j]->indexType == dd.indexType &&
+            mSortedDraws[j]->firstIndex == dd.firstIndex &&
+            mSortedDraws[j]->numIndices == dd.numIndices) {
+            ++j;
         }
 
-        material.second.renderList.clear();
+        if (j - i >= MIN_INSTANCES_BATCH) {
+            mDrawCalls.push_back(DrawCall{ materialIdx, i, j - i, *numInstances });
+            *numInstances += j - i;
+        }
+        else {
+            for (uint32_t k = i; k < j; ++k) {
+                mSingleDraws.push_back(k);
+            }
+        }
+    }
+}
+
+void RenderSubmitter::clearDraws()
+{
+    mDrawCalls.clear();
+    mSortedDraws.clear();
+    mGatheredDraws.clear();
 
+    for (Bucket& bucket : mBuckets) {
+        bucket.draws.clear();
     }
+    mLockedBucket.draws.clear();
+}
 
+void RenderSubmitter::s_bindMeshBuffers(vk::CommandBuffer cmd, const DrawData& dd, BoundState* state, Stats* stats)
+{
+    if (dd.vertexBuffer != state->vertexBuffer) {
+        // bind to 0
+        const vk::DeviceSize offset = 0;
+        cmd.bindVertexBuffers(0, 1, &dd.vertexBuffer, &offset);
+        state->vertexBuffer = dd.vertexBuffer;
+        stats->numVertexBufferBinds += 1;
+    }
+    // The first index is in units of the index type, from offset 0
+    if (dd.indexBuffer != state->indexBuffer || dd.indexType != state->indexType) {
+        cmd.bindIndexBuffer(dd.indexBuffer, 0, dd.indexType);
+        state->indexBuffer = dd.indexBuffer;
+        state->indexType = dd.indexType;
+        stats->numIndexBufferBinds += 1;
+    }
 }
 
 }
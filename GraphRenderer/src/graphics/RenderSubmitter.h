@@ -1,8 +1,11 @@
 #pragma once
 
 #include <vulkan/vulkan.hpp>
-#include <unordered_map>
+#include <vector>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <glm/glm.hpp>
 
 #include "resources/Buffer.h"
 
@@ -16,28 +19,63 @@ class GlobalContext;
 namespace vkg
 {
 
+class RenderContext;
 
 class RenderSubmitter
 {
 public:
 
-	RenderSubmitter() = default;
+	RenderSubmitter();
 	RenderSubmitter(const RenderSubmitter& o);
 	RenderSubmitter(RenderSubmitter&&) = default;
 	RenderSubmitter& operator=(const RenderSubmitter& o);
 	RenderSubmitter& operator=(RenderSubmitter&& o) = default;
 
 
+	// Snapshot of an object for the frame, copied in the extraction. The recording
+	// reads nothing else of the object, so the logic of the next frame can change it
 	class DrawData {
 	public:
+		// Bound at offset 0, the mesh is located with the vertex offset and the first index
 		vk::Buffer vertexBuffer = nullptr;
-		vk::DeviceSize vertexBufferOffset = 0;
 		vk::Buffer indexBuffer = nullptr;
+		vk::IndexType indexType = vk::IndexType::eUint32;
+		int32_t vertexOffset = 0;
 		uint32_t numIndices = 0;
 		uint32_t firstIndex = 0;
+		// Shared by the objects of the frame, the dynamic offset selects the model matrix
 		vk::DescriptorSet objectDescriptorSet = nullptr;
+		uint32_t objectOffset = 0;
+		// Used instead of the object descriptor set when drawn instanced
+		glm::mat4 modelMatrix = glm::mat4(1.0f);
+		// Distance along the view direction, to sort front to back
+		float_t depth = 0.0f;
+		// Drawn with the packed material, see Mesh::addToVertexInputDescription
+		bool packedVertices = false;
 	};
 
+	struct Stats {
+		uint32_t numDrawData = 0;
+		uint32_t numDrawCalls = 0;
+		uint32_t numInstancedDrawCalls = 0;
+		uint32_t numInstances = 0;
+
+		// Pushes from threads without bucket, that had to lock
+		uint32_t numLockedPushes = 0;
+		uint32_t numContendedPushes = 0;
+
+		// State changes recorded
+		uint32_t numPipelineBinds = 0;
+		uint32_t numDescriptorSetBinds = 0;
+		uint32_t numVertexBufferBinds = 0;
+		uint32_t numIndexBufferBinds = 0;
+
+		// Secondary command buffers recorded, and time from the prepare to the end
+		uint32_t numCommandBuffers = 0;
+		double_t recordTime = 0.0;
+	};
+
+	// Thread safe. Each worker thread appends to its own bucket without locking
 	void pushPredefinedDraw(const DrawData& drawData);
 
 	void setDefaultMaterial(
@@ -50,11 +88,47 @@ public:
 		const vk::DescriptorSet descriptor
 	);
 
-	void flushDraws(vk::CommandBuffer cmd);
+	// Pipeline of the default material that reads the model matrix per instance,
+	// from the vertex binding INSTANCE_BINDING. Disabled if null.
+	void setInstancedPipeline(const vk::Pipeline pipeline);
+
+	// Material of the draws with packed vertices, with the same descriptor sets
+	// as the default one. The instanced pipeline can be null.
+	void setPackedMaterial(
+		const vk::Pipeline pipeline,
+		const vk::Pipeline instancedPipeline,
+		const vk::PipelineLayout pipLayout,
+		const vk::DescriptorSet descriptorSet
+	);
+	bool supportsPackedVertices() const;
+
+	// Sorts and batches the draws pushed in this frame, and splits them in
+	// up to maxRanges ranges. Returns the number of ranges to record.
+	uint32_t prepareDraws(const RenderContext& rc, uint32_t maxRanges);
+	// Thread safe for different ranges. Binds all the state it needs,
+	// so each range can go to its own secondary command buffer.
+	void recordDraws(vk::CommandBuffer cmd, uint32_t rangeIdx);
+	// After recording all the ranges
+	void endDraws();
+
+	const Stats& getStats() const { return mStats; }
+
+	void destroy(const RenderContext& rc);
+
+	static constexpr uint32_t INSTANCE_BINDING = 1;
+	// Draws of the same mesh range are batched from this number of copies
+	static constexpr uint32_t MIN_INSTANCES_BATCH = 2;
+	// Ranges with less draw calls are not worth a command buffer
+	static constexpr uint32_t MIN_DRAW_CALLS_RANGE = 512;
 
 private:
 
-	typedef std::vector<DrawData> RenderList;
+	// Sort key, from the most to the least significant bits:
+	//  - 8 bits: material (pipeline and material descriptor set)
+	//  - 16 bits: hash of the vertex and index buffers
+	//  - 16 bits: hash of the LOD range inside the buffers
+	//  - 24 bits: depth, front to back
+	static constexpr uint32_t MAX_MATERIALS = 256;
 
 	struct MaterialKey {
 		vk::Pipeline pipeline;
@@ -63,28 +137,83 @@ private:
 		bool operator==(const MaterialKey& o) const;
 
 	};
-	struct HashMaterial { 
-		std::size_t operator()(const MaterialKey& b) const {
-			return std::hash<vk::Pipeline>{}(b.pipeline) ^
-				std::hash<vk::DescriptorSet>{}(b.materialDescriptorSet);
-		}
-	};
 	struct Material {
+		MaterialKey key;
 		vk::PipelineLayout pipelineLayout;
-		RenderList renderList;
+		// Batches the draws of the same mesh range if not null
+		vk::Pipeline instancedPipeline;
 	};
 
-	typedef std::unordered_map<MaterialKey, Material, HashMaterial> MaterialRenderList;
-
-	std::mutex mMutex;
+	struct KeyedDraw {
+		uint64_t key;
+		DrawData draw;
+	};
 
-	MaterialRenderList mMaterialRenderList;
+	// Aligned to avoid false sharing between threads
+	struct alignas(64) Bucket {
+		std::vector<KeyedDraw> draws;
+	};
 
-	MaterialKey mDefaultMaterial;
+	std::vector<Material> mMaterials;
+	uint32_t mDefaultMaterial = 0;
+	uint32_t mPackedMaterial = MAX_MATERIALS;
+
+	// One bucket per job system thread
+	std::vector<Bucket> mBuckets;
+	// Used by threads outside the job system
+	Bucket mLockedBucket;
+	std::mutex mLockedBucketMutex;
+	std::atomic<uint32_t> mNumLockedPushes{ 0 };
+	std::atomic<uint32_t> mNumContendedPushes{ 0 };
+
+	// Sort buffers, kept between frames
+	std::vector<std::pair<uint64_t, uint32_t>> mSortKeys, mSortKeysTmp;
+	std::vector<const DrawData*> mGatheredDraws, mSortedDraws;
+	std::vector<uint32_t> mSingleDraws;
+
+	// Draw calls to record, in order
+	struct DrawCall {
+		uint32_t materialIdx;
+		// Index in mSortedDraws
+		uint32_t firstDraw;
+		// 0 if it is not instanced
+		uint32_t numInstances;
+		uint32_t firstInstance;
+	};
+	std::vector<DrawCall> mDrawCalls;
+	std::vector<Stats> mRangeStats;
+	std::chrono::high_resolution_clock::time_point mPrepareTime;
 
 	vk::DescriptorSet mSceneDescriptorSet;
+
+	// Model matrices of this frame, grows when needed
+	Buffer mInstanceBuffer;
+	glm::mat4* mInstanceBufferPtr = nullptr;
+	uint32_t mInstanceCapacity = 0;
+
+	Stats mStats;
+
+	// Bound state while recording, to skip redundant binds
+	struct BoundState {
+		uint32_t materialIdx = MAX_MATERIALS;
+		vk::Pipeline pipeline;
+		bool instanceBufferBound = false;
+		vk::Buffer vertexBuffer;
+		vk::Buffer indexBuffer;
+		vk::IndexType indexType = vk::IndexType::eUint32;
+		vk::DescriptorSet objectDescriptorSet;
+		uint32_t objectOffset = 0;
+	};
+
+	static uint64_t s_computeSortKey(uint32_t materialIdx, const DrawData& drawData);
+	void sortDraws();
+
+	void reserveInstances(const RenderContext& rc, uint32_t numInstances);
+	// Appends the batches of [begin, end) to mDrawCalls, and the rest to mSingleDraws
+	void batchInstancedDraws(uint32_t materialIdx, uint32_t begin, uint32_t end, uint32_t* numInstances);
+	void clearDraws();
+	static void s_bindMeshBuffers(vk::CommandBuffer cmd, const DrawData& dd, BoundState* state, Stats* stats);
 };
 
 }
 }
-
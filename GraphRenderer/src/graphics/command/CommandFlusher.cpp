@@ -23,11 +23,11 @@ uint32_t CommandFlusher::createNewBlock(Type type)
 	}
 	return idx;
 }
-void CommandFlusher::flush(vk::Fence graphicsSignalFence)
+void CommandFlusher::flush(vk::Fence graphicsSignalFence, FrameArena* arena)
 {
 	
-	std::vector<vk::SubmitInfo> submits;
-	std::vector<vk::TimelineSemaphoreSubmitInfo> semaphoreInfo;
+	FrameVector<vk::SubmitInfo> submits(arena);
+	FrameVector<vk::TimelineSemaphoreSubmitInfo> semaphoreInfo(arena);
 
 	submits.reserve(std::max(mTransferBlocks.size(), mGraphicsBlocks.size()));
 	semaphoreInfo.reserve(std::max(mTransferBlocks.size(), mGraphicsBlocks.size()));
@@ -52,7 +52,7 @@ void CommandFlusher::flush(vk::Fence graphicsSignalFence)
 	}
 
 
-	mTransferQueue.submit(submits, nullptr);
+	mTransferQueue.submit(vk::ArrayProxy<const vk::SubmitInfo>(static_cast<uint32_t>(submits.size()), submits.data()), nullptr);
 
 	submits.clear();
 	semaphoreInfo.clear();
@@ -75,7 +75,7 @@ void CommandFlusher::flush(vk::Fence graphicsSignalFence)
 		submits.back().setPNext(&semaphoreInfo.back());
 	}
 
-	mGraphicsQueue.submit(submits, graphicsSignalFence);
+	mGraphicsQueue.submit(vk::ArrayProxy<const vk::SubmitInfo>(static_cast<uint32_t>(submits.size()), submits.data()), graphicsSignalFence);
 
 	for (FlushBlock& blk : mTransferBlocks) {
 		blk.clear();
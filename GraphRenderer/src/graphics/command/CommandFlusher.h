@@ -2,6 +2,8 @@
 
 #include <vulkan/vulkan.hpp>
 
+#include "../../utils/FrameArena.h"
+
 namespace gr
 {
 
@@ -21,7 +23,8 @@ public:
 
 	uint32_t createNewBlock(Type type);
 
-	void flush(vk::Fence graphicsSignalFence = nullptr);
+	// The submit infos are built in the arena, if any
+	void flush(vk::Fence graphicsSignalFence = nullptr, FrameArena* arena = nullptr);
 
 	void pushGraphicsCB(const uint32_t block, const vk::CommandBuffer cmd) { pushCB(Type::eGRAPHICS, block, cmd); }
 	void pushTransferCB(const uint32_t block, const vk::CommandBuffer cmd) { pushCB(Type::eTRANSFER, block, cmd); }
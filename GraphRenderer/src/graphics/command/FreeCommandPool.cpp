@@ -41,6 +41,7 @@ std::vector<FreeCommandPool::FreeCommandBuffer> gr::vkg::FreeCommandPool::newCom
 	assert(num != 0);
 
 	const uint32_t poolIdx = grjob::getThreadId();
+	releasePendingFrees(poolIdx);
 
 	vk::CommandBufferAllocateInfo info = vk::CommandBufferAllocateInfo(
 		mCommandSpace[poolIdx].pool,
@@ -61,6 +62,7 @@ std::vector<FreeCommandPool::FreeCommandBuffer> gr::vkg::FreeCommandPool::newCom
 FreeCommandPool::FreeCommandBuffer FreeCommandPool::newCommandBuffer()
 {
 	const uint32_t poolIdx = grjob::getThreadId();
+	releasePendingFrees(poolIdx);
 
 	vk::CommandBufferAllocateInfo info = vk::CommandBufferAllocateInfo(
 		mCommandSpace[poolIdx].pool,
@@ -79,33 +81,39 @@ FreeCommandPool::FreeCommandBuffer FreeCommandPool::newCommandBuffer()
 }
 
 
-void FreeCommandPool::flushFrees()
-{
-	for (CommandPoolSpace& poolS : mCommandSpace) {
-		if (!poolS.toFree.empty()) {
-			mDevice.freeCommandBuffers(poolS.pool, poolS.toFree);
-			poolS.toFree.clear();
-		}
-	}
-}
-
 void FreeCommandPool::freeCommandBuffer(const FreeCommandBuffer& command)
 {
-	mFreeMutex.lock();
-	mCommandSpace[command.id].toFree.push_back(command.buffer);
-	mFreeMutex.unlock();
+	freeOnThread(command);
 }
 
 void FreeCommandPool::freeCommandBuffers(const std::vector<FreeCommandBuffer>& commands)
 {
-	mFreeMutex.lock();
-
 	for (const FreeCommandBuffer& command : commands) {
-		mCommandSpace[command.id].toFree.push_back(command.buffer);
+		freeOnThread(command);
 	}
+}
 
-	mFreeMutex.unlock();
+void FreeCommandPool::freeOnThread(const FreeCommandBuffer& command)
+{
+	if (command.id == grjob::getThreadId()) {
+		mDevice.freeCommandBuffers(mCommandSpace[command.id].pool, 1, &command.buffer);
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mFreeMutex);
+	mCommandSpace[command.id].pendingFrees.push_back(command.buffer);
+}
 
+void FreeCommandPool::releasePendingFrees(uint32_t poolIdx)
+{
+	std::vector<vk::CommandBuffer> buffers;
+	{
+		std::lock_guard<std::mutex> lock(mFreeMutex);
+		buffers.swap(mCommandSpace[poolIdx].pendingFrees);
+	}
+	if (!buffers.empty()) {
+		mDevice.freeCommandBuffers(mCommandSpace[poolIdx].pool, buffers);
+	}
 }
 
 
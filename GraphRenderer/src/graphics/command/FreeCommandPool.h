@@ -2,6 +2,7 @@
 
 #include <vulkan/vulkan.hpp>
 #include <mutex>
+#include <vector>
 
 namespace gr
 {
@@ -34,11 +35,12 @@ public:
 
 	FreeCommandBuffer newCommandBuffer();
 
+	// Once the GPU is done with them, schedule them in the DeferredDestroyer.
+	// Only the thread of the pool touches it, so the buffers of other threads
+	// are freed by their thread on its next allocation
 	void freeCommandBuffers(const std::vector<FreeCommandBuffer>& commands);
 	void freeCommandBuffer(const FreeCommandBuffer& command);
 
-	void flushFrees();
-
 	void destroy();
 
 	explicit operator vk::CommandPool() const;
@@ -49,11 +51,16 @@ protected:
 
 	struct CommandPoolSpace {
 		vk::CommandPool pool;
-		std::vector<vk::CommandBuffer> toFree;
+		// Freed from other threads, with mFreeMutex
+		std::vector<vk::CommandBuffer> pendingFrees;
 	};
 
 	std::mutex mFreeMutex;
 
+	void freeOnThread(const FreeCommandBuffer& command);
+	// From the thread of the pool
+	void releasePendingFrees(uint32_t poolIdx);
+
 	std::vector<CommandPoolSpace> mCommandSpace;
 	vk::Device mDevice;
 	vk::Queue mQueue;
@@ -0,0 +1,414 @@
+#include "BufferReadback.h"
+
+#include "../RenderContext.h"
+#include "../../utils/grjob.h"
+
+#include <array>
+
+namespace gr
+{
+namespace vkg
+{
+
+void BufferReadback::initialize(const RenderContext& rc)
+{
+	assert(!mSemaphore);
+	mSemaphore = rc.createTimelineSemaphore(0);
+	mValue = 0;
+}
+
+bool BufferReadback::readBuffer(
+	const RenderContext& rc,
+	const Buffer& srcBuffer,
+	vk::DeviceSize srcOffset,
+	vk::DeviceSize numBytes,
+	Callback callback)
+{
+	if (numBytes == 0 || srcOffset + numBytes > srcBuffer.getSize()) {
+		throw std::runtime_error("Error: Readback out of the buffer");
+	}
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	Slot* slot = claimSlot(rc, numBytes);
+	if (slot == nullptr) {
+		return false;
+	}
+
+	slot->srcBuffer = srcBuffer.getVkBuffer();
+	slot->srcOffset = srcOffset;
+	slot->srcImage = nullptr;
+	slot->result = Result();
+	slot->result.data = slot->ptr;
+	slot->result.numBytes = numBytes;
+	slot->callback = std::move(callback);
+	slot->requestTime = std::chrono::high_resolution_clock::now();
+	slot->state = SlotState::eRequested;
+	return true;
+}
+
+bool BufferReadback::readImage(
+	const RenderContext& rc,
+	vk::Image srcImage,
+	const vk::Extent2D& extent,
+	vk::Format format,
+	vk::ImageLayout srcLayout,
+	vk::ImageLayout dstLayout,
+	Callback callback)
+{
+	const uint32_t texelSize = s_getTexelSize(format);
+	if (texelSize == 0) {
+		throw std::runtime_error("Error: Readback of an unsupported format");
+	}
+	const vk::DeviceSize numBytes =
+		static_cast<vk::DeviceSize>(extent.width) * extent.height * texelSize;
+	if (numBytes == 0) {
+		throw std::runtime_error("Error: Readback of an empty image");
+	}
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	Slot* slot = claimSlot(rc, numBytes);
+	if (slot == nullptr) {
+		return false;
+	}
+
+	slot->srcBuffer = nullptr;
+	slot->srcImage = srcImage;
+	slot->srcLayout = srcLayout;
+	slot->dstLayout = dstLayout;
+	slot->result = Result();
+	slot->result.data = slot->ptr;
+	slot->result.numBytes = numBytes;
+	slot->result.extent = extent;
+	slot->result.format = format;
+	slot->callback = std::move(callback);
+	slot->requestTime = std::chrono::high_resolution_clock::now();
+	slot->state = SlotState::eRequested;
+	return true;
+}
+
+bool BufferReadback::flush(RenderContext* rc,
+	vk::Semaphore waitSemaphore,
+	uint64_t waitValue,
+	vk::Semaphore signalSemaphore,
+	FrameArena* arena)
+{
+	FrameVector<Slot*> slots(arena);
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		for (Slot& slot : mSlots) {
+			if (slot.state == SlotState::eRequested) {
+				slot.state = SlotState::eInFlight;
+				slot.value = mValue + 1;
+				slots.push_back(&slot);
+			}
+		}
+	}
+	// The binary semaphore is signaled even without copies, someone waits for it
+	if (slots.empty() && !signalSemaphore) {
+		return false;
+	}
+
+	mValue += 1;
+
+	FreeCommandPool::FreeCommandBuffer command = rc->getGraphicsFreeCommandPool()->newCommandBuffer();
+	vk::CommandBuffer cmd = command;
+	cmd.begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
+
+	FrameVector<vk::ImageMemoryBarrier> imageBarriers(arena);
+	for (const Slot* slot : slots) {
+		if (slot->srcImage && slot->srcLayout != vk::ImageLayout::eTransferSrcOptimal) {
+			imageBarriers.push_back(vk::ImageMemoryBarrier(
+				vk::AccessFlags{},						// src AccessMask
+				vk::AccessFlagBits::eTransferRead,		// dst AccessMask
+				slot->srcLayout,						// old layout
+				vk::ImageLayout::eTransferSrcOptimal,	// new layout
+				VK_QUEUE_FAMILY_IGNORED,				// src queue family
+				VK_QUEUE_FAMILY_IGNORED,				// dst queue family
+				slot->srcImage,							// image
+				vk::ImageSubresourceRange(s_getAspect(slot->result.format), 0, 1, 0, 1)
+			));
+		}
+	}
+	if (!imageBarriers.empty()) {
+		// The semaphore wait already orders the previous writes
+		cmd.pipelineBarrier(
+			vk::PipelineStageFlagBits::eTopOfPipe,	// src stage mask
+			vk::PipelineStageFlagBits::eTransfer,	// dst stage mask
+			vk::DependencyFlagBits{},
+			0, nullptr, 0, nullptr,					// memory and buffer barriers
+			static_cast<uint32_t>(imageBarriers.size()), imageBarriers.data());
+	}
+
+	for (const Slot* slot : slots) {
+		if (slot->srcImage) {
+			const vk::BufferImageCopy region(
+				0, 0, 0,	// offset, tightly packed rows and layers
+				vk::ImageSubresourceLayers(s_getAspect(slot->result.format), 0, 0, 1),
+				vk::Offset3D(0),
+				vk::Extent3D(slot->result.extent, 1));
+			cmd.copyImageToBuffer(slot->srcImage, vk::ImageLayout::eTransferSrcOptimal,
+				slot->buffer.getVkBuffer(), 1, &region);
+		}
+		else {
+			const vk::BufferCopy region(slot->srcOffset, 0, slot->result.numBytes);
+			cmd.copyBuffer(slot->srcBuffer, slot->buffer.getVkBuffer(), 1, &region);
+		}
+	}
+
+	// Leave the images as requested, and make the copies visible to the host
+	imageBarriers.clear();
+	for (const Slot* slot : slots) {
+		if (slot->srcImage && slot->dstLayout != vk::ImageLayout::eTransferSrcOptimal) {
+			imageBarriers.push_back(vk::ImageMemoryBarrier(
+				vk::AccessFlagBits::eTransferRead,		// src AccessMask
+				vk::AccessFlags{},						// dst AccessMask
+				vk::ImageLayout::eTransferSrcOptimal,	// old layout
+				slot->dstLayout,						// new layout
+				VK_QUEUE_FAMILY_IGNORED,				// src queue family
+				VK_QUEUE_FAMILY_IGNORED,				// dst queue family
+				slot->srcImage,							// image
+				vk::ImageSubresourceRange(s_getAspect(slot->result.format), 0, 1, 0, 1)
+			));
+		}
+	}
+	FrameVector<vk::BufferMemoryBarrier> bufferBarriers(arena);
+	for (const Slot* slot : slots) {
+		bufferBarriers.push_back(vk::BufferMemoryBarrier(
+			vk::AccessFlagBits::eTransferWrite,	// src AccessMask
+			vk::AccessFlagBits::eHostRead,		// dst AccessMask
+			VK_QUEUE_FAMILY_IGNORED,			// src queue family
+			VK_QUEUE_FAMILY_IGNORED,			// dst queue family
+			slot->buffer.getVkBuffer(),			// buffer
+			0, VK_WHOLE_SIZE					// offset and size
+		));
+	}
+	if (!slots.empty()) {
+		cmd.pipelineBarrier(
+			vk::PipelineStageFlagBits::eTransfer,	// src stage mask
+			vk::PipelineStageFlagBits::eHost | vk::PipelineStageFlagBits::eBottomOfPipe, // dst stage mask
+			vk::DependencyFlagBits{},
+			0, nullptr,								// memory barriers
+			static_cast<uint32_t>(bufferBarriers.size()), bufferBarriers.data(),
+			static_cast<uint32_t>(imageBarriers.size()), imageBarriers.data());
+	}
+
+	cmd.end();
+
+	std::array<vk::Semaphore, 2> signalSemaphores = { mSemaphore, signalSemaphore };
+	std::array<uint64_t, 2> signalValues = { mValue, 0 };
+	const uint32_t numSignals = signalSemaphore ? 2 : 1;
+	const vk::PipelineStageFlags waitStage = vk::PipelineStageFlagBits::eTransfer;
+	const uint32_t numWaits = waitSemaphore ? 1 : 0;
+
+	vk::TimelineSemaphoreSubmitInfo semaphoreInfo(
+		numWaits, &waitValue,						// wait values
+		numSignals, signalValues.data()				// signal values
+	);
+	vk::SubmitInfo submitInfo(
+		numWaits, &waitSemaphore, &waitStage,		// wait semaphores
+		1, &cmd,									// command buffers
+		numSignals, signalSemaphores.data()			// signal semaphores
+	);
+	submitInfo.setPNext(&semaphoreInfo);
+	rc->getGraphicsQueue().submit(submitInfo, nullptr);
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	mBatches.push_back({ command, mValue });
+	return true;
+}
+
+void BufferReadback::update(RenderContext* rc)
+{
+	if (!mSemaphore) {
+		return;
+	}
+	const uint64_t completed = rc->getDevice().getSemaphoreCounterValue(mSemaphore);
+
+	std::vector<VmaAllocation> toInvalidate;
+	std::vector<grjob::Counter*> toFree;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		while (!mBatches.empty() && mBatches.front().value <= completed) {
+			// Already executed
+			rc->getDeferredDestroyer().pushCommandBuffer(rc->getGraphicsFreeCommandPool(), mBatches.front().cmd, 0);
+			mBatches.pop_front();
+		}
+
+		for (Slot& slot : mSlots) {
+			if (slot.state == SlotState::eInFlight && slot.value <= completed) {
+				toInvalidate.push_back(slot.buffer.getAllocation());
+			}
+			else if (slot.state == SlotState::eDelivering && slot.delivered.load(std::memory_order_acquire)) {
+				toFree.push_back(slot.counter);
+				slot.counter = nullptr;
+				slot.state = SlotState::eFree;
+			}
+		}
+	}
+	// Without the lock, the workers take it when they finish
+	for (grjob::Counter* counter : toFree) {
+		grjob::waitForCounterAndFree(counter, 0);
+	}
+	if (toInvalidate.empty()) {
+		return;
+	}
+
+	// In case the memory is not coherent
+	rc->invalidateAllocations(toInvalidate.data(), static_cast<uint32_t>(toInvalidate.size()));
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	for (Slot& slot : mSlots) {
+		if (slot.state == SlotState::eInFlight && slot.value <= completed) {
+			slot.state = SlotState::eDelivering;
+			slot.delivered.store(false);
+			grjob::runJob(grjob::Priority::eLow,
+				grjob::Job(&BufferReadback::deliver, this, &slot),
+				&slot.counter);
+		}
+	}
+}
+
+BufferReadback::Stats BufferReadback::getStats() const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	Stats stats;
+	stats.numSlots = static_cast<uint32_t>(mSlots.size());
+	for (const Slot& slot : mSlots) {
+		if (slot.state != SlotState::eFree) {
+			stats.numPending += 1;
+		}
+		stats.ringBytes += slot.capacity;
+	}
+	stats.numDelivered = mNumDelivered;
+	stats.numRejected = mNumRejected;
+	stats.bytesRead = mBytesRead;
+	stats.lastLatency = mLastLatency;
+	return stats;
+}
+
+uint32_t BufferReadback::s_getTexelSize(vk::Format format)
+{
+	switch (format)
+	{
+	case vk::Format::eR8G8B8A8Unorm:
+	case vk::Format::eR8G8B8A8Srgb:
+	case vk::Format::eB8G8R8A8Unorm:
+	case vk::Format::eB8G8R8A8Srgb:
+	case vk::Format::eR32Sfloat:
+	case vk::Format::eR32Uint:
+	case vk::Format::eD32Sfloat:
+		return 4;
+	case vk::Format::eR8Unorm:
+		return 1;
+	case vk::Format::eD16Unorm:
+		return 2;
+	case vk::Format::eR16G16B16A16Sfloat:
+		return 8;
+	case vk::Format::eR32G32B32A32Sfloat:
+		return 16;
+	default:
+		return 0;
+	}
+}
+
+void BufferReadback::destroy(RenderContext* rc)
+{
+	std::vector<grjob::Counter*> counters;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		for (Slot& slot : mSlots) {
+			if (slot.counter) {
+				counters.push_back(slot.counter);
+				slot.counter = nullptr;
+			}
+		}
+	}
+	for (grjob::Counter* counter : counters) {
+		grjob::waitForCounterAndFree(counter, 0);
+	}
+
+	for (Slot& slot : mSlots) {
+		if (slot.buffer.getVkBuffer()) {
+			rc->unmapAllocatable(slot.buffer);
+			rc->destroy(slot.buffer);
+		}
+	}
+	mSlots.clear();
+
+	for (Batch& batch : mBatches) {
+		rc->getGraphicsFreeCommandPool()->freeCommandBuffer(batch.cmd);
+	}
+	mBatches.clear();
+
+	if (mSemaphore) {
+		rc->destroy(mSemaphore);
+		mSemaphore = nullptr;
+	}
+}
+
+BufferReadback::Slot* BufferReadback::claimSlot(const RenderContext& rc, vk::DeviceSize numBytes)
+{
+	// The smallest free slot that fits, or else any free one to grow
+	Slot* best = nullptr;
+	Slot* anyFree = nullptr;
+	for (Slot& slot : mSlots) {
+		if (slot.state != SlotState::eFree) {
+			continue;
+		}
+		anyFree = &slot;
+		if (slot.capacity >= numBytes && (best == nullptr || slot.capacity < best->capacity)) {
+			best = &slot;
+		}
+	}
+
+	if (best == nullptr) {
+		if (anyFree == nullptr && mSlots.size() < MAX_SLOTS) {
+			anyFree = &mSlots.emplace_back();
+		}
+		if (anyFree == nullptr) {
+			mNumRejected += 1;
+			return nullptr;
+		}
+
+		// Free, so the GPU is done with its buffer
+		best = anyFree;
+		if (best->buffer.getVkBuffer()) {
+			rc.unmapAllocatable(best->buffer);
+			rc.destroy(best->buffer);
+		}
+		best->capacity = (numBytes + SLOT_GRANULARITY - 1) & ~(SLOT_GRANULARITY - 1);
+		best->buffer = rc.createReadbackBuffer(best->capacity);
+		rc.mapAllocatable(best->buffer, reinterpret_cast<void**>(&best->ptr));
+	}
+
+	return best;
+}
+
+void BufferReadback::deliver(Slot* slot)
+{
+	typedef std::chrono::duration<double_t> Fsec;
+	const Fsec latency = std::chrono::high_resolution_clock::now() - slot->requestTime;
+	slot->result.latency = latency.count();
+
+	slot->callback(slot->result);
+	slot->callback = nullptr;
+
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mNumDelivered += 1;
+		mBytesRead += slot->result.numBytes;
+		mLastLatency = slot->result.latency;
+	}
+	slot->delivered.store(true, std::memory_order_release);
+}
+
+vk::ImageAspectFlags BufferReadback::s_getAspect(vk::Format format)
+{
+	if (format == vk::Format::eD32Sfloat || format == vk::Format::eD16Unorm) {
+		return vk::ImageAspectFlagBits::eDepth;
+	}
+	return vk::ImageAspectFlagBits::eColor;
+}
+
+} // namespace vkg
+} // namespace gr
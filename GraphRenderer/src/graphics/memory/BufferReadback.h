@@ -0,0 +1,173 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+#include "../command/FreeCommandPool.h"
+#include "../resources/Buffer.h"
+#include "../../utils/FrameArena.h"
+
+namespace gr
+{
+namespace grjob
+{
+class Counter;
+}
+
+namespace vkg
+{
+
+class RenderContext;
+
+// Copies buffers and images back to the host without stalling the frame.
+// The copies go to a ring of host visible buffers, are submitted on the
+// graphics queue after the frame that wrote the data, and complete on a
+// timeline semaphore. The resources are exclusive to the graphics family,
+// so copying there needs no ownership transfer. The results are delivered to a callback in a worker,
+// some frames later.
+class BufferReadback
+{
+public:
+
+	BufferReadback() = default;
+	BufferReadback(const BufferReadback&) = delete;
+	BufferReadback& operator=(const BufferReadback&) = delete;
+
+	void initialize(const RenderContext& rc);
+
+	// Valid only during the callback
+	struct Result {
+		const uint8_t* data = nullptr;
+		vk::DeviceSize numBytes = 0;
+		// Only for images, the rows are tightly packed
+		vk::Extent2D extent;
+		vk::Format format = vk::Format::eUndefined;
+		// Seconds from the request to the delivery
+		double_t latency = 0.0;
+	};
+	typedef std::function<void(const Result&)> Callback;
+
+	// Thread safe. The buffer needs the TransferSrc usage. Returns false if all
+	// the slots of the ring are busy, then try again in a later frame
+	bool readBuffer(
+		const RenderContext& rc,
+		const Buffer& srcBuffer,
+		vk::DeviceSize srcOffset,
+		vk::DeviceSize numBytes,
+		Callback callback);
+
+	// Thread safe. Copies the first mip of a color or depth image, that is in srcLayout
+	// when the copy starts, and is left in dstLayout. The image needs the TransferSrc usage
+	bool readImage(
+		const RenderContext& rc,
+		vk::Image srcImage,
+		const vk::Extent2D& extent,
+		vk::Format format,
+		vk::ImageLayout srcLayout,
+		vk::ImageLayout dstLayout,
+		Callback callback);
+
+	// Records the requested copies in one submission to the graphics queue, after
+	// waitValue of waitSemaphore, the value signaled by the writes to read.
+	// Call after the submission that signals it, a wait before the signal on the same
+	// queue would never end. The binary signalSemaphore, if any, is signaled with them
+	bool flush(RenderContext* rc,
+		vk::Semaphore waitSemaphore,
+		uint64_t waitValue,
+		vk::Semaphore signalSemaphore = nullptr,
+		FrameArena* arena = nullptr);
+
+	// Once per frame. Sends the finished copies to the workers, and
+	// reclaims the slots of the delivered ones
+	void update(RenderContext* rc);
+
+	struct Stats {
+		uint32_t numSlots = 0;
+		// Requested, and not delivered yet
+		uint32_t numPending = 0;
+		uint64_t numDelivered = 0;
+		// Requests refused because the ring was busy
+		uint64_t numRejected = 0;
+		vk::DeviceSize ringBytes = 0;
+		uint64_t bytesRead = 0;
+		double_t lastLatency = 0.0;
+	};
+	Stats getStats() const;
+
+	// Bytes of one texel, or 0 if readImage does not support the format
+	static uint32_t s_getTexelSize(vk::Format format);
+
+	// With the device idle. The readbacks that were not delivered are dropped
+	void destroy(RenderContext* rc);
+
+	static constexpr uint32_t MAX_SLOTS = 8;
+	// Slots are rounded up to it, so a few sizes share them
+	static constexpr vk::DeviceSize SLOT_GRANULARITY = 1 << 20;
+
+private:
+
+	enum class SlotState {
+		eFree,
+		// Requested, waiting for the flush
+		eRequested,
+		// Submitted, waiting for the GPU
+		eInFlight,
+		// Its callback runs in a worker
+		eDelivering
+	};
+
+	struct Slot {
+		Buffer buffer;
+		uint8_t* ptr = nullptr;
+		vk::DeviceSize capacity = 0;
+		SlotState state = SlotState::eFree;
+
+		// The request
+		vk::Buffer srcBuffer;
+		vk::DeviceSize srcOffset = 0;
+		vk::Image srcImage;
+		vk::ImageLayout srcLayout = vk::ImageLayout::eUndefined;
+		vk::ImageLayout dstLayout = vk::ImageLayout::eUndefined;
+		Result result;
+		Callback callback;
+		std::chrono::high_resolution_clock::time_point requestTime;
+
+		// Value of the semaphore once copied
+		uint64_t value = 0;
+		grjob::Counter* counter = nullptr;
+		// Set by the worker when the callback returns
+		std::atomic<bool> delivered = false;
+	};
+
+	struct Batch {
+		FreeCommandPool::FreeCommandBuffer cmd;
+		uint64_t value = 0;
+	};
+
+	vk::Semaphore mSemaphore;
+	uint64_t mValue = 0;
+
+	// Addresses are stable, the workers keep a pointer to their slot
+	std::deque<Slot> mSlots;
+	std::deque<Batch> mBatches;
+	mutable std::mutex mMutex;
+
+	uint64_t mNumDelivered = 0;
+	uint64_t mNumRejected = 0;
+	uint64_t mBytesRead = 0;
+	double_t mLastLatency = 0.0;
+
+	// Takes a free slot with room for numBytes, growing the ring if needed. Under mMutex
+	Slot* claimSlot(const RenderContext& rc, vk::DeviceSize numBytes);
+
+	void deliver(Slot* slot);
+
+	static vk::ImageAspectFlags s_getAspect(vk::Format format);
+};
+
+} // namespace vkg
+} // namespace gr
@@ -2,78 +2,186 @@
 
 #include "../RenderContext.h"
 
+#include <algorithm>
+#include <chrono>
+#include <numeric>
+
 namespace gr
 {
 namespace vkg
 {
-BufferTransferer::BufferTransferer(const vk::DeviceSize minSize) :
-	mMinSize(minSize) 
+BufferTransferer::BufferTransferer(const vk::DeviceSize ringSize) :
+	mRingSize(ringSize),
+	mMaxChunkSize(ringSize / 4)
 {
+	assert(ringSize % STAGING_ALIGNMENT == 0);
 }
 
 void BufferTransferer::setUpTransferBlocks(RenderContext* rc)
 {
 	mGraphicsBlock = rc->getCommandFlusher()->createNewBlock(CommandFlusher::Type::eGRAPHICS);
 	mTransferBlock = rc->getCommandFlusher()->createNewBlock(CommandFlusher::Type::eTRANSFER);
-	mCurrentSpace = findOrCreateTransferSpace(*rc);
+	mRing.create(*rc, mRingSize);
+	mCurrentSpace.store(findOrCreateTransferSpace(*rc));
+	mFlushThread = std::this_thread::get_id();
 }
 
 void BufferTransferer::updateAndFlushTransfers(
 	RenderContext* rc,
 	vk::Semaphore* outSemaphore,
-	uint64_t* outValue)
+	uint64_t* outValue,
+	FrameArena* arena)
 {
 	assert((outSemaphore == nullptr) == (outValue == nullptr));
+	assert(std::this_thread::get_id() == mFlushThread);
+
+	// Close the current space, new transfers go to the next one
+	TransferSpace& ts = *mCurrentSpace.load();
+	TransferSpace* nextSpace = findOrCreateTransferSpace(*rc);
+	{
+		// In flight before it stops being current, so its floor keeps holding the ring
+		std::lock_guard<std::mutex> lock(mReclaimMutex);
+		ts.inFlight = true;
+		ts.stagingValue = std::numeric_limits<uint64_t>::max();
+		mInFlightSpaces.push_back(&ts);
+		mCurrentSpace.store(nextSpace);
+	}
+	// Callers that entered before may still be copying
+	while (ts.numWriters.load() != 0) {
+		std::this_thread::yield();
+	}
 
-	TransferSpace& ts = mTransferSpaces[mCurrentSpace];
+	if (!ts.empty()) {
+		typedef std::chrono::duration<double_t> Fsec;
+		const auto recordStart = std::chrono::high_resolution_clock::now();
+		uint32_t numCopyCommands = 0;
+		uint32_t numRegions = 0;
 
-	if (!ts.bufferTransferOps.empty() ||
-		!ts.imageTransfersFragmentOps.empty()) {
 		ts.value += 1;
 
 		ts.transferCmd = rc->getTransferFreeCommandPool()->newCommandBuffer();
 		vk::CommandBuffer transferCmd = ts.transferCmd;
 		transferCmd.begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
 
-		// buffer transferences
-		vk::BufferCopy cpyInfo;
-		for (const TransferOp& op : ts.bufferTransferOps) {
-			cpyInfo.setSrcOffset(op.srcOffset)
-				.setDstOffset(op.dstOffset)
-				.setSize(op.bytes);
+		// buffer transferences, one copy per staging and destination buffer
+		if (!ts.bufferTransferOps.empty()) {
+			const std::vector<TransferOp>& ops = ts.bufferTransferOps;
+			FrameVector<uint32_t> order(ops.size(), 0, arena);
+			std::iota(order.begin(), order.end(), 0);
+			std::sort(order.begin(), order.end(), [&ops](uint32_t a, uint32_t b) {
+				const TransferOp& opA = ops[a];
+				const TransferOp& opB = ops[b];
+				if (opA.srcBuffer != opB.srcBuffer) {
+					return opA.srcBuffer < opB.srcBuffer;
+				}
+				if (opA.dstBuffer != opB.dstBuffer) {
+					return opA.dstBuffer < opB.dstBuffer;
+				}
+				if (opA.dstOffset != opB.dstOffset) {
+					return opA.dstOffset < opB.dstOffset;
+				}
+				return a < b;
+			});
+
+			FrameVector<vk::BufferCopy> regions(arena);
+			for (size_t begin = 0; begin < order.size();) {
+				const TransferOp& first = ops[order[begin]];
+				size_t end = begin + 1;
+				bool overlap = false;
+				vk::DeviceSize dstEnd = first.dstOffset + first.bytes;
+				while (end < order.size() &&
+					ops[order[end]].srcBuffer == first.srcBuffer &&
+					ops[order[end]].dstBuffer == first.dstBuffer) {
+					const TransferOp& op = ops[order[end]];
+					overlap = overlap || op.dstOffset < dstEnd;
+					dstEnd = std::max(dstEnd, op.dstOffset + op.bytes);
+					++end;
+				}
 
-			transferCmd.copyBuffer(mStagingBuffers[op.stageBuffIdx].buffer.getVkBuffer(),
-				op.dstBuffer, 1, &cpyInfo);
+				if (overlap) {
+					// Regions of a copy can not overlap. Keep the requested order
+					// so the last write wins, as it did with one copy per transfer
+					std::sort(order.begin() + begin, order.begin() + end);
+					for (size_t i = begin; i < end; ++i) {
+						const TransferOp& op = ops[order[i]];
+						const vk::BufferCopy cpyInfo(op.srcOffset, op.dstOffset, op.bytes);
+						transferCmd.copyBuffer(op.srcBuffer, op.dstBuffer, 1, &cpyInfo);
+					}
+					numCopyCommands += static_cast<uint32_t>(end - begin);
+					numRegions += static_cast<uint32_t>(end - begin);
+				}
+				else {
+					// Merge the chunks of an upload, and uploads that are contiguous in both buffers
+					regions.clear();
+					for (size_t i = begin; i < end; ++i) {
+						const TransferOp& op = ops[order[i]];
+						if (!regions.empty() &&
+							regions.back().srcOffset + regions.back().size == op.srcOffset &&
+							regions.back().dstOffset + regions.back().size == op.dstOffset) {
+							regions.back().size += op.bytes;
+						}
+						else {
+							regions.push_back(vk::BufferCopy(op.srcOffset, op.dstOffset, op.bytes));
+						}
+					}
+					transferCmd.copyBuffer(first.srcBuffer, first.dstBuffer,
+						static_cast<uint32_t>(regions.size()), regions.data());
+					numCopyCommands += 1;
+					numRegions += static_cast<uint32_t>(regions.size());
+				}
+				begin = end;
+			}
 		}
 
 		// image transferences
 		uint32_t numGraphicsAcquire = 0;
-		std::vector<vk::ImageMemoryBarrier> barriers;
+		FrameVector<vk::ImageMemoryBarrier> barriers(arena);
+		// First transfer of the image of each barrier
+		FrameVector<uint32_t> barrierOps(arena);
 		if (!ts.imageTransfersFragmentOps.empty()) {
+			const std::vector<ImageTransferOp>& ops = ts.imageTransfersFragmentOps;
+			// Grouped per image, with all its mips and layers in one barrier,
+			// and one copy per staging buffer
+			FrameVector<uint32_t> order(ops.size(), 0, arena);
+			std::iota(order.begin(), order.end(), 0);
+			std::stable_sort(order.begin(), order.end(), [&ops](uint32_t a, uint32_t b) {
+				if (ops[a].dstImage != ops[b].dstImage) {
+					return ops[a].dstImage < ops[b].dstImage;
+				}
+				return ops[a].srcBuffer < ops[b].srcBuffer;
+			});
+
 			// First transition image to dstOptimal
-			barriers = std::vector<vk::ImageMemoryBarrier>(
-				ts.imageTransfersFragmentOps.size(),
-				vk::ImageMemoryBarrier(
-					vk::AccessFlags{}, // src AccessMask
-					vk::AccessFlagBits::eTransferWrite, // dst AccessMask
-					vk::ImageLayout::eUndefined,// old layout
-					vk::ImageLayout::eTransferDstOptimal,// new layout
-					VK_QUEUE_FAMILY_IGNORED,	// src queue family
-					VK_QUEUE_FAMILY_IGNORED,	// dst queue family
-					nullptr,					// image
-					{}							// range
-			));
-			const uint32_t numImgTransfers = static_cast<uint32_t>(ts.imageTransfersFragmentOps.size());
-			for (uint32_t i = 0; i < numImgTransfers; ++i) {
-				const ImageTransferOp& op = ts.imageTransfersFragmentOps[i];
-				barriers[i].setImage(op.dstImage)
-					.setSubresourceRange(vk::ImageSubresourceRange(
-						op.layersInfo.aspectMask,
-						op.layersInfo.mipLevel,
-						VK_REMAINING_MIP_LEVELS,
-						op.layersInfo.baseArrayLayer,
-						op.layersInfo.layerCount
-						));
+			for (size_t i = 0; i < order.size(); ++i) {
+				const ImageTransferOp& op = ops[order[i]];
+				if (i == 0 || ops[order[i - 1]].dstImage != op.dstImage) {
+					barriers.push_back(vk::ImageMemoryBarrier(
+						vk::AccessFlags{}, // src AccessMask
+						vk::AccessFlagBits::eTransferWrite, // dst AccessMask
+						vk::ImageLayout::eUndefined,// old layout
+						vk::ImageLayout::eTransferDstOptimal,// new layout
+						VK_QUEUE_FAMILY_IGNORED,	// src queue family
+						VK_QUEUE_FAMILY_IGNORED,	// dst queue family
+						op.dstImage,				// image
+						vk::ImageSubresourceRange(
+							op.layersInfo.aspectMask,
+							op.layersInfo.mipLevel,
+							VK_REMAINING_MIP_LEVELS,
+							op.layersInfo.baseArrayLayer,
+							op.layersInfo.layerCount
+						)));
+					barrierOps.push_back(order[i]);
+				}
+				else {
+					// Same image, widen the range to cover this transfer too
+					vk::ImageSubresourceRange& range = barriers.back().subresourceRange;
+					const uint32_t endLayer = std::max(range.baseArrayLayer + range.layerCount,
+						op.layersInfo.baseArrayLayer + op.layersInfo.layerCount);
+					range.aspectMask |= op.layersInfo.aspectMask;
+					range.baseMipLevel = std::min(range.baseMipLevel, op.layersInfo.mipLevel);
+					range.baseArrayLayer = std::min(range.baseArrayLayer, op.layersInfo.baseArrayLayer);
+					range.layerCount = endLayer - range.baseArrayLayer;
+				}
 			}
 
 			transferCmd.pipelineBarrier(
@@ -84,26 +192,37 @@ void BufferTransferer::updateAndFlushTransfers(
 				static_cast<uint32_t>(barriers.size()), barriers.data() // image memory barrier
 				);
 			// copy image data
-			for (uint32_t i = 0; i < numImgTransfers; ++i) {
-				const ImageTransferOp& op = ts.imageTransfersFragmentOps[i];
-
-				vk::BufferImageCopy regionInfo(
-					op.srcOffset, 0u, 0u,	// offset, row length, image height
-					op.layersInfo,		// subresource layers
-					vk::Offset3D(0),
-					op.extent
-					);
+			FrameVector<vk::BufferImageCopy> regions(arena);
+			for (size_t begin = 0; begin < order.size();) {
+				const ImageTransferOp& first = ops[order[begin]];
+				regions.clear();
+				size_t end = begin;
+				for (; end < order.size() &&
+					ops[order[end]].dstImage == first.dstImage &&
+					ops[order[end]].srcBuffer == first.srcBuffer; ++end) {
+					const ImageTransferOp& op = ops[order[end]];
+					regions.push_back(vk::BufferImageCopy(
+						op.srcOffset, 0u, 0u,	// offset, row length, image height
+						op.layersInfo,		// subresource layers
+						vk::Offset3D(0),
+						op.extent
+					));
+				}
 				transferCmd.copyBufferToImage(
-					mStagingBuffers[op.stageBuffIdx].buffer.getVkBuffer(), // src buffer
-					op.dstImage,	// dst image
+					first.srcBuffer,	// src buffer
+					first.dstImage,	// dst image
 					vk::ImageLayout::eTransferDstOptimal,			// dst image layout
-					1, &regionInfo									// regions
+					static_cast<uint32_t>(regions.size()), regions.data() // regions
 					);
+				numCopyCommands += 1;
+				numRegions += static_cast<uint32_t>(regions.size());
+				begin = end;
 			}
 
 			// Second barriers to set final layout
-			for (uint32_t i = 0; i < numImgTransfers; ++i) {
-				const ImageTransferOp& op = ts.imageTransfersFragmentOps[i];
+			const uint32_t numBarriers = static_cast<uint32_t>(barriers.size());
+			for (uint32_t i = 0; i < numBarriers; ++i) {
+				const ImageTransferOp& op = ops[barrierOps[i]];
 				barriers[i]
 					.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
 					.setDstAccessMask(op.dstAccessMask)
@@ -138,7 +257,7 @@ void BufferTransferer::updateAndFlushTransfers(
 			graphicsCmd.begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
 
 			for (uint32_t i = 0, k = 0; k < numGraphicsAcquire; ++i) {
-				const ImageTransferOp& op = ts.imageTransfersFragmentOps[i];
+				const ImageTransferOp& op = ts.imageTransfersFragmentOps[barrierOps[i]];
 				if (op.acquireGraphics) {
 					barriers[k++] = barriers[i];
 				}
@@ -168,6 +287,21 @@ void BufferTransferer::updateAndFlushTransfers(
 				mGraphicsBlock, ts.semaphore,
 				vk::PipelineStageFlagBits::eTransfer, transferSignalValue);
 		}
+
+		const Fsec recordTime = std::chrono::high_resolution_clock::now() - recordStart;
+
+		std::lock_guard<std::mutex> lock(mReclaimMutex);
+		ts.stagingValue = ts.value;
+		mLastFlush.numTransfers = static_cast<uint32_t>(ts.bufferTransferOps.size() + ts.imageTransfersFragmentOps.size());
+		mLastFlush.numCopyCommands = numCopyCommands;
+		mLastFlush.numRegions = numRegions;
+		mLastFlush.recordTime = recordTime.count();
+	}
+	else {
+		// Nothing to wait for
+		std::lock_guard<std::mutex> lock(mReclaimMutex);
+		ts.inFlight = false;
+		mInFlightSpaces.erase(std::find(mInFlightSpaces.begin(), mInFlightSpaces.end(), &ts));
 	}
 
 	if (outSemaphore != nullptr) {
@@ -183,31 +317,18 @@ void BufferTransferer::updateAndFlushTransfers(
 
 void BufferTransferer::updateTransferStates(RenderContext* rc)
 {
+	reclaimStaging(*rc);
 
+	const TransferSpace* current = mCurrentSpace.load();
+	std::lock_guard<std::mutex> lock(mReclaimMutex);
 	for (TransferSpace& ts : mTransferSpaces) {
-		if (ts.inUse) {
-			// If in use but empty, we have to reset the TransferSpace to mark them as !inUse
-			if (ts.empty()) {
-				ts.reset(rc);
-			}
-			else {
-				uint64_t value = rc->getDevice().getSemaphoreCounterValue(ts.semaphore);
-				bool finished = value >= ts.value;
-				if (finished) {
-					for (const TransferOp& op : ts.bufferTransferOps) {
-						mStagingBuffers[op.stageBuffIdx].free(op.srcOffset);
-					}
-					for (const ImageTransferOp& op : ts.imageTransfersFragmentOps) {
-						mStagingBuffers[op.stageBuffIdx].free(op.srcOffset);
-					}
-					ts.reset(rc);
-				}
+		if (ts.inUse && !ts.inFlight && &ts != current) {
+			for (StageBuffer& buff : ts.overflowBuffers) {
+				buff.destroy(*rc);
 			}
+			ts.reset(rc);
 		}
 	}
-
-	mCurrentSpace = findOrCreateTransferSpace(*rc);
-
 }
 
 void BufferTransferer::transferToBuffer(
@@ -219,23 +340,28 @@ void BufferTransferer::transferToBuffer(
 		throw std::runtime_error("Transfering buffer of size 0");
 	}
 
-	mBufferMutex.lock();
-
-	const uint32_t buffIdx = findOrCreateStageBuffer(rc, numBytes);
-	const vk::DeviceSize memPos = mStagingBuffers[buffIdx].getLastAvailableByte();
-	mStagingBuffers[buffIdx].reserve(numBytes);
-	
-	mTransferSpaces[mCurrentSpace].bufferTransferOps
-		.push_back(
-		TransferOp{ buffIdx, memPos,
-					dstBuffer.getVkBuffer(), dstOffset,
-					numBytes });
-
-	mBufferMutex.unlock();
-
-	std::memcpy(mStagingBuffers[buffIdx].ptr + memPos, data, numBytes);
-
+	const uint8_t* src = static_cast<const uint8_t*>(data);
+	for (vk::DeviceSize copied = 0; copied < numBytes;) {
+		const vk::DeviceSize chunk = std::min(numBytes - copied, mMaxChunkSize);
+
+		vk::Buffer srcBuffer;
+		vk::DeviceSize srcOffset;
+		uint8_t* ptr;
+		TransferSpace* space = claimStaging(rc, chunk, &srcBuffer, &srcOffset, &ptr);
+
+		std::memcpy(ptr, src + copied, chunk);
+		{
+			std::lock_guard<std::mutex> lock(space->opsMutex);
+			space->bufferTransferOps.push_back(
+				TransferOp{ srcBuffer, srcOffset,
+							dstBuffer.getVkBuffer(), dstOffset + copied,
+							chunk });
+		}
+		leaveSpace(space);
 
+		mNumChunks.fetch_add(1, std::memory_order_relaxed);
+		copied += chunk;
+	}
 }
 
 void BufferTransferer::transferToImage(const RenderContext& rc,
@@ -248,107 +374,227 @@ void BufferTransferer::transferToImage(const RenderContext& rc,
 	const vk::PipelineStageFlags dstStageMask,
 	const bool transferToGraphics)
 {
-	mImageMutex.lock();
-	const uint32_t buffIdx = findOrCreateStageBuffer(rc, numBytes);
-	const vk::DeviceSize memPos = mStagingBuffers[buffIdx].getLastAvailableByte();
-	mStagingBuffers[buffIdx].reserve(numBytes);
-
+	if (dstStageMask != vk::PipelineStageFlagBits::eFragmentShader) {
+		throw std::logic_error("Error: dst Pipeline Stage not supported!!");
+	}
 
+	// Not split, the layout transitions are for the whole image.
+	// Images bigger than a chunk get their own staging buffer
 	ImageTransferOp op;
-	op.stageBuffIdx = buffIdx;
-	op.srcOffset = memPos;
+	uint8_t* ptr;
+	TransferSpace* space = claimStaging(rc, numBytes, &op.srcBuffer, &op.srcOffset, &ptr);
+
 	op.dstImage = dstImage.getVkImage();
 	op.layersInfo = layerInfo;
 	op.extent =  vk::Extent3D(dstImage.getExtent(), 1);
 	op.dstAccessMask = dstAccessMask;
 	op.dstImageLayout = dstImageLayout;
-	op.acquireGraphics = transferToGraphics;
-
-	if (dstStageMask == vk::PipelineStageFlagBits::eFragmentShader) {
-		mTransferSpaces[mCurrentSpace].imageTransfersFragmentOps.push_back(op);
+	// With one family for both queues there is no ownership to transfer
+	op.acquireGraphics = transferToGraphics &&
+		rc.getGraphicsFamilyIdx() != rc.getTransferFamilyIdx();
+
+	std::memcpy(ptr, data, numBytes);
+	{
+		std::lock_guard<std::mutex> lock(space->opsMutex);
+		space->imageTransfersFragmentOps.push_back(op);
 	}
-	else {
-		mImageMutex.unlock();
-		throw std::logic_error("Error: dst Pipeline Stage not supported!!");
-	}
-	mImageMutex.unlock();
+	leaveSpace(space);
 
-	std::memcpy(mStagingBuffers[buffIdx].ptr + memPos, data, numBytes);
+	mNumChunks.fetch_add(1, std::memory_order_relaxed);
+}
 
+BufferTransferer::Stats BufferTransferer::getStats() const
+{
+	Stats stats;
+	stats.ringSize = mRingSize;
+	stats.ringUsed = mRingHead.load() - mRingTail.load();
+	stats.numChunks = mNumChunks.load(std::memory_order_relaxed);
+	stats.numWaits = mNumWaits.load(std::memory_order_relaxed);
+	stats.numOverflows = mNumOverflows.load(std::memory_order_relaxed);
+
+	std::lock_guard<std::mutex> lock(mReclaimMutex);
+	stats.lastFlush = mLastFlush;
+	return stats;
+}
 
+bool BufferTransferer::hasPendingTransfers() const
+{
+	TransferSpace* space = mCurrentSpace.load();
+	if (space == nullptr) {
+		return false;
+	}
+	if (space->numWriters.load() != 0) {
+		return true;
+	}
+	std::lock_guard<std::mutex> lock(space->opsMutex);
+	return !space->empty();
 }
 
 void BufferTransferer::destroy(RenderContext* rc)
 {
-	for (StageBuffer& buff : mStagingBuffers) {
-		buff.destroy(*rc);
-	}
 	for (TransferSpace& sem : mTransferSpaces) {
+		for (StageBuffer& buff : sem.overflowBuffers) {
+			buff.destroy(*rc);
+		}
 		sem.reset(rc);
 		rc->destroy(sem.semaphore);
 	}
+	mTransferSpaces.clear();
+	mInFlightSpaces.clear();
+	mCurrentSpace.store(nullptr);
+
+	if (mRing.buffer) {
+		mRing.destroy(*rc);
+	}
 }
 
-uint32_t BufferTransferer::findOrCreateStageBuffer(
-	const RenderContext& rc, const vk::DeviceSize numBytes)
+BufferTransferer::TransferSpace* BufferTransferer::findOrCreateTransferSpace(const RenderContext& rc)
 {
-	const uint32_t num = static_cast<uint32_t>(mStagingBuffers.size());
-	for (uint32_t i = 0; i < num; ++i) {
-		const StageBuffer& buf = mStagingBuffers[i];
-		if (buf.size - buf.getLastAvailableByte() >= numBytes) {
-			return i;
+	for (TransferSpace& ts : mTransferSpaces) {
+		if (!ts.inUse) {
+			ts.inUse = true;
+			return &ts;
 		}
 	}
 
-	// Else create buffer with enough size
-	mStagingBuffers.push_back({});
-	mStagingBuffers.back().create(rc, std::max(mMinSize, numBytes));
+	mTransferSpaces.emplace_back(rc.createTimelineSemaphore(0));
+	mTransferSpaces.back().inUse = true;
 
-	return num;
+	return &mTransferSpaces.back();
 }
 
-uint32_t BufferTransferer::findOrCreateTransferSpace(const RenderContext& rc)
+BufferTransferer::TransferSpace* BufferTransferer::enterSpace()
 {
-	const uint32_t num = static_cast<uint32_t>(mTransferSpaces.size());
-	for (uint32_t i = 0; i < num; ++i) {
-		if (!mTransferSpaces[i].inUse) {
-			mTransferSpaces[i].inUse = true;
-			return i;
+	for (;;) {
+		TransferSpace* space = mCurrentSpace.load();
+		space->numWriters.fetch_add(1);
+		// It may have been closed in between
+		if (mCurrentSpace.load() != space) {
+			space->numWriters.fetch_sub(1);
+			continue;
 		}
+
+		// Before claiming, so reclaimStaging never passes our claim
+		const uint64_t head = mRingHead.load();
+		uint64_t floor = space->ringFloor.load();
+		while (head < floor && !space->ringFloor.compare_exchange_weak(floor, head)) {}
+		return space;
 	}
+}
 
-	mTransferSpaces.push_back(
-		TransferSpace(rc.createTimelineSemaphore(0))
-	);
-	mTransferSpaces.back().inUse = true;
+void BufferTransferer::leaveSpace(TransferSpace* space)
+{
+	space->numWriters.fetch_sub(1);
+}
 
-	return num;
+bool BufferTransferer::tryClaim(vk::DeviceSize numBytes, uint64_t* outPosition)
+{
+	assert(numBytes <= mRingSize);
+	uint64_t head = mRingHead.load();
+	for (;;) {
+		uint64_t start = (head + STAGING_ALIGNMENT - 1) & ~(STAGING_ALIGNMENT - 1);
+		const uint64_t offset = start % mRingSize;
+		if (offset + numBytes > mRingSize) {
+			// Does not fit before the end, skip to the beginning
+			start += mRingSize - offset;
+		}
+		const uint64_t end = start + numBytes;
+		if (end - mRingTail.load() > mRingSize) {
+			return false;
+		}
+		if (mRingHead.compare_exchange_weak(head, end)) {
+			*outPosition = start;
+			return true;
+		}
+	}
 }
 
-void BufferTransferer::StageBuffer::create(const RenderContext& rc, vk::DeviceSize size)
+BufferTransferer::TransferSpace* BufferTransferer::claimStaging(
+	const RenderContext& rc, vk::DeviceSize numBytes,
+	vk::Buffer* outBuffer, vk::DeviceSize* outOffset, uint8_t** outPtr)
 {
-	this->buffer = rc.createStagingBuffer(size);
-	this->size = size;
+	if (numBytes <= mMaxChunkSize) {
+		bool canWait = true;
+		bool waited = false;
+		while (true) {
+			TransferSpace* space = enterSpace();
+			uint64_t position;
+			if (tryClaim(numBytes, &position)) {
+				*outBuffer = mRing.buffer.getVkBuffer();
+				*outOffset = position % mRingSize;
+				*outPtr = mRing.ptr + *outOffset;
+				return space;
+			}
+			leaveSpace(space);
 
+			if (!canWait) {
+				break;
+			}
+			// Only the GPU frees space that is in flight. If the ring is full of
+			// transfers not flushed yet, or this thread is the one that flushes, waiting never ends
+			canWait = reclaimStaging(rc) && std::this_thread::get_id() != mFlushThread;
+			if (canWait) {
+				if (!waited) {
+					mNumWaits.fetch_add(1, std::memory_order_relaxed);
+					waited = true;
+				}
+				std::this_thread::yield();
+			}
+		}
+	}
 
-	rc.mapAllocatable(this->buffer, reinterpret_cast<void**>(&this->ptr));
-}
+	mNumOverflows.fetch_add(1, std::memory_order_relaxed);
+	StageBuffer overflow;
+	overflow.create(rc, numBytes);
 
-void BufferTransferer::StageBuffer::free(vk::DeviceSize addr)
-{
-	this->lastAvailableByte.erase(addr);
+	TransferSpace* space = enterSpace();
+	{
+		std::lock_guard<std::mutex> lock(space->opsMutex);
+		space->overflowBuffers.push_back(overflow);
+	}
+	*outBuffer = overflow.buffer.getVkBuffer();
+	*outOffset = 0;
+	*outPtr = overflow.ptr;
+	return space;
 }
 
-vk::DeviceSize BufferTransferer::StageBuffer::getLastAvailableByte() const
+bool BufferTransferer::reclaimStaging(const RenderContext& rc)
 {
-	return this->lastAvailableByte.begin() == this->lastAvailableByte.end() ? 
-		0 : this->lastAvailableByte.begin()->second;
+	std::lock_guard<std::mutex> lock(mReclaimMutex);
+
+	// Read before the floors: a claim not seen in any floor starts after it
+	uint64_t tail = mRingHead.load();
+	for (auto it = mInFlightSpaces.begin(); it != mInFlightSpaces.end();) {
+		TransferSpace* ts = *it;
+		if (ts->stagingValue != std::numeric_limits<uint64_t>::max() &&
+			rc.getDevice().getSemaphoreCounterValue(ts->semaphore) >= ts->stagingValue) {
+			ts->inFlight = false;
+			it = mInFlightSpaces.erase(it);
+		}
+		else {
+			tail = std::min(tail, ts->ringFloor.load());
+			++it;
+		}
+	}
+	const TransferSpace* current = mCurrentSpace.load();
+	if (current != nullptr) {
+		tail = std::min(tail, current->ringFloor.load());
+	}
+
+	if (tail > mRingTail.load()) {
+		mRingTail.store(tail);
+	}
+
+	return !mInFlightSpaces.empty();
 }
 
-void BufferTransferer::StageBuffer::reserve(vk::DeviceSize bytes)
+void BufferTransferer::StageBuffer::create(const RenderContext& rc, vk::DeviceSize size)
 {
-	vk::DeviceSize src = this->getLastAvailableByte();
-	lastAvailableByte.emplace(src, src + bytes);
+	this->buffer = rc.createStagingBuffer(size);
+	this->size = size;
+
+
+	rc.mapAllocatable(this->buffer, reinterpret_cast<void**>(&this->ptr));
 }
 
 void BufferTransferer::StageBuffer::destroy(const RenderContext& rc)
@@ -361,17 +607,20 @@ void BufferTransferer::StageBuffer::destroy(const RenderContext& rc)
 void BufferTransferer::TransferSpace::reset(RenderContext* rc)
 {
 	this->inUse = false;
+	// Its semaphore already passed, they are freed in the next drain
 	if (this->graphicsCmd) {
-		rc->getGraphicsFreeCommandPool()->freeCommandBuffer(this->graphicsCmd);
+		rc->getDeferredDestroyer().pushCommandBuffer(rc->getGraphicsFreeCommandPool(), this->graphicsCmd, 0);
 	}
 	if (this->transferCmd) {
-		rc->getTransferFreeCommandPool()->freeCommandBuffer(this->transferCmd);
+		rc->getDeferredDestroyer().pushCommandBuffer(rc->getTransferFreeCommandPool(), this->transferCmd, 0);
 	}
 	this->graphicsCmd = nullptr;
 	this->transferCmd = nullptr;
 
 	this->bufferTransferOps.clear();
 	this->imageTransfersFragmentOps.clear();
+	this->overflowBuffers.clear();
+	this->ringFloor.store(std::numeric_limits<uint64_t>::max());
 }
 
 bool BufferTransferer::TransferSpace::empty() const
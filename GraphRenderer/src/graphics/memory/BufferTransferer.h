@@ -1,10 +1,15 @@
 #pragma once
 
-#include <map>
+#include <atomic>
+#include <cmath>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 #include "../command/FreeCommandPool.h"
 #include "../resources/Buffer.h"
 #include "../resources/Image2D.h"
+#include "../../utils/FrameArena.h"
 
 namespace gr
 {
@@ -12,18 +17,27 @@ namespace vkg
 {
 
 class RenderContext;
+
+// Uploads data to device local buffers and images. The data is copied into a
+// host visible staging ring, claimed with an atomic bump so the callers do not
+// wait for each other, and the ring is reclaimed in bulk when the timeline
+// semaphore of the TransferSpace that used it passes.
 class BufferTransferer
 {
 public:
 
-	BufferTransferer(const vk::DeviceSize minSize = 1 << 24);
+	BufferTransferer(const vk::DeviceSize ringSize = 1 << 24);
 
 	void setUpTransferBlocks(RenderContext* rc);
 
+	// The commands are sorted and merged in the arena, if any
 	void updateAndFlushTransfers(RenderContext* rc,
 		vk::Semaphore* outSemaphore = nullptr,
-		uint64_t* outValue = nullptr);
+		uint64_t* outValue = nullptr,
+		FrameArena* arena = nullptr);
 
+	// Thread safe. Uploads bigger than a quarter of the ring are split in chunks,
+	// and if the ring is full it waits for the GPU to release staging space
 	void transferToBuffer(
 		const RenderContext& rc,
 		const void* data,
@@ -47,31 +61,50 @@ public:
 		const bool transferToGraphics = true
 	);
 
+	// Last flush that recorded any transfer
+	struct FlushStats {
+		uint32_t numTransfers = 0;
+		uint32_t numCopyCommands = 0;
+		uint32_t numRegions = 0;
+		double_t recordTime = 0.0;
+	};
+
+	struct Stats {
+		vk::DeviceSize ringSize = 0;
+		// Claimed and not yet released by the GPU
+		vk::DeviceSize ringUsed = 0;
+		uint64_t numChunks = 0;
+		// Times a caller had to wait for the GPU to release space
+		uint64_t numWaits = 0;
+		// Uploads that did not fit, with their own staging buffer
+		uint64_t numOverflows = 0;
+		FlushStats lastFlush;
+	};
+	Stats getStats() const;
+
+	// Recorded, or being recorded, and not flushed yet
+	bool hasPendingTransfers() const;
 
 	// Destroy before destroying command pools
 	void destroy(RenderContext* rc);
 
 protected:
 
+	// Claims are aligned to the texel size of any format we upload
+	static constexpr vk::DeviceSize STAGING_ALIGNMENT = 16;
 
 	struct StageBuffer {
 		Buffer buffer;
 		vk::DeviceSize size;
-		std::map<vk::DeviceSize, vk::DeviceSize, std::greater<vk::DeviceSize>> lastAvailableByte;
 		uint8_t* ptr;
 
 		void create(const RenderContext& rc, vk::DeviceSize size);
-		void free(vk::DeviceSize addr);
-
-		vk::DeviceSize getLastAvailableByte() const;
-
-		void reserve(vk::DeviceSize bytes);
 
 		void destroy(const RenderContext& rc);
 	};
 
 	struct TransferOp {
-		uint32_t stageBuffIdx;
+		vk::Buffer srcBuffer;
 		vk::DeviceSize srcOffset;
 		vk::Buffer dstBuffer;
 		vk::DeviceSize dstOffset;
@@ -79,7 +112,7 @@ protected:
 	};
 
 	struct ImageTransferOp {
-		uint32_t stageBuffIdx;
+		vk::Buffer srcBuffer;
 		vk::DeviceSize srcOffset;
 		vk::Image dstImage;
 		vk::ImageSubresourceLayers layersInfo;
@@ -95,10 +128,22 @@ protected:
 		vk::Semaphore semaphore;
 		uint64_t value = 0;
 		bool inUse = false;
+		// Submitted, and its staging memory is not released yet. Guarded by mReclaimMutex
+		bool inFlight = false;
+		// Value of the semaphore once the copies are done
+		uint64_t stagingValue = 0;
 		FreeCommandPool::FreeCommandBuffer transferCmd;
 		FreeCommandPool::FreeCommandBuffer graphicsCmd;
+
+		// Callers recording transfers into this space
+		std::atomic<uint32_t> numWriters = 0;
+		// Every ring claim of this space starts at or after this position
+		std::atomic<uint64_t> ringFloor = std::numeric_limits<uint64_t>::max();
+
+		std::mutex opsMutex;
 		std::vector<TransferOp> bufferTransferOps;
 		std::vector<ImageTransferOp> imageTransfersFragmentOps;
+		std::vector<StageBuffer> overflowBuffers;
 
 		void reset(RenderContext* rc);
 
@@ -106,31 +151,54 @@ protected:
 
 		TransferSpace(vk::Semaphore s) : semaphore(s) {}
 	};
-	
 
-	
+	vk::DeviceSize mRingSize;
+	vk::DeviceSize mMaxChunkSize;
+	StageBuffer mRing = {};
 
-	vk::DeviceSize mMinSize;
+	// Monotonic positions, the ring offset is position % mRingSize.
+	// [tail, head) is claimed
+	std::atomic<uint64_t> mRingHead = 0;
+	std::atomic<uint64_t> mRingTail = 0;
 
-	std::vector<StageBuffer> mStagingBuffers;
-	std::vector<TransferSpace> mTransferSpaces;
+	// Addresses are stable, the callers keep a pointer to the current space
+	std::deque<TransferSpace> mTransferSpaces;
+	std::atomic<TransferSpace*> mCurrentSpace = nullptr;
 
-	uint32_t mCurrentSpace = std::numeric_limits<uint32_t>::max();
+	std::vector<TransferSpace*> mInFlightSpaces;
+	mutable std::mutex mReclaimMutex;
 
+	// The thread that sets up and flushes, it can not wait for the ring
+	std::thread::id mFlushThread;
+
+	std::atomic<uint64_t> mNumChunks = 0;
+	std::atomic<uint64_t> mNumWaits = 0;
+	std::atomic<uint64_t> mNumOverflows = 0;
+	// Guarded by mReclaimMutex
+	FlushStats mLastFlush;
 
 	uint32_t mGraphicsBlock = std::numeric_limits<uint32_t>::max();
 	uint32_t mTransferBlock = std::numeric_limits<uint32_t>::max();
 
-	std::mutex mBufferMutex, mImageMutex;
+	TransferSpace* findOrCreateTransferSpace(const RenderContext& rc);
 
-	uint32_t findOrCreateStageBuffer(
-		const RenderContext& rc,
-		const vk::DeviceSize numBytes);
+	void updateTransferStates(RenderContext* rc);
 
-	uint32_t findOrCreateTransferSpace(const RenderContext& rc);
+	// Registers the caller in the current space, and lowers its floor
+	TransferSpace* enterSpace();
+	void leaveSpace(TransferSpace* space);
 
-	void updateTransferStates(RenderContext* rc);
+	// Returns the ring position, or false if there is not enough free space
+	bool tryClaim(vk::DeviceSize numBytes, uint64_t* outPosition);
+
+	// Claims staging memory in the current space, that is entered on return.
+	// Waits for the GPU, or uses an overflow buffer if it can not wait
+	TransferSpace* claimStaging(const RenderContext& rc, vk::DeviceSize numBytes,
+		vk::Buffer* outBuffer, vk::DeviceSize* outOffset, uint8_t** outPtr);
 
+	// Releases the ring memory of the finished spaces. Returns whether
+	// any space is still in flight. Any thread
+	bool reclaimStaging(const RenderContext& rc);
 
 };
 
@@ -0,0 +1,149 @@
+#include "Defragmenter.h"
+
+#include "../RenderContext.h"
+
+#include <chrono>
+
+namespace gr
+{
+namespace vkg
+{
+
+void Defragmenter::initialize(const RenderContext& rc)
+{
+	assert(!mSemaphore);
+	mSemaphore = rc.createTimelineSemaphore(0);
+	mValue = 0;
+}
+
+void Defragmenter::setAutomatic(bool automatic, float threshold)
+{
+	mAutomatic = automatic;
+	mThreshold = threshold;
+}
+
+void Defragmenter::update(RenderContext* rc, vk::Semaphore frameSemaphore, uint64_t frameValue)
+{
+	if (!mStats.running) {
+		if (mAutomatic && mFramesToCheck-- == 0) {
+			mFramesToCheck = CHECK_PERIOD;
+			const MemoryManager::Fragmentation frag = rc->getMemoryManager().getFragmentation();
+			if (frag.ratio > mThreshold && frag.unusedBytes >= MIN_UNUSED_BYTES) {
+				mStartRequested = true;
+			}
+		}
+		if (!mStartRequested) {
+			return;
+		}
+		mStartRequested = false;
+		mStats.running = true;
+		mStats.before = rc->getMemoryManager().getFragmentation();
+		mPassSteps = 0;
+	}
+
+	// A worker is uploading to a movable buffer, or the upload is not flushed yet
+	std::unique_lock<std::shared_mutex> lock(mMoveMutex, std::try_to_lock);
+	if (!lock.owns_lock() || rc->getTransferer()->hasPendingTransfers()) {
+		mStats.numPostponed += 1;
+		return;
+	}
+
+	typedef std::chrono::duration<double_t> Fsec;
+	const auto stepStart = std::chrono::high_resolution_clock::now();
+	const uint32_t numMoved = step(rc, frameSemaphore, frameValue);
+	const Fsec stepTime = std::chrono::high_resolution_clock::now() - stepStart;
+	mStats.lastStepTime = stepTime.count();
+
+	mPassSteps += 1;
+	if (numMoved == 0 || mPassSteps == MAX_PASS_STEPS) {
+		mStats.running = false;
+		mStats.numPasses += 1;
+		mStats.after = rc->getMemoryManager().getFragmentation();
+	}
+}
+
+std::shared_lock<std::shared_mutex> Defragmenter::preventMoves() const
+{
+	return std::shared_lock<std::shared_mutex>(mMoveMutex);
+}
+
+void Defragmenter::destroy(RenderContext* rc)
+{
+	if (mSemaphore) {
+		rc->destroy(mSemaphore);
+		mSemaphore = nullptr;
+	}
+}
+
+uint32_t Defragmenter::step(RenderContext* rc, vk::Semaphore frameSemaphore, uint64_t frameValue)
+{
+	// The frames in flight may use the old places, and VMA moves the host visible
+	// buffers with the CPU in the begin. They also waited for the transfers that
+	// write the movable buffers
+	{
+		const vk::SemaphoreWaitInfo waitInfo(vk::SemaphoreWaitFlags{}, 1, &frameSemaphore, &frameValue);
+		const vk::Result res = rc->getDevice().waitSemaphores(waitInfo, UINT64_MAX);
+		assert(res == vk::Result::eSuccess);
+		(void)res;
+	}
+
+	FreeCommandPool::FreeCommandBuffer command = rc->getGraphicsFreeCommandPool()->newCommandBuffer();
+	vk::CommandBuffer cmd = command;
+	cmd.begin({ vk::CommandBufferUsageFlagBits::eOneTimeSubmit });
+
+	const vk::MemoryBarrier beforeBarrier(
+		vk::AccessFlagBits::eMemoryWrite,
+		vk::AccessFlagBits::eTransferRead | vk::AccessFlagBits::eTransferWrite);
+	cmd.pipelineBarrier(
+		vk::PipelineStageFlagBits::eAllCommands,	// src stage mask
+		vk::PipelineStageFlagBits::eTransfer,		// dst stage mask
+		vk::DependencyFlagBits{},
+		1, &beforeBarrier, 0, nullptr, 0, nullptr);
+
+	const MemoryManager& memManager = rc->getMemoryManager();
+	MemoryManager::DefragmentationStep defragStep;
+	memManager.beginDefragmentation(cmd, STEP_BYTES, STEP_ALLOCATIONS, &defragStep);
+
+	const vk::MemoryBarrier afterBarrier(
+		vk::AccessFlagBits::eTransferWrite,
+		vk::AccessFlagBits::eMemoryRead | vk::AccessFlagBits::eMemoryWrite);
+	cmd.pipelineBarrier(
+		vk::PipelineStageFlagBits::eTransfer,		// src stage mask
+		vk::PipelineStageFlagBits::eAllCommands,	// dst stage mask
+		vk::DependencyFlagBits{},
+		1, &afterBarrier, 0, nullptr, 0, nullptr);
+	cmd.end();
+
+	// Only the copies are waited for, not the whole device
+	mValue += 1;
+	vk::TimelineSemaphoreSubmitInfo semaphoreInfo(
+		0, nullptr,									// wait values
+		1, &mValue									// signal values
+	);
+	vk::SubmitInfo submitInfo(
+		0, nullptr, nullptr,						// wait semaphores
+		1, &cmd,									// command buffers
+		1, &mSemaphore								// signal semaphores
+	);
+	submitInfo.setPNext(&semaphoreInfo);
+	rc->getGraphicsQueue().submit(submitInfo, nullptr);
+
+	// The old buffers are destroyed in the end
+	const vk::SemaphoreWaitInfo waitInfo(vk::SemaphoreWaitFlags{}, 1, &mSemaphore, &mValue);
+	const vk::Result res = rc->getDevice().waitSemaphores(waitInfo, UINT64_MAX);
+	assert(res == vk::Result::eSuccess);
+	(void)res;
+
+	const uint32_t numMoved = memManager.endDefragmentation(&defragStep);
+	rc->getGraphicsFreeCommandPool()->freeCommandBuffer(command);
+
+	mStats.numSteps += 1;
+	mStats.bytesMoved += defragStep.stats.bytesMoved;
+	mStats.allocationsMoved += defragStep.stats.allocationsMoved;
+	mStats.bytesFreed += defragStep.stats.bytesFreed;
+	mStats.blocksFreed += defragStep.stats.deviceMemoryBlocksFreed;
+	return numMoved;
+}
+
+}
+}
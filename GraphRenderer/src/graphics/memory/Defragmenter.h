@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cmath>
+#include <shared_mutex>
+
+#include "MemoryManager.h"
+
+namespace gr
+{
+namespace vkg
+{
+
+class RenderContext;
+
+// Compacts the device memory of the movable buffers, see MemoryManager::setMovable.
+// A pass is split in bounded steps, at most one per frame. A step waits for the
+// frames in flight, copies on the graphics queue, and waits for the copies
+// before the buffers are rebound. The moved buffers get a new vk::Buffer in the
+// same Buffer, so their owners record with it the next time they read it.
+class Defragmenter
+{
+public:
+
+	Defragmenter() = default;
+	Defragmenter(const Defragmenter&) = delete;
+	Defragmenter& operator=(const Defragmenter&) = delete;
+
+	// The pass starts in the next update
+	void start() { mStartRequested = true; }
+
+	// Starts a pass by itself when the fragmentation ratio goes above the threshold
+	void setAutomatic(bool automatic, float threshold);
+	bool isAutomatic() const { return mAutomatic; }
+	float getThreshold() const { return mThreshold; }
+
+	void initialize(const RenderContext& rc);
+
+	// At the start of the frame, before any job reads the movable buffers. frameValue
+	// of frameSemaphore is signaled by the last frame submitted
+	void update(RenderContext* rc, vk::Semaphore frameSemaphore, uint64_t frameValue);
+
+	// Thread safe. The movable buffers keep their vk::Buffer while it is held. Hold it
+	// in a worker from reading the handle of a movable buffer to recording its transfer
+	[[nodiscard]] std::shared_lock<std::shared_mutex> preventMoves() const;
+
+	struct Stats {
+		bool running = false;
+		uint32_t numPasses = 0;
+		uint32_t numSteps = 0;
+		// Steps delayed by the uploads in progress
+		uint32_t numPostponed = 0;
+		vk::DeviceSize bytesMoved = 0;
+		uint32_t allocationsMoved = 0;
+		vk::DeviceSize bytesFreed = 0;
+		uint32_t blocksFreed = 0;
+		// Around the last pass
+		MemoryManager::Fragmentation before;
+		MemoryManager::Fragmentation after;
+		double_t lastStepTime = 0.0;
+	};
+	const Stats& getStats() const { return mStats; }
+
+	// With the device idle
+	void destroy(RenderContext* rc);
+
+	// Moved in a step, raised to the biggest movable buffer, see MemoryManager::beginDefragmentation
+	static constexpr vk::DeviceSize STEP_BYTES = 1 << 24;
+	static constexpr uint32_t STEP_ALLOCATIONS = 64;
+	// In case the moves never settle
+	static constexpr uint32_t MAX_PASS_STEPS = 64;
+	// Frames between the checks of the automatic mode
+	static constexpr uint32_t CHECK_PERIOD = 120;
+	// Less unused memory is not worth the stalls
+	static constexpr vk::DeviceSize MIN_UNUSED_BYTES = 1 << 24;
+
+private:
+
+	bool mStartRequested = false;
+	bool mAutomatic = false;
+	float mThreshold = 0.5f;
+	uint32_t mFramesToCheck = 0;
+	uint32_t mPassSteps = 0;
+	Stats mStats;
+
+	mutable std::shared_mutex mMoveMutex;
+
+	// Signaled by the copies of each step
+	vk::Semaphore mSemaphore;
+	uint64_t mValue = 0;
+
+	// Returns the number of buffers moved
+	uint32_t step(RenderContext* rc, vk::Semaphore frameSemaphore, uint64_t frameValue);
+};
+
+}
+}
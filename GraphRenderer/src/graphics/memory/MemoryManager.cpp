@@ -1,17 +1,27 @@
 #include "MemoryManager.h"
 
+#include "../resources/Buffer.h"
+
+#include <algorithm>
+
 namespace gr
 {
 namespace vkg
 {
 
-MemoryManager::MemoryManager(vk::Instance instance, vk::PhysicalDevice physicalDevice, vk::Device logicalDevice)
+MemoryManager::MemoryManager(vk::Instance instance, vk::PhysicalDevice physicalDevice, vk::Device logicalDevice,
+	bool memoryBudgetExt) : mDevice(logicalDevice), mMemoryBudgetExt(memoryBudgetExt), mAccounting(std::make_unique<Accounting>())
 {
 	VmaAllocatorCreateInfo createInfo = {};
 	createInfo.instance = instance;
 	createInfo.physicalDevice = physicalDevice;
 	createInfo.device = logicalDevice;
 	// TODO: lost allocations
+	if (memoryBudgetExt) {
+		// The budget is queried with vkGetPhysicalDeviceMemoryProperties2, core since 1.1
+		createInfo.vulkanApiVersion = VK_API_VERSION_1_2;
+		createInfo.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
+	}
 
 	vmaCreateAllocator(&createInfo, &mAllocator);
 }
@@ -22,7 +32,8 @@ void MemoryManager::createImageAllocation(const vk::ImageCreateInfo& imageInfo,
 	vk::MemoryPropertyFlags preferredProperties,
 	vk::Image* outImage,
 	VmaAllocation* allocation,
-	VmaAllocationInfo* outAllocInfo) const
+	VmaAllocationInfo* outAllocInfo,
+	const MemoryTag& tag) const
 {
 
 	VmaAllocationCreateInfo createInfo = {};
@@ -39,6 +50,7 @@ void MemoryManager::createImageAllocation(const vk::ImageCreateInfo& imageInfo,
 	if (res != VK_SUCCESS) {
 		throw std::runtime_error("Can't create image!!");
 	}
+	track(*allocation, tag);
 }
 
 void MemoryManager::createBufferAllocation(const vk::BufferCreateInfo& bufferInfo, 
@@ -46,7 +58,8 @@ void MemoryManager::createBufferAllocation(const vk::BufferCreateInfo& bufferInf
 	vk::MemoryPropertyFlags preferredProperties, 
 	vk::Buffer* outBuffer,
 	VmaAllocation* outAllocation,
-	VmaAllocationInfo* outAllocInfo) const
+	VmaAllocationInfo* outAllocInfo,
+	const MemoryTag& tag) const
 {
 
 	VmaAllocationCreateInfo createInfo = {};
@@ -63,10 +76,29 @@ void MemoryManager::createBufferAllocation(const vk::BufferCreateInfo& bufferInf
 	if (res != VK_SUCCESS) {
 		throw std::runtime_error("Can't create buffer!!");
 	}
+	track(*outAllocation, tag, &bufferInfo);
 }
 
 void MemoryManager::freeAllocation(VmaAllocation allocation) const
 {
+	if (mAccounting && allocation != nullptr) {
+		std::lock_guard<std::mutex> lock(mAccounting->mutex);
+		auto it = mAccounting->records.find(allocation);
+		if (it != mAccounting->records.end()) {
+			const Accounting::Record& record = it->second;
+			const size_t category = static_cast<size_t>(record.tag.category);
+			mAccounting->stats.categories.gpuBytes[category] -= record.size;
+			mAccounting->stats.numAllocations[category] -= 1;
+			if (record.tag.owner != MemoryTag::NO_OWNER) {
+				auto itOwner = mAccounting->stats.owners.find(record.tag.owner);
+				itOwner->second.gpuBytes[category] -= record.size;
+				if (itOwner->second.getGpuBytes() == 0) {
+					mAccounting->stats.owners.erase(itOwner);
+				}
+			}
+			mAccounting->records.erase(it);
+		}
+	}
 	vmaFreeMemory(mAllocator, allocation);
 }
 
@@ -115,6 +147,226 @@ void MemoryManager::flushAllocations(const VmaAllocation* allocations, uint32_t
 	}
 }
 
+void MemoryManager::invalidateAllocations(const VmaAllocation* allocations, uint32_t num) const
+{
+	VkResult res = vmaInvalidateAllocations(mAllocator, num,
+		allocations, nullptr, nullptr);
+
+	if (res != VK_SUCCESS) {
+		throw std::runtime_error("Error! Can't invalidate allocations!");
+	}
+}
+
+void MemoryManager::setCurrentFrameIndex(uint32_t frameIndex) const
+{
+	vmaSetCurrentFrameIndex(mAllocator, frameIndex);
+}
+
+MemoryManager::Budget MemoryManager::getDeviceLocalBudget() const
+{
+	const VkPhysicalDeviceMemoryProperties* props;
+	vmaGetMemoryProperties(mAllocator, &props);
+
+	VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+	vmaGetBudget(mAllocator, budgets);
+
+	Budget budget;
+	budget.fromDriver = mMemoryBudgetExt;
+	for (uint32_t i = 0; i < props->memoryHeapCount; ++i) {
+		if (props->memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+			budget.usage += budgets[i].usage;
+			budget.budget += budgets[i].budget;
+		}
+	}
+	return budget;
+}
+
+MemoryManager::Stats MemoryManager::getStats() const
+{
+	Stats stats;
+	if (mAccounting) {
+		std::lock_guard<std::mutex> lock(mAccounting->mutex);
+		stats = mAccounting->stats;
+	}
+
+	const VkPhysicalDeviceMemoryProperties* props;
+	vmaGetMemoryProperties(mAllocator, &props);
+	VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+	vmaGetBudget(mAllocator, budgets);
+	for (uint32_t i = 0; i < props->memoryHeapCount; ++i) {
+		stats.blockBytes += budgets[i].blockBytes;
+		stats.allocationBytes += budgets[i].allocationBytes;
+	}
+	return stats;
+}
+
+void MemoryManager::setMovable(Buffer* buffer, void** mappedPtr) const
+{
+	if (!mAccounting) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mAccounting->mutex);
+	auto it = mAccounting->records.find(buffer->getAllocation());
+	if (it == mAccounting->records.end() || !it->second.usage) {
+		throw std::runtime_error("Error: The movable buffer was not created by the memory manager");
+	}
+	it->second.movable = buffer;
+	it->second.mappedPtr = mappedPtr;
+}
+
+MemoryManager::Fragmentation MemoryManager::getFragmentation() const
+{
+	VmaStats vmaStats;
+	vmaCalculateStats(mAllocator, &vmaStats);
+	const VkPhysicalDeviceMemoryProperties* props;
+	vmaGetMemoryProperties(mAllocator, &props);
+
+	Fragmentation frag;
+	vk::DeviceSize scattered = 0;
+	for (uint32_t i = 0; i < props->memoryTypeCount; ++i) {
+		const VmaStatInfo& info = vmaStats.memoryType[i];
+		if (info.blockCount == 0) {
+			continue;
+		}
+		frag.blockBytes += info.usedBytes + info.unusedBytes;
+		frag.usedBytes += info.usedBytes;
+		frag.unusedBytes += info.unusedBytes;
+		frag.numUnusedRanges += info.unusedRangeCount;
+		frag.largestUnusedRange = std::max(frag.largestUnusedRange, info.unusedRangeSizeMax);
+		// An allocation only fits in one range, of one type
+		scattered += info.unusedBytes - info.unusedRangeSizeMax;
+	}
+	if (frag.unusedBytes != 0) {
+		frag.ratio = static_cast<float>(scattered) / static_cast<float>(frag.unusedBytes);
+	}
+	return frag;
+}
+
+void MemoryManager::beginDefragmentation(vk::CommandBuffer cmd,
+	vk::DeviceSize maxBytes,
+	uint32_t maxAllocations,
+	DefragmentationStep* step) const
+{
+	step->allocations.clear();
+	step->changed.clear();
+	step->stats = {};
+	step->context = {};
+	if (!mAccounting) {
+		return;
+	}
+
+	// Not held while the copies run, so the workers can still allocate and free.
+	// The movable buffers are only freed by this thread
+	vk::DeviceSize largestBytes = 0;
+	{
+		std::lock_guard<std::mutex> lock(mAccounting->mutex);
+		for (const auto& [allocation, record] : mAccounting->records) {
+			// Skip the ones whose owner already holds another buffer
+			if (record.movable == nullptr || record.movable->getAllocation() != allocation) {
+				continue;
+			}
+			step->allocations.push_back(allocation);
+			VmaAllocationInfo allocationInfo;
+			vmaGetAllocationInfo(mAllocator, allocation, &allocationInfo);
+			largestBytes = std::max(largestBytes, static_cast<vk::DeviceSize>(allocationInfo.size));
+			if (record.mappedPtr != nullptr) {
+				vmaUnmapMemory(mAllocator, allocation);
+				*record.mappedPtr = nullptr;
+			}
+		}
+	}
+	step->changed.assign(step->allocations.size(), VK_FALSE);
+
+	if (step->allocations.empty()) {
+		return;
+	}
+
+	VmaDefragmentationInfo2 info = {};
+	info.allocationCount = static_cast<uint32_t>(step->allocations.size());
+	info.pAllocations = step->allocations.data();
+	info.pAllocationsChanged = step->changed.data();
+	// VMA never moves an allocation bigger than the limit, like the arena blocks
+	const vk::DeviceSize stepBytes = std::max(maxBytes, largestBytes);
+	// The host visible ones are moved by the CPU in the begin
+	info.maxCpuBytesToMove = stepBytes;
+	info.maxCpuAllocationsToMove = maxAllocations;
+	info.maxGpuBytesToMove = stepBytes;
+	info.maxGpuAllocationsToMove = maxAllocations;
+	info.commandBuffer = cmd;
+
+	VkResult res = vmaDefragmentationBegin(mAllocator, &info, &step->stats, &step->context);
+	if (res != VK_SUCCESS && res != VK_NOT_READY) {
+		throw std::runtime_error("Error: Can't begin the defragmentation");
+	}
+}
+
+uint32_t MemoryManager::endDefragmentation(DefragmentationStep* step) const
+{
+	if (step->allocations.empty()) {
+		return 0;
+	}
+
+	if (step->context != VK_NULL_HANDLE) {
+		vmaDefragmentationEnd(mAllocator, step->context);
+		step->context = {};
+	}
+
+	std::lock_guard<std::mutex> lock(mAccounting->mutex);
+	uint32_t numMoved = 0;
+	for (size_t i = 0; i < step->allocations.size(); ++i) {
+		const VmaAllocation allocation = step->allocations[i];
+		const Accounting::Record& record = mAccounting->records.at(allocation);
+		if (step->changed[i]) {
+			// The old buffer is bound to the old place
+			mDevice.destroyBuffer(record.movable->getVkBuffer());
+			vk::BufferCreateInfo createInfo(
+				{},
+				record.bufferSize,
+				record.usage,
+				vk::SharingMode::eExclusive);
+			vk::Buffer buffer = mDevice.createBuffer(createInfo);
+			if (vmaBindBufferMemory(mAllocator, allocation, buffer) != VK_SUCCESS) {
+				throw std::runtime_error("Error: Can't bind a moved buffer");
+			}
+			record.movable->setVkBuffer(buffer);
+			numMoved += 1;
+		}
+		if (record.mappedPtr != nullptr) {
+			vmaMapMemory(mAllocator, allocation, record.mappedPtr);
+		}
+	}
+
+	step->allocations.clear();
+	step->changed.clear();
+	return numMoved;
+}
+
+void MemoryManager::track(VmaAllocation allocation, const MemoryTag& tag,
+	const vk::BufferCreateInfo* bufferInfo) const
+{
+	if (!mAccounting) {
+		return;
+	}
+
+	VmaAllocationInfo info;
+	vmaGetAllocationInfo(mAllocator, allocation, &info);
+
+	std::lock_guard<std::mutex> lock(mAccounting->mutex);
+	Accounting::Record& record = mAccounting->records[allocation];
+	record = { tag, info.size };
+	if (bufferInfo != nullptr) {
+		record.usage = bufferInfo->usage;
+		record.bufferSize = bufferInfo->size;
+	}
+	const size_t category = static_cast<size_t>(tag.category);
+	mAccounting->stats.categories.gpuBytes[category] += info.size;
+	mAccounting->stats.numAllocations[category] += 1;
+	if (tag.owner != MemoryTag::NO_OWNER) {
+		mAccounting->stats.owners[tag.owner].gpuBytes[category] += info.size;
+	}
+}
+
 void MemoryManager::destroy()
 {
 	vmaDestroyAllocator(mAllocator);
@@ -3,32 +3,45 @@
 #include <vulkan/vulkan.hpp>
 #include <vk_mem_alloc/vk_mem_alloc.h>
 
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "MemoryTag.h"
+
 namespace gr
 {
 namespace vkg
 {
+	class Buffer;
+
 	class MemoryManager
 	{
 	public:
 
 		MemoryManager() = default;
 
+		// With memoryBudgetExt, the device has VK_EXT_memory_budget enabled
 		MemoryManager(vk::Instance instance,
 			vk::PhysicalDevice physicalDevice,
-			vk::Device logicalDevice);
+			vk::Device logicalDevice,
+			bool memoryBudgetExt = false);
 
 
 		void createImageAllocation(const vk::ImageCreateInfo& imageInfo,
 			vk::MemoryPropertyFlags requiredProperties,
 			vk::MemoryPropertyFlags preferredProperties,
 			vk::Image* outImage, VmaAllocation* outAllocation,
-			VmaAllocationInfo* outAllocInfo = nullptr) const;
+			VmaAllocationInfo* outAllocInfo = nullptr,
+			const MemoryTag& tag = MemoryTag()) const;
 
 		void createBufferAllocation(const vk::BufferCreateInfo& bufferInfo,
 			vk::MemoryPropertyFlags requiredProperties,
 			vk::MemoryPropertyFlags preferredProperties,
 			vk::Buffer* outBuffer, VmaAllocation* outAllocation,
-			VmaAllocationInfo* outAllocInfo = nullptr) const;
+			VmaAllocationInfo* outAllocInfo = nullptr,
+			const MemoryTag& tag = MemoryTag()) const;
 
 		void freeAllocation(VmaAllocation allocation) const;
 
@@ -45,10 +58,98 @@ namespace vkg
 
 		void flushAllocations(const VmaAllocation* allocations, uint32_t num) const;
 
+		// Before the host reads what the device wrote
+		void invalidateAllocations(const VmaAllocation* allocations, uint32_t num) const;
+
+		// Once per frame, the budget of the driver is refreshed with it
+		void setCurrentFrameIndex(uint32_t frameIndex) const;
+
+		struct Budget {
+			// Estimated memory used by the process, and the one it can use
+			vk::DeviceSize usage = 0;
+			vk::DeviceSize budget = 0;
+			// From the driver, otherwise estimated by VMA
+			bool fromDriver = false;
+		};
+		// Sum of the device local heaps
+		Budget getDeviceLocalBudget() const;
+
+		// Bytes of the live allocations, by their tags
+		struct Stats {
+			MemoryUsage categories;
+			std::array<uint32_t, static_cast<size_t>(MemoryCategory::COUNT)> numAllocations = {};
+			// Only the allocations with an owner
+			std::unordered_map<uint64_t, MemoryUsage> owners;
+			// From VMA, of all the heaps. The blocks hold the allocations
+			vk::DeviceSize blockBytes = 0;
+			vk::DeviceSize allocationBytes = 0;
+		};
+		Stats getStats() const;
+
+		// The buffer can be moved by the defragmentation, which recreates its vk::Buffer
+		// in place. Only for buffers whose handle is read through the Buffer every frame,
+		// not written in descriptor sets. A mapped buffer gets its pointer updated.
+		// Unregistered when the allocation is freed. Free it only on the thread that
+		// runs the defragmentation, it is not locked while its copies run.
+		void setMovable(Buffer* buffer, void** mappedPtr = nullptr) const;
+
+		// Of the device memory blocks, from VMA
+		struct Fragmentation {
+			vk::DeviceSize blockBytes = 0;
+			vk::DeviceSize usedBytes = 0;
+			vk::DeviceSize unusedBytes = 0;
+			vk::DeviceSize largestUnusedRange = 0;
+			uint32_t numUnusedRanges = 0;
+			// Part of the unused bytes outside of the largest free range of each memory type.
+			// 0 when the free memory is contiguous, close to 1 when it is scattered
+			float ratio = 0.0f;
+		};
+		Fragmentation getFragmentation() const;
+
+		// One bounded step of defragmentation of the movable buffers. Begin records the
+		// copies in cmd, which has to finish on the device before the end. The movable
+		// buffers can't be freed between them, and can't be in use by the device, VMA
+		// moves the host visible ones with the CPU in the begin.
+		// maxBytes is raised to the biggest movable buffer, so all of them can move
+		struct DefragmentationStep {
+			VmaDefragmentationContext context = {};
+			std::vector<VmaAllocation> allocations;
+			std::vector<VkBool32> changed;
+			VmaDefragmentationStats stats = {};
+		};
+		void beginDefragmentation(vk::CommandBuffer cmd,
+			vk::DeviceSize maxBytes,
+			uint32_t maxAllocations,
+			DefragmentationStep* step) const;
+		// Rebinds the moved buffers, and returns how many moved
+		uint32_t endDefragmentation(DefragmentationStep* step) const;
+
 		void destroy();
 
 	private:
 		VmaAllocator mAllocator = {};
+		vk::Device mDevice;
+		bool mMemoryBudgetExt = false;
+
+		struct Accounting {
+			struct Record {
+				MemoryTag tag;
+				vk::DeviceSize size = 0;
+				// Of the buffers, to recreate them when moved
+				vk::BufferUsageFlags usage;
+				vk::DeviceSize bufferSize = 0;
+				Buffer* movable = nullptr;
+				void** mappedPtr = nullptr;
+			};
+			std::unordered_map<VmaAllocation, Record> records;
+			Stats stats;
+			std::mutex mutex;
+		};
+		// In the heap, so the manager can be moved
+		std::unique_ptr<Accounting> mAccounting;
+
+		void track(VmaAllocation allocation, const MemoryTag& tag,
+			const vk::BufferCreateInfo* bufferInfo = nullptr) const;
 	};
 }; // namespace vkg
 }; // namespace gr
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <array>
+#include <cstdint>
+
+namespace gr
+{
+namespace vkg
+{
+
+enum class MemoryCategory : uint32_t {
+	eVertex,
+	eIndex,
+	eUniform,
+	eStaging,
+	eTexture,
+	eAttachment,
+	eGui,
+	eOther,
+	COUNT
+};
+
+inline const char* to_string(MemoryCategory category) {
+	switch (category)
+	{
+	case MemoryCategory::eVertex: return "Vertex";
+	case MemoryCategory::eIndex: return "Index";
+	case MemoryCategory::eUniform: return "Uniform";
+	case MemoryCategory::eStaging: return "Staging";
+	case MemoryCategory::eTexture: return "Texture";
+	case MemoryCategory::eAttachment: return "Attachment";
+	case MemoryCategory::eGui: return "GUI";
+	case MemoryCategory::eOther: return "Other";
+	default: return "invalid";
+	}
+}
+
+// What an allocation is used for, and the ResId value of the resource that owns it
+struct MemoryTag {
+	static constexpr uint64_t NO_OWNER = ~0ull;
+
+	MemoryCategory category = MemoryCategory::eOther;
+	uint64_t owner = NO_OWNER;
+
+	constexpr MemoryTag() = default;
+	constexpr MemoryTag(MemoryCategory category, uint64_t owner = NO_OWNER) :
+		category(category), owner(owner) {}
+};
+
+// Memory held by a resource, per category on the device and in total on the host
+struct MemoryUsage {
+	std::array<vk::DeviceSize, static_cast<size_t>(MemoryCategory::COUNT)> gpuBytes = {};
+	vk::DeviceSize cpuBytes = 0;
+
+	vk::DeviceSize getGpuBytes() const {
+		vk::DeviceSize bytes = 0;
+		for (vk::DeviceSize b : gpuBytes) {
+			bytes += b;
+		}
+		return bytes;
+	}
+	vk::DeviceSize& gpu(MemoryCategory category) { return gpuBytes[static_cast<size_t>(category)]; }
+};
+
+}
+}
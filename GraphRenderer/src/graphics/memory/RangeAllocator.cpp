@@ -0,0 +1,107 @@
+#include "RangeAllocator.h"
+
+#include <cassert>
+
+namespace gr
+{
+namespace vkg
+{
+
+RangeAllocator::RangeAllocator(uint64_t size) : mSize(size)
+{
+	if (size > 0) {
+		insertFree(0, size);
+	}
+}
+
+bool RangeAllocator::allocate(uint64_t size, uint64_t alignment, uint64_t* outOffset)
+{
+	assert(outOffset != nullptr);
+	assert(alignment > 0);
+	if (size == 0) {
+		return false;
+	}
+
+	// From the smallest range that could fit. Only the padding of the
+	// alignment can make a range not fit, so few ranges are tested.
+	for (auto it = mFreeBySize.lower_bound(size); it != mFreeBySize.end(); ++it) {
+		const uint64_t freeOffset = it->second;
+		const uint64_t freeSize = it->first;
+		const uint64_t alignedOffset = (freeOffset + alignment - 1) / alignment * alignment;
+		const uint64_t padding = alignedOffset - freeOffset;
+		if (freeSize < size + padding) {
+			continue;
+		}
+
+		eraseFree(mFreeByOffset.find(freeOffset));
+		if (padding > 0) {
+			insertFree(freeOffset, padding);
+		}
+		if (freeSize > size + padding) {
+			insertFree(alignedOffset + size, freeSize - size - padding);
+		}
+
+		*outOffset = alignedOffset;
+		return true;
+	}
+
+	return false;
+}
+
+void RangeAllocator::free(uint64_t offset, uint64_t size)
+{
+	assert(offset + size <= mSize);
+	if (size == 0) {
+		return;
+	}
+
+	// Merge with the next free range
+	auto next = mFreeByOffset.find(offset + size);
+	if (next != mFreeByOffset.end()) {
+		size += next->second;
+		eraseFree(next);
+	}
+
+	// Merge with the previous free range
+	auto prev = mFreeByOffset.lower_bound(offset);
+	assert(prev == mFreeByOffset.end() || prev->first != offset);
+	if (prev != mFreeByOffset.begin()) {
+		--prev;
+		assert(prev->first + prev->second <= offset);
+		if (prev->first + prev->second == offset) {
+			offset = prev->first;
+			size += prev->second;
+			eraseFree(prev);
+		}
+	}
+
+	insertFree(offset, size);
+}
+
+uint64_t RangeAllocator::getLargestFreeRange() const
+{
+	return mFreeBySize.empty() ? 0 : mFreeBySize.rbegin()->first;
+}
+
+void RangeAllocator::insertFree(uint64_t offset, uint64_t size)
+{
+	mFreeByOffset.insert({ offset, size });
+	mFreeBySize.insert({ size, offset });
+	mFreeSize += size;
+}
+
+void RangeAllocator::eraseFree(std::map<uint64_t, uint64_t>::iterator it)
+{
+	auto range = mFreeBySize.equal_range(it->second);
+	for (auto sIt = range.first; sIt != range.second; ++sIt) {
+		if (sIt->second == it->first) {
+			mFreeBySize.erase(sIt);
+			break;
+		}
+	}
+	mFreeSize -= it->second;
+	mFreeByOffset.erase(it);
+}
+
+}
+}
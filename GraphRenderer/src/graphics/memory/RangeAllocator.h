@@ -0,0 +1,44 @@
+#pragma once
+
+#include <map>
+#include <cstdint>
+
+namespace gr
+{
+namespace vkg
+{
+
+// Suballocates ranges of a linear space, like a buffer. Keeps a free list
+// sorted by offset, to merge neighbour ranges when freeing, and by size,
+// to pick the smallest free range that fits. Not thread safe.
+class RangeAllocator
+{
+public:
+
+	RangeAllocator() = default;
+	explicit RangeAllocator(uint64_t size);
+
+	// The alignment does not need to be a power of two, so vertices can be
+	// aligned to their stride. Returns false if no free range fits.
+	bool allocate(uint64_t size, uint64_t alignment, uint64_t* outOffset);
+	void free(uint64_t offset, uint64_t size);
+
+	uint64_t getSize() const { return mSize; }
+	uint64_t getFreeSize() const { return mFreeSize; }
+	uint64_t getLargestFreeRange() const;
+	uint32_t getNumFreeRanges() const { return static_cast<uint32_t>(mFreeByOffset.size()); }
+
+private:
+	uint64_t mSize = 0;
+	uint64_t mFreeSize = 0;
+
+	// Offset to size, and size to offset
+	std::map<uint64_t, uint64_t> mFreeByOffset;
+	std::multimap<uint64_t, uint64_t> mFreeBySize;
+
+	void insertFree(uint64_t offset, uint64_t size);
+	void eraseFree(std::map<uint64_t, uint64_t>::iterator it);
+};
+
+}
+}
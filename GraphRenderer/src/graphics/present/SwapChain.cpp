@@ -84,6 +84,13 @@ void SwapChain::createSwapChainAndImages(const RenderContext& context, const Win
 		if (!(capabilities.supportedUsageFlags & vk::ImageUsageFlagBits::eTransferDst)) {
 			throw std::runtime_error("Swap chain does not support transfer operations");
 		}
+		// The captures are written as 8 bit RGB
+		const bool captureFormat = mFormat.format == vk::Format::eR8G8B8A8Unorm ||
+			mFormat.format == vk::Format::eR8G8B8A8Srgb ||
+			mFormat.format == vk::Format::eB8G8R8A8Unorm ||
+			mFormat.format == vk::Format::eB8G8R8A8Srgb;
+		mCaptureSupported = static_cast<bool>(capabilities.supportedUsageFlags & vk::ImageUsageFlagBits::eTransferSrc) &&
+			captureFormat;
 	}
 
 	vk::SwapchainCreateInfoKHR createInfo;
@@ -99,12 +106,15 @@ void SwapChain::createSwapChainAndImages(const RenderContext& context, const Win
 	createInfo.compositeAlpha = vk::CompositeAlphaFlagBitsKHR::eOpaque;
 	createInfo.clipped = VK_TRUE;
 	createInfo.imageUsage = vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferDst;
+	if (mCaptureSupported) {
+		createInfo.imageUsage |= vk::ImageUsageFlagBits::eTransferSrc;
+	}
 
 
-	// Check if the graphics family and the present family are different
-	if (context.getGraphicsFamilyIdx() != context.getPresentFamilyIdx()) {
-		std::array<uint32_t, 2> indices = { context.getGraphicsFamilyIdx(),  context.getPresentFamilyIdx() };
-
+	// Check if the graphics family and the present family are different.
+	// Captures are copied in the graphics queue, so they need no other family
+	const std::array<uint32_t, 2> indices = { context.getGraphicsFamilyIdx(),  context.getPresentFamilyIdx() };
+	if (indices[0] != indices[1]) {
 		createInfo.imageSharingMode = vk::SharingMode::eConcurrent;
 		createInfo.queueFamilyIndexCount = static_cast<uint32_t>(indices.size());
 		createInfo.pQueueFamilyIndices = indices.data();
@@ -30,6 +30,9 @@ namespace vkg
 
 		uint32_t getNumImages() const { return static_cast<uint32_t>(mImages.size()); }
 
+		// The images can be read back, see BufferReadback::readImage
+		bool isCaptureSupported() const { return mCaptureSupported; }
+
 		void recreateSwapChain(const RenderContext& device,
 			const Window& window);
 
@@ -57,6 +60,7 @@ namespace vkg
 		vk::Extent2D mExtent;
 		vk::SurfaceFormatKHR mFormat;
 		vk::PresentModeKHR mPresentMode;
+		bool mCaptureSupported = false;
 
 		void createSwapChainAndImages(const RenderContext& device, const Window& window);
 	};
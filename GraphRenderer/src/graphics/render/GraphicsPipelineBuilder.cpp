@@ -1,10 +1,35 @@
 #include "GraphicsPipelineBuilder.h"
 
+#include <type_traits>
+
 namespace gr
 {
 namespace vkg
 {
 
+namespace
+{
+// FNV-1a, fed field by field to skip the padding of the Vulkan structs
+class StateHasher
+{
+public:
+	template<typename T>
+	void add(const T& value)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Only plain values");
+		const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+		for (size_t i = 0; i < sizeof(T); ++i) {
+			mHash = (mHash ^ bytes[i]) * 1099511628211ull;
+		}
+	}
+
+	uint64_t get() const { return mHash; }
+
+private:
+	uint64_t mHash = 14695981039346656037ull;
+};
+}
+
 GraphicsPipelineBuilder::GraphicsPipelineBuilder() : PipelineBuilder(),
 	mViewport(0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 1.0f), // init viewport with everything zeroes except max depth
 	mRasterizationState( // Init rasterization state
@@ -131,7 +156,8 @@ void GraphicsPipelineBuilder::addDynamicState(vk::DynamicState state)
 vk::Pipeline GraphicsPipelineBuilder::createPipeline(
 	vk::Device device,
 	vk::RenderPass renderPass,
-	uint32_t subpass) const
+	uint32_t subpass,
+	vk::PipelineCache cache) const
 {
 
 	std::array<vk::PipelineShaderStageCreateInfo, 2> shaderStages = {
@@ -203,7 +229,7 @@ vk::Pipeline GraphicsPipelineBuilder::createPipeline(
 		subpass
 	);
 
-	vk::ResultValue<vk::Pipeline> res = device.createGraphicsPipeline(nullptr, createInfo);
+	vk::ResultValue<vk::Pipeline> res = device.createGraphicsPipeline(cache, createInfo);
 	if (res.result != vk::Result::eSuccess) {
 		throw std::runtime_error("Error creating graphics pipeline!!!");
 	}
@@ -211,5 +237,93 @@ vk::Pipeline GraphicsPipelineBuilder::createPipeline(
 	return res.value;
 }
 
+uint64_t GraphicsPipelineBuilder::computeHash() const
+{
+	StateHasher h;
+
+	h.add(static_cast<VkShaderModule>(mVertexModule));
+	h.add(static_cast<VkShaderModule>(mFragmentModule));
+
+	h.add(mVertInBindings.size());
+	for (const vk::VertexInputBindingDescription& b : mVertInBindings) {
+		h.add(b.binding);
+		h.add(b.stride);
+		h.add(b.inputRate);
+	}
+	h.add(mVertInAttributes.size());
+	for (const vk::VertexInputAttributeDescription& a : mVertInAttributes) {
+		h.add(a.location);
+		h.add(a.binding);
+		h.add(a.format);
+		h.add(a.offset);
+	}
+
+	h.add(mDynamicStates.size());
+	for (vk::DynamicState state : mDynamicStates) {
+		h.add(state);
+	}
+
+	h.add(mTopology);
+	h.add(mViewport.x);
+	h.add(mViewport.y);
+	h.add(mViewport.width);
+	h.add(mViewport.height);
+	h.add(mViewport.minDepth);
+	h.add(mViewport.maxDepth);
+	h.add(mScissor.offset.x);
+	h.add(mScissor.offset.y);
+	h.add(mScissor.extent.width);
+	h.add(mScissor.extent.height);
+
+	h.add(mRasterizationState.depthClampEnable);
+	h.add(mRasterizationState.rasterizerDiscardEnable);
+	h.add(mRasterizationState.polygonMode);
+	h.add(static_cast<VkCullModeFlags>(mRasterizationState.cullMode));
+	h.add(mRasterizationState.frontFace);
+	h.add(mRasterizationState.depthBiasEnable);
+	h.add(mRasterizationState.depthBiasConstantFactor);
+	h.add(mRasterizationState.depthBiasClamp);
+	h.add(mRasterizationState.depthBiasSlopeFactor);
+	h.add(mRasterizationState.lineWidth);
+
+	h.add(mDepthStencilState.depthTestEnable);
+	h.add(mDepthStencilState.depthWriteEnable);
+	h.add(mDepthStencilState.depthCompareOp);
+	h.add(mDepthStencilState.depthBoundsTestEnable);
+	h.add(mDepthStencilState.stencilTestEnable);
+
+	h.add(mMultisampleCount);
+
+	h.add(mColorBlendAttachment.blendEnable);
+	h.add(mColorBlendAttachment.srcColorBlendFactor);
+	h.add(mColorBlendAttachment.dstColorBlendFactor);
+	h.add(mColorBlendAttachment.colorBlendOp);
+	h.add(mColorBlendAttachment.srcAlphaBlendFactor);
+	h.add(mColorBlendAttachment.dstAlphaBlendFactor);
+	h.add(mColorBlendAttachment.alphaBlendOp);
+	h.add(static_cast<VkColorComponentFlags>(mColorBlendAttachment.colorWriteMask));
+
+	h.add(static_cast<VkPipelineLayout>(mPipLayout));
+
+	return h.get();
+}
+
+bool GraphicsPipelineBuilder::operator==(const GraphicsPipelineBuilder& o) const
+{
+	return mVertexModule == o.mVertexModule &&
+		mFragmentModule == o.mFragmentModule &&
+		mVertInBindings == o.mVertInBindings &&
+		mVertInAttributes == o.mVertInAttributes &&
+		mDynamicStates == o.mDynamicStates &&
+		mTopology == o.mTopology &&
+		mViewport == o.mViewport &&
+		mScissor == o.mScissor &&
+		mRasterizationState == o.mRasterizationState &&
+		mDepthStencilState == o.mDepthStencilState &&
+		mMultisampleCount == o.mMultisampleCount &&
+		mColorBlendAttachment == o.mColorBlendAttachment &&
+		mPipLayout == o.mPipLayout;
+}
+
 } // namespace vkg
 } // namespace gr
\ No newline at end of file
@@ -63,7 +63,14 @@ public:
 
 	void setCulling(vk::CullModeFlagBits culling) { mRasterizationState.setCullMode(culling); }
 
-	vk::Pipeline createPipeline(vk::Device device, vk::RenderPass renderPass, uint32_t subpass) const;
+	vk::Pipeline createPipeline(vk::Device device, vk::RenderPass renderPass, uint32_t subpass,
+		vk::PipelineCache cache = nullptr) const;
+
+	// Hash of all the state, without the render pass. Equal builders give the same pipeline
+	uint64_t computeHash() const;
+	// All the state of computeHash, to tell apart the builders with the same hash
+	bool operator==(const GraphicsPipelineBuilder& o) const;
+	bool operator!=(const GraphicsPipelineBuilder& o) const { return !(*this == o); }
 
 protected:
 
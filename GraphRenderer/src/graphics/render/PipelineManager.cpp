@@ -0,0 +1,322 @@
+#include "PipelineManager.h"
+
+#include "../RenderContext.h"
+#include "../../utils/grjob.h"
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+namespace gr
+{
+namespace vkg
+{
+
+void PipelineManager::initialize(const RenderContext& rc, const std::string& cachePath)
+{
+	assert(!mCache);
+	mCachePath = cachePath;
+
+	std::vector<char> data;
+	{
+		std::ifstream stream(cachePath, std::ios::binary | std::ios::ate);
+		if (stream) {
+			data.resize(static_cast<size_t>(stream.tellg()));
+			stream.seekg(0);
+			stream.read(data.data(), data.size());
+			if (!stream) {
+				data.clear();
+			}
+		}
+	}
+
+	// Header of VK_PIPELINE_CACHE_HEADER_VERSION_ONE. A cache of another device
+	// or driver would be ignored anyway, so it is not even passed
+	if (data.size() >= 16 + VK_UUID_SIZE) {
+		uint32_t header[4];
+		std::memcpy(header, data.data(), sizeof(header));
+		const vk::PhysicalDeviceProperties& props = rc.getPhysicalProperties();
+		const bool valid = header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+			header[2] == props.vendorID &&
+			header[3] == props.deviceID &&
+			std::memcmp(data.data() + 16, props.pipelineCacheUUID.data(), VK_UUID_SIZE) == 0;
+		if (!valid) {
+			data.clear();
+		}
+	}
+	else {
+		data.clear();
+	}
+
+	vk::PipelineCacheCreateInfo createInfo(
+		{},				// flags
+		data.size(),	// initial data size
+		data.data()		// initial data
+	);
+	mCache = rc.getDevice().createPipelineCache(createInfo);
+	mStats.loadedCacheBytes = data.size();
+}
+
+vk::Pipeline PipelineManager::getPipeline(
+	const RenderContext& rc,
+	const GraphicsPipelineBuilder& builder,
+	vk::RenderPass renderPass,
+	uint32_t subpass)
+{
+	Entry* entry;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		Handle handle;
+		bool added;
+		entry = findOrAddEntry(builder, renderPass, subpass, &handle, &added);
+		if (!added) {
+			mStats.numReused += 1;
+		}
+	}
+
+	waitEntry(entry);
+	if (!entry->pipeline) {
+		// New, or its asynchronous compilation failed
+		entry->pipeline = compile(rc, builder, renderPass, subpass);
+		entry->ready.store(true, std::memory_order_release);
+	}
+	return entry->pipeline;
+}
+
+PipelineManager::Handle PipelineManager::requestPipeline(
+	const RenderContext& rc,
+	const GraphicsPipelineBuilder& builder,
+	vk::RenderPass renderPass,
+	uint32_t subpass,
+	vk::Pipeline fallback)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	Handle handle;
+	bool added;
+	Entry* entry = findOrAddEntry(builder, renderPass, subpass, &handle, &added);
+	if (!added) {
+		mStats.numReused += 1;
+		return handle;
+	}
+
+	entry->fallback = fallback;
+	mStats.numPending += 1;
+
+	grjob::runJob(grjob::Priority::eLow,
+		grjob::Job(&PipelineManager::compileEntry, this, &rc, entry),
+		&entry->counter);
+
+	return handle;
+}
+
+vk::Pipeline PipelineManager::getPipeline(Handle handle) const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	auto it = mEntries.find(handle);
+	if (it == mEntries.end()) {
+		return nullptr;
+	}
+	const Entry& entry = *it->second;
+	if (entry.ready.load(std::memory_order_acquire) && entry.pipeline) {
+		return entry.pipeline;
+	}
+	return entry.fallback;
+}
+
+bool PipelineManager::isReady(Handle handle) const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	auto it = mEntries.find(handle);
+	return it != mEntries.end() && it->second->ready.load(std::memory_order_acquire);
+}
+
+void PipelineManager::destroyPipelines(const RenderContext& rc, vk::RenderPass renderPass)
+{
+	waitPending();
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	for (auto it = mEntries.begin(); it != mEntries.end();) {
+		if (it->second->renderPass != renderPass) {
+			++it;
+			continue;
+		}
+		if (it->second->pipeline) {
+			rc.destroy(it->second->pipeline);
+		}
+		auto range = mHandlesByHash.equal_range(it->second->hash);
+		for (auto h = range.first; h != range.second; ++h) {
+			if (h->second == it->first) {
+				mHandlesByHash.erase(h);
+				break;
+			}
+		}
+		it = mEntries.erase(it);
+	}
+}
+
+void PipelineManager::saveCache(const RenderContext& rc) const
+{
+	if (!mCache || mCachePath.empty()) {
+		return;
+	}
+
+	const std::vector<uint8_t> data = rc.getDevice().getPipelineCacheData(mCache);
+
+	const std::filesystem::path path(mCachePath);
+	if (path.has_parent_path()) {
+		std::filesystem::create_directories(path.parent_path());
+	}
+
+	// Written aside and renamed, so a crash does not leave half a cache
+	const std::filesystem::path tmpPath = path.string() + ".tmp";
+	{
+		std::ofstream stream(tmpPath, std::ofstream::trunc | std::ofstream::binary);
+		if (!stream) {
+			return;
+		}
+		stream.write(reinterpret_cast<const char*>(data.data()), data.size());
+		if (!stream) {
+			return;
+		}
+	}
+	std::error_code ec;
+	std::filesystem::rename(tmpPath, path, ec);
+}
+
+PipelineManager::Stats PipelineManager::getStats() const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	Stats stats = mStats;
+	stats.numPipelines = static_cast<uint32_t>(mEntries.size());
+	return stats;
+}
+
+void PipelineManager::destroy(const RenderContext& rc)
+{
+	waitPending();
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	for (auto& it : mEntries) {
+		if (it.second->pipeline) {
+			rc.destroy(it.second->pipeline);
+		}
+	}
+	mEntries.clear();
+	mHandlesByHash.clear();
+
+	if (mCache) {
+		saveCache(rc);
+		rc.getDevice().destroyPipelineCache(mCache);
+		mCache = nullptr;
+	}
+}
+
+uint64_t PipelineManager::s_computeHash(
+	const GraphicsPipelineBuilder& builder,
+	vk::RenderPass renderPass,
+	uint32_t subpass)
+{
+	uint64_t hash = builder.computeHash();
+	hash ^= reinterpret_cast<uint64_t>(static_cast<VkRenderPass>(renderPass)) + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+	hash ^= static_cast<uint64_t>(subpass) + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2);
+	return hash;
+}
+
+PipelineManager::Entry* PipelineManager::findOrAddEntry(
+	const GraphicsPipelineBuilder& builder,
+	vk::RenderPass renderPass,
+	uint32_t subpass,
+	Handle* outHandle,
+	bool* outAdded)
+{
+	const uint64_t hash = s_computeHash(builder, renderPass, subpass);
+
+	// Different states can share the hash, only the same state shares the pipeline
+	auto range = mHandlesByHash.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it) {
+		Entry* entry = mEntries.at(it->second).get();
+		if (entry->renderPass == renderPass && entry->subpass == subpass && entry->builder == builder) {
+			*outHandle = it->second;
+			*outAdded = false;
+			return entry;
+		}
+	}
+
+	const Handle handle = mNextHandle++;
+	Entry* entry = mEntries.emplace(handle, std::make_unique<Entry>()).first->second.get();
+	entry->renderPass = renderPass;
+	entry->subpass = subpass;
+	entry->builder = builder;
+	entry->hash = hash;
+	mHandlesByHash.emplace(hash, handle);
+
+	*outHandle = handle;
+	*outAdded = true;
+	return entry;
+}
+
+vk::Pipeline PipelineManager::compile(
+	const RenderContext& rc,
+	const GraphicsPipelineBuilder& builder,
+	vk::RenderPass renderPass,
+	uint32_t subpass)
+{
+	typedef std::chrono::duration<double_t> Fsec;
+	const auto start = std::chrono::high_resolution_clock::now();
+
+	vk::Pipeline pipeline = builder.createPipeline(rc.getDevice(), renderPass, subpass, mCache);
+
+	const Fsec time = std::chrono::high_resolution_clock::now() - start;
+	std::lock_guard<std::mutex> lock(mMutex);
+	mStats.compileTime += time.count();
+	return pipeline;
+}
+
+void PipelineManager::compileEntry(const RenderContext* rc, Entry* entry)
+{
+	try {
+		entry->pipeline = compile(*rc, entry->builder, entry->renderPass, entry->subpass);
+	}
+	catch (const std::exception&) {
+		// Keeps using the fallback
+		entry->pipeline = nullptr;
+	}
+	entry->ready.store(true, std::memory_order_release);
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	mStats.numPending -= 1;
+}
+
+void PipelineManager::waitEntry(Entry* entry)
+{
+	grjob::Counter* counter;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		counter = entry->counter;
+	}
+	if (counter) {
+		grjob::waitForCounter(counter, 0);
+	}
+}
+
+void PipelineManager::waitPending()
+{
+	// Without the lock, the jobs take it when they finish
+	std::vector<grjob::Counter*> counters;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		for (auto& it : mEntries) {
+			if (it.second->counter) {
+				counters.push_back(it.second->counter);
+				it.second->counter = nullptr;
+			}
+		}
+	}
+	for (grjob::Counter* counter : counters) {
+		grjob::waitForCounterAndFree(counter, 0);
+	}
+}
+
+}
+}
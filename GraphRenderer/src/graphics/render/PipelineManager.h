@@ -0,0 +1,115 @@
+#pragma once
+
+#include "GraphicsPipelineBuilder.h"
+
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace gr
+{
+namespace grjob
+{
+class Counter;
+}
+
+namespace vkg
+{
+
+class RenderContext;
+
+// Owns the graphics pipelines. Identical builder state gives the same
+// pipeline, all of them are created through one VkPipelineCache, and the
+// cache is stored on disk so the next run skips most of the compilation.
+class PipelineManager
+{
+public:
+
+	PipelineManager() = default;
+	PipelineManager(const PipelineManager&) = delete;
+	PipelineManager& operator=(const PipelineManager&) = delete;
+
+	// Loads the cache of a previous run, if it was made by the same device and driver
+	void initialize(const RenderContext& rc, const std::string& cachePath);
+
+	// Identifies the state of a requested pipeline, never 0
+	typedef uint64_t Handle;
+
+	// Returns the existing pipeline with the same state, or compiles it now
+	vk::Pipeline getPipeline(
+		const RenderContext& rc,
+		const GraphicsPipelineBuilder& builder,
+		vk::RenderPass renderPass,
+		uint32_t subpass);
+
+	// Compiles the pipeline in a worker. Until it is ready,
+	// getPipeline(handle) returns the fallback, that can be null
+	Handle requestPipeline(
+		const RenderContext& rc,
+		const GraphicsPipelineBuilder& builder,
+		vk::RenderPass renderPass,
+		uint32_t subpass,
+		vk::Pipeline fallback = nullptr);
+
+	vk::Pipeline getPipeline(Handle handle) const;
+	bool isReady(Handle handle) const;
+
+	// Before destroying a render pass
+	void destroyPipelines(const RenderContext& rc, vk::RenderPass renderPass);
+
+	void saveCache(const RenderContext& rc) const;
+
+	struct Stats {
+		uint32_t numPipelines = 0;
+		uint32_t numPending = 0;
+		// Requests served with an existing pipeline
+		uint32_t numReused = 0;
+		size_t loadedCacheBytes = 0;
+		double_t compileTime = 0.0;
+	};
+	Stats getStats() const;
+
+	// Waits for the pending compilations, and saves the cache
+	void destroy(const RenderContext& rc);
+
+private:
+
+	struct Entry {
+		vk::RenderPass renderPass;
+		vk::Pipeline pipeline;
+		vk::Pipeline fallback;
+		std::atomic<bool> ready = false;
+
+		// Compared on a hit of the hash, and compiled from in a worker
+		GraphicsPipelineBuilder builder;
+		uint32_t subpass = 0;
+		uint64_t hash = 0;
+		grjob::Counter* counter = nullptr;
+	};
+
+	vk::PipelineCache mCache;
+	std::string mCachePath;
+
+	std::unordered_map<Handle, std::unique_ptr<Entry>> mEntries;
+	// Handles of the entries with each hash, usually one
+	std::unordered_multimap<uint64_t, Handle> mHandlesByHash;
+	Handle mNextHandle = 1;
+	mutable std::mutex mMutex;
+
+	Stats mStats;
+
+	static uint64_t s_computeHash(const GraphicsPipelineBuilder& builder, vk::RenderPass renderPass, uint32_t subpass);
+	// With the lock. The entry with the same state, or a new one
+	Entry* findOrAddEntry(const GraphicsPipelineBuilder& builder, vk::RenderPass renderPass, uint32_t subpass,
+		Handle* outHandle, bool* outAdded);
+	vk::Pipeline compile(const RenderContext& rc, const GraphicsPipelineBuilder& builder, vk::RenderPass renderPass, uint32_t subpass);
+	void compileEntry(const RenderContext* rc, Entry* entry);
+	void waitEntry(Entry* entry);
+	void waitPending();
+};
+
+}
+}
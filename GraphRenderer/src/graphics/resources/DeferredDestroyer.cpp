@@ -0,0 +1,103 @@
+#include "DeferredDestroyer.h"
+
+#include "../RenderContext.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace gr
+{
+namespace vkg
+{
+
+template<typename T>
+uint32_t DeferredDestroyer::drainQueue(RenderContext& rc, Queue<T>* queue, uint64_t completedValue,
+	std::chrono::high_resolution_clock::time_point now, double_t* sumLatency, double_t* maxLatency)
+{
+	typedef std::chrono::duration<double_t> Fsec;
+
+	// The values are not in order, the ones of the pending objects are moved to the front
+	size_t numKept = 0;
+	for (size_t i = 0; i < queue->size(); ++i) {
+		Entry<T>& entry = (*queue)[i];
+		if (entry.value > completedValue) {
+			(*queue)[numKept++] = entry;
+			continue;
+		}
+
+		s_destroy(rc, entry.obj);
+		const Fsec latency = now - entry.pushTime;
+		*sumLatency += latency.count();
+		*maxLatency = std::max(*maxLatency, latency.count());
+	}
+
+	const uint32_t numDestroyed = static_cast<uint32_t>(queue->size() - numKept);
+	// Keeps the capacity
+	queue->resize(numKept);
+	return numDestroyed;
+}
+
+template<typename T>
+void DeferredDestroyer::s_destroy(RenderContext& rc, const T& obj)
+{
+	rc.destroy(obj);
+}
+
+void DeferredDestroyer::pushDescriptorSet(vk::DescriptorSet set, vk::DescriptorSetLayout layout, uint64_t timelineValue)
+{
+	push(DescriptorSetFree{ set, layout }, timelineValue);
+}
+
+void DeferredDestroyer::pushCommandBuffer(FreeCommandPool* pool, const FreeCommandPool::FreeCommandBuffer& command, uint64_t timelineValue)
+{
+	push(CommandBufferFree{ pool, command }, timelineValue);
+}
+
+void DeferredDestroyer::drain(RenderContext& rc, uint64_t completedValue)
+{
+	const auto now = std::chrono::high_resolution_clock::now();
+	double_t sumLatency = 0.0, maxLatency = 0.0;
+	uint32_t numDestroyed = 0;
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	std::apply([&](auto&... queues) {
+		((numDestroyed += drainQueue(rc, &queues, completedValue, now, &sumLatency, &maxLatency)), ...);
+	}, mQueues);
+
+	uint32_t numPending = 0;
+	std::apply([&](const auto&... queues) {
+		((numPending += static_cast<uint32_t>(queues.size())), ...);
+	}, mQueues);
+
+	mStats.numPending = numPending;
+	mStats.numDestroyed = numDestroyed;
+	mStats.totalDestroyed += numDestroyed;
+	if (numDestroyed != 0) {
+		mStats.meanLatency = sumLatency / numDestroyed;
+		mStats.maxLatency = maxLatency;
+	}
+}
+
+DeferredDestroyer::Stats DeferredDestroyer::getStats() const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mStats;
+}
+
+void DeferredDestroyer::destroy(RenderContext& rc)
+{
+	drain(rc, std::numeric_limits<uint64_t>::max());
+}
+
+void DeferredDestroyer::s_destroy(RenderContext& rc, const DescriptorSetFree& obj)
+{
+	rc.freeDescriptorSet(obj.set, obj.layout);
+}
+
+void DeferredDestroyer::s_destroy(RenderContext& rc, const CommandBufferFree& obj)
+{
+	obj.pool->freeCommandBuffer(obj.command);
+}
+
+}
+}
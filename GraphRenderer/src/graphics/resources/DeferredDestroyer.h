@@ -0,0 +1,117 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include "Buffer.h"
+#include "Image2D.h"
+#include "GeometryArena.h"
+#include "../command/FreeCommandPool.h"
+
+namespace gr
+{
+namespace vkg
+{
+
+class RenderContext;
+
+// Objects that the GPU may still be using, destroyed once a timeline value is
+// reached. Each type has its own queue that keeps its capacity, so scheduling
+// does not allocate once the queues have grown. Drained by the Engine once per
+// frame with the value of the frame timeline semaphore. Thread safe.
+class DeferredDestroyer
+{
+public:
+
+	DeferredDestroyer() = default;
+	DeferredDestroyer(const DeferredDestroyer&) = delete;
+	DeferredDestroyer& operator=(const DeferredDestroyer&) = delete;
+
+	// Destroyed with RenderContext::destroy once the timeline reaches the value.
+	// Value 0 is already reached, the object goes in the next drain
+	template<typename T>
+	void push(const T& obj, uint64_t timelineValue);
+
+	// Returns to the free list of its layout
+	void pushDescriptorSet(vk::DescriptorSet set, vk::DescriptorSetLayout layout, uint64_t timelineValue);
+	// Freed to its pool, in the thread that drains
+	void pushCommandBuffer(FreeCommandPool* pool, const FreeCommandPool::FreeCommandBuffer& command, uint64_t timelineValue);
+
+	// Destroys the objects of the completed values. While no thread allocates from the free command pools
+	void drain(RenderContext& rc, uint64_t completedValue);
+
+	struct Stats {
+		uint32_t numPending = 0;
+		// In the last drain
+		uint32_t numDestroyed = 0;
+		uint64_t totalDestroyed = 0;
+		// From the push to the destruction, of the objects of the last drain that destroyed any
+		double_t meanLatency = 0.0;
+		double_t maxLatency = 0.0;
+	};
+	Stats getStats() const;
+
+	// Destroys all the objects, once the device is idle
+	void destroy(RenderContext& rc);
+
+private:
+
+	struct DescriptorSetFree {
+		vk::DescriptorSet set;
+		vk::DescriptorSetLayout layout;
+	};
+
+	struct CommandBufferFree {
+		FreeCommandPool* pool;
+		FreeCommandPool::FreeCommandBuffer command;
+	};
+
+	template<typename T>
+	struct Entry {
+		T obj;
+		uint64_t value;
+		std::chrono::high_resolution_clock::time_point pushTime;
+	};
+
+	template<typename T>
+	using Queue = std::vector<Entry<T>>;
+
+	std::tuple<
+		Queue<Buffer>,
+		Queue<Image2D>,
+		Queue<GeometryRange>,
+		Queue<vk::Pipeline>,
+		Queue<vk::PipelineLayout>,
+		Queue<vk::Sampler>,
+		Queue<vk::DescriptorSetLayout>,
+		Queue<DescriptorSetFree>,
+		Queue<CommandBufferFree>
+	> mQueues;
+
+	Stats mStats;
+	mutable std::mutex mMutex;
+
+	// With the lock held. Returns the number of objects destroyed
+	template<typename T>
+	uint32_t drainQueue(RenderContext& rc, Queue<T>* queue, uint64_t completedValue,
+		std::chrono::high_resolution_clock::time_point now, double_t* sumLatency, double_t* maxLatency);
+
+	template<typename T>
+	static void s_destroy(RenderContext& rc, const T& obj);
+	static void s_destroy(RenderContext& rc, const DescriptorSetFree& obj);
+	static void s_destroy(RenderContext& rc, const CommandBufferFree& obj);
+};
+
+template<typename T>
+inline void DeferredDestroyer::push(const T& obj, uint64_t timelineValue)
+{
+	const auto now = std::chrono::high_resolution_clock::now();
+	std::lock_guard<std::mutex> lock(mMutex);
+	std::get<Queue<T>>(mQueues).push_back({ obj, timelineValue, now });
+}
+
+}
+}
@@ -2,6 +2,8 @@
 
 #include "../RenderContext.h"
 
+#include <algorithm>
+
 
 namespace gr
 {
@@ -16,33 +18,21 @@ DescriptorManager::DescriptorManager(const RenderContext& context)
 void DescriptorManager::initialize(const RenderContext& context)
 {
 	// If it is already initialized, destroy
-	if (mDescriptorPool) {
+	if (!mPools.empty()) {
 		destroy(context);
 	}
 
-	typedef vk::DescriptorPoolSize DPS;
-	std::array< DPS, 2> poolSizes =
-	{
-		DPS{vk::DescriptorType::eUniformBuffer, MAX_SIZE_RESOURCE},
-		DPS{vk::DescriptorType::eCombinedImageSampler, MAX_SIZE_RESOURCE}
-	};
-
-	
-
-	vk::DescriptorPoolCreateInfo createInfo(
-		{},
-		2 * MAX_SIZE_RESOURCE, // max sets
-		poolSizes
-	);
-
-	mDescriptorPool = context.getDevice().createDescriptorPool(createInfo);
+	addPool(context);
 }
 
 void DescriptorManager::destroy(const RenderContext& context)
 {
-	context.getDevice().destroyDescriptorPool(mDescriptorPool);
-	mDescriptorSetsCache.clear();
-	mDescriptorPool = nullptr;
+	for (vk::DescriptorPool pool : mPools) {
+		context.getDevice().destroyDescriptorPool(pool);
+	}
+	mPools.clear();
+	mFreeSets.clear();
+	mNumSets = 0;
 }
 
 void DescriptorManager::allocateDescriptorSets(
@@ -51,17 +41,16 @@ void DescriptorManager::allocateDescriptorSets(
 	const vk::DescriptorSetLayout layout,
 	vk::DescriptorSet* outLayouts)
 {
-	// First check if there exists cached descriptor sets of the layout
-	typedef std::pair<decltype(mDescriptorSetsCache)::const_iterator, decltype(mDescriptorSetsCache)::const_iterator> Range;
-	Range range = mDescriptorSetsCache.equal_range(layout);
-	if (range.first != range.second) {
-		uint32_t numCached = 0;
-		decltype(mDescriptorSetsCache)::const_iterator it = range.first;
-		while (it != range.second && numCached < num) {
-			outLayouts[numCached] = it->second;
-			// advance and delete entry
-			it = mDescriptorSetsCache.erase(it);
-			numCached += 1;
+	std::unique_lock lock(mMutex);
+
+	// First reuse the freed descriptor sets of the layout
+	auto freeIt = mFreeSets.find(layout);
+	if (freeIt != mFreeSets.end()) {
+		std::vector<vk::DescriptorSet>& freeSets = freeIt->second;
+		const uint32_t numCached = std::min(num, static_cast<uint32_t>(freeSets.size()));
+		for (uint32_t i = 0; i < numCached; ++i) {
+			outLayouts[i] = freeSets.back();
+			freeSets.pop_back();
 		}
 
 		// move pointer and update num
@@ -76,20 +65,64 @@ void DescriptorManager::allocateDescriptorSets(
 
 	std::vector<vk::DescriptorSetLayout> layouts(num, layout);
 	vk::DescriptorSetAllocateInfo allocInfo(
-		mDescriptorPool,
+		mPools.back(),
 		num, layouts.data()
 	);
 
 	vk::Result res = context.getDevice().allocateDescriptorSets(&allocInfo, outLayouts);
+	if (res == vk::Result::eErrorOutOfPoolMemory || res == vk::Result::eErrorFragmentedPool) {
+		// The last pool is full, continue in a new one with room for all the sets
+		addPool(context, std::max(num, SETS_PER_POOL));
+		allocInfo.descriptorPool = mPools.back();
+		res = context.getDevice().allocateDescriptorSets(&allocInfo, outLayouts);
+	}
 	if (res != vk::Result::eSuccess) {
 		throw std::runtime_error("Error: Cannot allocate descriptor set!!");
 	}
+	mNumSets += num;
 }
 
 void DescriptorManager::freeDescriptorSet(vk::DescriptorSet descriptorSet, vk::DescriptorSetLayout layout)
 {
-	mDescriptorSetsCache.emplace(layout, descriptorSet);
+	std::unique_lock lock(mMutex);
+	mFreeSets[layout].push_back(descriptorSet);
+}
+
+DescriptorManager::Stats DescriptorManager::getStats() const
+{
+	std::unique_lock lock(mMutex);
+	Stats stats;
+	stats.numPools = static_cast<uint32_t>(mPools.size());
+	stats.numSets = mNumSets;
+	for (const auto& it : mFreeSets) {
+		stats.numFreeSets += static_cast<uint32_t>(it.second.size());
+	}
+	return stats;
 }
 
+vk::DescriptorPool DescriptorManager::s_createPool(const RenderContext& context, uint32_t maxSets)
+{
+	typedef vk::DescriptorPoolSize DPS;
+	std::array< DPS, 3> poolSizes =
+	{
+		DPS{vk::DescriptorType::eUniformBuffer, maxSets},
+		DPS{vk::DescriptorType::eUniformBufferDynamic, maxSets},
+		DPS{vk::DescriptorType::eCombinedImageSampler, maxSets}
+	};
+
+	vk::DescriptorPoolCreateInfo createInfo(
+		{},
+		maxSets, // max sets
+		poolSizes
+	);
+
+	return context.getDevice().createDescriptorPool(createInfo);
+}
+
+void DescriptorManager::addPool(const RenderContext& context, uint32_t maxSets)
+{
+	mPools.push_back(s_createPool(context, maxSets));
+}
+
+}
 }
-}
\ No newline at end of file
@@ -3,6 +3,8 @@
 #include <vulkan/vulkan.hpp>
 
 #include <unordered_map>
+#include <vector>
+#include <mutex>
 
 namespace gr
 {
@@ -31,16 +33,37 @@ public:
 		const vk::DescriptorSetLayout layout, 
 		vk::DescriptorSet* outLayouts);
 
+	// The set is kept in the free list of its layout, to be reused
 	void freeDescriptorSet(vk::DescriptorSet descriptorSet, vk::DescriptorSetLayout layout);
 
+	struct Stats {
+		uint32_t numPools = 0;
+		// Allocated from the pools, including the free ones
+		uint32_t numSets = 0;
+		uint32_t numFreeSets = 0;
+	};
+	Stats getStats() const;
+
+	// Pool with room for maxSets sets, of up to one descriptor of each type
+	static vk::DescriptorPool s_createPool(const RenderContext& context, uint32_t maxSets);
+
+	static constexpr uint32_t SETS_PER_POOL = 512;
+
 private:
-	static constexpr uint32_t MAX_SIZE_RESOURCE = 1000;
-	vk::DescriptorPool mDescriptorPool;
+	// Chain of pools, a new one is added when the last is full
+	std::vector<vk::DescriptorPool> mPools;
+	uint32_t mNumSets = 0;
 
-	std::unordered_multimap<vk::DescriptorSetLayout, vk::DescriptorSet> mDescriptorSetsCache;
+	// Free list per layout
+	std::unordered_map<vk::DescriptorSetLayout, std::vector<vk::DescriptorSet>> mFreeSets;
 
+	// Resources can be started from several threads
+	mutable std::mutex mMutex;
+
+	// Larger than SETS_PER_POOL for the allocations that do not fit in one
+	void addPool(const RenderContext& context, uint32_t maxSets = SETS_PER_POOL);
 };
 
 
 }
-}
\ No newline at end of file
+}
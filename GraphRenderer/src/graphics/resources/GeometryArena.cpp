@@ -0,0 +1,207 @@
+#include "GeometryArena.h"
+
+#include "../RenderContext.h"
+
+#include <algorithm>
+
+namespace gr
+{
+namespace vkg
+{
+
+GeometryRange GeometryArena::allocateVertices(const RenderContext& rc, vk::DeviceSize numBytes, vk::DeviceSize stride)
+{
+	return allocate(rc, GeometryRange::Kind::eVertex, numBytes, stride);
+}
+
+GeometryRange GeometryArena::allocateIndices(const RenderContext& rc, vk::DeviceSize numBytes, vk::DeviceSize indexSize)
+{
+	return allocate(rc, GeometryRange::Kind::eIndex, numBytes, indexSize);
+}
+
+void GeometryArena::free(const GeometryRange& range)
+{
+	if (!range) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (range.block == DEDICATED_BLOCK) {
+		// Not found if the arena was destroyed before the last scheduled frees
+		for (Dedicated& dedicated : mDedicated) {
+			if (&dedicated.buffer == range.buffer) {
+				dedicated.freed = true;
+			}
+		}
+		return;
+	}
+
+	Heap& heap = getHeap(range.kind);
+	assert(range.block < heap.numBlocks);
+	Block& block = heap.blocks[range.block];
+	// The arena may have been destroyed before the last scheduled frees
+	if (!block.buffer) {
+		return;
+	}
+
+	block.allocator.free(range.offset, range.size);
+	block.numAllocations -= 1;
+}
+
+const Buffer& GeometryArena::getBuffer(const GeometryRange& range) const
+{
+	assert(range.block < MAX_BLOCKS || range.block == DEDICATED_BLOCK);
+	return *range.buffer;
+}
+
+void GeometryArena::releaseEmptyBlocks(RenderContext* rc, uint64_t timelineValue)
+{
+	// Pushed without the lock, the drain of the destroyer frees ranges with its own
+	std::vector<Buffer> released;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		for (Heap* heap : { &mVertexHeap, &mIndexHeap }) {
+			for (uint32_t i = 0; i < heap->numBlocks; ++i) {
+				Block& block = heap->blocks[i];
+				if (block.buffer && block.numAllocations == 0) {
+					released.push_back(block.buffer);
+					// Reset with the allocation, so the defragmentation sees that the
+					// block no longer owns it
+					block.buffer = Buffer();
+					block.allocator = RangeAllocator();
+				}
+			}
+		}
+		for (auto it = mDedicated.begin(); it != mDedicated.end();) {
+			if (it->freed) {
+				released.push_back(it->buffer);
+				it = mDedicated.erase(it);
+			}
+			else {
+				++it;
+			}
+		}
+		mNumReleased += static_cast<uint32_t>(released.size());
+	}
+
+	for (const Buffer& buffer : released) {
+		rc->getDeferredDestroyer().push(buffer, timelineValue);
+	}
+}
+
+GeometryArena::Stats GeometryArena::getStats() const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	Stats stats;
+	for (const Heap* heap : { &mVertexHeap, &mIndexHeap }) {
+		for (uint32_t i = 0; i < heap->numBlocks; ++i) {
+			const Block& block = heap->blocks[i];
+			if (!block.buffer) {
+				continue;
+			}
+			stats.numBlocks += 1;
+			stats.numAllocations += block.numAllocations;
+			stats.capacity += block.allocator.getSize();
+			stats.used += block.allocator.getSize() - block.allocator.getFreeSize();
+		}
+	}
+	for (const Dedicated& dedicated : mDedicated) {
+		stats.numDedicated += 1;
+		stats.capacity += dedicated.buffer.getSize();
+		if (!dedicated.freed) {
+			stats.numAllocations += 1;
+			stats.used += dedicated.buffer.getSize();
+		}
+	}
+	stats.numReleased = mNumReleased;
+	return stats;
+}
+
+void GeometryArena::destroy(const RenderContext& rc)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	for (Heap* heap : { &mVertexHeap, &mIndexHeap }) {
+		for (uint32_t i = 0; i < heap->numBlocks; ++i) {
+			Block& block = heap->blocks[i];
+			rc.destroy(block.buffer);
+			block.buffer = nullptr;
+			block.allocator = RangeAllocator();
+			block.numAllocations = 0;
+		}
+		// Keep numBlocks, so late frees find an empty block
+	}
+	for (Dedicated& dedicated : mDedicated) {
+		rc.destroy(dedicated.buffer);
+	}
+	mDedicated.clear();
+}
+
+GeometryRange GeometryArena::allocate(
+	const RenderContext& rc,
+	GeometryRange::Kind kind,
+	vk::DeviceSize numBytes,
+	vk::DeviceSize alignment)
+{
+	GeometryRange range;
+	range.kind = kind;
+	if (numBytes == 0) {
+		return range;
+	}
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	Heap& heap = getHeap(kind);
+
+	// First block with a free range that fits
+	for (uint32_t i = 0; i < heap.numBlocks; ++i) {
+		Block& block = heap.blocks[i];
+		if (block.buffer && block.allocator.allocate(numBytes, alignment, &range.offset)) {
+			block.numAllocations += 1;
+			range.block = i;
+			range.buffer = &block.buffer;
+			range.size = numBytes;
+			return range;
+		}
+	}
+
+	// Reuse a block destroyed before, or add a new one
+	uint32_t blockIdx = 0;
+	while (blockIdx < heap.numBlocks && heap.blocks[blockIdx].buffer) {
+		++blockIdx;
+	}
+	if (blockIdx == MAX_BLOCKS) {
+		// All the blocks are in use, the range gets a buffer of its own. Not movable,
+		// its Buffer is freed with the list node before the allocation is destroyed
+		Dedicated& dedicated = mDedicated.emplace_back();
+		dedicated.buffer = kind == GeometryRange::Kind::eVertex ?
+			rc.createVertexBuffer(numBytes) :
+			rc.createIndexBuffer(numBytes);
+		range.block = DEDICATED_BLOCK;
+		range.buffer = &dedicated.buffer;
+		range.offset = 0;
+		range.size = numBytes;
+		return range;
+	}
+	heap.numBlocks = std::max(heap.numBlocks, blockIdx + 1);
+
+	const vk::DeviceSize blockSize = std::max(numBytes,
+		kind == GeometryRange::Kind::eVertex ? VERTEX_BLOCK_SIZE : INDEX_BLOCK_SIZE);
+	Block& block = heap.blocks[blockIdx];
+	block.buffer = kind == GeometryRange::Kind::eVertex ?
+		rc.createVertexBuffer(blockSize) :
+		rc.createIndexBuffer(blockSize);
+	rc.getMemoryManager().setMovable(&block.buffer);
+	block.allocator = RangeAllocator(blockSize);
+	block.numAllocations = 1;
+
+	const bool allocated = block.allocator.allocate(numBytes, alignment, &range.offset);
+	assert(allocated && range.offset == 0);
+	(void)allocated;
+
+	range.block = blockIdx;
+	range.buffer = &block.buffer;
+	range.size = numBytes;
+	return range;
+}
+
+}
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <array>
+#include <list>
+#include <mutex>
+#include <vector>
+
+#include "Buffer.h"
+#include "../memory/RangeAllocator.h"
+
+namespace gr
+{
+namespace vkg
+{
+
+class RenderContext;
+
+// Range of one of the big vertex or index buffers of the GeometryArena
+struct GeometryRange
+{
+	enum class Kind : uint32_t { eVertex, eIndex };
+
+	Kind kind = Kind::eVertex;
+	// Or GeometryArena::DEDICATED_BLOCK, when the range has a buffer of its own
+	uint32_t block = 0;
+	// The block can be moved by the Defragmenter, read its vk::Buffer when recording
+	const Buffer* buffer = nullptr;
+	vk::DeviceSize offset = 0;
+	vk::DeviceSize size = 0;
+
+	operator bool() const { return buffer != nullptr; }
+};
+
+// Suballocates the geometry of all the meshes from a few big device local
+// buffers, so the draws can share the bound vertex and index buffers and
+// only change firstIndex and vertexOffset. Thread safe.
+class GeometryArena
+{
+public:
+
+	GeometryArena() = default;
+	GeometryArena(const GeometryArena&) = delete;
+	GeometryArena& operator=(const GeometryArena&) = delete;
+
+	// The offset is a multiple of the stride, to use it as vertexOffset
+	GeometryRange allocateVertices(const RenderContext& rc, vk::DeviceSize numBytes, vk::DeviceSize stride);
+	GeometryRange allocateIndices(const RenderContext& rc, vk::DeviceSize numBytes, vk::DeviceSize indexSize);
+
+	// Frees immediately, schedule it through the FrameContext if the GPU may be using it.
+	// The blocks left empty are released in the next releaseEmptyBlocks
+	void free(const GeometryRange& range);
+
+	// Once per frame. Sends the empty blocks, and the buffers of the freed dedicated
+	// ranges, to the DeferredDestroyer with the timeline value
+	void releaseEmptyBlocks(RenderContext* rc, uint64_t timelineValue);
+
+	// Valid while the range is alive
+	const Buffer& getBuffer(const GeometryRange& range) const;
+
+	struct Stats {
+		uint32_t numBlocks = 0;
+		uint32_t numAllocations = 0;
+		// Ranges with a buffer of their own, because all the blocks were in use
+		uint32_t numDedicated = 0;
+		uint32_t numReleased = 0;
+		vk::DeviceSize capacity = 0;
+		vk::DeviceSize used = 0;
+	};
+	Stats getStats() const;
+
+	void destroy(const RenderContext& rc);
+
+	// Allocations bigger than a block get a block of their size
+	static constexpr vk::DeviceSize VERTEX_BLOCK_SIZE = 1 << 26;
+	static constexpr vk::DeviceSize INDEX_BLOCK_SIZE = 1 << 25;
+	static constexpr uint32_t MAX_BLOCKS = 16;
+	static constexpr uint32_t DEDICATED_BLOCK = UINT32_MAX;
+
+private:
+
+	struct Block {
+		Buffer buffer;
+		RangeAllocator allocator;
+		uint32_t numAllocations = 0;
+	};
+
+	// Fixed arrays, so the blocks never move while other threads read them
+	struct Heap {
+		std::array<Block, MAX_BLOCKS> blocks;
+		uint32_t numBlocks = 0;
+	};
+
+	struct Dedicated {
+		Buffer buffer;
+		bool freed = false;
+	};
+
+	Heap mVertexHeap;
+	Heap mIndexHeap;
+	// A list, so the buffers never move while other threads read them
+	std::list<Dedicated> mDedicated;
+	uint32_t mNumReleased = 0;
+	mutable std::mutex mMutex;
+
+	Heap& getHeap(GeometryRange::Kind kind) { return kind == GeometryRange::Kind::eVertex ? mVertexHeap : mIndexHeap; }
+	const Heap& getHeap(GeometryRange::Kind kind) const { return kind == GeometryRange::Kind::eVertex ? mVertexHeap : mIndexHeap; }
+
+	GeometryRange allocate(const RenderContext& rc, GeometryRange::Kind kind, vk::DeviceSize numBytes, vk::DeviceSize alignment);
+};
+
+}
+}
@@ -0,0 +1,145 @@
+#include "TransformBuffer.h"
+
+#include "../RenderContext.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace gr
+{
+namespace vkg
+{
+
+void TransformBuffer::initialize(RenderContext& rc, uint32_t numFrames)
+{
+	assert(!mFrames);
+	mNumFrames = numFrames;
+	mFrames = std::make_unique<Frame[]>(numFrames);
+	mStride = static_cast<uint32_t>(rc.padUniformBuffer(sizeof(RenderContext::BasicTransformUBO)));
+}
+
+uint32_t TransformBuffer::allocateSlot()
+{
+	std::lock_guard<std::mutex> lock(mSlotsMutex);
+	if (!mFreeSlots.empty()) {
+		const uint32_t slot = mFreeSlots.back();
+		mFreeSlots.pop_back();
+		return slot;
+	}
+	return mNumSlots++;
+}
+
+void TransformBuffer::freeSlot(uint32_t slot)
+{
+	if (slot == INVALID_SLOT) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mSlotsMutex);
+	assert(slot < mNumSlots);
+	mFreeSlots.push_back(slot);
+}
+
+void TransformBuffer::beginFrame(RenderContext& rc, uint32_t frameIdx, vk::DescriptorSet frameSet)
+{
+	assert(frameIdx < mNumFrames);
+	Frame& frame = mFrames[frameIdx];
+	frame.numWrites = 0;
+	// The set of the previous use of the frame was reset with its pool
+	frame.descriptorSet = frameSet;
+
+	uint32_t numSlots;
+	{
+		std::lock_guard<std::mutex> lock(mSlotsMutex);
+		numSlots = mNumSlots;
+	}
+	if (numSlots <= frame.capacity && frame.buffer) {
+		updateDescriptorSet(rc, frame);
+		return;
+	}
+
+	uint32_t capacity = std::max(frame.capacity, MIN_CAPACITY);
+	while (capacity < numSlots) {
+		capacity *= 2;
+	}
+
+	Buffer buffer = rc.createUniformBuffer(static_cast<size_t>(capacity) * mStride);
+	uint8_t* bufferPtr;
+	rc.mapAllocatable(buffer, reinterpret_cast<void**>(&bufferPtr));
+
+	// The GPU is done with this frame, so the old buffer can go now
+	if (frame.buffer) {
+		std::memcpy(bufferPtr, frame.bufferPtr, static_cast<size_t>(frame.capacity) * mStride);
+		rc.unmapAllocatable(frame.buffer);
+		rc.destroy(frame.buffer);
+	}
+
+	frame.buffer = buffer;
+	frame.bufferPtr = bufferPtr;
+	frame.capacity = capacity;
+	updateDescriptorSet(rc, frame);
+}
+
+bool TransformBuffer::write(uint32_t frameIdx, uint32_t slot, const glm::mat4& modelMatrix)
+{
+	assert(frameIdx < mNumFrames);
+	Frame& frame = mFrames[frameIdx];
+	if (slot >= frame.capacity) {
+		return false;
+	}
+
+	RenderContext::BasicTransformUBO ubo;
+	ubo.M = modelMatrix;
+	std::memcpy(frame.bufferPtr + static_cast<size_t>(slot) * mStride, &ubo, sizeof(ubo));
+	frame.numWrites.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+TransformBuffer::Stats TransformBuffer::getStats(uint32_t frameIdx) const
+{
+	Stats stats;
+	{
+		std::lock_guard<std::mutex> lock(mSlotsMutex);
+		stats.numSlots = mNumSlots - static_cast<uint32_t>(mFreeSlots.size());
+	}
+	if (frameIdx < mNumFrames) {
+		stats.capacity = mFrames[frameIdx].capacity;
+		stats.numWrites = mFrames[frameIdx].numWrites.load(std::memory_order_relaxed);
+	}
+	return stats;
+}
+
+void TransformBuffer::destroy(RenderContext& rc)
+{
+	for (uint32_t i = 0; i < mNumFrames; ++i) {
+		Frame& frame = mFrames[i];
+		if (frame.buffer) {
+			rc.unmapAllocatable(frame.buffer);
+			rc.destroy(frame.buffer);
+		}
+	}
+	mFrames.reset();
+	mNumFrames = 0;
+}
+
+void TransformBuffer::updateDescriptorSet(RenderContext& rc, const Frame& frame) const
+{
+	// Dynamic uniform buffer, each draw selects its slot with the offset
+	vk::DescriptorBufferInfo buffInfo(
+		frame.buffer.getVkBuffer(),         // buffer
+		0,                                  // offset
+		sizeof(RenderContext::BasicTransformUBO) // range
+	);
+
+	vk::WriteDescriptorSet write(
+		frame.descriptorSet,                // dst descriptor set
+		0, 0,                               // dst binding, dst array
+		1,                                  // descriptor count
+		vk::DescriptorType::eUniformBufferDynamic,
+		nullptr, &buffInfo, nullptr
+	);
+
+	rc.getDevice().updateDescriptorSets(1, &write, 0, nullptr);
+}
+
+}
+}
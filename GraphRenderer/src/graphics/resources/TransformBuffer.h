@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Buffer.h"
+
+namespace gr
+{
+namespace vkg
+{
+
+class RenderContext;
+
+// Model matrices of all the objects, in one host visible uniform buffer per
+// frame in flight. Each object owns a slot, that is selected with the dynamic
+// offset of the descriptor set of the frame, so all the draws share the set.
+// The buffer of a frame is only touched while that frame is being prepared,
+// when the GPU is done with it. The set is a transient one of the frame.
+class TransformBuffer
+{
+public:
+
+	TransformBuffer() = default;
+	TransformBuffer(const TransformBuffer&) = delete;
+	TransformBuffer& operator=(const TransformBuffer&) = delete;
+
+	void initialize(RenderContext& rc, uint32_t numFrames);
+
+	// Thread safe. Slots are reused immediately, the new owner rewrites them
+	uint32_t allocateSlot();
+	void freeSlot(uint32_t slot);
+
+	// Call right before the objects write their matrices, once the GPU finished the frame
+	// and after the objects of the frame were started. Grows the buffer of the frame to
+	// fit all the slots, keeping its contents.
+	// The set, of the basic transform layout, is written with the buffer and used until the next call
+	void beginFrame(RenderContext& rc, uint32_t frameIdx, vk::DescriptorSet frameSet);
+
+	// Thread safe for different slots. Returns false if the slot was allocated
+	// after the frame began, and does not fit in its buffer yet
+	bool write(uint32_t frameIdx, uint32_t slot, const glm::mat4& modelMatrix);
+
+	vk::DescriptorSet getDescriptorSet(uint32_t frameIdx) const { return mFrames[frameIdx].descriptorSet; }
+	uint32_t getDynamicOffset(uint32_t slot) const { return slot * mStride; }
+
+	struct Stats {
+		uint32_t numSlots = 0;
+		uint32_t capacity = 0;
+		// Matrices written in the frame, the rest were already up to date
+		uint32_t numWrites = 0;
+	};
+	Stats getStats(uint32_t frameIdx) const;
+
+	void destroy(RenderContext& rc);
+
+	static constexpr uint32_t INVALID_SLOT = ~0u;
+	static constexpr uint32_t MIN_CAPACITY = 256;
+
+private:
+
+	struct Frame {
+		Buffer buffer;
+		uint8_t* bufferPtr = nullptr;
+		uint32_t capacity = 0;
+		vk::DescriptorSet descriptorSet;
+		std::atomic<uint32_t> numWrites = 0;
+	};
+
+	std::unique_ptr<Frame[]> mFrames;
+	uint32_t mNumFrames = 0;
+	uint32_t mStride = 0;
+
+	// Slots under mNumSlots that are not in mFreeSlots are in use
+	std::vector<uint32_t> mFreeSlots;
+	uint32_t mNumSlots = 0;
+	mutable std::mutex mSlotsMutex;
+
+	void updateDescriptorSet(RenderContext& rc, const Frame& frame) const;
+};
+
+}
+}
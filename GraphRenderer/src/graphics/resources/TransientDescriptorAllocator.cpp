@@ -0,0 +1,87 @@
+#include "TransientDescriptorAllocator.h"
+
+#include "DescriptorManager.h"
+#include "../RenderContext.h"
+#include "../../utils/grjob.h"
+
+#include <algorithm>
+
+namespace gr
+{
+namespace vkg
+{
+
+TransientDescriptorAllocator::TransientDescriptorAllocator() : mPoolSpaces(grjob::getNumThreads()) {}
+
+vk::DescriptorSet TransientDescriptorAllocator::allocate(const RenderContext& rc, vk::DescriptorSetLayout layout)
+{
+	PoolSpace& ps = getPS();
+
+	vk::DescriptorSet set;
+	while (true) {
+		if (ps.currentPool == static_cast<uint32_t>(ps.pools.size())) {
+			ps.pools.push_back(DescriptorManager::s_createPool(rc, SETS_PER_POOL));
+		}
+
+		vk::DescriptorSetAllocateInfo allocInfo(
+			ps.pools[ps.currentPool],
+			1, &layout
+		);
+		vk::Result res = rc.getDevice().allocateDescriptorSets(&allocInfo, &set);
+		if (res == vk::Result::eSuccess) {
+			break;
+		}
+
+		// Continue in the next pool, unless this one was empty
+		if ((res != vk::Result::eErrorOutOfPoolMemory && res != vk::Result::eErrorFragmentedPool) ||
+			ps.numSets == 0) {
+			throw std::runtime_error("Error: Cannot allocate transient descriptor set!!");
+		}
+		ps.currentPool += 1;
+		ps.numSets = 0;
+	}
+
+	ps.numSets += 1;
+	ps.numFrameSets += 1;
+	return set;
+}
+
+void TransientDescriptorAllocator::reset(const RenderContext& rc)
+{
+	Stats stats;
+	for (PoolSpace& ps : mPoolSpaces) {
+		stats.numPools += static_cast<uint32_t>(ps.pools.size());
+		stats.numSets += ps.numFrameSets;
+
+		// Only the pools used in the frame have sets to release
+		const uint32_t numUsed = std::min(ps.currentPool + 1, static_cast<uint32_t>(ps.pools.size()));
+		for (uint32_t i = 0; i < numUsed; ++i) {
+			rc.getDevice().resetDescriptorPool(ps.pools[i]);
+		}
+		ps.currentPool = 0;
+		ps.numSets = 0;
+		ps.numFrameSets = 0;
+	}
+	mLastStats = stats;
+}
+
+void TransientDescriptorAllocator::destroy(const RenderContext& rc)
+{
+	for (PoolSpace& ps : mPoolSpaces) {
+		for (vk::DescriptorPool pool : ps.pools) {
+			rc.getDevice().destroyDescriptorPool(pool);
+		}
+		ps.pools.clear();
+		ps.currentPool = 0;
+		ps.numSets = 0;
+		ps.numFrameSets = 0;
+	}
+}
+
+TransientDescriptorAllocator::PoolSpace& TransientDescriptorAllocator::getPS()
+{
+	return mPoolSpaces[grjob::getThreadId()];
+}
+
+}
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <vector>
+
+namespace gr
+{
+namespace vkg
+{
+
+class RenderContext;
+
+// Descriptor sets that live for one frame. Each thread allocates linearly
+// from its own chain of pools, and the pools are reset all at once when the
+// frame is reused, so there is no free and no locking.
+class TransientDescriptorAllocator
+{
+public:
+	TransientDescriptorAllocator();
+	TransientDescriptorAllocator(TransientDescriptorAllocator&&) = default;
+	TransientDescriptorAllocator& operator=(const TransientDescriptorAllocator&) = delete;
+	TransientDescriptorAllocator& operator=(TransientDescriptorAllocator&&) = default;
+
+	// Valid until the next reset
+	vk::DescriptorSet allocate(const RenderContext& rc, vk::DescriptorSetLayout layout);
+
+	// Only when the GPU is done with the sets
+	void reset(const RenderContext& rc);
+
+	void destroy(const RenderContext& rc);
+
+	struct Stats {
+		uint32_t numPools = 0;
+		uint32_t numSets = 0;
+	};
+	// Sets of the previous use of the frame, counted when reset
+	Stats getStats() const { return mLastStats; }
+
+	static constexpr uint32_t SETS_PER_POOL = 128;
+
+protected:
+	struct PoolSpace
+	{
+		std::vector<vk::DescriptorPool> pools;
+		uint32_t currentPool = 0;
+		// In the current pool, and in all the pools since the reset
+		uint32_t numSets = 0;
+		uint32_t numFrameSets = 0;
+	};
+
+	std::vector<PoolSpace> mPoolSpaces;
+	Stats mLastStats;
+
+	PoolSpace& getPS();
+};
+
+}
+}
@@ -0,0 +1,131 @@
+#include "ShaderModuleCache.h"
+
+#include "../RenderContext.h"
+#include "../../utils/grTools.h"
+
+namespace gr
+{
+namespace vkg
+{
+
+vk::ShaderModule ShaderModuleCache::acquire(
+	const RenderContext& rc,
+	const char* fileName,
+	uint64_t* outHash,
+	std::vector<uint32_t>* outSpirV)
+{
+	std::vector<uint8_t> file;
+	tools::loadBinaryFile(fileName, &file);
+
+	if (file.empty() || file.size() % sizeof(uint32_t) != 0) {
+		throw std::domain_error("Trying to run empty shader SPIR-V");
+	}
+
+	std::vector<uint32_t> code(file.size() / sizeof(uint32_t));
+	std::memcpy(code.data(), file.data(), file.size());
+	const uint64_t hash = s_hashCode(code.data(), code.size());
+	if (outHash) {
+		*outHash = hash;
+	}
+
+	vk::ShaderModule module;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		auto it = mEntries.find(hash);
+		if (it != mEntries.end() && it->second.code == code) {
+			it->second.numUsers += 1;
+			mNumReused += 1;
+			module = it->second.module;
+		}
+	}
+
+	if (!module) {
+		vk::ShaderModuleCreateInfo createInfo(
+			{},			// flags
+			file.size(),
+			code.data()
+		);
+		module = rc.getDevice().createShaderModule(createInfo);
+
+		std::lock_guard<std::mutex> lock(mMutex);
+		auto it = mEntries.find(hash);
+		if (it == mEntries.end()) {
+			mEntries.emplace(hash, Entry{ module, code, 1 });
+			mHashOfModule.emplace(module, hash);
+		}
+		else {
+			// Created by another thread meanwhile, or a hash collision
+			// of different code, that keeps its own module out of the cache
+			if (it->second.code == code) {
+				rc.getDevice().destroyShaderModule(module);
+				module = it->second.module;
+				it->second.numUsers += 1;
+				mNumReused += 1;
+			}
+		}
+	}
+
+	if (outSpirV) {
+		*outSpirV = std::move(code);
+	}
+	return module;
+}
+
+void ShaderModuleCache::release(const RenderContext& rc, vk::ShaderModule module)
+{
+	if (!module) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	auto hashIt = mHashOfModule.find(module);
+	if (hashIt == mHashOfModule.end()) {
+		// Not cached
+		rc.getDevice().destroyShaderModule(module);
+		return;
+	}
+
+	auto it = mEntries.find(hashIt->second);
+	assert(it != mEntries.end() && it->second.numUsers > 0);
+	it->second.numUsers -= 1;
+	if (it->second.numUsers == 0) {
+		rc.getDevice().destroyShaderModule(module);
+		mEntries.erase(it);
+		mHashOfModule.erase(hashIt);
+	}
+}
+
+uint64_t ShaderModuleCache::s_hashCode(const uint32_t* code, size_t numWords)
+{
+	// FNV-1a over the words
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < numWords; ++i) {
+		hash = (hash ^ code[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+ShaderModuleCache::Stats ShaderModuleCache::getStats() const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	Stats stats;
+	stats.numModules = static_cast<uint32_t>(mEntries.size());
+	for (const auto& it : mEntries) {
+		stats.numUsers += it.second.numUsers;
+	}
+	stats.numReused = mNumReused;
+	return stats;
+}
+
+void ShaderModuleCache::destroy(const RenderContext& rc)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	for (const auto& it : mEntries) {
+		rc.getDevice().destroyShaderModule(it.second.module);
+	}
+	mEntries.clear();
+	mHashOfModule.clear();
+}
+
+}
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace gr
+{
+namespace vkg
+{
+
+class RenderContext;
+
+// Shader modules keyed by the hash of their SPIR-V, so every user of the
+// same code shares one vk::ShaderModule. Reference counted, thread safe.
+class ShaderModuleCache
+{
+public:
+
+	ShaderModuleCache() = default;
+	ShaderModuleCache(const ShaderModuleCache&) = delete;
+	ShaderModuleCache& operator=(const ShaderModuleCache&) = delete;
+
+	// Reads the SPIR-V file, and returns the module of the same code if it exists.
+	// Each acquire must be paired with a release
+	vk::ShaderModule acquire(
+		const RenderContext& rc,
+		const char* fileName,
+		uint64_t* outHash = nullptr,
+		std::vector<uint32_t>* outSpirV = nullptr);
+
+	// Destroys the module with its last user
+	void release(const RenderContext& rc, vk::ShaderModule module);
+
+	static uint64_t s_hashCode(const uint32_t* code, size_t numWords);
+
+	struct Stats {
+		uint32_t numModules = 0;
+		uint32_t numUsers = 0;
+		// Acquires served with an existing module
+		uint32_t numReused = 0;
+	};
+	Stats getStats() const;
+
+	void destroy(const RenderContext& rc);
+
+private:
+
+	struct Entry {
+		vk::ShaderModule module;
+		// Compared on a hit of the hash
+		std::vector<uint32_t> code;
+		uint32_t numUsers = 0;
+	};
+
+	std::unordered_map<uint64_t, Entry> mEntries;
+	std::unordered_map<vk::ShaderModule, uint64_t> mHashOfModule;
+	uint32_t mNumReused = 0;
+	mutable std::mutex mMutex;
+};
+
+}
+}
@@ -55,10 +55,62 @@ gr::vkg::VertexInputDescription::Binding& gr::vkg::VertexInputDescription::Bindi
 	return *this;
 }
 
-gr::vkg::VertexInputDescription::Binding& gr::vkg::VertexInputDescription::addBinding(uint32_t bindId, uint32_t stride)
+gr::vkg::VertexInputDescription::Binding& gr::vkg::VertexInputDescription::Binding::addAttribute16UNORM(uint32_t location, uint32_t numUnsigned, uint32_t offset)
+{
+	vk::Format format;
+	switch (numUnsigned)
+	{
+	case 1:
+		format = vk::Format::eR16Unorm;
+		break;
+	case 2:
+		format = vk::Format::eR16G16Unorm;
+		break;
+	case 3:
+		format = vk::Format::eR16G16B16Unorm;
+		break;
+	case 4:
+		format = vk::Format::eR16G16B16A16Unorm;
+		break;
+	default:
+		throw std::runtime_error("Binding attribute with non supported format");
+		break;
+	}
+
+	mAttributes.emplace_back(location, format, offset);
+	return *this;
+}
+
+gr::vkg::VertexInputDescription::Binding& gr::vkg::VertexInputDescription::Binding::addAttribute16SNORM(uint32_t location, uint32_t numSigned, uint32_t offset)
+{
+	vk::Format format;
+	switch (numSigned)
+	{
+	case 1:
+		format = vk::Format::eR16Snorm;
+		break;
+	case 2:
+		format = vk::Format::eR16G16Snorm;
+		break;
+	case 3:
+		format = vk::Format::eR16G16B16Snorm;
+		break;
+	case 4:
+		format = vk::Format::eR16G16B16A16Snorm;
+		break;
+	default:
+		throw std::runtime_error("Binding attribute with non supported format");
+		break;
+	}
+
+	mAttributes.emplace_back(location, format, offset);
+	return *this;
+}
+
+gr::vkg::VertexInputDescription::Binding& gr::vkg::VertexInputDescription::addBinding(uint32_t bindId, uint32_t stride, vk::VertexInputRate inputRate)
 {
 
-	mBindings.emplace_back(bindId, stride);
+	mBindings.emplace_back(bindId, stride, inputRate);
 
 	return mBindings.back();
 }
@@ -73,7 +125,7 @@ std::vector<vk::VertexInputBindingDescription> gr::vkg::VertexInputDescription::
 		const Binding& binding = mBindings[i];
 		desc.binding = binding.getBindId();
 		desc.stride = binding.getStride();
-		desc.inputRate = vk::VertexInputRate::eVertex;
+		desc.inputRate = binding.getInputRate();
 	}
 
 	return descs;
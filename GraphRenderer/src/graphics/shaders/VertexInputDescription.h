@@ -13,7 +13,7 @@ class VertexInputDescription
 {
 public:
 	class Binding;
-	Binding& addBinding(uint32_t bindId, uint32_t stride);
+	Binding& addBinding(uint32_t bindId, uint32_t stride, vk::VertexInputRate inputRate = vk::VertexInputRate::eVertex);
 	
 	std::vector<vk::VertexInputBindingDescription> getBindingDescription() const;
 
@@ -42,26 +42,31 @@ public:
 		uint32_t mOffset;
 	};
 
-	// Input Rate Vertex
 	class Binding
 	{
 	public:
 		Binding() = default;
-		Binding(uint32_t bindId, uint32_t stride) : mBindId(bindId), mStride(stride) {}
+		Binding(uint32_t bindId, uint32_t stride, vk::VertexInputRate inputRate = vk::VertexInputRate::eVertex) :
+			mBindId(bindId), mStride(stride), mInputRate(inputRate) {}
 
 		void setBindId(uint32_t bindId) { mBindId = bindId; }
 		void setStride(uint32_t stride) { mStride = stride; }
+		void setInputRate(vk::VertexInputRate inputRate) { mInputRate = inputRate; }
 
 		const uint32_t& getBindId() const { return mBindId; }
 		const uint32_t& getStride() const { return mStride; }
+		const vk::VertexInputRate& getInputRate() const { return mInputRate; }
 		const std::vector<Attribute>& getAttributes() const { return mAttributes; }
 
 		Binding& addAttributeFloat(uint32_t location, uint32_t numFloats, uint32_t offset);
 		Binding& addAttribute8UNORM(uint32_t location, uint32_t numUnsigned, uint32_t offset);
+		Binding& addAttribute16UNORM(uint32_t location, uint32_t numUnsigned, uint32_t offset);
+		Binding& addAttribute16SNORM(uint32_t location, uint32_t numSigned, uint32_t offset);
 
 	private:
 		uint32_t mBindId;
 		uint32_t mStride;
+		vk::VertexInputRate mInputRate = vk::VertexInputRate::eVertex;
 		std::vector<Attribute> mAttributes;
 	};
 
@@ -2,9 +2,12 @@
 
 #include "../graphics/render/GraphicsPipelineBuilder.h"
 #include "../graphics/shaders/VertexInputDescription.h"
+#include "../utils/grTools.h"
+#include "../utils/HeapCounter.h"
 
 #include <imgui/imgui.h>
 #include <ImGuiFileDialog/ImGuiFileDialog.h>
+#include <chrono>
 #include <iostream>
 
 namespace gr
@@ -324,6 +327,10 @@ void Gui::updatePreFrame(FrameContext* fc)
     ImGuiIO& io = ImGui::GetIO();
     IM_ASSERT(io.Fonts->IsBuilt());
 
+    const uint64_t numHeapAllocations = tools::getNumHeapAllocations();
+    mFrameHeapAllocations = numHeapAllocations - mLastNumHeapAllocations;
+    mLastNumHeapAllocations = numHeapAllocations;
+
     // update io: dt, screen size
     io.DeltaTime = fc->dtf();
     io.DisplaySize =
@@ -385,9 +392,12 @@ void Gui::render(FrameContext* fc, vk::CommandBuffer cmd)
             }
             fc->scheduleToDestroy(mVertexBuffer);
             mVertexBuffer = fc->rc().createCpuVisibleBuffer(2*vertexSize,
-                vk::BufferUsageFlagBits::eVertexBuffer);
+                vk::BufferUsageFlagBits::eVertexBuffer, vkg::MemoryTag(vkg::MemoryCategory::eGui));
             fc->rc().mapAllocatable(mVertexBuffer, 
                 reinterpret_cast<void**>(&mVertPtrMap));
+            // Bound by handle each frame, so the defragmentation can move it
+            fc->rc().getMemoryManager().setMovable(&mVertexBuffer,
+                reinterpret_cast<void**>(&mVertPtrMap));
         }
         if (!mIndexBuffer || mIndexBuffer.getSize() < indexSize) {
             if (mIdxPtrMap) {
@@ -396,9 +406,11 @@ void Gui::render(FrameContext* fc, vk::CommandBuffer cmd)
             }
             fc->scheduleToDestroy(mIndexBuffer);
             mIndexBuffer = fc->rc().createCpuVisibleBuffer(2*indexSize,
-                vk::BufferUsageFlagBits::eIndexBuffer);
+                vk::BufferUsageFlagBits::eIndexBuffer, vkg::MemoryTag(vkg::MemoryCategory::eGui));
             fc->rc().mapAllocatable(mIndexBuffer, 
                 reinterpret_cast<void**>(&mIdxPtrMap));
+            fc->rc().getMemoryManager().setMovable(&mIndexBuffer,
+                reinterpret_cast<void**>(&mIdxPtrMap));
         }
 
         // upload new vertex and index
@@ -525,7 +537,9 @@ void Gui::uploadFontObjects(vkg::RenderContext* rc)
     mFontImage = rc->createTexture2D(
         vk::Extent2D(w, h),     // extent
         1, vk::SampleCountFlagBits::e1, // mip and samples
-        vk::Format::eR8G8B8A8Unorm
+        vk::Format::eR8G8B8A8Unorm,
+        vk::ImageAspectFlagBits::eColor,
+        vkg::MemoryTag(vkg::MemoryCategory::eGui)
     );
 
     // Update the descriptor set
@@ -703,6 +717,9 @@ void Gui::drawMainMenuBar(FrameContext* fc)
                 }
                 ImGui::EndCombo();
             }
+            if (ImGui::MenuItem("Capture frame")) {
+                mCaptureRequested = true;
+            }
             ImGui::EndMenu();
         }
 
@@ -821,7 +838,7 @@ void Gui::drawFilePicker(FrameContext* fc)
                 map.begin()->first,
                 &mesh
             );
-            mesh->load(fc, map.begin()->second.c_str());
+            mesh->loadAsync(fc, map.begin()->second.c_str());
         }
 
         // close
@@ -956,7 +973,7 @@ void Gui::drawInspectorWindow(FrameContext* fc)
 
             if (!appendRenamePopupItem(fc, itemName)) {
                 IObject* obj;
-                fc->gc().getDict().get(mInspectorResourceId, &obj);
+                fc->gc().getDict().get(fc, mInspectorResourceId, &obj);
                 obj->renderImGui(fc, this);
             }
             ImGui::PopID();
@@ -1002,7 +1019,7 @@ void Gui::drawSceneWindow(FrameContext* fc)
 
             if (!appendRenamePopupItem(fc, itemName)) {
                 IObject* obj;
-                fc->gc().getDict().get(fc->gc().getBoundScene(), &obj);
+                fc->gc().getDict().get(fc, fc->gc().getBoundScene(), &obj);
                 obj->renderImGui(fc, this);
 
             }
@@ -1029,15 +1046,176 @@ void Gui::drawMetricsWindow(FrameContext* fc)
     if (ImGui::Begin("Metrics", &this->mWindowMetricsOpen)) {
         float_t dt = fc->dtf();
         ImGui::Text("Average %.3f ms/frame (%.1f FPS)", dt * 1000.0f, 1.0 / dt);
+        ImGui::Text("GPU %.3f ms/frame", fc->gpuTime() * 1000.0);
 
         const bool goodId = fc->gc().getDict().exists(fc->gc().getBoundScene());
         double_t numTrisFrame = 0.0;
+        double_t extractionTime = 0.0, logicWaitTime = 0.0;
         if (goodId) {
             Scene* scn;
-            fc->gc().getDict().get(fc->gc().getBoundScene(), &scn);
+            fc->gc().getDict().get(fc, fc->gc().getBoundScene(), &scn);
             numTrisFrame = scn->getTrianglesPerFrame();
+            extractionTime = scn->getExtractionTime();
+            logicWaitTime = scn->getLogicWaitTime();
         }
         ImGui::Text("Average %.3f triangles/frame", numTrisFrame);
+        ImGui::Text("Scene extraction %.3f ms, logic wait %.3f ms", extractionTime * 1000.0, logicWaitTime * 1000.0);
+
+        const vkg::RenderSubmitter::Stats& drawStats = fc->renderSubmitter().getStats();
+        ImGui::Text("Draw calls %u (%u before batching)", drawStats.numDrawCalls, drawStats.numDrawData);
+        ImGui::Text("Instanced draws %u, with %u instances", drawStats.numInstancedDrawCalls, drawStats.numInstances);
+        ImGui::Text("Binds: %u pipelines, %u descriptor sets, %u vertex buffers, %u index buffers",
+            drawStats.numPipelineBinds, drawStats.numDescriptorSetBinds,
+            drawStats.numVertexBufferBinds, drawStats.numIndexBufferBinds);
+        ImGui::Text("Draw pushes with lock %u, contended %u", drawStats.numLockedPushes, drawStats.numContendedPushes);
+        ImGui::Text("Draw recording %.3f ms in %u command buffers", drawStats.recordTime * 1000.0, drawStats.numCommandBuffers);
+
+        const FrameArena::Stats arenaFrameStats = fc->getFrameArena().getStats();
+        ImGui::Text("Heap allocations %llu/frame, frame arena %.1f / %.1f KiB in %u allocations, %u new blocks",
+            static_cast<unsigned long long>(mFrameHeapAllocations),
+            arenaFrameStats.usedBytes / 1024.0, arenaFrameStats.capacity / 1024.0,
+            arenaFrameStats.numAllocations, arenaFrameStats.numNewBlocks);
+        bool arenaEnabled = FrameArena::s_isEnabled();
+        if (ImGui::Checkbox("Frame arena", &arenaEnabled)) {
+            FrameArena::s_setEnabled(arenaEnabled);
+        }
+        ImGui::SameLine();
+        helpMarker("Transient containers of the frame, like the jobs of the scene and the submit infos, "
+            "use linear memory reset with the frame. Disable it to compare the heap allocations.");
+
+        const vkg::GeometryArena::Stats arenaStats = fc->rc().getGeometryArena().getStats();
+        ImGui::Text("Geometry arena %.1f / %.1f MiB in %u buffers (%u dedicated), %u ranges, %u buffers released",
+            arenaStats.used / (1024.0 * 1024.0), arenaStats.capacity / (1024.0 * 1024.0),
+            arenaStats.numBlocks + arenaStats.numDedicated, arenaStats.numDedicated,
+            arenaStats.numAllocations, arenaStats.numReleased);
+
+        const vkg::DescriptorManager::Stats descStats = fc->rc().getDescriptorManager().getStats();
+        const vkg::TransientDescriptorAllocator::Stats transientStats = fc->descriptorAllocator().getStats();
+        ImGui::Text("Descriptor sets %u (%u free) in %u pools, per frame %u in %u pools",
+            descStats.numSets, descStats.numFreeSets, descStats.numPools,
+            transientStats.numSets, transientStats.numPools);
+
+        const vkg::PipelineManager::Stats pipStats = fc->rc().getPipelineManager().getStats();
+        ImGui::Text("Pipelines %u (%u compiling, %u reused), compiled in %.3f ms, cache %.1f KiB loaded",
+            pipStats.numPipelines, pipStats.numPending, pipStats.numReused,
+            pipStats.compileTime * 1000.0, pipStats.loadedCacheBytes / 1024.0);
+
+        const vkg::ShaderModuleCache::Stats shaderStats = fc->rc().getShaderModuleCache().getStats();
+        ImGui::Text("Shader modules %u, used %u times, %u reused",
+            shaderStats.numModules, shaderStats.numUsers, shaderStats.numReused);
+
+        const vkg::TransformBuffer::Stats transformStats = fc->rc().getTransformBuffer().getStats(fc->getIdx());
+        ImGui::Text("Transforms %u / %u slots, %u written this frame",
+            transformStats.numSlots, transformStats.capacity, transformStats.numWrites);
+
+        const vkg::DeferredDestroyer::Stats destroyStats = fc->rc().getDeferredDestroyer().getStats();
+        ImGui::Text("Deferred destruction %u pending, %u destroyed this frame (%llu total), latency %.3f ms mean, %.3f ms max",
+            destroyStats.numPending, destroyStats.numDestroyed,
+            static_cast<unsigned long long>(destroyStats.totalDestroyed),
+            destroyStats.meanLatency * 1000.0, destroyStats.maxLatency * 1000.0);
+
+        const vkg::BufferTransferer::Stats stagingStats = fc->rc().getTransferer()->getStats();
+        ImGui::Text("Staging %.1f / %.1f MiB, %llu copies, %llu waits, %llu overflows",
+            stagingStats.ringUsed / (1024.0 * 1024.0), stagingStats.ringSize / (1024.0 * 1024.0),
+            static_cast<unsigned long long>(stagingStats.numChunks),
+            static_cast<unsigned long long>(stagingStats.numWaits),
+            static_cast<unsigned long long>(stagingStats.numOverflows));
+        ImGui::Text("Last transfer flush %u transfers in %u copy commands, %u regions, recorded in %.3f ms",
+            stagingStats.lastFlush.numTransfers, stagingStats.lastFlush.numCopyCommands,
+            stagingStats.lastFlush.numRegions, stagingStats.lastFlush.recordTime * 1000.0);
+        if (ImGui::Button("Upload storm")) {
+            runUploadStorm(fc);
+        }
+        ImGui::SameLine();
+        helpMarker("Queues 4096 uploads of 512 bytes, half of them contiguous and half scattered. "
+            "The line above shows how the next flush records them.");
+
+        const vkg::BufferReadback::Stats readbackStats = fc->rc().getReadback().getStats();
+        ImGui::Text("Readback %u pending, %llu delivered (%.1f MiB), %llu rejected, ring %u slots %.1f MiB, last latency %.3f ms",
+            readbackStats.numPending, static_cast<unsigned long long>(readbackStats.numDelivered),
+            readbackStats.bytesRead / (1024.0 * 1024.0),
+            static_cast<unsigned long long>(readbackStats.numRejected),
+            readbackStats.numSlots, readbackStats.ringBytes / (1024.0 * 1024.0),
+            readbackStats.lastLatency * 1000.0);
+
+        const MeshStreamer::Stats streamStats = fc->gc().getMeshStreamer().getStats();
+        ImGui::Text("Mesh streaming %u meshes, %u levels queued (%u loading), %u loaded",
+            streamStats.numMeshes, streamStats.numQueued, streamStats.numLoading, streamStats.numLoaded);
+
+        ResidencyManager& residency = fc->gc().getResidencyManager();
+        const ResidencyManager::Stats residencyStats = residency.getStats();
+        ImGui::Text("Mesh residency %.1f / %.1f MiB, %llu levels evicted, %llu streamed again",
+            residencyStats.residentBytes / (1024.0 * 1024.0), residencyStats.budgetBytes / (1024.0 * 1024.0),
+            static_cast<unsigned long long>(residencyStats.numEvicted),
+            static_cast<unsigned long long>(residencyStats.numRestreamed));
+        ImGui::Text("Device local heaps %.1f / %.1f MiB (%s)",
+            residencyStats.heapUsage / (1024.0 * 1024.0), residencyStats.heapBudget / (1024.0 * 1024.0),
+            residencyStats.budgetFromDriver ? "driver budget" : "estimated");
+        float_t budgetMiB = residency.getBudgetOverride() / (1024.0f * 1024.0f);
+        if (ImGui::DragFloat("Mesh budget (MiB)", &budgetMiB, 1.0f, 0.0f, 65536.0f, "%.0f")) {
+            residency.setBudgetOverride(static_cast<vk::DeviceSize>(budgetMiB * 1024.0f * 1024.0f));
+        }
+        ImGui::SameLine();
+        helpMarker("0 uses a part of the budget of the device local heaps. "
+            "Over it, the finest levels of the meshes far away or not drawn are evicted.");
+
+        ImGui::Text("Process resident set %.1f MiB, mesh host copies released %.1f MiB",
+            tools::getResidentSetSize() / (1024.0 * 1024.0), Mesh::s_getReleasedHostBytes() / (1024.0 * 1024.0));
+        bool gpuOnly = Mesh::s_getGpuOnlyDefault();
+        if (ImGui::Checkbox("New meshes only on the GPU", &gpuOnly)) {
+            Mesh::s_setGpuOnlyDefault(gpuOnly);
+        }
+        ImGui::SameLine();
+        helpMarker("The meshes created or loaded afterwards release their vertices and indices in host memory "
+            "once they are uploaded. Each mesh can change it in its inspector.");
+        bool sortForOverdraw = Mesh::s_getSortForOverdraw();
+        if (ImGui::Checkbox("Sort mesh triangles for overdraw", &sortForOverdraw)) {
+            Mesh::s_setSortForOverdraw(sortForOverdraw);
+        }
+        ImGui::SameLine();
+        helpMarker("The meshes imported and the levels generated afterwards draw first the triangles "
+            "that face outwards, to shade fewer hidden pixels, with a slightly worse vertex cache.");
+
+        vkg::Defragmenter& defragmenter = fc->rc().getDefragmenter();
+        const vkg::Defragmenter::Stats& defragStats = defragmenter.getStats();
+        const vkg::MemoryManager::Fragmentation frag = fc->rc().getMemoryManager().getFragmentation();
+        ImGui::Text("Fragmentation %.2f, %.1f MiB unused in %u ranges, largest %.1f MiB",
+            frag.ratio, frag.unusedBytes / (1024.0 * 1024.0), frag.numUnusedRanges,
+            frag.largestUnusedRange / (1024.0 * 1024.0));
+        ImGui::Text("Defragmentation %s, %u passes, %u steps (%u postponed), moved %u (%.1f MiB), freed %u blocks (%.1f MiB), last step %.3f ms",
+            defragStats.running ? "running" : "idle", defragStats.numPasses,
+            defragStats.numSteps, defragStats.numPostponed,
+            defragStats.allocationsMoved, defragStats.bytesMoved / (1024.0 * 1024.0),
+            defragStats.blocksFreed, defragStats.bytesFreed / (1024.0 * 1024.0),
+            defragStats.lastStepTime * 1000.0);
+        if (defragStats.numPasses > 0) {
+            ImGui::Text("Last pass fragmentation %.2f -> %.2f, blocks %.1f -> %.1f MiB",
+                defragStats.before.ratio, defragStats.after.ratio,
+                defragStats.before.blockBytes / (1024.0 * 1024.0),
+                defragStats.after.blockBytes / (1024.0 * 1024.0));
+        }
+        if (ImGui::Button("Defragment")) {
+            defragmenter.start();
+        }
+        ImGui::SameLine();
+        bool autoDefrag = defragmenter.isAutomatic();
+        float_t threshold = defragmenter.getThreshold();
+        if (ImGui::Checkbox("Automatic", &autoDefrag)) {
+            defragmenter.setAutomatic(autoDefrag, threshold);
+        }
+        ImGui::SameLine();
+        if (ImGui::SliderFloat("Threshold", &threshold, 0.05f, 0.95f, "%.2f")) {
+            defragmenter.setAutomatic(autoDefrag, threshold);
+        }
+        ImGui::SameLine();
+        helpMarker("Moves the mesh geometry, the instances and the gui buffers to compact the device memory, "
+            "a few MiB per frame with a stall of the device. Automatic starts it when the fragmentation, "
+            "the part of the unused memory outside of the largest free range of each type, is above the threshold.");
+
+        mMemoryTelemetry.update(fc);
+        if (ImGui::CollapsingHeader("Memory")) {
+            mMemoryTelemetry.drawImGui();
+        }
 
         mLogger.drawImGui();
     }
@@ -1151,6 +1329,41 @@ int Gui::s_stringTextCallback(void* data_) {
 }
 
 
+void Gui::runUploadStorm(FrameContext* fc)
+{
+    constexpr uint32_t NUM_UPLOADS = 4096;
+    constexpr vk::DeviceSize UPLOAD_SIZE = 512;
+    constexpr uint32_t NUM_CONTIGUOUS = NUM_UPLOADS / 2;
+    constexpr uint32_t NUM_SCATTERED = NUM_UPLOADS - NUM_CONTIGUOUS;
+    // The scattered half leaves a gap after each upload, so they can not merge
+    constexpr vk::DeviceSize BUFFER_SIZE = (NUM_CONTIGUOUS + 2 * NUM_SCATTERED) * UPLOAD_SIZE;
+
+    vkg::RenderContext& rc = fc->rc();
+    vkg::Buffer buffer = rc.createVertexBuffer(BUFFER_SIZE);
+    const std::vector<uint8_t> data(UPLOAD_SIZE, 0xAB);
+
+    typedef std::chrono::duration<double_t> Fsec;
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    // Like the parts of a mesh
+    for (uint32_t i = 0; i < NUM_CONTIGUOUS; ++i) {
+        rc.getTransferer()->transferToBuffer(rc, data.data(), UPLOAD_SIZE, buffer, i * UPLOAD_SIZE);
+    }
+    // Like many small resources, in no particular order
+    for (uint32_t i = 0; i < NUM_SCATTERED; ++i) {
+        const uint32_t slot = (i * 7919u) % NUM_SCATTERED;
+        rc.getTransferer()->transferToBuffer(rc, data.data(), UPLOAD_SIZE, buffer,
+            (NUM_CONTIGUOUS + 2 * slot) * UPLOAD_SIZE);
+    }
+
+    const Fsec time = std::chrono::high_resolution_clock::now() - start;
+    fc->gc().addNewLog("Upload storm: " + std::to_string(NUM_UPLOADS) + " uploads queued in " +
+        std::to_string(time.count() * 1000.0) + " ms");
+
+    // Destroyed once this frame, that waits for the transfers, finishes
+    fc->scheduleToDestroy(buffer);
+}
+
 void Gui::helpMarker(const char* text)
 {
     ImGui::TextDisabled("(?)");
@@ -3,6 +3,7 @@
 #include "../control/FrameContext.h"
 
 #include "Logger.h"
+#include "MemoryTelemetry.h"
 
 namespace gr {
 
@@ -33,6 +34,9 @@ public:
 
 	bool isWireframeRenderModeEnabled() const { return mWireframeModeEnabled; }
 
+	// True once after "Capture frame" is clicked
+	bool consumeCaptureRequest() { const bool requested = mCaptureRequested; mCaptureRequested = false; return requested; }
+
 	void selectResourceInspector(const ResId& id) { mInspectorResourceId = id; }
 
 	// make sure to push id before
@@ -55,6 +59,7 @@ protected:
 	vk::Sampler mTexSampler;
 
 	bool mWireframeModeEnabled = false;
+	bool mCaptureRequested = false;
 
 	bool mFilePickerInUse = false;
 
@@ -75,6 +80,11 @@ protected:
 	ResId mInspectorResourceId;
 
 	Logger mLogger;
+	MemoryTelemetry mMemoryTelemetry;
+
+	// Calls to operator new between the last two frames
+	uint64_t mLastNumHeapAllocations = 0;
+	uint64_t mFrameHeapAllocations = 0;
 
 
 	void drawWindows(FrameContext* fc);
@@ -88,6 +98,9 @@ protected:
 
 	void helpMarker(const char* text);
 
+	// Queues many small uploads, to measure how the transferer records them
+	void runUploadStorm(FrameContext* fc);
+
 	static int s_stringTextCallback(void* data);
 
 private:
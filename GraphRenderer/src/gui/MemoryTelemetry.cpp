@@ -0,0 +1,137 @@
+#include "MemoryTelemetry.h"
+
+#include "../control/FrameContext.h"
+#include "GuiUtils.h"
+
+#include <imgui/imgui.h>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
+namespace gr
+{
+
+namespace
+{
+
+double_t deltaKiB(vk::DeviceSize current, vk::DeviceSize previous)
+{
+	return (static_cast<double_t>(current) - static_cast<double_t>(previous)) / 1024.0;
+}
+
+}
+
+void MemoryTelemetry::update(FrameContext* fc)
+{
+	mPrevious = std::move(mCurrent);
+
+	mCurrent = Snapshot();
+	mCurrent.allocations = fc->rc().getMemoryManager().getStats();
+	mCurrent.valid = true;
+
+	// Memory of the allocations tagged with an owner, and the one that the
+	// objects report, like ranges of shared buffers and copies on the host
+	const ResourceDictionary& dict = fc->gc().getDict();
+	dict.forEachObject([this](ResId id, const IObject& object) {
+		vkg::MemoryUsage usage;
+		object.appendMemoryUsage(&usage);
+		auto it = mCurrent.allocations.owners.find(id.value);
+		if (it != mCurrent.allocations.owners.end()) {
+			for (size_t c = 0; c < usage.gpuBytes.size(); ++c) {
+				usage.gpuBytes[c] += it->second.gpuBytes[c];
+			}
+		}
+		if (usage.getGpuBytes() == 0 && usage.cpuBytes == 0) {
+			return;
+		}
+
+		mCurrent.cpuBytes += usage.cpuBytes;
+		Resource& resource = mCurrent.resources[id.value];
+		resource.name = object.getObjectName();
+		resource.usage = usage;
+	});
+
+	if (!mMark.valid) {
+		mMark = mCurrent;
+	}
+}
+
+void MemoryTelemetry::drawImGui()
+{
+	if (!mCurrent.valid) {
+		return;
+	}
+	const Snapshot& previous = mPrevious.valid ? mPrevious : mCurrent;
+
+	ImGui::Text("VMA blocks %.1f MiB, allocations %.1f MiB, host copies %.1f MiB",
+		mCurrent.allocations.blockBytes / (1024.0 * 1024.0),
+		mCurrent.allocations.allocationBytes / (1024.0 * 1024.0),
+		mCurrent.cpuBytes / (1024.0 * 1024.0));
+	if (ImGui::Button("Mark")) {
+		mMark = mCurrent;
+	}
+	ImGui::SameLine();
+	gui::helpMarker("The last column is the change since the mark. "
+		"The GPU memory of the meshes is their part of the shared vertex and index buffers.");
+
+	const ImGuiTableFlags flags = ImGuiTableFlags_Borders | ImGuiTableFlags_SizingStretchProp | ImGuiTableFlags_RowBg;
+	if (ImGui::BeginTable("Memory categories", 5, flags)) {
+		ImGui::TableSetupColumn("Category");
+		ImGui::TableSetupColumn("Allocations");
+		ImGui::TableSetupColumn("KiB");
+		ImGui::TableSetupColumn("Frame delta");
+		ImGui::TableSetupColumn("Mark delta");
+		ImGui::TableHeadersRow();
+
+		for (size_t c = 0; c < static_cast<size_t>(vkg::MemoryCategory::COUNT); ++c) {
+			const vk::DeviceSize bytes = mCurrent.allocations.categories.gpuBytes[c];
+			ImGui::TableNextRow();
+			ImGui::TableNextColumn();
+			ImGui::TextUnformatted(vkg::to_string(static_cast<vkg::MemoryCategory>(c))); ImGui::TableNextColumn();
+			ImGui::Text("%u", mCurrent.allocations.numAllocations[c]); ImGui::TableNextColumn();
+			ImGui::Text("%.1f", bytes / 1024.0); ImGui::TableNextColumn();
+			ImGui::Text("%+.1f", deltaKiB(bytes, previous.allocations.categories.gpuBytes[c])); ImGui::TableNextColumn();
+			ImGui::Text("%+.1f", deltaKiB(bytes, mMark.allocations.categories.gpuBytes[c]));
+		}
+
+		ImGui::EndTable();
+	}
+
+	// The biggest resources first
+	std::vector<std::pair<vk::DeviceSize, uint64_t>> order;
+	order.reserve(mCurrent.resources.size());
+	for (const auto& it : mCurrent.resources) {
+		order.emplace_back(it.second.usage.getGpuBytes() + it.second.usage.cpuBytes, it.first);
+	}
+	std::sort(order.begin(), order.end(), std::greater<std::pair<vk::DeviceSize, uint64_t>>());
+	order.resize(std::min<size_t>(order.size(), MAX_RESOURCES_SHOWN));
+
+	auto getTotal = [](const Snapshot& snapshot, uint64_t id) -> vk::DeviceSize {
+		auto it = snapshot.resources.find(id);
+		return it == snapshot.resources.end() ? 0 : it->second.usage.getGpuBytes() + it->second.usage.cpuBytes;
+	};
+
+	if (ImGui::BeginTable("Memory resources", 5, flags)) {
+		ImGui::TableSetupColumn("Resource");
+		ImGui::TableSetupColumn("GPU KiB");
+		ImGui::TableSetupColumn("CPU KiB");
+		ImGui::TableSetupColumn("Frame delta");
+		ImGui::TableSetupColumn("Mark delta");
+		ImGui::TableHeadersRow();
+
+		for (const std::pair<vk::DeviceSize, uint64_t>& it : order) {
+			const Resource& resource = mCurrent.resources.at(it.second);
+			ImGui::TableNextRow();
+			ImGui::TableNextColumn();
+			ImGui::TextUnformatted(resource.name.c_str()); ImGui::TableNextColumn();
+			ImGui::Text("%.1f", resource.usage.getGpuBytes() / 1024.0); ImGui::TableNextColumn();
+			ImGui::Text("%.1f", resource.usage.cpuBytes / 1024.0); ImGui::TableNextColumn();
+			ImGui::Text("%+.1f", deltaKiB(it.first, getTotal(previous, it.second))); ImGui::TableNextColumn();
+			ImGui::Text("%+.1f", deltaKiB(it.first, getTotal(mMark, it.second)));
+		}
+
+		ImGui::EndTable();
+	}
+}
+
+}
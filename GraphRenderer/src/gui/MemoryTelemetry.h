@@ -0,0 +1,49 @@
+#pragma once
+
+#include "../graphics/memory/MemoryManager.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace gr
+{
+
+class FrameContext;
+
+// Where the memory goes, by category and by resource. Each snapshot is
+// compared with the previous one, and with a marked one, to find the
+// resources that grow over a long session.
+class MemoryTelemetry
+{
+public:
+
+	// Takes a snapshot, once per frame while it is shown
+	void update(FrameContext* fc);
+
+	void drawImGui();
+
+	// Resources in the table, the biggest ones
+	static constexpr uint32_t MAX_RESOURCES_SHOWN = 32;
+
+private:
+
+	struct Resource {
+		std::string name;
+		vkg::MemoryUsage usage;
+	};
+
+	struct Snapshot {
+		vkg::MemoryManager::Stats allocations;
+		// By ResId value
+		std::unordered_map<uint64_t, Resource> resources;
+		vk::DeviceSize cpuBytes = 0;
+		bool valid = false;
+	};
+
+	Snapshot mCurrent;
+	Snapshot mPrevious;
+	Snapshot mMark;
+};
+
+}
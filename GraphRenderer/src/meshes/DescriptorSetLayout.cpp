@@ -168,7 +168,7 @@ void DescriptorSetLayout::createDescriptorLayout(FrameContext* fc)
                 if (!fc->gc().getDict().exists(id)) {
                     throw std::runtime_error("Not exists sampler!");
                 }
-                fc->gc().getDict().get(id, &sampler);
+                fc->gc().getDict().get(fc, id, &sampler);
                 if (! (*sampler)) {
                     throw std::runtime_error("Sampler not initalized");
                 }
@@ -72,6 +72,13 @@ void GameObject::start(FrameContext* fc)
     mTransform.start(fc);
 }
 
+void GameObject::appendReferencedResources(std::vector<ResId>* outIds) const
+{
+    for (decltype(mAddons)::const_iterator it = mAddons.begin(); it != mAddons.end(); ++it) {
+        it->second->appendReferencedResources(outIds);
+    }
+}
+
 void GameObject::duplicateTo(FrameContext* fc, GameObject* obj) const
 {
     obj->scheduleDestroy(fc);
@@ -22,6 +22,7 @@ public:
     void scheduleDestroy(FrameContext* fc) override;
     void renderImGui(FrameContext* fc, Gui* gui) override;
     void start(FrameContext* fc) override;
+    void appendReferencedResources(std::vector<ResId>* outIds) const override;
 
     void duplicateTo(FrameContext* fc, GameObject* obj) const;
 
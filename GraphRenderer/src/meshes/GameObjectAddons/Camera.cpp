@@ -79,7 +79,7 @@ void Camera::destroy(FrameContext* fc)
     }
 
     for (vk::DescriptorSet set : mCameraDescriptorSets) {
-        fc->rc().freeDescriptorSet(set, fc->rc().getBasicCameraTransformLayout());
+        fc->scheduleToDestroy(set, fc->rc().getBasicCameraTransformLayout());
     }
 }
 
@@ -29,6 +29,9 @@ public:
 
 	static const char* s_getAddonName() { return "Camera"; }
 
+	// Vertical field of view, in degrees
+	float getFov() const { return mFov; }
+
 protected:
 
 	float mFov = 90.0f;
@@ -1,8 +1,10 @@
 #pragma once
 
 #include "../../utils/serialization.h"
+#include "../ResourcesHeader.h"
 
 #include <memory>
+#include <vector>
 
 namespace gr {
 
@@ -27,6 +29,8 @@ public:
 
 	virtual void start(FrameContext* fc) {}
 
+	virtual void appendReferencedResources(std::vector<ResId>* outIds) const {}
+
 	virtual void update(FrameContext* fc, GameObject* parent) {}
 
 	virtual void destroy(FrameContext* fc) {}
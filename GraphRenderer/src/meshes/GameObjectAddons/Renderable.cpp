@@ -63,7 +63,7 @@ void Renderable::drawImGuiInspector(FrameContext* fc, GameObject* parent)
     ImGui::InputScalar("LOD", ImGuiDataType_U32, (void*)&mLod, &step, nullptr, "%d", ImGuiInputTextFlags_None);
     if (this->mMesh) {
         Mesh* mesh;
-        fc->gc().getDict().get(mMesh, &mesh);
+        fc->gc().getDict().get(fc, mMesh, &mesh);
 
         mLod = std::min(mLod, mesh->getNumLODs());
     }
@@ -77,28 +77,59 @@ void Renderable::updateBeforeRender(FrameContext* fc, GameObject* parent, const
     Transform* transf = parent->getAddon<Transform>();
     assert(transf != nullptr);
 
-    // update UBO
-    {
-        vkg::RenderContext::BasicTransformUBO ubo;
-        ubo.M = transf->getTransformMatrix();
+    Mesh* mesh = nullptr;
+    uint32_t lod = mLod;
+    if (this->mMesh) {
+        fc->gc().getDict().get(fc, mMesh, &mesh);
+        // The finer levels may still be streaming, or be evicted. A level that
+        // failed to load is skipped for the next coarser one
+        lod = std::min(std::max(mLod, mesh->getFinestResidentLOD()), mesh->getNumLODs());
+        while (lod < mesh->getNumLODs() && !mesh->isLODResident(lod)) {
+            ++lod;
+        }
+        mesh->reportView(glm::length(transf->getPos() - src.cameraPosition), mLod);
+    }
 
-        size_t sizePadd = fc->rc().padUniformBuffer(sizeof(vkg::RenderContext::BasicTransformUBO));
+    // Packed meshes store the positions relative to the bounding box of the level
+    glm::mat4 modelMatrix = transf->getTransformMatrix();
+    if (mesh != nullptr) {
+        modelMatrix = modelMatrix * mesh->getDequantizationMatrix(lod);
+    }
 
-        std::memcpy(mUbosGpuPtr + sizePadd * fc->getIdx(), &ubo, sizeof(vkg::RenderContext::BasicTransformUBO));
+    // Static objects keep the matrix written in previous frames
+    if (modelMatrix != mLastModelMatrix) {
+        mLastModelMatrix = modelMatrix;
+        mStaleFrames = (1u << fc->getNumConcurrentFrames()) - 1;
+        mLODInputsChanged = true;
+    }
+    const uint32_t metricsVersion = mesh != nullptr ? mesh->getLODMetricsVersion() : UINT32_MAX;
+    if (mLod != mLastLod || metricsVersion != mLastLODMetricsVersion) {
+        mLastLod = mLod;
+        mLastLODMetricsVersion = metricsVersion;
+        mLODInputsChanged = true;
+    }
+    // The buffer of the frame grows before the extraction, so the slot only misses it
+    // if the object was started during the extraction itself
+    const uint32_t frameBit = 1u << fc->getIdx();
+    if ((mStaleFrames & frameBit) &&
+        fc->rc().getTransformBuffer().write(fc->getIdx(), mTransformSlot, modelMatrix)) {
+        mStaleFrames &= ~frameBit;
     }
 
-    // get mesh and schedule draw
-    if (this->mMesh) {
-        Mesh* mesh;
-        fc->gc().getDict().get(mMesh, &mesh);
+    // schedule draw, once its slot fits in the buffer of the frame
+    if (mesh != nullptr && (mStaleFrames & frameBit) == 0) {
 
-        if (*mesh) {
+        if (mesh->isLODResident(lod)) {
 
             vkg::RenderSubmitter::DrawData drawData{};
-            drawData.vertexBuffer = mesh->getVB();
-            drawData.indexBuffer = mesh->getIB();
-            mesh->getDrawDataLod(mLod, &drawData.numIndices, &drawData.firstIndex, &drawData.vertexBufferOffset);
-            drawData.objectDescriptorSet = mObjectDescriptorSets[fc->getIdx()];
+            drawData.vertexBuffer = mesh->getVB(lod);
+            drawData.indexBuffer = mesh->getIB(lod);
+            mesh->getDrawDataLod(lod, &drawData.numIndices, &drawData.firstIndex, &drawData.vertexOffset, &drawData.indexType);
+            drawData.packedVertices = mesh->isPacked();
+            drawData.objectDescriptorSet = fc->rc().getTransformBuffer().getDescriptorSet(fc->getIdx());
+            drawData.objectOffset = fc->rc().getTransformBuffer().getDynamicOffset(mTransformSlot);
+            drawData.modelMatrix = modelMatrix;
+            drawData.depth = glm::dot(transf->getPos() - src.cameraPosition, src.cameraForward);
 
             fc->renderSubmitter().pushPredefinedDraw(drawData);
         }
@@ -108,28 +139,30 @@ void Renderable::updateBeforeRender(FrameContext* fc, GameObject* parent, const
 
 void Renderable::destroy(FrameContext* fc)
 {
-    if (mUbosGpuPtr) {
-        fc->rc().unmapAllocatable(mUbos);
-        mUbosGpuPtr = nullptr;
-    }
-
-    if (mUbos) {
-        fc->scheduleToDestroy(mUbos);
-    }
+    fc->rc().getTransformBuffer().freeSlot(mTransformSlot);
+    mTransformSlot = vkg::TransformBuffer::INVALID_SLOT;
+}
 
-    for (vk::DescriptorSet set : mObjectDescriptorSets) {
-        fc->rc().freeDescriptorSet(set, fc->rc().getBasicTransformLayout());
+void Renderable::start(FrameContext* fc)
+{
+    if (mTransformSlot == vkg::TransformBuffer::INVALID_SLOT) {
+        mTransformSlot = fc->rc().getTransformBuffer().allocateSlot();
+        // Written in the next update of every frame
+        mStaleFrames = (1u << fc->getNumConcurrentFrames()) - 1;
     }
 }
 
-void Renderable::start(FrameContext* fc)
+void Renderable::appendReferencedResources(std::vector<ResId>* outIds) const
 {
-    createUbos(fc);
+    if (mMesh) {
+        outIds->push_back(mMesh);
+    }
 }
 
 void Renderable::setMesh(ResId meshId)
 {
 	mMesh = meshId;
+	mLODInputsChanged = true;
 }
 
 uint32_t Renderable::getMaxLOD(FrameContext* fc) const
@@ -139,7 +172,7 @@ uint32_t Renderable::getMaxLOD(FrameContext* fc) const
     }
 
     const Mesh* mesh;
-    fc->gc().getDict().get(mMesh, &mesh);
+    fc->gc().getDict().get(fc, mMesh, &mesh);
     return mesh->getNumLODs();
 }
 
@@ -154,10 +187,17 @@ uint32_t Renderable::getLODDepth(FrameContext* fc, uint32_t lod) const
     }
 
     const Mesh* mesh;
-    fc->gc().getDict().get(mMesh, &mesh);
+    fc->gc().getDict().get(fc, mMesh, &mesh);
     return mesh->getDepthLod(lod - 1);
 }
 
+bool Renderable::takeLODInputsChanged()
+{
+    const bool changed = mLODInputsChanged;
+    mLODInputsChanged = false;
+    return changed;
+}
+
 uint32_t Renderable::getNumTrisToRender(FrameContext* fc, uint32_t lod) const
 {
     if (!mMesh) {
@@ -165,7 +205,7 @@ uint32_t Renderable::getNumTrisToRender(FrameContext* fc, uint32_t lod) const
     }
 
     const Mesh* mesh;
-    fc->gc().getDict().get(mMesh, &mesh);
+    fc->gc().getDict().get(fc, mMesh, &mesh);
 
     if (lod == 0) {
         return mesh->getNumIndices() / 3;
@@ -180,7 +220,7 @@ mth::AABBox Renderable::getBBox(FrameContext* fc, const GameObject* parent) cons
         return {};
     }
     const Mesh* mesh;
-    fc->gc().getDict().get(mMesh, &mesh);
+    fc->gc().getDict().get(fc, mMesh, &mesh);
     if (parent == nullptr) {
         return mesh->getBBox();
     }
@@ -190,47 +230,5 @@ mth::AABBox Renderable::getBBox(FrameContext* fc, const GameObject* parent) cons
 }
 
 
-void Renderable::createUbos(FrameContext* fc)
-{
-    if (mUbos) {
-        return;
-    }
-    const uint32_t concurrentFrames = fc->getNumConcurrentFrames();
-
-    size_t sizePadded = fc->rc().padUniformBuffer(sizeof(vkg::RenderContext::BasicTransformUBO));
-    mUbos = fc->rc().createUniformBuffer(
-        concurrentFrames * sizePadded
-    );
-
-    fc->rc().mapAllocatable(mUbos, reinterpret_cast<void**>(&mUbosGpuPtr));
-
-
-    // allocate descriptor sets
-    mObjectDescriptorSets.resize(concurrentFrames);
-    fc->rc().allocateDescriptorSet(
-        concurrentFrames,                   // num
-        fc->rc().getBasicTransformLayout(), // descriptor set layout
-        mObjectDescriptorSets.data());      // out
-    // write
-    for (uint32_t i = 0; i < concurrentFrames; ++i) {
-        vk::DescriptorBufferInfo buffInfo(
-            mUbos.getVkBuffer(),            // buffer
-            sizePadded * i,                 // offset
-            sizeof(vkg::RenderContext::BasicTransformUBO) // range
-        );
-
-        vk::WriteDescriptorSet write(
-            mObjectDescriptorSets[i],   // dst descriptor set
-            0, 0,                       // dst binding, dst array
-            1,                          // descriptor count
-            vk::DescriptorType::eUniformBuffer,
-            nullptr, &buffInfo, nullptr
-        );
-
-        fc->rc().getDevice().updateDescriptorSets(1, &write, 0, nullptr);
-    }
-
-}
-
 } // namespace addon
 } // namespace gr
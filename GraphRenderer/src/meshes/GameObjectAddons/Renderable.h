@@ -2,10 +2,11 @@
 #include "IAddon.h"
 
 #include "../ResourcesHeader.h"
-#include "../../graphics/resources/Buffer.h"
+#include "../../graphics/resources/TransformBuffer.h"
 #include "../../utils/math/BBox.h"
 
 #include <vulkan/vulkan.hpp>
+#include <glm/glm.hpp>
 
 namespace gr
 {
@@ -26,6 +27,7 @@ public:
 
     void destroy(FrameContext* fc) override;
     void start(FrameContext* fc) override;
+    void appendReferencedResources(std::vector<ResId>* outIds) const override;
 
     void setMesh(ResId meshId);
     ResId getMesh() const { return mMesh; }
@@ -37,6 +39,10 @@ public:
 
     uint32_t getNumTrisToRender(FrameContext* fc, uint32_t lod) const;
 
+    // If the transform, the LOD or the LOD table of the mesh changed since the last
+    // call, and the LOD selector has to evaluate it again. Set by updateBeforeRender
+    bool takeLODInputsChanged();
+
     // If parent set, returns BBox transformed by parent
     mth::AABBox getBBox(FrameContext* fc, const GameObject* parent) const;
 
@@ -52,11 +58,16 @@ private:
 
     uint32_t mLod = 0;
 
-    vkg::Buffer mUbos;
-    uint8_t* mUbosGpuPtr = nullptr;
-    std::vector<vk::DescriptorSet> mObjectDescriptorSets;
+    // Slot of the model matrix in the TransformBuffer. Each bit of
+    // mStaleFrames is a frame whose copy of the matrix is outdated
+    uint32_t mTransformSlot = vkg::TransformBuffer::INVALID_SLOT;
+    uint32_t mStaleFrames = 0;
+    glm::mat4 mLastModelMatrix = glm::mat4(1.0f);
 
-    void createUbos(FrameContext* fc);
+    // Inputs of the last LOD selection
+    uint32_t mLastLod = UINT32_MAX;
+    uint32_t mLastLODMetricsVersion = UINT32_MAX;
+    bool mLODInputsChanged = true;
 
     // Serialization functions
     template<class Archive>
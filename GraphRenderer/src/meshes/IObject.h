@@ -1,11 +1,13 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include <stdint.h>
 
 #include <vulkan/vulkan.hpp>
 
 #include "../utils/serialization.h"
+#include "../graphics/memory/MemoryTag.h"
 #include "ResourcesHeader.h"
 
 namespace gr
@@ -25,16 +27,28 @@ public:
 	const std::string& getObjectName() const { return mObjectName; }
 	void setObjectName(const std::string& newName) { mObjectName = newName; }
 
+	// Set by the ResourceDictionary
+	ResId getResId() const { return mResId; }
+	void setResId(ResId id) { mResId = id; }
+
 	virtual void scheduleDestroy(FrameContext* fc) = 0;
 
 	virtual void renderImGui(FrameContext* fc, Gui* gui) = 0;
 
 	virtual void start(FrameContext* fc) {}
 
+	// Appends the ids of the resources that must be started before this one
+	virtual void appendReferencedResources(std::vector<ResId>* outIds) const {}
+
+	// Adds the memory that is not in an allocation tagged with the id of the object,
+	// like ranges of shared buffers or copies on the host
+	virtual void appendMemoryUsage(vkg::MemoryUsage* usage) const {}
+
 	static constexpr const char* s_getClassName() { return "IObject"; }
 
 private:
 	std::string mObjectName;
+	ResId mResId;
 
 	uint64_t mFrameLastUpdate = 0;
 
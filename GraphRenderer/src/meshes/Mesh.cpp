@@ -7,47 +7,63 @@
 #include "../graphics/RenderContext.h"
 #include "../gui/GuiUtils.h"
 
+#include <algorithm>
 #include <fstream>
 #include <imgui/imgui.h>
 #include <tiny_obj_loader/tiny_obj_loader.h>
 #include <tiny_ply_loader/tinyply.h>
 #include <unordered_map>
 #include <filesystem>
+#include <limits>
+#include <glm/gtc/matrix_transform.hpp>
 
 namespace gr
 {
 
-void Mesh::load(FrameContext* fc,
-	const char* filePath)
+std::atomic<bool> Mesh::s_gpuOnlyDefault = false;
+std::atomic<size_t> Mesh::s_releasedHostBytes = 0;
+std::atomic<bool> Mesh::s_sortForOverdraw = false;
+
+namespace
 {
+// In the header of the ply files written by the engine, their triangles are optimized
+constexpr const char* OPTIMIZED_PLY_COMMENT = "Optimized by gRenderer";
+}
 
+std::filesystem::path Mesh::setPath(FrameContext* fc, const char* filePath)
+{
 	std::filesystem::path path(filePath);
 	if (path.is_absolute()) {
 		path = std::filesystem::relative(path, fc->gc().getProjectPath());
 	}
 
 	mPath.assign(path.string());
-	
-	std::filesystem::path absolutePath = fc->gc().getAbsolutePathTo(path);
 
-	vkg::RenderContext* rc = &fc->rc();
+	return fc->gc().getAbsolutePathTo(path);
+}
+
+void Mesh::load(FrameContext* fc,
+	const char* filePath)
+{
+	std::filesystem::path absolutePath = setPath(fc, filePath);
+
+	// Drop the levels that were still streaming
+	scheduleDestroy(fc);
 
 	mVertices.clear();
 	mIndices.clear();
 	mBBox.reset();
+	mHostCopiesReleased = false;
+	mLODsOnDisk = true;
 
-	if (mPath.find(".obj") != std::string::npos) {
-		parseObj(absolutePath.string().c_str(), &mVertices, &mIndices, &mBBox);
-	}
-	else if (mPath.find(".ply") != std::string::npos) {
-		parsePly(absolutePath.string().c_str(), &mVertices, &mIndices, &mBBox);
-	}
+	s_readLevel(absolutePath.string(), fc->gc().getAbsolutePathTo(getRelativeOptimizedPath()).string(),
+		&mVertices, &mIndices, &mBBox);
 
 	uint32_t lod_i = 0;
 	for (LOD& lod : mLODs) {
 		std::filesystem::path fileLod = fc->gc().getAbsolutePathTo(getRelativeLodPath(lod_i++));
 		if (std::filesystem::exists(fileLod)) {
-			parsePly(fileLod.string().c_str(), &lod.vertices, &lod.indices);
+			s_readLevel(fileLod.string(), fileLod.string(), &lod.vertices, &lod.indices);
 		}
 		else {
 			lod.vertices.clear();
@@ -58,45 +74,288 @@ void Mesh::load(FrameContext* fc,
 	this->uploadDataToGPU(fc);
 }
 
+void Mesh::loadAsync(FrameContext* fc, const char* filePath)
+{
+	const std::filesystem::path absolutePath = setPath(fc, filePath);
+
+	// Drop the levels of a previous load
+	scheduleDestroy(fc);
+
+	mVertices.clear();
+	mIndices.clear();
+	mBBox.reset();
+	for (LOD& lod : mLODs) {
+		lod.vertices.clear();
+		lod.indices.clear();
+	}
+	// The levels come from the files, so they are dropped as they arrive
+	mLODsOnDisk = true;
+	mHostCopiesReleased = canReleaseHostCopies();
+
+	const uint32_t numParts = static_cast<uint32_t>(mLODs.size()) + 1;
+	mPacked = mUsePackedVertices && fc->renderSubmitter().supportsPackedVertices();
+	mParts.assign(numParts, Part());
+	mFinestResidentLod = numParts;
+	mStreamGeneration += 1;
+	mStreaming = true;
+	mStreamTarget = 0;
+	mStreamStart = std::chrono::high_resolution_clock::now();
+
+	// From the coarsest level to the full mesh. Levels without a file stay empty
+	std::vector<std::unique_ptr<StreamedPart>> parts;
+	for (uint32_t p = numParts; p-- > 0;) {
+		const std::filesystem::path partPath = p == 0 ?
+			absolutePath : fc->gc().getAbsolutePathTo(getRelativeLodPath(p - 1));
+		if (p != 0 && !std::filesystem::exists(partPath)) {
+			continue;
+		}
+
+		std::unique_ptr<StreamedPart> part = std::make_unique<StreamedPart>();
+		part->part = p;
+		part->generation = mStreamGeneration;
+		part->absolutePath = partPath.string();
+		part->optimizedPath = p == 0 ?
+			fc->gc().getAbsolutePathTo(getRelativeOptimizedPath()).string() : part->absolutePath;
+		part->packed = mPacked;
+		parts.push_back(std::move(part));
+	}
+
+	fc->gc().getMeshStreamer().stream(fc, this, std::move(parts));
+	fc->gc().getResidencyManager().add(this);
+}
+
 void Mesh::scheduleDestroy(FrameContext* fc)
 {
-	if (mIndexBuffer) {
-		fc->scheduleToDestroy(mIndexBuffer);
-		mIndexBuffer = nullptr;
+	fc->gc().getMeshStreamer().cancel(this);
+	fc->gc().getResidencyManager().remove(this);
+	mStreaming = false;
+
+	// The ranges return to the arena once the frames that use them have finished
+	for (Part& part : mParts) {
+		s_schedulePartDestroy(fc, &part);
+	}
+	mParts.clear();
+	mFinestResidentLod = 0;
+	updateReleasedHostBytes();
+}
+
+
+void Mesh::getDrawDataLod(uint32_t lod, uint32_t* numIndices, uint32_t* firstIndex, int32_t* vertexOffset, vk::IndexType* indexType) const
+{
+	assert(numIndices != nullptr && firstIndex != nullptr && vertexOffset != nullptr && indexType != nullptr);
+
+	const LOD_DrawData& drawData = mParts[lod].drawData;
+	*numIndices = drawData.numIndices;
+	*firstIndex = drawData.firstIndex;
+	*vertexOffset = drawData.vertexOffset;
+	*indexType = drawData.indexType;
+}
+
+void Mesh::reportView(float_t distance, uint32_t lod)
+{
+	const uint32_t bits = glm::floatBitsToUint(std::max(distance, 0.0f));
+	uint32_t current = mViewDistanceBits.load(std::memory_order_relaxed);
+	while (bits < current &&
+		!mViewDistanceBits.compare_exchange_weak(current, bits, std::memory_order_relaxed)) {}
+
+	current = mRequestedLodReport.load(std::memory_order_relaxed);
+	while (lod < current &&
+		!mRequestedLodReport.compare_exchange_weak(current, lod, std::memory_order_relaxed)) {}
+}
+
+void Mesh::updateViewState()
+{
+	const uint32_t infinity = glm::floatBitsToUint(std::numeric_limits<float_t>::infinity());
+	mViewDistance = glm::uintBitsToFloat(mViewDistanceBits.exchange(infinity, std::memory_order_relaxed));
+	mRequestedLod = mRequestedLodReport.exchange(~0u, std::memory_order_relaxed);
+}
+
+vk::DeviceSize Mesh::getResidentBytes() const
+{
+	vk::DeviceSize bytes = 0;
+	for (const Part& part : mParts) {
+		bytes += part.vertexRange.size + part.indexRange.size;
 	}
-	if (mVertexBuffer) {
-		fc->scheduleToDestroy(mVertexBuffer);
-		mVertexBuffer = nullptr;
+	return bytes;
+}
+
+void Mesh::appendMemoryUsage(vkg::MemoryUsage* usage) const
+{
+	for (const Part& part : mParts) {
+		usage->gpu(vkg::MemoryCategory::eVertex) += part.vertexRange.size;
+		usage->gpu(vkg::MemoryCategory::eIndex) += part.indexRange.size;
 	}
 
-	mLODsDrawData.clear();
+	usage->cpuBytes += getHostBytes();
 }
 
+size_t Mesh::getHostBytes() const
+{
+	size_t bytes = mVertices.capacity() * sizeof(Vertex) + mIndices.capacity() * sizeof(uint32_t);
+	for (const LOD& lod : mLODs) {
+		bytes += lod.vertices.capacity() * sizeof(Vertex) + lod.indices.capacity() * sizeof(uint32_t);
+	}
+	return bytes;
+}
 
-void Mesh::getDrawDataLod(uint32_t lod, uint32_t* numIndices, uint32_t* firstIndex, vk::DeviceSize* vertexOffset) const
+void Mesh::releaseHostCopies()
 {
-	assert(numIndices != nullptr && firstIndex != nullptr && vertexOffset != nullptr);
+	// Swapped with empty vectors, clear keeps the capacity
+	std::vector<Vertex>().swap(mVertices);
+	std::vector<uint32_t>().swap(mIndices);
+	for (LOD& lod : mLODs) {
+		std::vector<Vertex>().swap(lod.vertices);
+		std::vector<uint32_t>().swap(lod.indices);
+	}
+	mHostCopiesReleased = true;
+	updateReleasedHostBytes();
+}
 
-	if (lod == 0) {
-		*numIndices = this->getNumIndices();
-		*firstIndex = 0;
-		*vertexOffset = 0;
+bool Mesh::ensureHostCopies(FrameContext* fc)
+{
+	if (!mHostCopiesReleased) {
+		return true;
+	}
+
+	// Read aside, so a missing or broken file leaves the mesh as it was.
+	// The levels on the GPU were read from the same optimized files
+	std::vector<Vertex> vertices;
+	std::vector<uint32_t> indices;
+	mth::AABBox bbox;
+	std::vector<LOD> lods(mLODs.size());
+	try {
+		const std::filesystem::path absolutePath = fc->gc().getAbsolutePathTo(mPath);
+		s_readLevel(absolutePath.string(), fc->gc().getAbsolutePathTo(getRelativeOptimizedPath()).string(),
+			&vertices, &indices, &bbox);
+
+		for (uint32_t i = 0; i < static_cast<uint32_t>(mLODs.size()); ++i) {
+			std::filesystem::path fileLod = fc->gc().getAbsolutePathTo(getRelativeLodPath(i));
+			if (std::filesystem::exists(fileLod)) {
+				s_readLevel(fileLod.string(), fileLod.string(), &lods[i].vertices, &lods[i].indices);
+			}
+		}
+	}
+	catch (const std::exception& e) {
+		fc->gc().addNewLog("Error reading again the levels of " + this->getObjectName() + ": " + e.what());
+		return false;
+	}
+
+	mVertices.swap(vertices);
+	mIndices.swap(indices);
+	mBBox = bbox;
+	for (uint32_t i = 0; i < static_cast<uint32_t>(mLODs.size()); ++i) {
+		mLODs[i].vertices.swap(lods[i].vertices);
+		mLODs[i].indices.swap(lods[i].indices);
+	}
+
+	mHostCopiesReleased = false;
+	updateReleasedHostBytes();
+	return true;
+}
+
+void Mesh::updateReleasedHostBytes()
+{
+	size_t bytes = 0;
+	if (mHostCopiesReleased) {
+		for (const Part& part : mParts) {
+			bytes += part.numVertices * sizeof(Vertex) + part.numIndices * sizeof(uint32_t);
+		}
+	}
+
+	if (bytes >= mReleasedHostBytes) {
+		s_releasedHostBytes.fetch_add(bytes - mReleasedHostBytes, std::memory_order_relaxed);
 	}
 	else {
-		*numIndices = mLODsDrawData[lod - 1].numIndices;
-		*firstIndex = mLODsDrawData[lod - 1].firstIndex;
-		*vertexOffset = mLODsDrawData[lod - 1].vertexOffset;
+		s_releasedHostBytes.fetch_sub(mReleasedHostBytes - bytes, std::memory_order_relaxed);
+	}
+	mReleasedHostBytes = bytes;
+}
+
+vk::DeviceSize Mesh::evictFinestLOD(FrameContext* fc)
+{
+	assert(!mStreaming);
+	if (mFinestResidentLod >= getNumLODs()) {
+		return 0;
+	}
+
+	Part& part = mParts[mFinestResidentLod];
+	const vk::DeviceSize bytes = part.vertexRange.size + part.indexRange.size;
+
+	// The frames in flight may still draw it, the frame context destroys
+	// the ranges after waiting for its timeline value
+	if (part.indexRange) {
+		fc->scheduleToDestroy(part.indexRange);
+	}
+	if (part.vertexRange) {
+		fc->scheduleToDestroy(part.vertexRange);
+	}
+	part.indexRange = vkg::GeometryRange();
+	part.vertexRange = vkg::GeometryRange();
+	part.drawData = {};
+	mFinestResidentLod += 1;
+
+	return bytes;
+}
+
+void Mesh::restreamLODs(FrameContext* fc, uint32_t lod)
+{
+	assert(!mStreaming);
+	if (lod >= mFinestResidentLod || mFinestResidentLod > getNumLODs()) {
+		return;
+	}
+
+	std::vector<std::unique_ptr<StreamedPart>> parts;
+	for (uint32_t p = mFinestResidentLod; p-- > lod;) {
+		std::unique_ptr<StreamedPart> part = std::make_unique<StreamedPart>();
+		part->part = p;
+		part->generation = mStreamGeneration;
+		part->packed = mPacked;
+		if (mHostCopiesReleased) {
+			part->absolutePath = (p == 0 ? fc->gc().getAbsolutePathTo(mPath) :
+				fc->gc().getAbsolutePathTo(getRelativeLodPath(p - 1))).string();
+			part->optimizedPath = p == 0 ?
+				fc->gc().getAbsolutePathTo(getRelativeOptimizedPath()).string() : part->absolutePath;
+		}
+		else {
+			part->inMemory = true;
+			part->vertices = p == 0 ? mVertices : mLODs[p - 1].vertices;
+			part->indices = p == 0 ? mIndices : mLODs[p - 1].indices;
+		}
+		parts.push_back(std::move(part));
+	}
+
+	mStreaming = true;
+	mStreamTarget = lod;
+	mStreamStart = std::chrono::high_resolution_clock::now();
+	fc->gc().getMeshStreamer().stream(fc, this, std::move(parts));
+}
+
+glm::mat4 Mesh::getDequantizationMatrix(uint32_t lod) const
+{
+	if (!mPacked || lod >= static_cast<uint32_t>(mParts.size())) {
+		return glm::mat4(1.0f);
 	}
+
+	const Part& part = mParts[lod];
+	return glm::scale(glm::translate(glm::mat4(1.0f), part.quantizationOrigin), glm::vec3(part.quantizationExtent));
 }
 
 void Mesh::addToVertexInputDescription(
 	uint32_t binding,
-	vkg::VertexInputDescription* vid)
+	vkg::VertexInputDescription* vid,
+	bool packed)
 {
 	if (vid->existsBinding(binding)) {
 		throw std::logic_error("Error, already exists binding with such id!");
 	}
 
+	if (packed) {
+		vid->addBinding(binding, sizeof(PackedVertex))
+			.addAttribute16UNORM(0, 4, offsetof(PackedVertex, PackedVertex::pos))
+			.addAttribute16SNORM(1, 2, offsetof(PackedVertex, PackedVertex::normal));
+		return;
+	}
+
 	vid->addBinding(binding, sizeof(Vertex))
 		.addAttributeFloat(0, 3, offsetof(Vertex, Vertex::pos))
 		.addAttributeFloat(1, 3, offsetof(Vertex, Vertex::normal))
@@ -177,7 +436,8 @@ void Mesh::parseObj(const char* fileName, std::vector<Vertex>* outVertices, std:
 	}
 }
 
-void Mesh::parsePly(const char* fileName, std::vector<Vertex>* outVertices, std::vector<uint32_t>* outIndices, mth::AABBox* outBBox)
+void Mesh::parsePly(const char* fileName, std::vector<Vertex>* outVertices, std::vector<uint32_t>* outIndices,
+	mth::AABBox* outBBox, bool* outOptimized)
 {
 	assert(outVertices != nullptr && outIndices != nullptr);
 	std::ifstream stream(fileName, std::ios::binary);
@@ -191,6 +451,10 @@ void Mesh::parsePly(const char* fileName, std::vector<Vertex>* outVertices, std:
 	if (!res) {
 		throw std::runtime_error("Error: Can't parse ply header.");
 	}
+	if (outOptimized != nullptr) {
+		const std::vector<std::string>& comments = file.get_comments();
+		*outOptimized = std::find(comments.begin(), comments.end(), OPTIMIZED_PLY_COMMENT) != comments.end();
+	}
 
 	bool recomputeNormals = false;
 
@@ -301,125 +565,280 @@ void Mesh::computeNormals(const std::vector<uint32_t>& indices, std::vector<Vert
 
 void Mesh::uploadDataToGPU(FrameContext* fc)
 {
+	// Keeps the levels on the GPU
+	if (!ensureHostCopies(fc)) {
+		return;
+	}
 
 	// destroy buffers if exist there
 	scheduleDestroy(fc);
 
-	vkg::RenderContext* rc = &fc->rc();
-	// create buffers
-	{
-		if (mIndexBuffer) {
-			throw std::logic_error("Error! Buffer previously alocated");
+	mPacked = mUsePackedVertices && fc->renderSubmitter().supportsPackedVertices();
+
+	const uint32_t numParts = static_cast<uint32_t>(mLODs.size()) + 1;
+	mParts.resize(numParts);
+	for (uint32_t p = 0; p < numParts; ++p) {
+		const std::vector<Vertex>& vertices = p == 0 ? mVertices : mLODs[p - 1].vertices;
+		const std::vector<uint32_t>& indices = p == 0 ? mIndices : mLODs[p - 1].indices;
+		s_uploadPart(&fc->rc(), vertices, indices, mPacked, &mParts[p]);
+	}
+	mFinestResidentLod = 0;
+	fc->gc().getResidencyManager().add(this);
+
+	updateLODMetrics();
+
+	// The transferer copies the data to the staging memory when it is queued
+	if (canReleaseHostCopies()) {
+		releaseHostCopies();
+	}
+}
+
+void Mesh::s_uploadPart(vkg::RenderContext* rc, const std::vector<Vertex>& vertices,
+	const std::vector<uint32_t>& indices, bool packed, Part* outPart)
+{
+	*outPart = Part();
+	if (indices.empty()) {
+		return;
+	}
+
+	vkg::GeometryArena& arena = rc->getGeometryArena();
+	const vk::DeviceSize vertexSize = packed ? sizeof(PackedVertex) : sizeof(Vertex);
+	// 16 bit indices if the vertices fit
+	const vk::IndexType indexType = vertices.size() <= (1u << 16) ?
+		vk::IndexType::eUint16 : vk::IndexType::eUint32;
+	const vk::DeviceSize indexSize = indexType == vk::IndexType::eUint16 ? sizeof(uint16_t) : sizeof(uint32_t);
+
+	// allocate ranges of the shared buffers
+	outPart->vertexRange = arena.allocateVertices(*rc, vertexSize * vertices.size(), vertexSize);
+	outPart->indexRange = arena.allocateIndices(*rc, indexSize * indices.size(), indexSize);
+
+	// Positions relative to the bounding box of the part, with the same
+	// scale in all the axes to keep the direction of the normals
+	mth::AABBox bbox;
+	for (const Vertex& v : vertices) {
+		bbox.addPoint(v.pos);
+	}
+	const glm::vec3 bbSize = bbox.getSize();
+	outPart->quantizationOrigin = bbox.getMin();
+	outPart->quantizationExtent = std::max(bbSize.x, std::max(bbSize.y, bbSize.z));
+	if (!(outPart->quantizationExtent > 0.0f)) {
+		outPart->quantizationExtent = 1.0f;
+	}
+
+	// upload to gpu
+	const void* vertexData = vertices.data();
+	std::vector<PackedVertex> packedVertices;
+	if (packed) {
+		const float_t invExtent = 1.0f / outPart->quantizationExtent;
+		packedVertices.resize(vertices.size());
+		for (size_t i = 0; i < vertices.size(); ++i) {
+			packedVertices[i] = s_packVertex(vertices[i], outPart->quantizationOrigin, invExtent);
 		}
-		mIndexBufferSize = sizeof(uint32_t) * mIndices.size();
-		for (const LOD& lod : mLODs) {
-			mIndexBufferSize += sizeof(uint32_t) * lod.indices.size();
+		vertexData = packedVertices.data();
+	}
+	// The arena blocks keep their handles until the transfers are recorded
+	const auto noMoves = rc->getDefragmenter().preventMoves();
+	rc->getTransferer()->transferToBuffer(*rc,
+		vertexData, vertexSize * vertices.size(),
+		arena.getBuffer(outPart->vertexRange), outPart->vertexRange.offset);
+
+	const void* indexData = indices.data();
+	std::vector<uint16_t> shortIndices;
+	if (indexType == vk::IndexType::eUint16) {
+		shortIndices.resize(indices.size());
+		for (size_t i = 0; i < indices.size(); ++i) {
+			shortIndices[i] = static_cast<uint16_t>(indices[i]);
 		}
-		mIndexBuffer = rc->createIndexBuffer(mIndexBufferSize);
-		if (mVertexBuffer) {
-			throw std::logic_error("Error! Buffer previously alocated");
+		indexData = shortIndices.data();
+	}
+	rc->getTransferer()->transferToBuffer(*rc,
+		indexData, indexSize * indices.size(),
+		arena.getBuffer(outPart->indexRange), outPart->indexRange.offset);
+
+	outPart->numVertices = static_cast<uint32_t>(vertices.size());
+	outPart->numIndices = static_cast<uint32_t>(indices.size());
+
+	LOD_DrawData& drawData = outPart->drawData;
+	drawData.numIndices = static_cast<uint32_t>(indices.size());
+	drawData.firstIndex = static_cast<uint32_t>(outPart->indexRange.offset / indexSize);
+	drawData.vertexOffset = static_cast<int32_t>(outPart->vertexRange.offset / vertexSize);
+	drawData.indexType = indexType;
+
+	outPart->uploadedBytes = vertexSize * vertices.size() + indexSize * indices.size();
+	outPart->gpuBytes = outPart->vertexRange.size + outPart->indexRange.size;
+	outPart->fullFormatBytes = sizeof(Vertex) * vertices.size() + sizeof(uint32_t) * indices.size();
+}
+
+void Mesh::s_schedulePartDestroy(FrameContext* fc, Part* part)
+{
+	if (part->indexRange) {
+		fc->scheduleToDestroy(part->indexRange);
+	}
+	if (part->vertexRange) {
+		fc->scheduleToDestroy(part->vertexRange);
+	}
+	*part = Part();
+}
+
+void Mesh::s_loadPart(vkg::RenderContext* rc, StreamedPart* part)
+{
+	// Runs in a worker, the error is reported when the part is applied
+	try {
+		if (part->inMemory) {
+			for (const Vertex& v : part->vertices) {
+				part->bbox.addPoint(v.pos);
+			}
 		}
-		mVertexBufferSize = sizeof(Vertex) * mVertices.size();
-		for (const LOD& lod : mLODs) {
-			mVertexBufferSize += sizeof(Vertex) * lod.vertices.size();
+		else {
+			s_readLevel(part->absolutePath, part->optimizedPath, &part->vertices, &part->indices, &part->bbox);
 		}
-		mVertexBuffer = rc->createVertexBuffer(mVertexBufferSize);
+
+		s_uploadPart(rc, part->vertices, part->indices, part->packed, &part->gpu);
 	}
+	catch (const std::exception& e) {
+		part->error = e.what();
+	}
+}
 
-	// upload to gpu
-	rc->getTransferer()->transferToBuffer(*rc,
-		mVertices.data(), mVertices.size() * sizeof(mVertices[0]),
-		mVertexBuffer);
-	rc->getTransferer()->transferToBuffer(*rc,
-		mIndices.data(), mIndices.size() * sizeof(mIndices[0]),
-		mIndexBuffer);
+void Mesh::applyStreamedPart(FrameContext* fc, StreamedPart* part)
+{
+	const uint32_t p = part->part;
+	// Outdated, or the inspector removed its LOD
+	if (part->generation != mStreamGeneration || p >= static_cast<uint32_t>(mParts.size()) ||
+		p > static_cast<uint32_t>(mLODs.size())) {
+		part->scheduleDestroy(fc);
+		return;
+	}
 
-	vk::DeviceSize vertexOffset = mVertices.size() * sizeof(mVertices[0]);
-	vk::DeviceSize indexOffset = mIndices.size() * sizeof(mIndices[0]);
-	uint32_t nextFirstIndice = static_cast<uint32_t>(mIndices.size());
-	mLODsDrawData.resize(mLODs.size());
-	for (uint32_t i = 0; i < (uint32_t)mLODs.size(); ++i) {
+	if (!part->error.empty()) {
+		fc->gc().addNewLog("Error streaming level " + std::to_string(p) + " of " +
+			this->getObjectName() + ": " + part->error);
+		part->scheduleDestroy(fc);
+	}
+	else {
+		if (mHostCopiesReleased) {
+			// Only on the GPU, the copy is freed with the part
+		}
+		else if (p == 0) {
+			mVertices = std::move(part->vertices);
+			mIndices = std::move(part->indices);
+		}
+		else {
+			mLODs[p - 1].vertices = std::move(part->vertices);
+			mLODs[p - 1].indices = std::move(part->indices);
+		}
+		mParts[p] = part->gpu;
+		part->gpu = Part();
 
-		if (mLODs[i].indices.empty()) {
-			continue;
+		// The full mesh has the exact box, until then it grows with the levels
+		if (p == 0 || mFinestResidentLod >= static_cast<uint32_t>(mParts.size())) {
+			mBBox = part->bbox;
 		}
+		else {
+			mBBox.addPoint(part->bbox.getMin());
+			mBBox.addPoint(part->bbox.getMax());
+		}
+		updateReleasedHostBytes();
 
-		rc->getTransferer()->transferToBuffer(*rc,
-			mLODs[i].vertices.data(), mLODs[i].vertices.size() * sizeof(mLODs[i].vertices[0]),
-			mVertexBuffer, vertexOffset);
-		rc->getTransferer()->transferToBuffer(*rc,
-			mLODs[i].indices.data(), mLODs[i].indices.size() * sizeof(mLODs[i].indices[0]),
-			mIndexBuffer, indexOffset);
+		// Finer levels are only applied after the coarser ones. A level that failed
+		// has no ranges and is not resident, the draws skip it for a coarser one
+		mFinestResidentLod = std::min(mFinestResidentLod, p);
+	}
 
-		mLODsDrawData[i].firstIndex = nextFirstIndice;
-		mLODsDrawData[i].numIndices = static_cast<uint32_t>(mLODs[i].indices.size());
-		mLODsDrawData[i].vertexOffset = vertexOffset;
+	if (p == mStreamTarget) {
+		mStreaming = false;
 
-		vertexOffset += mLODs[i].vertices.size() * sizeof(mLODs[i].vertices[0]);
-		indexOffset += mLODs[i].indices.size() * sizeof(mLODs[i].indices[0]);
-		nextFirstIndice += static_cast<uint32_t>(mLODs[i].indices.size());
+		typedef std::chrono::duration<double_t> Fsec;
+		const Fsec duration = std::chrono::high_resolution_clock::now() - mStreamStart;
+		std::stringstream ss;
+		ss << "Streamed " << this->getObjectName() << " down to level " << p << '\n';
+		ss << "\tTook " << duration.count() << " seconds";
+		fc->gc().addNewLog(ss.str());
+	}
+
+	updateLODMetrics();
+}
+
+void Mesh::StreamedPart::scheduleDestroy(FrameContext* fc)
+{
+	s_schedulePartDestroy(fc, &this->gpu);
+}
+
+void Mesh::StreamedPart::destroy(vkg::RenderContext& rc)
+{
+	if (this->gpu.indexRange) {
+		rc.destroy(this->gpu.indexRange);
+	}
+	if (this->gpu.vertexRange) {
+		rc.destroy(this->gpu.vertexRange);
+	}
+	this->gpu = Part();
+}
+
+Mesh::PackedVertex Mesh::s_packVertex(const Vertex& vertex, const glm::vec3& origin, float_t invExtent)
+{
+	PackedVertex packed;
+
+	const glm::vec3 pos = glm::clamp((vertex.pos - origin) * invExtent, 0.0f, 1.0f);
+	for (uint32_t i = 0; i < 3; ++i) {
+		packed.pos[i] = static_cast<uint16_t>(std::round(pos[i] * 65535.0f));
+	}
+	packed.pos[3] = 0;
+
+	// Octahedral encoding, the lower hemisphere is folded over the diagonals
+	const glm::vec3& n = vertex.normal;
+	const float_t l1 = std::abs(n.x) + std::abs(n.y) + std::abs(n.z);
+	glm::vec2 oct(0.0f);
+	if (l1 > 0.0f) {
+		oct = glm::vec2(n.x, n.y) / l1;
+		if (n.z < 0.0f) {
+			oct = (1.0f - glm::abs(glm::vec2(oct.y, oct.x))) *
+				glm::vec2(oct.x >= 0.0f ? 1.0f : -1.0f, oct.y >= 0.0f ? 1.0f : -1.0f);
+		}
+	}
+	for (uint32_t i = 0; i < 2; ++i) {
+		packed.normal[i] = static_cast<int16_t>(std::round(glm::clamp(oct[i], -1.0f, 1.0f) * 32767.0f));
 	}
+
+	return packed;
 }
 
-void Mesh::saveLODModels(FrameContext* fc) const
+void Mesh::updateLODMetrics()
 {
+	mLODMetrics.resize(mLODs.size() + 1);
+	mLODMetricsVersion += 1;
+	// From the uploaded levels, the host copies may be released
+	mLODMetrics[0] = { mParts.empty() ? 0 : mParts[0].numIndices / 3, 0.0f };
+
+	// Each LOD clusters the vertices in the cells of an octree that encloses the BBox.
+	// The representative of a cell can move, at most, the diagonal of the cell.
+	const float_t octreeSize = std::max(mBBox.getSize().x, std::max(mBBox.getSize().y, mBBox.getSize().z));
+	for (uint32_t i = 0; i < (uint32_t)mLODs.size(); ++i) {
+		const float_t cellSize = octreeSize / static_cast<float_t>(1u << std::min(mLODs[i].depth, 31u));
+		mLODMetrics[i + 1].numTris = i + 1 < static_cast<uint32_t>(mParts.size()) ? mParts[i + 1].numIndices / 3 : 0;
+		mLODMetrics[i + 1].geometricError = std::sqrt(3.0f) * cellSize;
+	}
+}
+
+void Mesh::saveLODModels(FrameContext* fc)
+{
+	if (!ensureHostCopies(fc)) {
+		return;
+	}
+
 	{
 		std::string log = "Saving " + std::to_string(mLODs.size()) + std::string(" LODs of ") + this->getObjectName();
 		fc->gc().addNewLog(log);
 	}
 	const auto start_timer = std::chrono::high_resolution_clock::now();
 
-	std::ofstream stream;
-	
 	for (uint32_t i = 0; i < (uint32_t)mLODs.size(); ++i) {
 		const auto start_inner_timer = std::chrono::high_resolution_clock::now();
 
 		std::filesystem::path modelPath = fc->gc().getAbsolutePathTo( getRelativeLodPath(i) );
-		stream.open(modelPath, std::ofstream::trunc | std::ofstream::binary);
-		if (!stream) {
-			throw std::runtime_error("Error: Can't store LOD model");
-		}
+		// The levels in memory are optimized, when read or generated
 		const LOD& lod = mLODs[i];
-
-		tinyply::PlyFile file;
-		// vertex positions
-		std::vector<glm::vec3> vert(lod.vertices.size());
-		{
-			for (uint32_t j = 0; j < (uint32_t)lod.vertices.size(); ++j) {
-				vert[j] = lod.vertices[j].pos;
-			}
-			file.add_properties_to_element(
-				"vertex", { "x", "y", "z" },
-				tinyply::Type::FLOAT32,
-				vert.size(),
-				reinterpret_cast<uint8_t*>(vert.data()),
-				tinyply::Type::INVALID, 0);
-		}
-		// vertex normals
-		std::vector<glm::vec3> norm(lod.vertices.size());
-		{
-			for (uint32_t j = 0; j < (uint32_t)lod.vertices.size(); ++j) {
-				norm[j] = lod.vertices[j].normal;
-			}
-			file.add_properties_to_element(
-				"vertex", { "nx", "ny", "nz" },
-				tinyply::Type::FLOAT32,
-				norm.size(),
-				reinterpret_cast<const uint8_t*>(norm.data()),
-				tinyply::Type::INVALID, 0);
-		}
-		// faces
-		{
-			file.add_properties_to_element(
-				"face", { "vertex_indices" },
-				tinyply::Type::UINT32, lod.indices.size() / 3,
-				reinterpret_cast<const uint8_t*>(lod.indices.data()),
-				tinyply::Type::UINT8, 3);
-		}
-
-		file.write(stream, true);
-
-		stream.close();
+		s_writePly(modelPath, lod.vertices, lod.indices);
 
 		const auto end_inner_timer = std::chrono::high_resolution_clock::now();
 		typedef std::chrono::duration<double_t> Fsec;
@@ -440,6 +859,95 @@ void Mesh::saveLODModels(FrameContext* fc) const
 	ss << "\tTook " << dur.count() << " seconds\n";
 	fc->gc().addNewLog(ss.str());
 
+	mLODsOnDisk = true;
+	if (canReleaseHostCopies()) {
+		releaseHostCopies();
+	}
+}
+
+void Mesh::s_writePly(const std::filesystem::path& path, const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices)
+{
+	std::ofstream stream(path, std::ofstream::trunc | std::ofstream::binary);
+	if (!stream) {
+		throw std::runtime_error("Error: Can't store model " + path.string());
+	}
+
+	tinyply::PlyFile file;
+	file.get_comments().push_back(OPTIMIZED_PLY_COMMENT);
+	// vertex positions
+	std::vector<glm::vec3> vert(vertices.size());
+	{
+		for (uint32_t j = 0; j < (uint32_t)vertices.size(); ++j) {
+			vert[j] = vertices[j].pos;
+		}
+		file.add_properties_to_element(
+			"vertex", { "x", "y", "z" },
+			tinyply::Type::FLOAT32,
+			vert.size(),
+			reinterpret_cast<uint8_t*>(vert.data()),
+			tinyply::Type::INVALID, 0);
+	}
+	// vertex normals
+	std::vector<glm::vec3> norm(vertices.size());
+	{
+		for (uint32_t j = 0; j < (uint32_t)vertices.size(); ++j) {
+			norm[j] = vertices[j].normal;
+		}
+		file.add_properties_to_element(
+			"vertex", { "nx", "ny", "nz" },
+			tinyply::Type::FLOAT32,
+			norm.size(),
+			reinterpret_cast<const uint8_t*>(norm.data()),
+			tinyply::Type::INVALID, 0);
+	}
+	// faces
+	{
+		file.add_properties_to_element(
+			"face", { "vertex_indices" },
+			tinyply::Type::UINT32, indices.size() / 3,
+			reinterpret_cast<const uint8_t*>(indices.data()),
+			tinyply::Type::UINT8, 3);
+	}
+
+	file.write(stream, true);
+	if (!stream) {
+		throw std::runtime_error("Error: Can't store model " + path.string());
+	}
+}
+
+void Mesh::s_readLevel(const std::string& path, const std::string& optimizedPath,
+	std::vector<Vertex>* outVertices, std::vector<uint32_t>* outIndices, mth::AABBox* outBBox)
+{
+	bool optimized = false;
+	if (std::filesystem::exists(optimizedPath)) {
+		parsePly(optimizedPath.c_str(), outVertices, outIndices, outBBox, &optimized);
+	}
+	else if (path.find(".obj") != std::string::npos) {
+		parseObj(path.c_str(), outVertices, outIndices, outBBox);
+	}
+	else {
+		parsePly(path.c_str(), outVertices, outIndices, outBBox, &optimized);
+	}
+
+	if (optimized || outIndices->empty()) {
+		return;
+	}
+
+	// Once per model, when it is imported
+	CacheStats stats;
+	s_optimizeLevel(outVertices, outIndices, &stats);
+
+	// Renamed, so a load in another thread never reads half of the file.
+	// If the folder is read only, the level is optimized again on each load
+	const std::filesystem::path tmpPath = optimizedPath + ".tmp";
+	try {
+		s_writePly(tmpPath, *outVertices, *outIndices);
+		std::filesystem::rename(tmpPath, optimizedPath);
+	}
+	catch (const std::exception&) {
+		std::error_code ec;
+		std::filesystem::remove(tmpPath, ec);
+	}
 }
 
 std::string Mesh::getRelativeLodPath(uint32_t lod) const
@@ -453,6 +961,15 @@ std::string Mesh::getRelativeLodPath(uint32_t lod) const
 	return newFile.string();
 }
 
+std::string Mesh::getRelativeOptimizedPath() const
+{
+	std::filesystem::path path = std::filesystem::path(mPath).parent_path();
+	std::filesystem::path fileName = std::filesystem::path(mPath).filename();
+
+	std::filesystem::path newFile = path / (fileName.stem().string() + ".opt.ply");
+	return newFile.string();
+}
+
 bool Mesh::Vertex::operator==(const Vertex& o) const
 {
 	return this->pos == o.pos &&
@@ -473,9 +990,51 @@ void Mesh::renderImGui(FrameContext* fc, Gui* gui)
 {
 	ImGui::TextDisabled("Triangle Mesh");
 	ImGui::Separator();
-	ImGui::Text("Num vertices: %u", mVertices.size());
-	ImGui::Text("Num indices: %u", mIndices.size());
+	ImGui::Text("Num vertices: %u", mParts.empty() ? 0 : mParts[0].numVertices);
+	ImGui::Text("Num indices: %u", mParts.empty() ? 0 : mParts[0].numIndices);
 
+	if (mStreaming) {
+		ImGui::TextDisabled("Streaming, the finest level on the GPU is %u", mFinestResidentLod);
+	}
+
+	if (ImGui::Checkbox("Only on the GPU", &mGpuOnly)) {
+		if (!mGpuOnly && !ensureHostCopies(fc)) {
+			mGpuOnly = true;
+		}
+		else if (canReleaseHostCopies() && *this) {
+			releaseHostCopies();
+		}
+	}
+	ImGui::SameLine(); gui::helpMarker("Releases the vertices and indices in host memory once they are uploaded. "
+		"They are read again from the files to regenerate or save the levels.");
+	if (mHostCopiesReleased) {
+		ImGui::TextDisabled("Host copies released, %.1f KiB", mReleasedHostBytes / 1024.0);
+	}
+	else if (mGpuOnly && !mLODsOnDisk) {
+		ImGui::TextDisabled("Host copies kept until the levels are saved");
+	}
+
+	ImGui::Separator();
+	if (ImGui::Checkbox("Packed vertices", &mUsePackedVertices) && *this && !mStreaming) {
+		uploadDataToGPU(fc);
+	}
+	ImGui::SameLine(); gui::helpMarker("16 bit positions inside the bounding box and octahedral normals. "
+		"Indices use 16 bits in the levels with up to 65536 vertices.");
+	if (mUsePackedVertices && !mPacked) {
+		ImGui::TextDisabled("Packed shaders not available");
+	}
+	{
+		vk::DeviceSize gpuBytes = 0, uploadedBytes = 0, fullFormatBytes = 0;
+		for (const Part& part : mParts) {
+			gpuBytes += part.vertexRange.size + part.indexRange.size;
+			uploadedBytes += part.uploadedBytes;
+			fullFormatBytes += part.fullFormatBytes;
+		}
+		const double_t savedBytes = static_cast<double_t>(fullFormatBytes) - static_cast<double_t>(uploadedBytes);
+		ImGui::Text("GPU memory: %.1f KiB, uploaded %.1f KiB", gpuBytes / 1024.0, uploadedBytes / 1024.0);
+		ImGui::Text("Saved: %.1f KiB (%.1f%%)", savedBytes / 1024.0,
+			fullFormatBytes > 0 ? 100.0 * savedBytes / fullFormatBytes : 0.0);
+	}
 	
 	ImGui::Separator();
 	if (ImGui::TreeNode("Levels of detail:")) {
@@ -492,8 +1051,9 @@ void Mesh::renderImGui(FrameContext* fc, Gui* gui)
 		ImGui::PushID("Lods");
 		for (size_t i = 0; i < mLODs.size(); ++i) {
 			if (ImGui::TreeNode((void*)(intptr_t)i,"LOD %d", i + 1)) {
-				ImGui::Text("Num vertices: %u", mLODs[i].vertices.size());
-				ImGui::Text("Num indices: %u", mLODs[i].indices.size());
+				const Part* part = i + 1 < mParts.size() ? &mParts[i + 1] : nullptr;
+				ImGui::Text("Num vertices: %u", part ? part->numVertices : 0);
+				ImGui::Text("Num indices: %u", part ? part->numIndices : 0);
 				ImGui::Text("Computed on depth: %u", mLODs[i].depth);
 				std::string str = std::string("Depth##") + std::to_string(i);
 				int32_t step = 1;
@@ -508,7 +1068,10 @@ void Mesh::renderImGui(FrameContext* fc, Gui* gui)
 			}
 		}
 
-		if (ImGui::TreeNode("Regenerate LOD")) {
+		if (mStreaming) {
+			ImGui::TextDisabled("Regenerate after the levels are loaded");
+		}
+		else if (ImGui::TreeNode("Regenerate LOD")) {
 			if (ImGui::Button("Representative Mean")) {
 				this->regenerateLODs(fc);
 				this->uploadDataToGPU(fc);
@@ -560,7 +1123,7 @@ void Mesh::renderImGui(FrameContext* fc, Gui* gui)
 void Mesh::start(FrameContext* fc)
 {
 	if (!mPath.empty()) {
-		this->load(fc, mPath.c_str());
+		this->loadAsync(fc, mPath.c_str());
 	}
 }
 
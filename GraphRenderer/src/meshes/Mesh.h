@@ -1,9 +1,13 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <limits>
 #include <glm/glm.hpp>
 #include <vector>
 
-#include "../graphics/resources/Buffer.h"
+#include "../graphics/resources/GeometryArena.h"
 #include "../graphics/shaders/VertexInputDescription.h"
 #include "IObject.h"
 #include "../utils/math/BBox.h"
@@ -24,31 +28,103 @@ public:
 
 	Mesh() = default;
 
-	Mesh(const Mesh&) = default;
-	Mesh(Mesh&&) = default;
-	Mesh& operator=(const Mesh&) = default;
-	Mesh& operator=(Mesh&&) = default;
+	// The MeshStreamer keeps a pointer while it loads the levels
+	Mesh(const Mesh&) = delete;
+	Mesh& operator=(const Mesh&) = delete;
 
-	// Catch exception if it can fail
+	// Catch exception if it can fail. All the levels are on the GPU when it returns
 	void load(FrameContext* fc,
 		const char* filePath);
 
+	// Returns right away. The MeshStreamer loads the coarsest level first,
+	// and the finer ones in the background, see getFinestResidentLOD
+	void loadAsync(FrameContext* fc, const char* filePath);
+
 	void scheduleDestroy(FrameContext* fc) override final;
 	void renderImGui(FrameContext* fc, Gui* gui) override final;
 	void start(FrameContext* fc) override final;
+	// The ranges of the geometry arena, and the copies of the levels on the host
+	void appendMemoryUsage(vkg::MemoryUsage* usage) const override final;
 
 	static constexpr const char* s_getClassName() { return "Mesh"; }
 
 
-	const vk::Buffer& getVB() const { return mVertexBuffer.getVkBuffer(); }
-	const vk::Buffer& getIB() const { return mIndexBuffer.getVkBuffer(); }
+	// Shared with other meshes, use the offsets of getDrawDataLod
+	vk::Buffer getVB(uint32_t lod) const { return mParts[lod].vertexRange ? mParts[lod].vertexRange.buffer->getVkBuffer() : vk::Buffer(); }
+	vk::Buffer getIB(uint32_t lod) const { return mParts[lod].indexRange ? mParts[lod].indexRange.buffer->getVkBuffer() : vk::Buffer(); }
 
-	uint32_t getNumIndices() const { return static_cast<uint32_t>(mIndices.size()); }
-	uint32_t getNumLODs() const { return (uint32_t) mLODsDrawData.size(); }
-	uint32_t getNumIndicesLod(uint32_t lod) const { return static_cast<uint32_t>(mLODs.at(lod).indices.size()); }
+	// Also without the host copies, from the uploaded levels
+	uint32_t getNumIndices() const { return mParts.empty() ? 0 : mParts[0].numIndices; }
+	uint32_t getNumLODs() const { return mParts.empty() ? 0 : static_cast<uint32_t>(mParts.size()) - 1; }
+	uint32_t getNumIndicesLod(uint32_t lod) const { return mParts.at(lod + 1).numIndices; }
 	uint32_t getDepthLod(uint32_t lod) const { return mLODs.at(lod).depth; }
 
-	void getDrawDataLod(uint32_t lod, uint32_t* numIndices, uint32_t* firstIndex, vk::DeviceSize* vertexOffset) const;
+	// The vertex offset is in vertices, to add to the indices when drawing.
+	// The first index is in units of the index type.
+	void getDrawDataLod(uint32_t lod, uint32_t* numIndices, uint32_t* firstIndex, int32_t* vertexOffset, vk::IndexType* indexType) const;
+
+	// Levels stream from the coarsest one to the full mesh. The levels from this one
+	// to getNumLODs() are on the GPU, and none if it is greater than getNumLODs()
+	uint32_t getFinestResidentLOD() const { return mFinestResidentLod; }
+	bool isLODResident(uint32_t lod) const {
+		return lod >= mFinestResidentLod && lod < static_cast<uint32_t>(mParts.size()) && mParts[lod].indexRange;
+	}
+	bool isStreaming() const { return mStreaming; }
+
+	// Thread safe. The objects that draw the mesh report their distance to the camera
+	// and the level they want, the closest one sets the priority of the next level to stream
+	void reportView(float_t distance, uint32_t lod);
+	// Once per frame on the main thread, keeps the closest distance and the finest level
+	// reported since the last call. Infinity and ~0u if nobody drew the mesh
+	void updateViewState();
+	float_t getViewDistance() const { return mViewDistance; }
+	uint32_t getRequestedLOD() const { return mRequestedLod; }
+
+	// Device memory of the ranges of the level, also while it is evicted
+	vk::DeviceSize getLODBytes(uint32_t lod) const { return mParts[lod].gpuBytes; }
+	vk::DeviceSize getResidentBytes() const;
+	// Frees the finest resident level, never the coarsest one. The ranges are destroyed
+	// once the frames in flight are done. Returns the bytes freed
+	vk::DeviceSize evictFinestLOD(FrameContext* fc);
+	// Uploads again the evicted levels down to lod, from the copy in memory,
+	// or from the files if the host copies were released
+	void restreamLODs(FrameContext* fc, uint32_t lod);
+
+	// In GPU only mode the vertices and indices of the levels are released once they
+	// are uploaded, keeping the bounding box and the draw ranges. They are read again
+	// from the files when an operation needs them. Only while the levels on the
+	// GPU are the ones in the files, until the generated levels are saved
+	bool isGpuOnly() const { return mGpuOnly; }
+	bool hasHostCopies() const { return !mHostCopiesReleased; }
+	// Reads the levels again if they were released. If a file can not be read, the error
+	// is logged and the mesh stays released. Returns if the host copies are there
+	bool ensureHostCopies(FrameContext* fc);
+
+	// Mode of the meshes created after the call
+	static void s_setGpuOnlyDefault(bool gpuOnly) { s_gpuOnlyDefault.store(gpuOnly, std::memory_order_relaxed); }
+	static bool s_getGpuOnlyDefault() { return s_gpuOnlyDefault.load(std::memory_order_relaxed); }
+	// Host memory of the copies released by all the meshes
+	static size_t s_getReleasedHostBytes() { return s_releasedHostBytes.load(std::memory_order_relaxed); }
+	// If the levels optimized afterwards also sort their clusters of triangles to reduce
+	// the overdraw. Off by default, it makes the vertex cache a bit worse
+	static void s_setSortForOverdraw(bool sort) { s_sortForOverdraw.store(sort, std::memory_order_relaxed); }
+	static bool s_getSortForOverdraw() { return s_sortForOverdraw.load(std::memory_order_relaxed); }
+
+	// If packed, the vertices use the layout of addToVertexInputDescription with packed = true
+	bool isPacked() const { return mPacked; }
+	// Transforms the packed positions of the level to model space, to premultiply
+	// by the model matrix. Identity if not packed.
+	glm::mat4 getDequantizationMatrix(uint32_t lod) const;
+
+	struct LODMetrics {
+		uint32_t numTris;
+		// Upper bound of the deviation from the original surface, in model space
+		float_t geometricError;
+	};
+	// Cached table of all the levels, where 0 is the full resolution mesh
+	const std::vector<LODMetrics>& getLODMetrics() const { return mLODMetrics; }
+	// Changes each time the table is rebuilt
+	uint32_t getLODMetricsVersion() const { return mLODMetricsVersion; }
 
 	const mth::AABBox& getBBox() const { return mBBox; }
 
@@ -58,14 +134,29 @@ public:
 	// 	   TODO these are removed
 	// (location = 2) float3 vertexColor
 	// (location = 3) float2 texCoord
+	// If packed:
+	// (location = 0) unorm16x4 position in the bounding box, w unused
+	// (location = 1) snorm16x2 octahedral normal
 	static void addToVertexInputDescription(uint32_t binding,
-		vkg::VertexInputDescription* vid);
+		vkg::VertexInputDescription* vid, bool packed = false);
 
-	operator bool()const { return mIndexBuffer; }
+	operator bool()const { return mFinestResidentLod < static_cast<uint32_t>(mParts.size()); }
 
 	
 	void regenerateLODs(FrameContext* fc, bool useQuadricErrorMetric = false, bool useNormalClustering = false);
 
+	// Reorders the triangles for the post-transform vertex cache, and to reduce overdraw
+	// if s_getSortForOverdraw, and the vertices in order of first use. One job per level of detail.
+	// The levels read from files are already optimized, see s_readLevel
+	void optimizeForGPU(FrameContext* fc, bool onlyLODs = false);
+
+	// A level loaded by the MeshStreamer in a worker
+	struct StreamedPart;
+	// Parses, optimizes and uploads the level. Any thread
+	static void s_loadPart(vkg::RenderContext* rc, StreamedPart* part);
+	// Only when no render job reads the mesh. An outdated part is freed
+	void applyStreamedPart(FrameContext* fc, StreamedPart* part);
+
 protected:
 
 	struct Vertex {
@@ -81,6 +172,11 @@ protected:
 		std::size_t operator()(const Vertex& o) const;
 	};
 
+	struct PackedVertex {
+		uint16_t pos[4];
+		int16_t normal[2];
+	};
+
 
 	std::vector<Vertex> mVertices;
 	std::vector<uint32_t> mIndices;
@@ -98,16 +194,61 @@ protected:
 	struct LOD_DrawData {
 		uint32_t numIndices;
 		uint32_t firstIndex;
-		vk::DeviceSize vertexOffset;
+		int32_t vertexOffset;
+		vk::IndexType indexType;
 	};
-	std::vector<LOD_DrawData> mLODsDrawData;
-	
 
-	vkg::Buffer mIndexBuffer;
-	vkg::Buffer mVertexBuffer;
-
-	vk::DeviceSize mVertexBufferSize = 0;
-	vk::DeviceSize mIndexBufferSize = 0;
+	// GPU data of a level, 0 is the full resolution mesh and i the LOD i - 1.
+	// Each one has its own ranges, so they can arrive separately
+	struct Part {
+		vkg::GeometryRange vertexRange;
+		vkg::GeometryRange indexRange;
+		LOD_DrawData drawData = {};
+		// Packed positions are relative to the bounding box of the level,
+		// with the same scale in all the axes to keep the direction of the normals
+		glm::vec3 quantizationOrigin = glm::vec3(0.0f);
+		float_t quantizationExtent = 1.0f;
+		// Bytes uploaded, and the ones of the full format with 32 bit indices
+		vk::DeviceSize uploadedBytes = 0;
+		vk::DeviceSize fullFormatBytes = 0;
+		// Size of the ranges
+		vk::DeviceSize gpuBytes = 0;
+		// Kept after an eviction and without the host copies
+		uint32_t numVertices = 0;
+		uint32_t numIndices = 0;
+	};
+	std::vector<Part> mParts;
+	std::vector<LODMetrics> mLODMetrics;
+	uint32_t mLODMetricsVersion = 0;
+
+	// Requested from the inspector, only used if the submitter has the packed material
+	bool mUsePackedVertices = true;
+	bool mPacked = false;
+
+	bool mGpuOnly = s_gpuOnlyDefault.load(std::memory_order_relaxed);
+	bool mHostCopiesReleased = false;
+	// The files of the levels are the ones on the GPU. Not after regenerating them
+	bool mLODsOnDisk = true;
+	// Part of s_releasedHostBytes
+	size_t mReleasedHostBytes = 0;
+
+	static std::atomic<bool> s_gpuOnlyDefault;
+	static std::atomic<size_t> s_releasedHostBytes;
+	static std::atomic<bool> s_sortForOverdraw;
+
+	uint32_t mFinestResidentLod = 0;
+	bool mStreaming = false;
+	// The finest level of the current stream
+	uint32_t mStreamTarget = 0;
+	// Parts of previous loads are discarded
+	uint64_t mStreamGeneration = 0;
+	std::chrono::high_resolution_clock::time_point mStreamStart;
+	// Bits of the closest reported distance, the order of non negative floats
+	// is the same as the one of their bits. Starts at infinity
+	std::atomic<uint32_t> mViewDistanceBits = 0x7f800000u;
+	std::atomic<uint32_t> mRequestedLodReport = ~0u;
+	float_t mViewDistance = std::numeric_limits<float_t>::infinity();
+	uint32_t mRequestedLod = ~0u;
 
 	mth::AABBox mBBox;
 
@@ -115,13 +256,46 @@ protected:
 
 
 	static void parseObj(const char* fileName, std::vector<Vertex>* outVertices, std::vector<uint32_t>* outIndices, mth::AABBox* outBBox = nullptr);
-	static void parsePly(const char* fileName, std::vector<Vertex>* outVertices, std::vector<uint32_t>* outIndices, mth::AABBox* outBBox = nullptr);
+	// outOptimized is set if the file was written by s_writePly
+	static void parsePly(const char* fileName, std::vector<Vertex>* outVertices, std::vector<uint32_t>* outIndices,
+		mth::AABBox* outBBox = nullptr, bool* outOptimized = nullptr);
+	// Binary ply, marked as already optimized for the GPU
+	static void s_writePly(const std::filesystem::path& path, const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices);
+	// Reads the optimized copy of the level if it exists. If not, the level is read from
+	// its file and optimized, and the copy is written for the next loads. Any thread
+	static void s_readLevel(const std::string& path, const std::string& optimizedPath,
+		std::vector<Vertex>* outVertices, std::vector<uint32_t>* outIndices, mth::AABBox* outBBox = nullptr);
 	static void computeNormals(const std::vector<uint32_t>& indices, std::vector<Vertex>* outVertices);
+	static PackedVertex s_packVertex(const Vertex& vertex, const glm::vec3& origin, float_t invExtent);
+
+	// Average cache miss ratio per triangle and per vertex, with a FIFO cache of 16 vertices
+	struct CacheStats {
+		float_t acmrBefore = 0.0f, acmrAfter = 0.0f;
+		float_t atvrBefore = 0.0f, atvrAfter = 0.0f;
+	};
+	static void s_optimizeLevel(std::vector<Vertex>* vertices, std::vector<uint32_t>* indices, CacheStats* outStats);
 
+	// Allocates the ranges of the level and queues its upload. Any thread
+	static void s_uploadPart(vkg::RenderContext* rc, const std::vector<Vertex>& vertices,
+		const std::vector<uint32_t>& indices, bool packed, Part* outPart);
+	static void s_schedulePartDestroy(FrameContext* fc, Part* part);
+
+	// Returns the absolute path
+	std::filesystem::path setPath(FrameContext* fc, const char* filePath);
 	void uploadDataToGPU(FrameContext* fc);
+	void updateLODMetrics();
+
+	size_t getHostBytes() const;
+	bool canReleaseHostCopies() const { return mGpuOnly && mLODsOnDisk && !mPath.empty(); }
+	void releaseHostCopies();
+	// From the sizes of the uploaded levels, while the copies are released
+	void updateReleasedHostBytes();
 
-	void saveLODModels(FrameContext* fc) const;
+	void saveLODModels(FrameContext* fc);
 	std::string getRelativeLodPath(uint32_t lod) const;
+	// The full mesh optimized for the GPU, written when the model is imported.
+	// The files of the levels are optimized in place
+	std::string getRelativeOptimizedPath() const;
 
 
 	// Serialization functions
@@ -144,5 +318,28 @@ inline void gr::Mesh::LOD::serialize(Archive& archive)
 	archive(depth);
 }
 
+struct gr::Mesh::StreamedPart {
+	// 0 is the full resolution mesh, i the LOD i - 1
+	uint32_t part = 0;
+	uint64_t generation = 0;
+	std::string absolutePath;
+	// See s_readLevel
+	std::string optimizedPath;
+	bool packed = false;
+	// The vertices and indices are already set, from the copy of the mesh
+	bool inMemory = false;
+
+	// Filled by s_loadPart
+	std::vector<Vertex> vertices;
+	std::vector<uint32_t> indices;
+	mth::AABBox bbox;
+	Part gpu;
+	std::string error;
+
+	// For the parts that are not applied to their mesh
+	void scheduleDestroy(FrameContext* fc);
+	void destroy(vkg::RenderContext& rc);
+};
+
 GR_SERIALIZE_TYPE(gr::Mesh)
 GR_SERIALIZE_POLYMORPHIC_RELATION(gr::IObject, gr::Mesh)
\ No newline at end of file
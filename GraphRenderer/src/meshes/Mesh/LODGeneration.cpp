@@ -78,6 +78,12 @@ void gr::Mesh::regenerateLODs(FrameContext* fc, bool useQuadricErrorMetric, bool
 		return;
 	}
 
+	// Needs the full mesh, and the new levels are not in the files until they are saved
+	if (!ensureHostCopies(fc)) {
+		return;
+	}
+	mLODsOnDisk = false;
+
 	const auto start_timer = std::chrono::high_resolution_clock::now();
 
 
@@ -284,4 +290,7 @@ void gr::Mesh::regenerateLODs(FrameContext* fc, bool useQuadricErrorMetric, bool
 	ss << "\tGenerated " << mLODs.size() << " different LODs\n";
 
 	fc->gc().addNewLog(ss.str());
+
+	// The faces are in octree order, bad for the vertex cache
+	this->optimizeForGPU(fc, true);
 }
\ No newline at end of file
@@ -0,0 +1,161 @@
+#include "MeshStreamer.h"
+
+#include "../control/FrameContext.h"
+#include "../utils/grjob.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace gr
+{
+
+void MeshStreamer::stream(FrameContext* fc, Mesh* mesh, std::vector<std::unique_ptr<Mesh::StreamedPart>>&& parts)
+{
+	cancel(mesh);
+	if (parts.empty()) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	Queue queue;
+	queue.mesh = mesh;
+	queue.parts = std::move(parts);
+	std::reverse(queue.parts.begin(), queue.parts.end());
+	mQueues.push_back(std::move(queue));
+
+	// The coarsest level of a load does not wait for the background loads.
+	// Evicted levels uploaded again do, the mesh is drawn with a coarser one
+	if (!mQueues.back().parts.back()->inMemory) {
+		dispatch(&fc->rc(), &mQueues.back(), false);
+	}
+}
+
+void MeshStreamer::cancel(const Mesh* mesh)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	for (std::unique_ptr<Load>& load : mLoads) {
+		if (load->mesh == mesh) {
+			load->mesh = nullptr;
+		}
+	}
+
+	mQueues.erase(std::remove_if(mQueues.begin(), mQueues.end(),
+		[mesh](const Queue& queue) { return queue.mesh == mesh; }),
+		mQueues.end());
+}
+
+void MeshStreamer::update(FrameContext* fc)
+{
+	// Finished loads, applied without the lock because the mesh may cancel
+	std::vector<std::unique_ptr<Load>> finished;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		for (auto it = mLoads.begin(); it != mLoads.end();) {
+			if ((*it)->counter->getValue() != 0) {
+				++it;
+				continue;
+			}
+			for (Queue& queue : mQueues) {
+				if (queue.mesh == (*it)->mesh) {
+					queue.loading = false;
+				}
+			}
+			finished.push_back(std::move(*it));
+			it = mLoads.erase(it);
+		}
+	}
+
+	for (std::unique_ptr<Load>& load : finished) {
+		grjob::waitForCounterAndFree(load->counter, 0);
+		if (load->mesh != nullptr) {
+			load->mesh->applyStreamedPart(fc, load->part.get());
+			mNumLoaded += 1;
+		}
+		else {
+			load->part->scheduleDestroy(fc);
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	mQueues.erase(std::remove_if(mQueues.begin(), mQueues.end(),
+		[](const Queue& queue) { return queue.parts.empty() && !queue.loading; }),
+		mQueues.end());
+
+	uint32_t numBackground = 0;
+	for (const std::unique_ptr<Load>& load : mLoads) {
+		numBackground += load->background ? 1 : 0;
+	}
+
+	// The distance reported by the objects that drew the mesh, the
+	// meshes nobody draws keep their last one
+	std::vector<Queue*> idle;
+	for (Queue& queue : mQueues) {
+		const float_t distance = queue.mesh->getViewDistance();
+		if (distance < std::numeric_limits<float_t>::infinity()) {
+			queue.distance = distance;
+		}
+		if (!queue.loading && !queue.parts.empty()) {
+			idle.push_back(&queue);
+		}
+	}
+
+	std::sort(idle.begin(), idle.end(),
+		[](const Queue* a, const Queue* b) { return a->distance < b->distance; });
+	for (Queue* queue : idle) {
+		if (numBackground >= MAX_BACKGROUND_LOADS) {
+			break;
+		}
+		dispatch(&fc->rc(), queue, true);
+		numBackground += 1;
+	}
+}
+
+MeshStreamer::Stats MeshStreamer::getStats() const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	Stats stats;
+	stats.numMeshes = static_cast<uint32_t>(mQueues.size());
+	for (const Queue& queue : mQueues) {
+		stats.numQueued += static_cast<uint32_t>(queue.parts.size());
+	}
+	stats.numLoading = static_cast<uint32_t>(mLoads.size());
+	stats.numQueued += stats.numLoading;
+	stats.numLoaded = mNumLoaded;
+	return stats;
+}
+
+void MeshStreamer::destroy(vkg::RenderContext& rc)
+{
+	std::vector<std::unique_ptr<Load>> loads;
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		loads = std::move(mLoads);
+		mLoads.clear();
+		mQueues.clear();
+	}
+
+	for (std::unique_ptr<Load>& load : loads) {
+		grjob::waitForCounterAndFree(load->counter, 0);
+		load->part->destroy(rc);
+	}
+}
+
+void MeshStreamer::dispatch(vkg::RenderContext* rc, Queue* queue, bool background)
+{
+	assert(!queue->loading && !queue->parts.empty());
+
+	std::unique_ptr<Load> load = std::make_unique<Load>();
+	load->mesh = queue->mesh;
+	load->part = std::move(queue->parts.back());
+	load->background = background;
+	queue->parts.pop_back();
+	queue->loading = true;
+
+	grjob::runJob(background ? grjob::Priority::eLow : grjob::Priority::eMid,
+		grjob::Job(&Mesh::s_loadPart, rc, load->part.get()),
+		&load->counter);
+
+	mLoads.push_back(std::move(load));
+}
+
+}
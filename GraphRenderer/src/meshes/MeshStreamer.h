@@ -0,0 +1,83 @@
+#pragma once
+
+#include "Mesh.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace gr
+{
+namespace grjob
+{
+class Counter;
+}
+
+class FrameContext;
+
+// Loads the levels of the meshes in workers. The coarsest level of a mesh is
+// loaded right away, so it can be drawn soon, and the finer ones in the
+// background, first for the meshes closest to the camera. The loaded levels
+// are applied to their meshes in update, on the main thread.
+class MeshStreamer
+{
+public:
+
+	MeshStreamer() = default;
+	MeshStreamer(const MeshStreamer&) = delete;
+	MeshStreamer& operator=(const MeshStreamer&) = delete;
+
+	// Thread safe. The parts go from the coarsest level to the full mesh,
+	// and replace the ones of a previous call for the mesh
+	void stream(FrameContext* fc, Mesh* mesh, std::vector<std::unique_ptr<Mesh::StreamedPart>>&& parts);
+
+	// Thread safe. Before destroying the mesh, its levels that are loading are freed later
+	void cancel(const Mesh* mesh);
+
+	// Once per frame, on the main thread while no render job reads the meshes,
+	// after the ResidencyManager updated the view of the meshes
+	void update(FrameContext* fc);
+
+	struct Stats {
+		uint32_t numMeshes = 0;
+		// Levels waiting and in workers
+		uint32_t numQueued = 0;
+		uint32_t numLoading = 0;
+		uint32_t numLoaded = 0;
+	};
+	Stats getStats() const;
+
+	// Waits for the loads in workers
+	void destroy(vkg::RenderContext& rc);
+
+	// Finer levels loading at the same time
+	static constexpr uint32_t MAX_BACKGROUND_LOADS = 2;
+
+private:
+
+	struct Load {
+		// Null if the mesh was cancelled
+		Mesh* mesh = nullptr;
+		std::unique_ptr<Mesh::StreamedPart> part;
+		grjob::Counter* counter = nullptr;
+		bool background = false;
+	};
+
+	struct Queue {
+		Mesh* mesh = nullptr;
+		// The coarsest one at the back
+		std::vector<std::unique_ptr<Mesh::StreamedPart>> parts;
+		bool loading = false;
+		float_t distance = 0.0f;
+	};
+
+	std::vector<std::unique_ptr<Load>> mLoads;
+	std::vector<Queue> mQueues;
+	uint32_t mNumLoaded = 0;
+	mutable std::mutex mMutex;
+
+	// With the lock held
+	void dispatch(vkg::RenderContext* rc, Queue* queue, bool background);
+};
+
+}
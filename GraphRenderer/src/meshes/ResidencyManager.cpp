@@ -0,0 +1,128 @@
+#include "ResidencyManager.h"
+
+#include "../control/FrameContext.h"
+
+#include <algorithm>
+
+namespace gr
+{
+
+void ResidencyManager::add(Mesh* mesh)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	if (std::find(mMeshes.begin(), mMeshes.end(), mesh) == mMeshes.end()) {
+		mMeshes.push_back(mesh);
+	}
+}
+
+void ResidencyManager::remove(const Mesh* mesh)
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	mMeshes.erase(std::remove(mMeshes.begin(), mMeshes.end(), mesh), mMeshes.end());
+}
+
+void ResidencyManager::update(FrameContext* fc)
+{
+	const vkg::MemoryManager& memory = fc->rc().getMemoryManager();
+	memory.setCurrentFrameIndex(mFrameIndex++);
+	const vkg::MemoryManager::Budget heap = memory.getDeviceLocalBudget();
+
+	std::lock_guard<std::mutex> lock(mMutex);
+	vk::DeviceSize resident = 0;
+	for (Mesh* mesh : mMeshes) {
+		mesh->updateViewState();
+		resident += mesh->getResidentBytes();
+	}
+
+	// The blocks of the arena are only released once empty, and an eviction
+	// leaves free ranges in them. The rest of the process does not count them
+	vk::DeviceSize budget = mBudgetOverride;
+	if (budget == 0) {
+		const vk::DeviceSize arenaBytes = fc->rc().getGeometryArena().getStats().capacity;
+		const vk::DeviceSize others = heap.usage > arenaBytes ? heap.usage - arenaBytes : 0;
+		const vk::DeviceSize available = static_cast<vk::DeviceSize>(heap.budget * HEAP_BUDGET_FRACTION);
+		budget = available > others ? available - others : 0;
+	}
+
+	// Closest first
+	std::vector<Mesh*> meshes = mMeshes;
+	std::sort(meshes.begin(), meshes.end(),
+		[](const Mesh* a, const Mesh* b) { return a->getViewDistance() < b->getViewDistance(); });
+
+	if (resident > budget) {
+		// First the levels nobody requested, then the requested ones. From the farthest mesh
+		for (auto it = meshes.rbegin(); it != meshes.rend() && resident > budget; ++it) {
+			evict(fc, *it, (*it)->getRequestedLOD(), budget, &resident);
+		}
+		// Down to the coarsest level of each mesh, see evict
+		for (auto it = meshes.rbegin(); it != meshes.rend() && resident > budget; ++it) {
+			evict(fc, *it, (*it)->getNumLODs(), budget, &resident);
+		}
+	}
+	else {
+		uint32_t numRestreamed = 0;
+		for (size_t i = 0; i < meshes.size() && numRestreamed < MAX_RESTREAMS_PER_FRAME; ++i) {
+			Mesh* mesh = meshes[i];
+			const uint32_t finest = mesh->getFinestResidentLOD();
+			const uint32_t requested = mesh->getRequestedLOD();
+			if (mesh->isStreaming() || requested >= finest || finest > mesh->getNumLODs()) {
+				continue;
+			}
+
+			vk::DeviceSize needed = 0;
+			for (uint32_t lod = requested; lod < finest; ++lod) {
+				needed += mesh->getLODBytes(lod);
+			}
+			if (needed > budget) {
+				continue;
+			}
+
+			// Makes room with the levels of farther meshes that nobody requested
+			for (size_t j = meshes.size() - 1; j > i && resident + needed > budget; --j) {
+				if (!meshes[j]->isStreaming()) {
+					evict(fc, meshes[j], meshes[j]->getRequestedLOD(), budget - needed, &resident);
+				}
+			}
+			if (resident + needed > budget) {
+				continue;
+			}
+
+			mesh->restreamLODs(fc, requested);
+			resident += needed;
+			numRestreamed += 1;
+		}
+		mStats.numRestreamed += numRestreamed;
+	}
+
+	mStats.numMeshes = static_cast<uint32_t>(mMeshes.size());
+	mStats.residentBytes = resident;
+	mStats.budgetBytes = budget;
+	mStats.heapUsage = heap.usage;
+	mStats.heapBudget = heap.budget;
+	mStats.budgetFromDriver = heap.fromDriver;
+}
+
+ResidencyManager::Stats ResidencyManager::getStats() const
+{
+	std::lock_guard<std::mutex> lock(mMutex);
+	return mStats;
+}
+
+void ResidencyManager::evict(FrameContext* fc, Mesh* mesh, uint32_t keepLod, vk::DeviceSize budget, vk::DeviceSize* resident)
+{
+	if (mesh->isStreaming()) {
+		return;
+	}
+
+	// The levels go from 0 to getNumLODs(), the coarsest one always stays resident
+	// so the mesh is never left without anything to draw
+	const uint32_t coarsestLod = mesh->getNumLODs();
+	const uint32_t lastLod = std::min(keepLod, coarsestLod);
+	while (*resident > budget && mesh->getFinestResidentLOD() < lastLod) {
+		const vk::DeviceSize bytes = mesh->evictFinestLOD(fc);
+		*resident -= std::min(bytes, *resident);
+		mStats.numEvicted += 1;
+	}
+}
+
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <vulkan/vulkan.hpp>
+
+#include <cmath>
+#include <mutex>
+#include <vector>
+
+namespace gr
+{
+
+class FrameContext;
+class Mesh;
+
+// Keeps the levels of the meshes on the GPU under a budget of device memory.
+// When they go over it, the finest levels of the meshes that are far away,
+// or that nobody drew because they are out of the visible set, are evicted.
+// They are streamed again once they are requested and fit.
+class ResidencyManager
+{
+public:
+
+	ResidencyManager() = default;
+	ResidencyManager(const ResidencyManager&) = delete;
+	ResidencyManager& operator=(const ResidencyManager&) = delete;
+
+	// Thread safe, the mesh is added when it loads and removed when destroyed
+	void add(Mesh* mesh);
+	void remove(const Mesh* mesh);
+
+	// Once per frame on the main thread, while no render job reads the meshes
+	// and before the MeshStreamer update
+	void update(FrameContext* fc);
+
+	// 0 derives the budget of the meshes from the one of the device local heaps
+	void setBudgetOverride(vk::DeviceSize bytes) { mBudgetOverride = bytes; }
+	vk::DeviceSize getBudgetOverride() const { return mBudgetOverride; }
+
+	struct Stats {
+		uint32_t numMeshes = 0;
+		vk::DeviceSize residentBytes = 0;
+		vk::DeviceSize budgetBytes = 0;
+		// Of the device local heaps
+		vk::DeviceSize heapUsage = 0;
+		vk::DeviceSize heapBudget = 0;
+		bool budgetFromDriver = false;
+		uint64_t numEvicted = 0;
+		uint64_t numRestreamed = 0;
+	};
+	Stats getStats() const;
+
+	// Part of the heap budget the process fills before evicting
+	static constexpr float_t HEAP_BUDGET_FRACTION = 0.8f;
+	// Each one copies the levels on the main thread
+	static constexpr uint32_t MAX_RESTREAMS_PER_FRAME = 1;
+
+private:
+
+	std::vector<Mesh*> mMeshes;
+	mutable std::mutex mMutex;
+
+	vk::DeviceSize mBudgetOverride = 0;
+	uint32_t mFrameIndex = 0;
+	Stats mStats;
+
+	// Evicts the levels of the mesh finer than keepLod while over the budget.
+	// keepLod is capped to the coarsest level, that always stays resident
+	void evict(FrameContext* fc, Mesh* mesh, uint32_t keepLod, vk::DeviceSize budget, vk::DeviceSize* resident);
+};
+
+}
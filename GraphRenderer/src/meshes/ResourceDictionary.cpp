@@ -1,8 +1,12 @@
 #include "ResourceDictionary.h"
 
 #include "../control/FrameContext.h"
+#include "../utils/grjob.h"
 
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <sstream>
 
 namespace gr
 {
@@ -28,6 +32,16 @@ void ResourceDictionary::flushDataAndFree(FrameContext* fc)
 	std::unique_lock lock(mEraseObjectMutex);
 
 	for (const ResId& id : mObjectsToFree) {
+		{
+			std::unique_lock lazyLock(mLazyMutex);
+			if (mLazyObjects.erase(id) != 0) {
+				mNumLazyObjects -= 1;
+			}
+			auto itStart = mLazyStarts.find(id);
+			if (itStart != mLazyStarts.end() && itStart->second->getValue() == 0) {
+				mLazyStarts.erase(itStart);
+			}
+		}
 		for (std::unordered_set<ResId>& s : mObjectsByType) {
 			s.erase(id);
 		}
@@ -82,15 +96,176 @@ void ResourceDictionary::clear(FrameContext* fc)
 
 	mObjectsDictionary.clear();
 	mName2Id.clear();
+
+	std::unique_lock lazyLock(mLazyMutex);
+	mLazyObjects.clear();
+	mLazyStarts.clear();
+	mNumLazyObjects = 0;
 }
 
-void ResourceDictionary::startAll(FrameContext* fc)
+void ResourceDictionary::startAll(FrameContext* fc, ResId root)
 {
-	// TODO: lock somehow without deadlocks
-	//std::unique_lock ulock(mObjectsMutex);
-	for (decltype(mObjectsDictionary)::iterator it = mObjectsDictionary.begin();
-		it != mObjectsDictionary.end(); ++it) {
-		it->second->start(fc);
+	const auto start_timer = std::chrono::high_resolution_clock::now();
+
+	// Copy the objects, because starting them can allocate new ones
+	std::unordered_map<ResId, IObject*> objects;
+	std::unordered_set<ResId> scenes;
+	{
+		std::shared_lock slock(mObjectsMutex);
+		objects.reserve(mObjectsDictionary.size());
+		for (const std::pair<const ResId, std::unique_ptr<IObject>>& it : mObjectsDictionary) {
+			objects.emplace(it.first, it.second.get());
+		}
+		scenes = mObjectsByType[ctools::indexOf<ResourceTypesList, Scene>()];
+	}
+
+	// Find the objects reachable from the root
+	std::unordered_map<ResId, std::vector<ResId>> dependencies;
+	std::vector<ResId> toVisit;
+	if (root && objects.count(root) != 0) {
+		toVisit.push_back(root);
+	}
+	else {
+		for (const std::pair<const ResId, IObject*>& it : objects) {
+			toVisit.push_back(it.first);
+		}
+	}
+	while (!toVisit.empty()) {
+		const ResId id = toVisit.back();
+		toVisit.pop_back();
+		if (dependencies.count(id) != 0) {
+			continue;
+		}
+
+		std::vector<ResId>& deps = dependencies[id];
+		objects.at(id)->appendReferencedResources(&deps);
+		// Ignore references to erased objects
+		deps.erase(std::remove_if(deps.begin(), deps.end(),
+			[&](const ResId& dep) { return dep == id || objects.count(dep) == 0; }), deps.end());
+		toVisit.insert(toVisit.end(), deps.begin(), deps.end());
+	}
+
+	// The rest wait until they are used
+	{
+		std::unique_lock lazyLock(mLazyMutex);
+		for (const std::pair<const ResId, IObject*>& it : objects) {
+			if (dependencies.count(it.first) == 0) {
+				mLazyObjects.insert(it.first);
+			}
+		}
+		mNumLazyObjects = static_cast<uint32_t>(mLazyObjects.size());
+	}
+
+	// Sort in levels, where each object only references objects of previous levels
+	std::unordered_map<ResId, uint32_t> numPendingDeps;
+	std::unordered_map<ResId, std::vector<ResId>> dependants;
+	std::vector<ResId> level;
+	for (const std::pair<const ResId, std::vector<ResId>>& it : dependencies) {
+		for (const ResId& dep : it.second) {
+			dependants[dep].push_back(it.first);
+		}
+		numPendingDeps[it.first] = static_cast<uint32_t>(it.second.size());
+		if (it.second.empty()) {
+			level.push_back(it.first);
+		}
+	}
+
+	uint32_t numLevels = 0;
+	uint32_t numStarted = 0;
+	std::vector<grjob::Job> jobs;
+	while (!level.empty() || numStarted != static_cast<uint32_t>(dependencies.size())) {
+		if (level.empty()) {
+			// Cyclic references, start the remaining objects in any order
+			for (const std::pair<const ResId, uint32_t>& it : numPendingDeps) {
+				if (it.second != 0) {
+					level.push_back(it.first);
+				}
+			}
+			for (const ResId& id : level) {
+				numPendingDeps[id] = 0;
+			}
+		}
+
+		// Scenes create objects when they start, thus they start in this thread
+		jobs.clear();
+		for (const ResId& id : level) {
+			if (scenes.count(id) == 0) {
+				jobs.push_back(grjob::Job(&IObject::start, objects.at(id), fc));
+			}
+		}
+		if (!jobs.empty()) {
+			grjob::Counter* c = nullptr;
+			grjob::runJobBatch(grjob::Priority::eHigh, jobs.data(), (uint32_t)jobs.size(), &c);
+			grjob::waitForCounterAndFree(c, 0);
+		}
+		for (const ResId& id : level) {
+			if (scenes.count(id) != 0) {
+				objects.at(id)->start(fc);
+			}
+		}
+
+		numStarted += static_cast<uint32_t>(level.size());
+		numLevels += 1;
+
+		std::vector<ResId> nextLevel;
+		for (const ResId& id : level) {
+			for (const ResId& dependant : dependants[id]) {
+				uint32_t& pending = numPendingDeps.at(dependant);
+				if (pending != 0 && --pending == 0) {
+					nextLevel.push_back(dependant);
+				}
+			}
+		}
+		level = std::move(nextLevel);
+	}
+
+	// Log duration
+	const auto end_timer = std::chrono::high_resolution_clock::now();
+	typedef std::chrono::duration<double_t> Fsec;
+	const Fsec duration = end_timer - start_timer;
+	std::stringstream ss;
+	ss << "Started " << numStarted << " resources in " << numLevels << " levels, ";
+	ss << mNumLazyObjects << " deferred until first use\n\tTook " << duration.count() << " seconds";
+	fc->gc().addNewLog(ss.str());
+}
+
+void ResourceDictionary::startIfLazy(FrameContext* fc, ResId id, IObject* object) const
+{
+	grjob::Counter* counter;
+	bool starts = false;
+	{
+		std::unique_lock lock(mLazyMutex);
+		if (mLazyObjects.erase(id) != 0) {
+			std::unique_ptr<grjob::Counter>& started = mLazyStarts[id];
+			started = std::make_unique<grjob::Counter>(1);
+			counter = started.get();
+			starts = true;
+		}
+		else {
+			auto it = mLazyStarts.find(id);
+			if (it == mLazyStarts.end()) {
+				return;
+			}
+			counter = it->second.get();
+		}
+	}
+
+	if (starts) {
+		// Keep the count until it has started, so the other getters check the counter.
+		// If it throws, the waiters are released with the object as it is
+		try {
+			object->start(fc);
+		}
+		catch (...) {
+			counter->decrement(1);
+			mNumLazyObjects -= 1;
+			throw;
+		}
+		counter->decrement(1);
+		mNumLazyObjects -= 1;
+	}
+	else {
+		grjob::waitForCounter(counter, 0);
 	}
 }
 
@@ -5,10 +5,13 @@
 #include <unordered_map>
 #include <set>
 #include <shared_mutex>
+#include <mutex>
+#include <atomic>
 #include <memory>
 #include <iostream>
 
 #include "../utils/serialization.h"
+#include "../utils/grjob.h"
 
 #include "Mesh.h"
 #include "Texture.h"
@@ -40,8 +43,9 @@ public:
 	template<typename T>
 	ResId allocateObject(FrameContext* fc, std::string objectName, T** outPtr = nullptr);
 
+	// Starts the object with fc if it was deferred, see startAll
 	template<typename T>
-	void get(ResId id, T** object) const;
+	void get(FrameContext* fc, ResId id, T** object) const;
 
 	// erase will schedule destroy on the item
 	void erase(ResId id);
@@ -52,7 +56,12 @@ public:
 	// clear the data structure
 	void clear(FrameContext* fc);
 
-	void startAll(FrameContext* fc);
+	// Starts the objects reachable from root after the objects they reference,
+	// running the independent ones in parallel. The rest are started on their
+	// first get. If root is not valid, every object is started.
+	void startAll(FrameContext* fc, ResId root = ResId());
+
+	uint32_t getNumLazyObjects() const { return mNumLazyObjects; }
 
 	ResId getId(const std::string&  name) const;
 	std::string getName(const ResId id) const;
@@ -63,6 +72,10 @@ public:
 	template <typename T>
 	std::vector<ResId> getAllObjectsOfType() const;
 
+	// Calls function(ResId, const IObject&) for every object, with the dictionary locked
+	template <typename F>
+	void forEachObject(F&& function) const;
+
 
 	void destroy(FrameContext* gc);
 	void flushDataAndFree(FrameContext* fc);
@@ -81,11 +94,22 @@ protected:
 	mutable std::shared_mutex mObjectsMutex;
 	mutable std::mutex mNextIdMutex;
 
+	// Objects not started yet, and the counters of the ones started on demand,
+	// zero once they finished. mNumLazyObjects counts both until they finish
+	mutable std::unordered_set<ResId> mLazyObjects;
+	mutable std::unordered_map<ResId, std::unique_ptr<grjob::Counter>> mLazyStarts;
+	mutable std::atomic<uint32_t> mNumLazyObjects{ 0 };
+	mutable std::mutex mLazyMutex;
+
 
 	ResId getAndUpdateId();
 	// Create new unique name from string. Does not lock!
 	std::string createUniqueName(const std::string& string);
 
+	// The first caller starts it, the rest wait for its counter. The start can
+	// switch fibers, so no lock is held meanwhile
+	void startIfLazy(FrameContext* fc, ResId id, IObject* object) const;
+
 
 	// Serialization functions
 	template<class Archive>
@@ -97,6 +121,11 @@ protected:
 		archive(GR_SERIALIZE_NVP_MEMBER(mName2Id));
 		archive(GR_SERIALIZE_NVP_MEMBER(mObjectsByType));
 		archive(GR_SERIALIZE_NVP_MEMBER(mObjectsDictionary));
+
+		// The ids are not stored in the objects
+		for (auto& it : mObjectsDictionary) {
+			it.second->setResId(it.first);
+		}
 	}
 
 	GR_SERIALIZE_PRIVATE_MEMBERS
@@ -135,6 +164,7 @@ ResId ResourceDictionary::allocateObject(
 		assert(itObjType.second);
 
 		itObj.first->second->setObjectName(itName.first->first);
+		itObj.first->second->setResId(id);
 
 		// return reference
 		if (outPtr != nullptr) {
@@ -157,12 +187,19 @@ ResId ResourceDictionary::allocateObject(
 }
 
 template<typename T>
-void gr::ResourceDictionary::get(ResId id, T** object) const
+void gr::ResourceDictionary::get(FrameContext* fc, ResId id, T** object) const
 {
 	assert(object != nullptr);
-	std::shared_lock lock(mObjectsMutex);
+	IObject* ptr;
+	{
+		std::shared_lock lock(mObjectsMutex);
+		ptr = mObjectsDictionary.at(id).get();
+	}
+
+	if (mNumLazyObjects != 0) {
+		startIfLazy(fc, id, ptr);
+	}
 
-	IObject* ptr = mObjectsDictionary.at(id).get();
 	if (CONFIG_USE_DYNAMIC_CAST) {
 		*object = dynamic_cast<T*>(ptr);
 		assert(*object != nullptr);
@@ -190,4 +227,13 @@ gr::ResourceDictionary::getAllObjectsOfType() const
 	return res;
 }
 
+template<typename F>
+void gr::ResourceDictionary::forEachObject(F&& function) const
+{
+	std::shared_lock lock(mObjectsMutex);
+	for (const auto& it : mObjectsDictionary) {
+		function(it.first, static_cast<const IObject&>(*it.second));
+	}
+}
+
 } // namespace gr
@@ -13,6 +13,7 @@
 #include "../gui/GuiUtils.h"
 
 #include <queue>
+#include <chrono>
 
 
 namespace gr
@@ -21,9 +22,13 @@ Scene::Scene()
 {
 	mUiCameraGameObj = std::make_unique<GameObject>();
 	mVisibilityGrid = std::make_unique<VisibilityGrid>();
+	mLODSelector = std::make_unique<LODSelector>();
+	mBudgetController = std::make_unique<FrameBudgetController>();
 }
 void Scene::scheduleDestroy(FrameContext* fc)
 {
+	waitLogicUpdate();
+
 	if (mUiCameraGameObj) {
 		mUiCameraGameObj->scheduleDestroy(fc);
 	}
@@ -34,6 +39,8 @@ void Scene::scheduleDestroy(FrameContext* fc)
 
 void Scene::renderImGui(FrameContext* fc, Gui* gui)
 {
+	// The logic jobs own the live objects until they are waited for
+	assert(mLogicCounter == nullptr);
 	
 
 	if (ImGui::BeginPopupContextWindow(0, ImGuiPopupFlags_NoOpenOverItems | ImGuiPopupFlags_MouseButtonRight)) {
@@ -78,8 +85,17 @@ void Scene::renderImGui(FrameContext* fc, Gui* gui)
 		ImGui::Separator();
 
 		ImGui::Checkbox("Automatic LOD", &mAutomaticLOD);
+		ImGui::Checkbox("Screen-space error LOD", &mScreenSpaceErrorLOD);
+		ImGui::SameLine(); gui::helpMarker("Select the LOD from the projected error instead of a triangle budget");
+		if (mScreenSpaceErrorLOD) {
+			mLODSelector->renderImGui();
+		}
 		int32_t step = 1;
 		ImGui::InputFloat("LOD goal FPS", &mGoalFPSLOD, 1.0f, 10.0f);
+		mGoalFPSLOD = std::max(mGoalFPSLOD, 1.0f);
+		if (!mScreenSpaceErrorLOD) {
+			mBudgetController->renderImGui(fc);
+		}
 		uint32_t numSamples = (uint32_t)mNumTrisFrameBuff.size();
 		ImGui::InputScalar("Num samples TPS", ImGuiDataType_U32, (void*)&numSamples, &step, nullptr, "%d", ImGuiInputTextFlags_None);
 		ImGui::SameLine(); gui::helpMarker("Sample the last N frames to compute triangles/second");
@@ -88,6 +104,10 @@ void Scene::renderImGui(FrameContext* fc, Gui* gui)
 			mNumTrisFrameBuff.resize(numSamples, mNumTrisFrameBuff.back());
 		}
 
+		ImGui::Separator();
+		ImGui::Checkbox("Overlap logic and rendering", &mOverlapLogicAndRender);
+		ImGui::SameLine(); gui::helpMarker("Run the logic of the next frame while the current one is being recorded.\nAdds one frame of latency.");
+
 		ImGui::Separator();
 		ImGui::Checkbox("Use cell-to-cell visibility", &mCellVisibility);
 		if (ImGui::Button("Edit walls and cells")) {
@@ -109,9 +129,9 @@ void Scene::renderImGui(FrameContext* fc, Gui* gui)
 	ImGui::Separator();
 	ImGui::Separator();
 	// Other gameobjects
-	decltype(mGameObjects)::iterator it = mGameObjects.begin();
-	while (it != mGameObjects.end()) {
-		ResId id = *it;
+	size_t it = 0;
+	while (it < mGameObjects.size()) {
+		ResId id = mGameObjects[it];
 
 		bool advance = true;
 
@@ -128,16 +148,17 @@ void Scene::renderImGui(FrameContext* fc, Gui* gui)
 			if (ImGui::BeginPopupContextItem()) {
 
 				if (ImGui::Button("Remove from scene")) {
-					it = mGameObjects.erase(it);
+					// the last GameObject is moved to this position
+					mGameObjects.erase(id);
 					advance = false;
 					ImGui::CloseCurrentPopup();
 				}
 
 				if (ImGui::Button("Duplicate")) {
 					GameObject* obj = nullptr;
-					fc->gc().getDict().get(*it, &obj);
+					fc->gc().getDict().get(fc, id, &obj);
 					GameObject* newObj = nullptr;
-					std::string name = fc->gc().getDict().getName(*it);
+					std::string name = fc->gc().getDict().getName(id);
 					size_t found = name.find_last_of("_");
 					if (found != std::string::npos) {
 						name = name.substr(0, found);
@@ -158,7 +179,7 @@ void Scene::renderImGui(FrameContext* fc, Gui* gui)
 			ImGui::PopID();
 		}
 		else {
-			it = mGameObjects.erase(it);
+			mGameObjects.erase(id);
 			advance = false;
 		}
 
@@ -172,32 +193,52 @@ void Scene::renderImGui(FrameContext* fc, Gui* gui)
 
 void Scene::graphicsUpdate(FrameContext* fc)
 {
-	std::vector<grjob::Job> jobs;
+	assert(mLogicCounter == nullptr);
+	const auto start_timer = std::chrono::high_resolution_clock::now();
+
+	FrameVector<grjob::Job> jobs(fc->frameArena());
 	jobs.reserve(mGameObjects.size() + 1);
 
-	const SceneRenderContext src = { mUiCameraGameObj.get()->getAddon<addon::Camera>() };
+	const addon::Transform* cameraTransform = mUiCameraGameObj.get()->getAddon<addon::Transform>();
+	const SceneRenderContext src = {
+		mUiCameraGameObj.get()->getAddon<addon::Camera>(),
+		cameraTransform->getPos(),
+		cameraTransform->forward()
+	};
 
 	if (mUiCameraGameObj) {
 		jobs.push_back(grjob::Job(&GameObject::graphicsUpdate, mUiCameraGameObj.get(), fc, src));
 	}
 
-	const std::set<ResId>* gameObjectsToRender = nullptr;
+	ResIdSpan gameObjectsToRender;
 	if (mCellVisibility) {
-		gameObjectsToRender = &mVisibilityGrid->getVisibleSet(mUiCameraGameObj.get()->getAddon<addon::Transform>()->getPos());
+		gameObjectsToRender = mVisibilityGrid->getVisibleSet(mUiCameraGameObj.get()->getAddon<addon::Transform>()->getPos());
 	}
 	else {
-		gameObjectsToRender = &mGameObjects;
+		gameObjectsToRender = mGameObjects;
 	}
 
-	this->lodUpdate(fc, *gameObjectsToRender);
-	
-	updateNumTrisFrame(fc, *gameObjectsToRender);
-
-	for (ResId id : (*gameObjectsToRender)) {
+	mRenderObjects.clear();
+	mRenderObjects.reserve(gameObjectsToRender.size());
+	mRenderIds.clear();
+	mRenderIds.reserve(gameObjectsToRender.size());
+	for (ResId id : gameObjectsToRender) {
+		// The precomputed visibility can be older than the scene
+		if (mCellVisibility && !mGameObjects.contains(id)) {
+			continue;
+		}
 		GameObject* obj;
-		fc->gc().getDict().get(id, &obj);
+		fc->gc().getDict().get(fc, id, &obj);
+		mRenderObjects.push_back(obj);
+		mRenderIds.push_back(id);
+	}
 
-		jobs.push_back(grjob::Job(&GameObject::graphicsUpdate, obj, fc, src));
+	this->lodUpdate(fc, mRenderObjects);
+	
+	updateNumTrisFrame(fc, mRenderObjects);
+
+	for (uint32_t i = 0; i < static_cast<uint32_t>(mRenderObjects.size()); ++i) {
+		jobs.push_back(grjob::Job(&Scene::extractObject, this, fc, i, &src));
 	}
 
 
@@ -205,40 +246,76 @@ void Scene::graphicsUpdate(FrameContext* fc)
 	grjob::runJobBatch(grjob::Priority::eMid, jobs.data(), (uint32_t)jobs.size(), &c);
 	mVisibilityGrid->graphicsUpdate(fc, src);
 	grjob::waitForCounterAndFree(c, 0);
+
+	mExtractionTime = std::chrono::duration<double_t>(std::chrono::high_resolution_clock::now() - start_timer).count();
+}
+
+void Scene::extractObject(FrameContext* fc, uint32_t renderIdx, const SceneRenderContext* src)
+{
+	GameObject* obj = mRenderObjects[renderIdx];
+	obj->graphicsUpdate(fc, *src);
+
+	addon::Renderable* rend = obj->getAddon<addon::Renderable>();
+	if (rend != nullptr && rend->takeLODInputsChanged() && mScreenSpaceErrorLOD) {
+		mLODSelector->markDirty(mRenderIds[renderIdx]);
+	}
 }
 
 void Scene::logicUpdate(FrameContext* fc)
 {
-	std::vector<grjob::Job> jobs;
-	jobs.reserve(mGameObjects.size() + 1);
+	dispatchLogicUpdate(fc);
+	waitLogicUpdate();
+}
+
+void Scene::dispatchLogicUpdate(FrameContext* fc)
+{
+	assert(mLogicCounter == nullptr);
+
+	mLogicJobs.clear();
+	mLogicJobs.reserve(mGameObjects.size() + 2);
 
 	if (mUiCameraGameObj) {
-		jobs.push_back(grjob::Job(&GameObject::logicUpdate, mUiCameraGameObj.get(), fc));
+		mLogicJobs.push_back(grjob::Job(&GameObject::logicUpdate, mUiCameraGameObj.get(), fc));
 	}
 
 	for (ResId id : mGameObjects) {
 		GameObject* obj;
-		fc->gc().getDict().get(id, &obj);
+		fc->gc().getDict().get(fc, id, &obj);
 
-		jobs.push_back(grjob::Job(&GameObject::logicUpdate, obj, fc));
+		mLogicJobs.push_back(grjob::Job(&GameObject::logicUpdate, obj, fc));
 	}
 
+	mLogicJobs.push_back(grjob::Job(&VisibilityGrid::logicUpdate, mVisibilityGrid.get(), fc));
 
-	grjob::Counter* c = nullptr;
-	grjob::runJobBatch(grjob::Priority::eMid, jobs.data(), (uint32_t)jobs.size(), &c);
+	grjob::runJobBatch(grjob::Priority::eMid, mLogicJobs.data(), (uint32_t)mLogicJobs.size(), &mLogicCounter);
+}
 
-	mVisibilityGrid->logicUpdate(fc);
+void Scene::waitLogicUpdate()
+{
+	if (mLogicCounter == nullptr) {
+		return;
+	}
 
-	grjob::waitForCounterAndFree(c, 0);
+	const auto start_timer = std::chrono::high_resolution_clock::now();
+
+	grjob::waitForCounterAndFree(mLogicCounter, 0);
+	mLogicCounter = nullptr;
+
+	mLogicWaitTime = std::chrono::duration<double_t>(std::chrono::high_resolution_clock::now() - start_timer).count();
 }
 
-void Scene::lodUpdate(FrameContext* fc, const std::set<ResId>& gameObjectsToRender)
+void Scene::lodUpdate(FrameContext* fc, const std::vector<GameObject*>& gameObjectsToRender)
 {
+	if (!mAutomaticLOD || mScreenSpaceErrorLOD) {
+		mBudgetControllerActive = false;
+	}
+	if (!mAutomaticLOD || !mScreenSpaceErrorLOD) {
+		mLODSelector->invalidate();
+	}
+
 	// If not automatic LOD, downgrade the LOD if not exists
 	if (!mAutomaticLOD) {
-		for (ResId id : gameObjectsToRender) {
-			GameObject* obj;
-			fc->gc().getDict().get(id, &obj);
+		for (GameObject* obj : gameObjectsToRender) {
 			addon::Renderable* rend = obj->getAddon<addon::Renderable>();
 			if (rend != nullptr) {
 				if (rend->getLOD() > rend->getMaxLOD(fc)) {
@@ -251,19 +328,21 @@ void Scene::lodUpdate(FrameContext* fc, const std::set<ResId>& gameObjectsToRend
 		return;
 	}
 
+	if (mScreenSpaceErrorLOD) {
+		mLODSelector->update(fc, mUiCameraGameObj.get(), mGameObjects);
+		return;
+	}
 
 	// If automatic LOD, use heuristic to maximize
 	struct LodData {
 		addon::Renderable* pRenderable;
 		float_t diagOverDist;
 	};
-	std::vector<LodData> renderables;
+	FrameVector<LodData> renderables(fc->frameArena());
 	renderables.reserve(gameObjectsToRender.size());
 	// compute actual number of triangles to render
 	uint64_t numTris = 0;
-	for (ResId id : gameObjectsToRender) {
-		GameObject* obj;
-		fc->gc().getDict().get(id, &obj);
+	for (GameObject* obj : gameObjectsToRender) {
 		addon::Renderable* rend = obj->getAddon<addon::Renderable>();
 		if (rend != nullptr) {
 			numTris += rend->getNumTrisToRender(fc, rend->getLOD());
@@ -280,14 +359,22 @@ void Scene::lodUpdate(FrameContext* fc, const std::set<ResId>& gameObjectsToRend
 
 	} // end for
 
-	const double_t TPS = mNumTrisFrame / fc->dt();
-	const uint64_t maxCost = static_cast<uint32_t>(TPS / mGoalFPSLOD);
-	uint64_t cost = 0;
+	// Start the controller from the current load
+	if (!mBudgetControllerActive) {
+		mBudgetController->reset(numTris + mBudgetController->getDrawCost() * renderables.size());
+		mBudgetControllerActive = true;
+	}
+	mBudgetController->update(fc, 1.0 / mGoalFPSLOD);
+	const uint64_t maxCost = static_cast<uint64_t>(mBudgetController->getBudget());
+	// Each draw has a fixed overhead, independent of its LOD
+	uint64_t cost = static_cast<uint64_t>(mBudgetController->getDrawCost() * renderables.size());
 	typedef std::pair<uint32_t, float_t> QueueVal;
 	auto comparator = [](QueueVal a, QueueVal b) -> bool {
 		return a.second < b.second;
 	};
-	std::priority_queue<QueueVal, std::vector<QueueVal>, decltype(comparator)> queueLods(comparator);
+	FrameVector<QueueVal> queueStorage(fc->frameArena());
+	queueStorage.reserve(renderables.size());
+	std::priority_queue<QueueVal, FrameVector<QueueVal>, decltype(comparator)> queueLods(comparator, std::move(queueStorage));
 	auto getDeltaBenefit = [&renderables, fc](uint32_t i, uint32_t lod) -> float_t {
 		const uint32_t actualDepth = renderables[i].pRenderable->getLODDepth(fc, lod);
 		const uint32_t nextDepth = (lod == 1) ? std::min(11u, 2 * actualDepth) : renderables[i].pRenderable->getLODDepth(fc, lod - 1);
@@ -296,6 +383,16 @@ void Scene::lodUpdate(FrameContext* fc, const std::set<ResId>& gameObjectsToRend
 		float_t denom = (float_t)(1 << nextDepth);
 		return renderables[i].diagOverDist * num / denom;
 	};
+	// The levels never uploaded, still streaming or that failed, have no triangle count
+	// and are not refined into. The evicted ones keep it, and are streamed again if chosen
+	auto canRefine = [&renderables, fc](uint32_t i, uint32_t lod) -> bool {
+		return lod > 0 && renderables[i].pRenderable->getNumTrisToRender(fc, lod - 1) > 0;
+	};
+	auto getDeltaTris = [&renderables, fc](uint32_t i, uint32_t lod) -> uint32_t {
+		const uint32_t finer = renderables[i].pRenderable->getNumTrisToRender(fc, lod - 1);
+		const uint32_t coarser = renderables[i].pRenderable->getNumTrisToRender(fc, lod);
+		return finer > coarser ? finer - coarser : 0;
+	};
 
 	for (uint32_t i = 0; i < (uint32_t)renderables.size(); ++i) {
 		// Only add those that can be improved
@@ -303,11 +400,13 @@ void Scene::lodUpdate(FrameContext* fc, const std::set<ResId>& gameObjectsToRend
 		if (maxLod > 0) {
 			// set to lowest definition LOD
 			renderables[i].pRenderable->setLOD(maxLod);
-			// Delta triangles
-			const float_t deltaCost = (float_t) (renderables[i].pRenderable->getNumTrisToRender(fc, maxLod - 1) - renderables[i].pRenderable->getNumTrisToRender(fc, maxLod));
-			// compute value
-			float_t deltaBenefit = getDeltaBenefit(i, maxLod);
-			queueLods.push({ i, deltaBenefit / deltaCost });
+			if (canRefine(i, maxLod)) {
+				// Delta triangles
+				const float_t deltaCost = (float_t)std::max(getDeltaTris(i, maxLod), 1u);
+				// compute value
+				float_t deltaBenefit = getDeltaBenefit(i, maxLod);
+				queueLods.push({ i, deltaBenefit / deltaCost });
+			}
 			cost += renderables[i].pRenderable->getNumTrisToRender(fc, maxLod);
 		}
 		else { // else set to lod 0, and add its triangles to the cost
@@ -322,7 +421,7 @@ void Scene::lodUpdate(FrameContext* fc, const std::set<ResId>& gameObjectsToRend
 		queueLods.pop();
 		const uint32_t lod = renderables[top].pRenderable->getLOD();
 		// Check if improvement can be applied. If not, ignore this case
-		const uint32_t deltaCost = renderables[top].pRenderable->getNumTrisToRender(fc, lod - 1) - renderables[top].pRenderable->getNumTrisToRender(fc, lod);
+		const uint32_t deltaCost = getDeltaTris(top, lod);
 		if (cost + deltaCost > maxCost) {
 			continue;
 		}
@@ -332,9 +431,9 @@ void Scene::lodUpdate(FrameContext* fc, const std::set<ResId>& gameObjectsToRend
 		cost += deltaCost;
 
 		// if can keep improving.. store into the priority queue
-		if (lod > 1) {
+		if (canRefine(top, lod - 1)) {
 			// Delta triangles
-			const float_t newDeltaCost = (float_t)(renderables[top].pRenderable->getNumTrisToRender(fc, lod - 2) - renderables[top].pRenderable->getNumTrisToRender(fc, lod - 1));
+			const float_t newDeltaCost = (float_t)std::max(getDeltaTris(top, lod - 1), 1u);
 			// compute value
 			float_t deltaBenefit = getDeltaBenefit(top, lod - 1);
 			queueLods.push({ top, deltaBenefit / newDeltaCost });
@@ -343,12 +442,10 @@ void Scene::lodUpdate(FrameContext* fc, const std::set<ResId>& gameObjectsToRend
 
 }
 
-void Scene::updateNumTrisFrame(FrameContext* fc, const std::set<ResId>& renderedObjects)
+void Scene::updateNumTrisFrame(FrameContext* fc, const std::vector<GameObject*>& renderedObjects)
 {
 	uint64_t numTris = 0;
-	for (ResId id : renderedObjects) {
-		GameObject* obj;
-		fc->gc().getDict().get(id, &obj);
+	for (GameObject* obj : renderedObjects) {
 		addon::Renderable* rend = obj->getAddon<addon::Renderable>();
 		if (rend != nullptr) {
 			numTris += rend->getNumTrisToRender(fc, rend->getLOD());
@@ -365,6 +462,11 @@ void Scene::updateNumTrisFrame(FrameContext* fc, const std::set<ResId>& rendered
 	mNumTrisFrame += static_cast<decltype(mNumTrisFrame)>(mNumTrisFrameBuff.back()) / mNumTrisFrameBuff.size();
 }
 
+void Scene::appendReferencedResources(std::vector<ResId>* outIds) const
+{
+	outIds->insert(outIds->end(), mGameObjects.begin(), mGameObjects.end());
+}
+
 void Scene::start(FrameContext* fc)
 {
 	mUiCameraGameObj->start(fc);
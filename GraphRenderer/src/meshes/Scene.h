@@ -4,10 +4,12 @@
 #include "GameObject.h"
 #include "GameObjectAddons/Camera.h"
 #include "SceneControl/VisibilityGrid.h"
+#include "SceneControl/LODSelector.h"
+#include "SceneControl/FrameBudgetController.h"
+#include "SceneControl/DenseResIdSet.h"
+#include "../utils/grjob.h"
 
 
-#include <set>
-
 
 
 namespace gr
@@ -28,30 +30,61 @@ public:
 
     void start(FrameContext* fc) override;
 
+    void appendReferencedResources(std::vector<ResId>* outIds) const override;
+
     void graphicsUpdate(FrameContext* fc);
 
     void logicUpdate(FrameContext* fc);
 
+    // Launch the logic update in the job system without waiting for it.
+    // It can then overlap with the recording of the frame extracted before.
+    // The recording only reads the render list extracted into the FrameContext,
+    // see RenderSubmitter::DrawData, and the slots of the frame in the transform
+    // and camera buffers. The jobs own the live objects until the wait.
+    void dispatchLogicUpdate(FrameContext* fc);
+    void waitLogicUpdate();
+
+    bool overlapsLogicAndRender() const { return mOverlapLogicAndRender; }
+
     double_t getTrianglesPerFrame() const { return mNumTrisFrame; }
+    double_t getExtractionTime() const { return mExtractionTime; }
+    double_t getLogicWaitTime() const { return mLogicWaitTime; }
 
 
 private:
 
     std::unique_ptr<GameObject> mUiCameraGameObj;
     std::unique_ptr<VisibilityGrid> mVisibilityGrid;
+    std::unique_ptr<LODSelector> mLODSelector;
+    std::unique_ptr<FrameBudgetController> mBudgetController;
 
-    std::set<ResId> mGameObjects;
+    DenseResIdSet mGameObjects;
+    // GameObjects to render this frame, resolved once from the dictionary
+    std::vector<GameObject*> mRenderObjects;
+    std::vector<ResId> mRenderIds;
 
     std::vector<uint64_t> mNumTrisFrameBuff = std::vector<uint64_t>(4, 0);
     double_t mNumTrisFrame = 0.0;
 
     float mGoalFPSLOD = 60.0f;
     bool mAutomaticLOD = false;
+    bool mScreenSpaceErrorLOD = false;
+    bool mBudgetControllerActive = false;
     bool mCellVisibility = false;
     bool mVisibilityGridMenuOpen = false;
+    bool mOverlapLogicAndRender = true;
+
+    std::vector<grjob::Job> mLogicJobs;
+    grjob::Counter* mLogicCounter = nullptr;
+
+    // In seconds
+    double_t mExtractionTime = 0.0;
+    double_t mLogicWaitTime = 0.0;
 
-    void lodUpdate(FrameContext* fc, const std::set<ResId>& gameObjectsToRender);
-    void updateNumTrisFrame(FrameContext* fc, const std::set<ResId>& renderedObjects);
+    void lodUpdate(FrameContext* fc, const std::vector<GameObject*>& gameObjectsToRender);
+    // Extraction job of one of the render objects
+    void extractObject(FrameContext* fc, uint32_t renderIdx, const SceneRenderContext* src);
+    void updateNumTrisFrame(FrameContext* fc, const std::vector<GameObject*>& renderedObjects);
 
     // Serialization functions
     template<class Archive>
@@ -71,6 +104,9 @@ private:
 
 struct SceneRenderContext {
     const addon::Camera* camera;
+    // World space position and view direction of the camera
+    glm::vec3 cameraPosition;
+    glm::vec3 cameraForward;
 };
 
 } // namespace gr
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <cassert>
+
+#include "../ResourcesHeader.h"
+
+namespace gr
+{
+
+// Read only view of a contiguous array of ids
+class ResIdSpan
+{
+public:
+	ResIdSpan() = default;
+	ResIdSpan(const ResId* data, size_t size) : mData(data), mSize(size) {}
+	ResIdSpan(const std::vector<ResId>& ids) : mData(ids.data()), mSize(ids.size()) {}
+
+	const ResId* begin() const { return mData; }
+	const ResId* end() const { return mData + mSize; }
+	size_t size() const { return mSize; }
+	bool empty() const { return mSize == 0; }
+	const ResId& operator[](size_t i) const { assert(i < mSize); return mData[i]; }
+
+private:
+	const ResId* mData = nullptr;
+	size_t mSize = 0;
+};
+
+// Set of ids stored in a dense array, with a sparse reverse map to insert and
+// erase in O(1). Erasing moves the last id into the hole, so the iteration
+// order only depends on the sequence of insertions and deletions.
+class DenseResIdSet
+{
+public:
+
+	DenseResIdSet() = default;
+
+	// Returns false if the id was already in the set
+	bool insert(ResId id)
+	{
+		if (!mIndices.emplace(id, static_cast<uint32_t>(mIds.size())).second) {
+			return false;
+		}
+		mIds.push_back(id);
+		return true;
+	}
+
+	// Returns false if the id was not in the set
+	bool erase(ResId id)
+	{
+		auto it = mIndices.find(id);
+		if (it == mIndices.end()) {
+			return false;
+		}
+
+		const uint32_t idx = it->second;
+		mIndices.erase(it);
+		if (idx + 1 != static_cast<uint32_t>(mIds.size())) {
+			mIds[idx] = mIds.back();
+			mIndices[mIds[idx]] = idx;
+		}
+		mIds.pop_back();
+		return true;
+	}
+
+	bool contains(ResId id) const { return mIndices.count(id) != 0; }
+
+	void clear()
+	{
+		mIds.clear();
+		mIndices.clear();
+	}
+
+	void reserve(size_t size)
+	{
+		mIds.reserve(size);
+		mIndices.reserve(size);
+	}
+
+	size_t size() const { return mIds.size(); }
+	bool empty() const { return mIds.empty(); }
+
+	const ResId* begin() const { return mIds.data(); }
+	const ResId* end() const { return mIds.data() + mIds.size(); }
+	const ResId& operator[](size_t i) const { return mIds[i]; }
+
+	operator ResIdSpan() const { return ResIdSpan(mIds); }
+
+private:
+
+	std::vector<ResId> mIds;
+	std::unordered_map<ResId, uint32_t> mIndices;
+
+	// Serialized as a plain sequence of ids, the same as a std::set
+	template<class Archive>
+	void save(Archive& archive) const
+	{
+		archive(cereal::make_size_tag(static_cast<cereal::size_type>(mIds.size())));
+		for (const ResId& id : mIds) {
+			archive(id);
+		}
+	}
+
+	template<class Archive>
+	void load(Archive& archive)
+	{
+		cereal::size_type size;
+		archive(cereal::make_size_tag(size));
+
+		clear();
+		reserve(static_cast<size_t>(size));
+		for (cereal::size_type i = 0; i < size; ++i) {
+			ResId id;
+			archive(id);
+			insert(id);
+		}
+	}
+
+	GR_SERIALIZE_PRIVATE_MEMBERS
+};
+
+} // namespace gr
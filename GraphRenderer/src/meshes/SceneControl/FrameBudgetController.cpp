@@ -0,0 +1,92 @@
+#include "FrameBudgetController.h"
+
+#include <imgui/imgui.h>
+#include <algorithm>
+#include <sstream>
+
+#include "../../control/FrameContext.h"
+#include "../../gui/GuiUtils.h"
+
+namespace gr
+{
+
+void FrameBudgetController::update(FrameContext* fc, double_t targetFrameTime)
+{
+	// The frame is bound by the slowest of the CPU and the GPU
+	double_t frameTime = fc->dt();
+	if (mUseGpuTime && fc->gpuTime() > 0.0) {
+		frameTime = std::max(frameTime, fc->gpuTime());
+	}
+
+	if (mFilteredFrameTime <= 0.0) {
+		mFilteredFrameTime = frameTime;
+	}
+	mFilteredFrameTime += mSmoothing * (frameTime - mFilteredFrameTime);
+
+	// Relative error, positive when there is time left
+	const double_t error = (targetFrameTime - mFilteredFrameTime) / targetFrameTime;
+
+	double_t signal = mKp * (error - mPrevError) +
+		mKi * error +
+		mKd * (error - 2.0 * mPrevError + mPrevPrevError);
+	signal = std::clamp(signal, -(double_t)mMaxSlew, (double_t)mMaxSlew);
+
+	mBudget = std::max(mBudget * (1.0 + signal), mMinBudget);
+
+	mPrevPrevError = mPrevError;
+	mPrevError = error;
+	mLastSignal = signal;
+
+	mFrameTimeHistory[mHistoryOffset] = static_cast<float>(mFilteredFrameTime * 1000.0);
+	mSignalHistory[mHistoryOffset] = static_cast<float>(signal);
+	mHistoryOffset = (mHistoryOffset + 1) % HISTORY_SIZE;
+
+	if (mLogSignal && fc->time() - mLastLogTime > 1.0) {
+		mLastLogTime = fc->time();
+		std::stringstream ss;
+		ss << "LOD budget controller\n\tFrame time " << mFilteredFrameTime * 1000.0 << " ms, target " << targetFrameTime * 1000.0 << " ms\n";
+		ss << "\tSignal " << signal << ", budget " << (uint64_t)mBudget << " triangles";
+		fc->gc().addNewLog(ss.str());
+	}
+}
+
+void FrameBudgetController::reset(double_t budget)
+{
+	mBudget = std::max(budget, mMinBudget);
+	mFilteredFrameTime = 0.0;
+	mPrevError = 0.0;
+	mPrevPrevError = 0.0;
+	mLastSignal = 0.0;
+}
+
+void FrameBudgetController::renderImGui(FrameContext* fc)
+{
+	if (!ImGui::TreeNode("Budget controller")) {
+		return;
+	}
+
+	ImGui::Text("Budget: %.0f triangles", mBudget);
+	ImGui::Text("Filtered frame time: %.3f ms", mFilteredFrameTime * 1000.0);
+	ImGui::Text("GPU time: %.3f ms", fc->gpuTime() * 1000.0);
+	ImGui::PlotLines("Frame time (ms)", mFrameTimeHistory.data(), (int)HISTORY_SIZE, (int)mHistoryOffset);
+	ImGui::PlotLines("Control signal", mSignalHistory.data(), (int)HISTORY_SIZE, (int)mHistoryOffset, nullptr, -mMaxSlew, mMaxSlew);
+
+	ImGui::DragFloat("Kp", &mKp, 0.005f, 0.0f, 10.0f, "%.3f");
+	ImGui::DragFloat("Ki", &mKi, 0.005f, 0.0f, 10.0f, "%.3f");
+	ImGui::DragFloat("Kd", &mKd, 0.005f, 0.0f, 10.0f, "%.3f");
+	ImGui::DragFloat("Max slew", &mMaxSlew, 0.005f, 0.001f, 1.0f, "%.3f");
+	ImGui::SameLine(); gui::helpMarker("Max relative change of the budget in one frame");
+	ImGui::DragFloat("Smoothing", &mSmoothing, 0.01f, 0.01f, 1.0f, "%.2f");
+	ImGui::DragFloat("Triangles per draw", &mTrianglesPerDraw, 10.0f, 0.0f, 1.0e6f, "%.0f");
+	ImGui::SameLine(); gui::helpMarker("Cost of a draw call measured in triangles");
+	ImGui::Checkbox("Use GPU time", &mUseGpuTime);
+	ImGui::Checkbox("Log control signal", &mLogSignal);
+
+	if (ImGui::Button("Reset controller")) {
+		reset(mBudget);
+	}
+
+	ImGui::TreePop();
+}
+
+} // namespace gr
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <stdint.h>
+
+namespace gr
+{
+
+class FrameContext;
+
+// Closed loop controller of the rendering budget used by the automatic LOD.
+// A velocity form PID compares the measured frame time against the target,
+// and its output is the relative change applied to the budget each frame.
+// The budget is expressed in triangles, where each draw call costs a fixed
+// amount of triangles to take into account the per draw overhead.
+class FrameBudgetController
+{
+public:
+
+	void update(FrameContext* fc, double_t targetFrameTime);
+
+	double_t getBudget() const { return mBudget; }
+	double_t getDrawCost() const { return mTrianglesPerDraw; }
+
+	void reset(double_t budget);
+
+	void renderImGui(FrameContext* fc);
+
+private:
+
+	static constexpr uint32_t HISTORY_SIZE = 128;
+
+	float_t mKp = 0.2f;
+	float_t mKi = 0.1f;
+	float_t mKd = 0.02f;
+	// Max relative change of the budget per frame
+	float_t mMaxSlew = 0.05f;
+	// Weight of the new sample in the filtered frame time
+	float_t mSmoothing = 0.2f;
+	float_t mTrianglesPerDraw = 2000.0f;
+	double_t mMinBudget = 1.0e4;
+
+	bool mUseGpuTime = true;
+	bool mLogSignal = false;
+
+	double_t mBudget = 1.0e6;
+	double_t mFilteredFrameTime = 0.0;
+	double_t mPrevError = 0.0;
+	double_t mPrevPrevError = 0.0;
+	double_t mLastSignal = 0.0;
+	double_t mLastLogTime = 0.0;
+
+	std::vector<float> mFrameTimeHistory = std::vector<float>(HISTORY_SIZE, 0.0f);
+	std::vector<float> mSignalHistory = std::vector<float>(HISTORY_SIZE, 0.0f);
+	uint32_t mHistoryOffset = 0;
+};
+
+} // namespace gr
@@ -0,0 +1,192 @@
+#include "LODSelector.h"
+
+#include <imgui/imgui.h>
+
+#include <limits>
+
+#include "../Mesh.h"
+#include "../GameObject.h"
+#include "../GameObjectAddons/Camera.h"
+#include "../GameObjectAddons/Renderable.h"
+#include "../../control/FrameContext.h"
+#include "../../gui/GuiUtils.h"
+#include "../../utils/grjob.h"
+
+namespace gr
+{
+
+void LODSelector::update(FrameContext* fc, const GameObject* camera, const DenseResIdSet& sceneObjects)
+{
+	const addon::Camera* cam = camera->getAddon<addon::Camera>();
+	if (cam == nullptr) {
+		return;
+	}
+
+	// Pixels covered by an object of size 1 at distance 1
+	const float_t height = static_cast<float_t>(std::max(fc->getWindow().getFrameBufferHeigth(), 1));
+	const float_t pixelsPerUnit = height / (2.0f * std::tan(glm::radians(cam->getFov()) * 0.5f));
+	const glm::vec3 cameraPos = camera->getAddon<addon::Transform>()->getPos();
+
+	{
+		std::lock_guard<std::mutex> lock(mDirtyMutex);
+		if (!mValid || pixelsPerUnit != mPixelsPerUnit) {
+			// The errors of all the objects changed
+			mEntries.clear();
+			mRechecks = decltype(mRechecks)();
+			mTravel = 0.0;
+			mDirty.clear();
+			for (ResId id : sceneObjects) {
+				mEntries[id].dirty = true;
+				mDirty.push_back(id);
+			}
+			mValid = true;
+		}
+		else {
+			mTravel += glm::length(cameraPos - mCameraPos);
+			while (!mRechecks.empty() && mRechecks.top().travel <= mTravel) {
+				const Recheck recheck = mRechecks.top();
+				mRechecks.pop();
+				auto it = mEntries.find(recheck.id);
+				if (it != mEntries.end() && it->second.generation == recheck.generation && !it->second.dirty) {
+					it->second.dirty = true;
+					mDirty.push_back(recheck.id);
+				}
+			}
+		}
+
+		mEvaluated.clear();
+		for (ResId id : mDirty) {
+			if (sceneObjects.contains(id)) {
+				mEvaluated.push_back(id);
+			}
+			else {
+				mEntries.erase(id);
+			}
+		}
+		mDirty.clear();
+	}
+
+	mPixelsPerUnit = pixelsPerUnit;
+	mCameraPos = cameraPos;
+	mLODChangesCounter = 0;
+	mSlack.assign(mEvaluated.size(), std::numeric_limits<float_t>::infinity());
+
+	const uint32_t numObjects = static_cast<uint32_t>(mEvaluated.size());
+	const uint32_t numChunks = (numObjects + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	if (numChunks == 1) {
+		updateChunk(fc, 0, numObjects);
+	}
+	else if (numChunks > 1) {
+		std::vector<grjob::Job> jobs;
+		jobs.reserve(numChunks);
+		for (uint32_t begin = 0; begin < numObjects; begin += CHUNK_SIZE) {
+			uint32_t end = std::min(begin + CHUNK_SIZE, numObjects);
+			jobs.push_back(grjob::Job(&LODSelector::updateChunk, this, fc, begin, end));
+		}
+
+		grjob::Counter* c = nullptr;
+		grjob::runJobBatch(grjob::Priority::eHigh, jobs.data(), (uint32_t)jobs.size(), &c);
+		grjob::waitForCounterAndFree(c, 0);
+	}
+
+	// Clean until marked again, or until the camera travels their slack
+	for (uint32_t i = 0; i < numObjects; ++i) {
+		Entry& entry = mEntries[mEvaluated[i]];
+		entry.dirty = false;
+		entry.generation = ++mGeneration;
+		if (mSlack[i] != std::numeric_limits<float_t>::infinity()) {
+			mRechecks.push({ mTravel + mSlack[i], entry.generation, mEvaluated[i] });
+		}
+	}
+
+	mNumEvaluated = numObjects;
+	mNumLODChanges = mLODChangesCounter;
+}
+
+void LODSelector::markDirty(ResId id)
+{
+	std::lock_guard<std::mutex> lock(mDirtyMutex);
+	Entry& entry = mEntries[id];
+	if (!entry.dirty) {
+		entry.dirty = true;
+		mDirty.push_back(id);
+	}
+}
+
+void LODSelector::renderImGui()
+{
+	if (ImGui::DragFloat("Max error (pixels)", &mPixelThreshold, 0.05f, 0.05f, 100.0f, "%.2f")) {
+		mValid = false;
+	}
+	if (ImGui::DragFloat("Hysteresis", &mHysteresis, 0.01f, 0.0f, 0.9f, "%.2f")) {
+		mValid = false;
+	}
+	ImGui::SameLine(); gui::helpMarker("Relative band around the max error where an object keeps its LOD");
+	ImGui::Text("LOD changes last frame: %u, objects evaluated: %u", mNumLODChanges, mNumEvaluated);
+}
+
+void LODSelector::updateChunk(FrameContext* fc, uint32_t begin, uint32_t end)
+{
+	const float_t refineThreshold = mPixelThreshold * (1.0f + mHysteresis);
+	const float_t coarsenThreshold = mPixelThreshold * (1.0f - mHysteresis);
+
+	uint32_t numChanges = 0;
+	for (uint32_t i = begin; i < end; ++i) {
+		GameObject* obj;
+		fc->gc().getDict().get(fc, mEvaluated[i], &obj);
+		addon::Renderable* rend = obj->getAddon<addon::Renderable>();
+		if (rend == nullptr || !rend->getMesh()) {
+			continue;
+		}
+
+		const Mesh* mesh;
+		fc->gc().getDict().get(fc, rend->getMesh(), &mesh);
+		const std::vector<Mesh::LODMetrics>& metrics = mesh->getLODMetrics();
+		if (metrics.size() <= 1) {
+			continue;
+		}
+
+		// Bounding sphere of the object in world space
+		const addon::Transform* transf = obj->getAddon<addon::Transform>();
+		const mth::AABBox& bb = mesh->getBBox();
+		const glm::vec3 center = transf->getTransformMatrix() * glm::vec4(bb.getMin() + bb.getSize() * 0.5f, 1.0f);
+		const float_t scale = std::max(std::abs(transf->getScale().x),
+			std::max(std::abs(transf->getScale().y), std::abs(transf->getScale().z)));
+		const float_t radius = 0.5f * glm::length(bb.getSize()) * scale;
+
+		// Use the closest point of the sphere, and avoid dividing by zero inside it
+		const float_t distance = std::max(glm::length(center - mCameraPos) - radius, 1e-3f);
+		const float_t pixelsPerError = mPixelsPerUnit * scale / distance;
+
+		const uint32_t maxLod = static_cast<uint32_t>(metrics.size()) - 1;
+		const uint32_t oldLod = std::min(rend->getLOD(), maxLod);
+		uint32_t lod = oldLod;
+		while (lod > 0 && metrics[lod].geometricError * pixelsPerError > refineThreshold) {
+			--lod;
+		}
+		while (lod < maxLod && metrics[lod + 1].geometricError * pixelsPerError < coarsenThreshold) {
+			++lod;
+		}
+
+		if (lod != rend->getLOD()) {
+			rend->setLOD(lod);
+			numChanges += 1;
+		}
+
+		// Distances where the error of the level leaves the band. Moving the
+		// camera by some amount changes the distance by that much at most
+		const float_t errorToDistance = mPixelsPerUnit * scale;
+		float_t slack = std::numeric_limits<float_t>::infinity();
+		if (lod > 0) {
+			slack = std::min(slack, distance - errorToDistance * metrics[lod].geometricError / refineThreshold);
+		}
+		if (lod < maxLod) {
+			slack = std::min(slack, errorToDistance * metrics[lod + 1].geometricError / coarsenThreshold - distance);
+		}
+		mSlack[i] = std::max(slack, 0.0f);
+	}
+
+	mLODChangesCounter += numChanges;
+}
+
+} // namespace gr
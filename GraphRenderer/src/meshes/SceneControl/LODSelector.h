@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <glm/glm.hpp>
+
+#include "DenseResIdSet.h"
+
+namespace gr
+{
+
+class FrameContext;
+class GameObject;
+
+// Selects the LOD of each renderable from the screen-space projection of
+// its geometric error. An object only changes of LOD when its error leaves
+// the hysteresis band around the threshold, to avoid popping.
+// Only the dirty objects are evaluated: the ones marked, and the ones the
+// camera moved far enough from that their error may leave the band.
+class LODSelector
+{
+public:
+
+	LODSelector() = default;
+	LODSelector(const LODSelector&) = delete;
+	LODSelector& operator=(const LODSelector&) = delete;
+
+	// The first update, and the first after invalidate, evaluate all the scene objects
+	void update(FrameContext* fc, const GameObject* camera, const DenseResIdSet& sceneObjects);
+
+	// Thread safe. The transform, mesh or LOD of the object changed
+	void markDirty(ResId id);
+
+	// While the selector is not used, the tracked state gets old
+	void invalidate() { mValid = false; }
+
+	void renderImGui();
+
+	uint32_t getNumLODChanges() const { return mNumLODChanges; }
+
+private:
+
+	static constexpr uint32_t CHUNK_SIZE = 256;
+
+	// Maximum error allowed, in pixels
+	float_t mPixelThreshold = 1.0f;
+	// Relative band around the threshold where the LOD is kept
+	float_t mHysteresis = 0.25f;
+
+	uint32_t mNumLODChanges = 0;
+	uint32_t mNumEvaluated = 0;
+	std::atomic<uint32_t> mLODChangesCounter{ 0 };
+
+	struct Entry {
+		// Of its last recheck, the older ones in the queue are skipped
+		uint64_t generation = 0;
+		bool dirty = false;
+	};
+	// Camera travel at which the object has to be evaluated again
+	struct Recheck {
+		double_t travel;
+		uint64_t generation;
+		ResId id;
+
+		bool operator>(const Recheck& o) const { return travel > o.travel; }
+	};
+
+	bool mValid = false;
+	std::unordered_map<ResId, Entry> mEntries;
+	std::vector<ResId> mDirty;
+	std::mutex mDirtyMutex;
+	std::priority_queue<Recheck, std::vector<Recheck>, std::greater<Recheck>> mRechecks;
+	uint64_t mGeneration = 0;
+	// Distance moved by the camera since the last invalidation
+	double_t mTravel = 0.0;
+
+	// Set at the start of each update
+	glm::vec3 mCameraPos = glm::vec3(0.0f);
+	float_t mPixelsPerUnit = 1.0f;
+	// Evaluated in this update, and the distance the camera can move before they may change of LOD
+	std::vector<ResId> mEvaluated;
+	std::vector<float_t> mSlack;
+
+	void updateChunk(FrameContext* fc, uint32_t begin, uint32_t end);
+};
+
+} // namespace gr
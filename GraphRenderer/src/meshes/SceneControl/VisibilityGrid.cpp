@@ -3,6 +3,7 @@
 #include <imgui/imgui.h>
 #include <filesystem>
 #include <queue>
+#include <set>
 #include <chrono>
 #include <sstream>
 #include <random>
@@ -25,7 +26,7 @@ void VisibilityGrid::start(FrameContext* fc)
 	Mesh* mesh = nullptr;
 	if (fc->gc().getDict().existsName("wall_visibility_grid")) {
 		mMesh = fc->gc().getDict().getId("wall_visibility_grid");
-		fc->gc().getDict().get(mMesh, &mesh);
+		fc->gc().getDict().get(fc, mMesh, &mesh);
 	}
 	else {
 		mMesh = fc->gc().getDict().allocateObject(fc, "wall_visibility_grid", &mesh);
@@ -170,18 +171,18 @@ void VisibilityGrid::logicUpdate(FrameContext* fc)
 	}
 }
 
-void VisibilityGrid::computeVisibility(FrameContext* fc, const std::set<ResId>& gameObjects)
+void VisibilityGrid::computeVisibility(FrameContext* fc, ResIdSpan gameObjects)
 {
 	const auto start_timer = std::chrono::high_resolution_clock::now();
 
 	// create tmp rasterization of the gameobjects of the scene
 	std::vector<std::vector<std::set<ResId>>> objectsRasterized(mResolutionY, std::vector<std::set<ResId>>(mResolutionX));
-	// Rebuild visibility grid
-	mVisibilityGrid = std::vector<std::vector<std::set<ResId>>>(mResolutionY, std::vector<std::set<ResId>>(mResolutionX));
+	// Visible sets, stored as sorted arrays at the end
+	std::vector<std::vector<std::set<ResId>>> visibilityGrid(mResolutionY, std::vector<std::set<ResId>>(mResolutionX));
 	// rasterize all gameobjects in axis aligned grid
 	for (const ResId& id : gameObjects) {
 		GameObject* obj;
-		fc->gc().getDict().get(id, &obj);
+		fc->gc().getDict().get(fc, id, &obj);
 		gr::mth::AABBox bb = obj->getRenderBB(fc);
 		glm::ivec2 from = glm::floor(glm::vec2(bb.getMin().x, bb.getMin().z));
 		glm::ivec2 to = glm::floor(glm::vec2(bb.getMax().x, bb.getMax().z));
@@ -342,7 +343,7 @@ void VisibilityGrid::computeVisibility(FrameContext* fc, const std::set<ResId>&
 
 				// add to visibility grid
 				for (const glm::ivec2& v : cellsInLine) {
-					mVisibilityGrid[v.y][v.x].insert(gameObjectsInLine.begin(), gameObjectsInLine.end());
+					visibilityGrid[v.y][v.x].insert(gameObjectsInLine.begin(), gameObjectsInLine.end());
 				}
 				// also try adding to 4 neighbors, to account for error of starting
 				// at the center of the cells
@@ -362,6 +363,14 @@ void VisibilityGrid::computeVisibility(FrameContext* fc, const std::set<ResId>&
 		}
 	}
 
+	// Rebuild visibility grid
+	mVisibilityGrid = std::vector<std::vector<std::vector<ResId>>>(mResolutionY, std::vector<std::vector<ResId>>(mResolutionX));
+	for (uint32_t j = 0; j < mResolutionY; ++j) {
+		for (uint32_t i = 0; i < mResolutionX; ++i) {
+			mVisibilityGrid[j][i].assign(visibilityGrid[j][i].begin(), visibilityGrid[j][i].end());
+		}
+	}
+
 	// Log duration
 	const auto end_timer = std::chrono::high_resolution_clock::now();
 	typedef std::chrono::duration<double_t> Fsec;
@@ -373,13 +382,12 @@ void VisibilityGrid::computeVisibility(FrameContext* fc, const std::set<ResId>&
 	fc->gc().addNewLog(ss.str());
 }
 
-std::set<ResId> g_stupid_set;
-const std::set<ResId>& VisibilityGrid::getVisibleSet(const glm::vec3& pos) const
+ResIdSpan VisibilityGrid::getVisibleSet(const glm::vec3& pos) const
 {
 	int32_t x = (int32_t)std::floor(pos.x);
 	int32_t y = (int32_t)std::floor(pos.z);
 	if (x < 0 || y < 0 || y >= (int32_t)mVisibilityGrid.size() || x >= (int32_t)mVisibilityGrid.front().size()) {
-		return g_stupid_set;
+		return ResIdSpan();
 	}
 	return mVisibilityGrid[y][x];
 }
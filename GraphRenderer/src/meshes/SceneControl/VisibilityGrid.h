@@ -6,6 +6,7 @@
 #include "../IObject.h"
 #include "../Mesh.h"
 #include "../GameObject.h"
+#include "DenseResIdSet.h"
 
 namespace gr
 {
@@ -21,9 +22,10 @@ public:
 	void renderImGui(FrameContext* fc, Gui* gui) override final;
 	void graphicsUpdate(FrameContext* fc, const SceneRenderContext& src);
 	void logicUpdate(FrameContext* fc);
-	void computeVisibility(FrameContext* fc, const std::set<ResId>& gameObjects);
+	void computeVisibility(FrameContext* fc, ResIdSpan gameObjects);
 
-	const std::set<ResId>& getVisibleSet(const glm::vec3& pos) const;
+	// Ids sorted in increasing order
+	ResIdSpan getVisibleSet(const glm::vec3& pos) const;
 
 private:
 	
@@ -102,7 +104,8 @@ private:
 	};
 	std::unordered_map<WallKey, std::unique_ptr<GameObject>, WallKeyHasher> mWallsGameObjects;
 
-	std::vector<std::vector<std::set<ResId>>> mVisibilityGrid;
+	// Sorted ids visible from each cell
+	std::vector<std::vector<std::vector<ResId>>> mVisibilityGrid;
 
 	void updateWallCellGameObject(FrameContext* fc, uint32_t x, uint32_t y);
 
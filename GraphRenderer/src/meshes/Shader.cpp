@@ -5,13 +5,134 @@
 
 #include <imgui/imgui.h>
 #include <spirv_cross/spirv_glsl.hpp>
+#include <fstream>
 
 namespace gr {
 
+namespace
+{
+// Reflection sidecar: magic, version, code hash, and then the locations and bindings
+constexpr uint32_t REFLECTION_MAGIC = 0x52535247; // GRSR
+constexpr uint32_t REFLECTION_VERSION = 1;
+// Limits to reject a corrupt sidecar
+constexpr uint32_t MAX_REFLECTION_COUNT = 1 << 12;
+constexpr uint32_t MAX_REFLECTION_DEPTH = 16;
+
+class BinaryWriter
+{
+public:
+	explicit BinaryWriter(std::ostream& stream) : mStream(stream) {}
+
+	void u32(uint32_t v) { mStream.write(reinterpret_cast<const char*>(&v), sizeof(v)); }
+	void u64(uint64_t v) { mStream.write(reinterpret_cast<const char*>(&v), sizeof(v)); }
+	void str(const std::string& s) {
+		u32(static_cast<uint32_t>(s.size()));
+		mStream.write(s.data(), s.size());
+	}
+
+private:
+	std::ostream& mStream;
+};
+
+class BinaryReader
+{
+public:
+	explicit BinaryReader(std::istream& stream) : mStream(stream) {}
+
+	uint32_t u32() { uint32_t v = 0; mStream.read(reinterpret_cast<char*>(&v), sizeof(v)); return v; }
+	uint64_t u64() { uint64_t v = 0; mStream.read(reinterpret_cast<char*>(&v), sizeof(v)); return v; }
+	std::string str() {
+		const uint32_t size = u32();
+		if (!mStream || size > MAX_REFLECTION_COUNT) {
+			mStream.setstate(std::ios::failbit);
+			return {};
+		}
+		std::string s(size, '\0');
+		mStream.read(s.data(), size);
+		return s;
+	}
+	// Reads a count, failing if it is not plausible
+	uint32_t count() {
+		const uint32_t c = u32();
+		if (c > MAX_REFLECTION_COUNT) {
+			mStream.setstate(std::ios::failbit);
+			return 0;
+		}
+		return c;
+	}
+	bool ok() const { return static_cast<bool>(mStream); }
+
+private:
+	std::istream& mStream;
+};
+
+enum class BindingKind : uint32_t { eStruct, eBasic, eSampledImage };
+
+void writeBinding(BinaryWriter& w, const Shader::BindingInfo& info)
+{
+	if (const Shader::StructInfo* s = dynamic_cast<const Shader::StructInfo*>(&info)) {
+		w.u32(static_cast<uint32_t>(BindingKind::eStruct));
+		w.str(info.name);
+		w.u32(info.bytes);
+		w.u32(info.offset);
+		w.u32(static_cast<uint32_t>(s->childInfo.size()));
+		for (const std::unique_ptr<Shader::BindingInfo>& child : s->childInfo) {
+			writeBinding(w, *child);
+		}
+		return;
+	}
+
+	const bool sampled = dynamic_cast<const Shader::SampledImgInfo*>(&info) != nullptr;
+	w.u32(static_cast<uint32_t>(sampled ? BindingKind::eSampledImage : BindingKind::eBasic));
+	w.str(info.name);
+	w.u32(info.bytes);
+	w.u32(info.offset);
+	w.u32(0);
+}
+
+std::unique_ptr<Shader::BindingInfo> readBinding(BinaryReader& r, uint32_t depth)
+{
+	const uint32_t kind = r.u32();
+	std::unique_ptr<Shader::BindingInfo> info;
+	switch (static_cast<BindingKind>(kind))
+	{
+	case BindingKind::eStruct:
+		info = std::make_unique<Shader::StructInfo>();
+		break;
+	case BindingKind::eBasic:
+		info = std::make_unique<Shader::BasicInfo>();
+		break;
+	case BindingKind::eSampledImage:
+		info = std::make_unique<Shader::SampledImgInfo>();
+		break;
+	default:
+		return nullptr;
+	}
+
+	info->name = r.str();
+	const uint32_t bytes = r.u32();
+	info->offset = r.u32();
+	const uint32_t numChildren = r.count();
+	if (!r.ok() || depth >= MAX_REFLECTION_DEPTH) {
+		return nullptr;
+	}
+	for (uint32_t i = 0; i < numChildren; ++i) {
+		std::unique_ptr<Shader::BindingInfo> child = readBinding(r, depth + 1);
+		if (!child) {
+			return nullptr;
+		}
+		info->addChild(std::move(child));
+	}
+	// Stored as computed by the reflection
+	info->bytes = bytes;
+	return info;
+}
+}
+
 
 void Shader::scheduleDestroy(FrameContext* fc)
 {
-	fc->rc().destroy(mShaderModule);
+	fc->rc().getShaderModuleCache().release(fc->rc(), mShaderModule);
 	mShaderModule = nullptr;
 }
 
@@ -137,6 +258,8 @@ void Shader::renderImGui(FrameContext* fc, Gui* gui)
 
 			ImGui::Separator();
 
+			ImGui::TextDisabled(mReflectionFromCache ? "Reflection loaded from cache" : "Reflection from SPIR-V");
+
 			ImGui::Text("Path of shader:");
 			ImGui::InputText(
 				"##Path",
@@ -150,7 +273,7 @@ void Shader::renderImGui(FrameContext* fc, Gui* gui)
 		if (ImGui::BeginTabItem("Code")) {
 			ImGui::BeginChild("scrolling", ImVec2(0, 0), true, ImGuiWindowFlags_HorizontalScrollbar);
 
-			ImGui::TextUnformatted(mGLSLCode.c_str());
+			ImGui::TextUnformatted(getGLSLCode().c_str());
 
 			ImGui::EndChild();
 			ImGui::EndTabItem();
@@ -202,9 +325,13 @@ void Shader::load(FrameContext* fc, const char* filePath)
 	}
 
 	mPath = filePath;
+	mGLSLCode.clear();
+	mInLocations.clear();
+	mOutLocations.clear();
+	mDescriptorSets.clear();
 
 	std::vector<uint32_t> spir;
-	fc->rc().createShaderModule(filePath, &this->mShaderModule, &spir);
+	this->mShaderModule = fc->rc().getShaderModuleCache().acquire(fc->rc(), filePath, &mCodeHash, &spir);
 
 	if (std::strstr(filePath, "vert")) {
 		mStage = vk::ShaderStageFlagBits::eVertex;
@@ -213,7 +340,20 @@ void Shader::load(FrameContext* fc, const char* filePath)
 		mStage = vk::ShaderStageFlagBits::eFragment;
 	}
 
-	spirv_cross::CompilerGLSL cmp(std::move(spir));
+	// The sidecar of the same code skips the reflection
+	const std::string reflectionPath = s_getReflectionPath(mPath);
+	mReflectionFromCache = loadReflection(reflectionPath, mCodeHash);
+	if (!mReflectionFromCache) {
+		reflect(std::move(spir));
+		saveReflection(reflectionPath, mCodeHash);
+	}
+
+	this->markUpdated(fc);
+}
+
+void Shader::reflect(std::vector<uint32_t>&& spirv)
+{
+	spirv_cross::CompilerGLSL cmp(std::move(spirv));
 
 	spirv_cross::ShaderResources resources = cmp.get_shader_resources();
 	// Get inputs
@@ -271,11 +411,116 @@ void Shader::load(FrameContext* fc, const char* filePath)
 		mDescriptorSets[set].emplace(bind,
 			loadBinding(type, cmp));
 	}
+}
 
-	mGLSLCode = cmp.compile();
+const std::string& Shader::getGLSLCode()
+{
+	if (mGLSLCode.empty() && !mPath.empty()) {
+		try {
+			std::vector<uint8_t> file;
+			tools::loadBinaryFile(mPath.c_str(), &file);
+			std::vector<uint32_t> spirv(file.size() / sizeof(uint32_t));
+			std::memcpy(spirv.data(), file.data(), spirv.size() * sizeof(uint32_t));
+
+			spirv_cross::CompilerGLSL cmp(std::move(spirv));
+			mGLSLCode = cmp.compile();
+		}
+		catch (const std::exception& e) {
+			mGLSLCode = std::string("Cannot decompile the shader: ") + e.what();
+		}
+	}
+	return mGLSLCode;
+}
 
+bool Shader::loadReflection(const std::string& path, uint64_t codeHash)
+{
+	std::ifstream stream(path, std::ios::binary);
+	if (!stream) {
+		return false;
+	}
+	BinaryReader r(stream);
 
-	this->markUpdated(fc);
+	if (r.u32() != REFLECTION_MAGIC || r.u32() != REFLECTION_VERSION || r.u64() != codeHash || !r.ok()) {
+		return false;
+	}
+
+	std::map<uint32_t, InLocationInfo> inLocations;
+	const uint32_t numIn = r.count();
+	for (uint32_t i = 0; i < numIn && r.ok(); ++i) {
+		const uint32_t location = r.u32();
+		const uint32_t vecSize = r.u32();
+		inLocations[location] = InLocationInfo{ Type::eFloat, vecSize, r.str() };
+	}
+
+	std::map<uint32_t, LocationInfo> outLocations;
+	const uint32_t numOut = r.count();
+	for (uint32_t i = 0; i < numOut && r.ok(); ++i) {
+		const uint32_t location = r.u32();
+		const uint32_t vecSize = r.u32();
+		outLocations[location] = LocationInfo{ Type::eFloat, vecSize, r.str() };
+	}
+
+	std::map<uint32_t, DescriptorSet> descriptorSets;
+	const uint32_t numSets = r.count();
+	for (uint32_t i = 0; i < numSets && r.ok(); ++i) {
+		DescriptorSet& set = descriptorSets[r.u32()];
+		const uint32_t numBinds = r.count();
+		for (uint32_t j = 0; j < numBinds && r.ok(); ++j) {
+			const uint32_t bind = r.u32();
+			std::unique_ptr<BindingInfo> info = readBinding(r, 0);
+			if (!info) {
+				return false;
+			}
+			set.emplace(bind, std::move(info));
+		}
+	}
+
+	if (!r.ok()) {
+		return false;
+	}
+
+	mInLocations = std::move(inLocations);
+	mOutLocations = std::move(outLocations);
+	mDescriptorSets = std::move(descriptorSets);
+	return true;
+}
+
+void Shader::saveReflection(const std::string& path, uint64_t codeHash) const
+{
+	// Without the sidecar the next load reflects again, so errors are ignored
+	std::ofstream stream(path, std::ofstream::trunc | std::ofstream::binary);
+	if (!stream) {
+		return;
+	}
+	BinaryWriter w(stream);
+
+	w.u32(REFLECTION_MAGIC);
+	w.u32(REFLECTION_VERSION);
+	w.u64(codeHash);
+
+	w.u32(static_cast<uint32_t>(mInLocations.size()));
+	for (const std::pair<const uint32_t, InLocationInfo>& loc : mInLocations) {
+		w.u32(loc.first);
+		w.u32(loc.second.vecSize);
+		w.str(loc.second.name);
+	}
+
+	w.u32(static_cast<uint32_t>(mOutLocations.size()));
+	for (const std::pair<const uint32_t, LocationInfo>& loc : mOutLocations) {
+		w.u32(loc.first);
+		w.u32(loc.second.vecSize);
+		w.str(loc.second.name);
+	}
+
+	w.u32(static_cast<uint32_t>(mDescriptorSets.size()));
+	for (const auto& set : mDescriptorSets) {
+		w.u32(set.first);
+		w.u32(static_cast<uint32_t>(set.second.size()));
+		for (const auto& bind : set.second) {
+			w.u32(bind.first);
+			writeBinding(w, *bind.second);
+		}
+	}
 }
 
 
@@ -75,8 +75,13 @@ private:
 
     std::string mPath;
 
+    // Decompiled when the code tab is first shown
     std::string mGLSLCode;
 
+    // Hash of the SPIR-V, that identifies the reflection sidecar
+    uint64_t mCodeHash = 0;
+    bool mReflectionFromCache = false;
+
 
     std::map<uint32_t, InLocationInfo> mInLocations;
     std::map<uint32_t, LocationInfo> mOutLocations;
@@ -84,6 +89,14 @@ private:
     typedef std::map<uint32_t, std::unique_ptr<BindingInfo>> DescriptorSet;
     std::map<uint32_t, DescriptorSet> mDescriptorSets;
 
+    void reflect(std::vector<uint32_t>&& spirv);
+    const std::string& getGLSLCode();
+
+    // Binary file next to the shader, with the reflection of the code with that hash
+    static std::string s_getReflectionPath(const std::string& shaderPath) { return shaderPath + ".refl"; }
+    bool loadReflection(const std::string& path, uint64_t codeHash);
+    void saveReflection(const std::string& path, uint64_t codeHash) const;
+
     // Serialization functions
     template<class Archive>
     void serialize(Archive& archive)
@@ -34,7 +34,8 @@ bool Texture::load(FrameContext* fc, const char* filePath)
 			static_cast<vk::DeviceSize>(height) }, // extent
 		1, vk::SampleCountFlagBits::e1, // mip levels and samples
 		vk::Format::eR8G8B8A8Srgb,
-		vk::ImageAspectFlagBits::eColor
+		vk::ImageAspectFlagBits::eColor,
+		vkg::MemoryTag(vkg::MemoryCategory::eTexture, getResId().value)
 	);
 
 	rc->getTransferer()->transferToImage(
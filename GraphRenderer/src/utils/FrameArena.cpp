@@ -0,0 +1,79 @@
+#include "FrameArena.h"
+
+#include "grjob.h"
+
+#include <algorithm>
+
+namespace gr
+{
+
+std::atomic<bool> FrameArena::s_enabled = true;
+
+FrameArena::FrameArena(size_t blockSize) : mSpaces(grjob::getNumThreads()), mBlockSize(blockSize) {}
+
+void* FrameArena::allocate(size_t numBytes, size_t alignment)
+{
+	Space& space = getSpace();
+
+	while (true) {
+		if (space.currentBlock < static_cast<uint32_t>(space.blocks.size())) {
+			Block& block = space.blocks[space.currentBlock];
+			const uintptr_t base = reinterpret_cast<uintptr_t>(block.data.get());
+			const uintptr_t aligned = (base + space.offset + alignment - 1) & ~(static_cast<uintptr_t>(alignment) - 1);
+			const size_t offset = static_cast<size_t>(aligned - base);
+			if (offset + numBytes <= block.size) {
+				space.offset = offset + numBytes;
+				space.usedBytes += numBytes;
+				space.numAllocations += 1;
+				return block.data.get() + offset;
+			}
+
+			// The rest of the block is wasted until the reset
+			if (space.currentBlock + 1 < static_cast<uint32_t>(space.blocks.size())) {
+				space.currentBlock += 1;
+				space.offset = 0;
+				continue;
+			}
+		}
+
+		const size_t size = std::max(mBlockSize, numBytes + alignment);
+		space.blocks.push_back({ std::unique_ptr<uint8_t[]>(new uint8_t[size]), size });
+		space.currentBlock = static_cast<uint32_t>(space.blocks.size()) - 1;
+		space.offset = 0;
+		space.numNewBlocks += 1;
+	}
+}
+
+void FrameArena::reset()
+{
+	Stats stats;
+	for (Space& space : mSpaces) {
+		size_t capacity = 0;
+		for (const Block& block : space.blocks) {
+			capacity += block.size;
+		}
+		stats.usedBytes += space.usedBytes;
+		stats.capacity += capacity;
+		stats.numAllocations += space.numAllocations;
+		stats.numNewBlocks += space.numNewBlocks;
+
+		// One block that fits the whole frame, for the next one
+		if (space.blocks.size() > 1) {
+			space.blocks.clear();
+			space.blocks.push_back({ std::unique_ptr<uint8_t[]>(new uint8_t[capacity]), capacity });
+		}
+		space.currentBlock = 0;
+		space.offset = 0;
+		space.usedBytes = 0;
+		space.numAllocations = 0;
+		space.numNewBlocks = 0;
+	}
+	mLastStats = stats;
+}
+
+FrameArena::Space& FrameArena::getSpace()
+{
+	return mSpaces[grjob::getThreadId()];
+}
+
+} // namespace gr
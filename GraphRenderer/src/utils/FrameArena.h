@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace gr
+{
+
+// Linear allocator of the CPU memory that lives for one frame. Each thread
+// bumps its own blocks, so there is no locking, and all the memory is released
+// at once when the frame is reused. The blocks are kept, merged into one if
+// the frame needed more, so a frame in steady state does not touch the heap.
+class FrameArena
+{
+public:
+	FrameArena(size_t blockSize = DEFAULT_BLOCK_SIZE);
+	FrameArena(FrameArena&&) = default;
+	FrameArena& operator=(const FrameArena&) = delete;
+	FrameArena& operator=(FrameArena&&) = default;
+
+	// Valid until the next reset. Thread safe, each thread allocates from its own blocks
+	void* allocate(size_t numBytes, size_t alignment);
+
+	// Only when nobody uses the memory of the frame
+	void reset();
+
+	struct Stats {
+		size_t usedBytes = 0;
+		size_t capacity = 0;
+		uint32_t numAllocations = 0;
+		// Blocks taken from the heap because the frame did not fit
+		uint32_t numNewBlocks = 0;
+	};
+	// Of the previous use of the frame, counted when reset
+	Stats getStats() const { return mLastStats; }
+
+	// When disabled, FrameContext::frameArena returns null and the containers use the heap
+	static void s_setEnabled(bool enabled) { s_enabled.store(enabled, std::memory_order_relaxed); }
+	static bool s_isEnabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+	static constexpr size_t DEFAULT_BLOCK_SIZE = 64 * 1024;
+
+private:
+
+	struct Block {
+		std::unique_ptr<uint8_t[]> data;
+		size_t size = 0;
+	};
+
+	struct Space {
+		std::vector<Block> blocks;
+		uint32_t currentBlock = 0;
+		size_t offset = 0;
+
+		size_t usedBytes = 0;
+		uint32_t numAllocations = 0;
+		uint32_t numNewBlocks = 0;
+	};
+
+	std::vector<Space> mSpaces;
+	size_t mBlockSize;
+	Stats mLastStats;
+
+	static std::atomic<bool> s_enabled;
+
+	Space& getSpace();
+};
+
+// Allocator of the STL containers. Without an arena it uses the heap, so the
+// same code works when the arena is disabled. Deallocating from the arena does
+// nothing, its memory returns when the frame is reset.
+template<typename T>
+class FrameAllocator
+{
+public:
+	typedef T value_type;
+
+	FrameAllocator(FrameArena* arena = nullptr) noexcept : mArena(arena) {}
+	template<typename U>
+	FrameAllocator(const FrameAllocator<U>& o) noexcept : mArena(o.getArena()) {}
+
+	T* allocate(size_t n) {
+		if (mArena == nullptr) {
+			return std::allocator<T>().allocate(n);
+		}
+		return static_cast<T*>(mArena->allocate(n * sizeof(T), alignof(T)));
+	}
+
+	void deallocate(T* ptr, size_t n) noexcept {
+		if (mArena == nullptr) {
+			std::allocator<T>().deallocate(ptr, n);
+		}
+	}
+
+	FrameArena* getArena() const { return mArena; }
+
+	template<typename U>
+	bool operator==(const FrameAllocator<U>& o) const { return mArena == o.getArena(); }
+	template<typename U>
+	bool operator!=(const FrameAllocator<U>& o) const { return mArena != o.getArena(); }
+
+private:
+	FrameArena* mArena;
+};
+
+template<typename T>
+using FrameVector = std::vector<T, FrameAllocator<T>>;
+
+} // namespace gr
@@ -0,0 +1,46 @@
+#include "HeapCounter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+std::atomic<uint64_t> s_numHeapAllocations = 0;
+}
+
+uint64_t gr::tools::getNumHeapAllocations()
+{
+	return s_numHeapAllocations.load(std::memory_order_relaxed);
+}
+
+// Replace the global operators, the array and nothrow forms use these ones
+
+void* operator new(std::size_t size)
+{
+	s_numHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+	if (size == 0) {
+		size = 1;
+	}
+	while (true) {
+		void* ptr = std::malloc(size);
+		if (ptr != nullptr) {
+			return ptr;
+		}
+		std::new_handler handler = std::get_new_handler();
+		if (handler == nullptr) {
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+}
+
+void operator delete(void* ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+	std::free(ptr);
+}
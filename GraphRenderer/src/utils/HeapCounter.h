@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+
+namespace gr
+{
+namespace tools
+{
+
+// Calls to the global operator new since the process started. Thread safe
+uint64_t getNumHeapAllocations();
+
+}; // namespace tools
+}; // namespace gr
@@ -1,5 +1,13 @@
 #include "grTools.h"
 
+#ifdef _WIN32
+#define NOMINMAX
+#include <Windows.h>
+#include <Psapi.h>
+#else
+#include <unistd.h>
+#endif
+
 #include <iostream>
 #include <fstream>
 #include <stb_image/stb_image.h>
@@ -45,4 +53,23 @@ void tools::freeImage(uint8_t* img)
 	stbi_image_free(img);
 }
 
+size_t tools::getResidentSetSize()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+		return 0;
+	}
+	return counters.WorkingSetSize;
+#else
+	// The second field is the resident pages
+	std::ifstream file("/proc/self/statm");
+	size_t size = 0, resident = 0;
+	if (!(file >> size >> resident)) {
+		return 0;
+	}
+	return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
 }; // namespace gr
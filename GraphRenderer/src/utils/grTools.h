@@ -21,6 +21,9 @@ void loadImageRGBA(
 
 void freeImage(uint8_t* img);
 
+// Physical memory used by the process, 0 if unknown
+size_t getResidentSetSize();
+
 }; // namespace tools 
 }; // namespace gr
 